@@ -31,19 +31,31 @@
 // SUCH DAMAGE.
 // 
 
+
+#include <os.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <shlib.h>
 #include <regex.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
-#define MAXLINE 512
+#define BLOCKSIZE   (64 * 1024)         // Initial size of read buffer
+#define WINDOWSIZE  (16 * 1024 * 1024)  // Size of file mapping window
+#define OUTBUFSIZE  (64 * 1024)         // Output buffered for each file
+#define MAXJOBS     4                   // Number of files searched concurrently
+#define PROBELINES  8                   // Lines tested one at a time after a match
+
+struct job;
 
 struct options {
   int extended;
+  int fixed;
   int nocase;
   int output_filename;
   int output_linenum;
@@ -52,62 +64,457 @@ struct options {
   int invert;
   int recurse;
   regex_t re;
+  char *pattern;
+  int patlen;
+  unsigned char skip[256];
+  struct job *head;
+  struct job *tail;
+  int njobs;
+  int rc;
 };
 
-int search_file(FILE *f, char *filename, struct options *opts) {
-  int match;
-  int n;
+struct job {
+  struct options *opts;
+  struct job *next;
+  char *filename;
+  handle_t f;
+  handle_t thread;
+  handle_t ready;
+  int direct;
+  char *out;
+  int outlen;
+  int matches;
   int linenum;
-  char line[MAXLINE];
-
-  // Handle simple match or no match case
-  if (opts->nolines || opts->matchcount) {
-    // Count number of matches
-    int matches = 0;
-    while (fgets(line, sizeof(line), f) != NULL) {
-      n = strlen(line);
-      if (n > 0 && line[n - 1] == '\n') line[--n] = 0;
-      if (n > 0 && line[n - 1] == '\r') line[--n] = 0;
-
-      match = regexec(&opts->re, line, 0, NULL, 0) != REG_NOMATCH;
-      if (opts->invert) match = !match;
-      if (match) {
-        matches++;
-        if (!opts->matchcount) break;
-      }
+  int done;
+  int err;
+};
+
+//
+// Output
+//
+// Files are searched concurrently, so each job buffers its output until
+// the output for all previous files has been written. If the buffer fills
+// up, the job waits for its turn and then writes directly to stdout.
+//
+
+static void output(struct job *job, char *data, int len) {
+  if (!job->direct) {
+    if (!job->out) job->out = (char *) malloc(OUTBUFSIZE);
+    if (job->out && job->outlen + len <= OUTBUFSIZE) {
+      memcpy(job->out + job->outlen, data, len);
+      job->outlen += len;
+      return;
     }
 
-    // Output filename (and matches) if any matches was found
-    if (opts->matchcount) {
-      if (opts->output_filename) printf("%s:", filename);
-      printf("%d\n", matches);
-    } else if (matches) {
-      printf("%s\n", filename);
+    waitone(job->ready, INFINITE);
+    if (job->outlen > 0) fwrite(job->out, 1, job->outlen, stdout);
+    job->outlen = 0;
+    job->direct = 1;
+  }
+
+  fwrite(data, 1, len, stdout);
+}
+
+static void select_line(struct job *job, char *line, char *end) {
+  struct options *opts = job->opts;
+  char prefix[16];
+  int n;
+
+  job->matches++;
+  if (opts->matchcount) return;
+  if (opts->nolines) {
+    job->done = 1;
+    return;
+  }
+
+  if (opts->output_filename) {
+    output(job, job->filename, strlen(job->filename));
+    output(job, ":", 1);
+  }
+  if (opts->output_linenum) {
+    n = sprintf(prefix, "%d:", job->linenum);
+    output(job, prefix, n);
+  }
+  if (end > line && end[-1] == '\r') end--;
+  output(job, line, end - line);
+  output(job, "\n", 1);
+}
+
+//
+// Searching
+//
+// Buffers are searched for the pattern as a whole and line boundaries are
+// only located around the matches. The regular expression is compiled with
+// REG_NEWLINE, so a match never spans lines. Lines before a match are only
+// scanned for newlines when line numbers or non-matching lines are needed.
+//
+
+static int count_lines(char *start, char *end) {
+  int n = 0;
+
+  while ((start = memchr(start, '\n', end - start)) != NULL) {
+    n++;
+    start++;
+  }
+
+  return n;
+}
+
+static char *find_fixed(struct options *opts, char *start, char *end) {
+  char *str = opts->pattern;
+  int len = opts->patlen;
+  char *p;
+  char *q;
+  int i;
+
+  if (end - start < len) return NULL;
+  if (len == 0) return start;
+
+  // Short strings are found by scanning for the first character
+  if (!opts->nocase && len < 8) {
+    p = start;
+    end -= len - 1;
+    while (p < end) {
+      p = memchr(p, *str, end - p);
+      if (!p) return NULL;
+      if (memcmp(p + 1, str + 1, len - 1) == 0) return p;
+      p++;
     }
-    return 0;
+    return NULL;
   }
 
-  // Find matches in file
-  linenum = 1;
-  while (fgets(line, sizeof(line), f) != NULL) {
-    n = strlen(line);
-      if (n > 0 && line[n - 1] == '\n') line[--n] = 0;
-      if (n > 0 && line[n - 1] == '\r') line[--n] = 0;
+  // Boyer-Moore-Horspool search
+  p = start + len - 1;
+  while (p < end) {
+    q = p - len + 1;
+    if (opts->nocase) {
+      for (i = len - 1; i >= 0 && tolower((unsigned char) q[i]) == (unsigned char) str[i]; i--);
+    } else {
+      for (i = len - 1; i >= 0 && q[i] == str[i]; i--);
+    }
+    if (i < 0) return q;
+    p += opts->skip[(unsigned char) *p];
+  }
+
+  return NULL;
+}
 
-    match = regexec(&opts->re, line, 0, NULL, 0) != REG_NOMATCH;
-    if (opts->invert) match = !match;
+static char *find_match(struct job *job, char *start, char *end, int cr, int probe) {
+  struct options *opts = job->opts;
+  regmatch_t pmatch[1];
+  char *line;
+  char *eol;
+  int len;
 
-    if (match) {
-      if (opts->output_filename) printf("%s:", filename);
-      if (opts->output_linenum) printf("%d:", linenum);
-      printf("%s\n", line);
+  if (opts->fixed) return find_fixed(opts, start, end);
+
+  if (!cr) {
+    // Matches tend to cluster, so test the lines following a match one at a
+    // time first, which saves locating the match within the line
+    while (probe-- > 0) {
+      eol = memchr(start, '\n', end - start);
+      if (!eol) eol = end;
+      pmatch[0].rm_so = 0;
+      pmatch[0].rm_eo = eol - start;
+      if (regexec(&opts->re, start, 0, pmatch, REG_STARTEND) == 0) return start;
+      if (eol == end) return NULL;
+      start = eol + 1;
     }
 
-    linenum++;
+    pmatch[0].rm_so = 0;
+    pmatch[0].rm_eo = end - start;
+    if (regexec(&opts->re, start, 1, pmatch, REG_STARTEND) != 0) return NULL;
+    return start + pmatch[0].rm_so;
+  }
+
+  // Match one line at a time without the carriage return, so $ matches
+  line = start;
+  for (;;) {
+    eol = memchr(line, '\n', end - line);
+    if (!eol) eol = end;
+    len = eol - line;
+    if (len > 0 && line[len - 1] == '\r') len--;
+    pmatch[0].rm_so = 0;
+    pmatch[0].rm_eo = len;
+    if (regexec(&opts->re, line, 0, pmatch, REG_STARTEND) == 0) return line;
+    if (eol == end) return NULL;
+    line = eol + 1;
   }
+}
+
+static void search_lines(struct job *job, char *start, char *end) {
+  struct options *opts = job->opts;
+  char *p;
+  char *hit;
+  char *line;
+  char *eol;
+  char *next;
+  int probe;
+  int cr;
+
+  cr = !opts->fixed && memchr(start, '\r', end - start) != NULL;
+  probe = 0;
+  p = start;
+  while (!job->done) {
+    // Find next matching line
+    hit = find_match(job, p, end, cr, probe);
+    probe = PROBELINES;
+    if (hit) {
+      line = hit;
+      while (line > p && line[-1] != '\n') line--;
+      eol = memchr(hit, '\n', end - hit);
+      if (!eol) eol = end;
+    }
+
+    // Handle the non-matching lines before it
+    if (opts->invert) {
+      if (opts->matchcount) {
+        job->matches += hit ? count_lines(p, line) : count_lines(p, end) + 1;
+      } else {
+        while (!job->done && (hit ? p < line : p <= end)) {
+          next = memchr(p, '\n', end - p);
+          if (!next) next = end;
+          select_line(job, p, next);
+          job->linenum++;
+          p = next + 1;
+        }
+      }
+    } else if (opts->output_linenum) {
+      job->linenum += hit ? count_lines(p, line) : count_lines(p, end) + 1;
+    }
+    if (!hit || job->done) break;
+
+    if (!opts->invert) select_line(job, line, eol);
+    job->linenum++;
+    if (eol == end) break;
+    p = eol + 1;
+  }
+}
+
+static int search_mapped(struct job *job, off64_t size) {
+  unsigned long window = WINDOWSIZE;
+  unsigned long len;
+  off64_t pos = 0;
+  off64_t base;
+  char *map;
+  char *start;
+  char *end;
+  char *last;
+
+  while (pos < size && !job->done) {
+    // Map next window of the file
+    base = pos & ~(PAGESIZE - 1);
+    len = size - base > window ? window : (unsigned long) (size - base);
+    map = (char *) vmmap(NULL, len, PAGE_READONLY, job->f, base);
+    if (!map) {
+      if (pos == 0) return -1;
+      job->err = errno;
+      break;
+    }
+    start = map + (int) (pos - base);
+    end = map + len;
+
+    // Search the complete lines in the window
+    if (base + len < size) {
+      last = end;
+      while (last > start && last[-1] != '\n') last--;
+      if (last == start) {
+        // Line does not fit in window, try again with a larger window
+        vmfree(map, len, MEM_DECOMMIT | MEM_RELEASE);
+        window *= 2;
+        continue;
+      }
+      pos = base + (last - map);
+      end = last - 1;
+    } else {
+      pos = size;
+      if (end[-1] == '\n') end--;
+    }
+
+    search_lines(job, start, end);
+    vmfree(map, len, MEM_DECOMMIT | MEM_RELEASE);
+  }
+
   return 0;
 }
 
+static void search_read(struct job *job) {
+  int size = BLOCKSIZE;
+  int len = 0;
+  char *buf;
+  char *last;
+  char *newbuf;
+  int n;
+
+  buf = (char *) malloc(size);
+  if (!buf) {
+    job->err = ENOMEM;
+    return;
+  }
+
+  while (!job->done) {
+    if (len == size) {
+      // Grow buffer for long line
+      newbuf = (char *) realloc(buf, size * 2);
+      if (!newbuf) {
+        job->err = ENOMEM;
+        break;
+      }
+      buf = newbuf;
+      size *= 2;
+    }
+
+    n = read(job->f, buf + len, size - len);
+    if (n < 0) {
+      job->err = errno;
+      break;
+    }
+    if (n == 0) {
+      // Search the last line, which has no newline
+      if (len > 0) search_lines(job, buf, buf + len);
+      break;
+    }
+    len += n;
+
+    // Search complete lines and keep the rest for the next block
+    last = buf + len;
+    while (last > buf && last[-1] != '\n') last--;
+    if (last > buf) {
+      search_lines(job, buf, last - 1);
+      len = buf + len - last;
+      memmove(buf, last, len);
+    }
+  }
+
+  free(buf);
+}
+
+static void search_file(struct job *job) {
+  struct options *opts = job->opts;
+  struct stat64 st;
+  char count[16];
+  int opened = 0;
+  int n;
+
+  if (job->f == NOHANDLE) {
+    job->f = open(job->filename, O_RDONLY | O_BINARY);
+    if (job->f < 0) {
+      job->f = NOHANDLE;
+      job->err = errno;
+      return;
+    }
+    opened = 1;
+  }
+  job->linenum = 1;
+
+  // Map regular files into memory, otherwise read input in large blocks
+  if (fstat64(job->f, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || search_mapped(job, st.st_size) < 0) {
+    search_read(job);
+  }
+  if (opened) {
+    close(job->f);
+    job->f = NOHANDLE;
+  }
+  if (job->err) return;
+
+  // Output filename (and matches) if any matches was found
+  if (opts->matchcount) {
+    if (opts->output_filename) {
+      output(job, job->filename, strlen(job->filename));
+      output(job, ":", 1);
+    }
+    n = sprintf(count, "%d\n", job->matches);
+    output(job, count, n);
+  } else if (opts->nolines && job->matches) {
+    output(job, job->filename, strlen(job->filename));
+    output(job, "\n", 1);
+  }
+}
+
+//
+// Jobs
+//
+// Each file is searched by a worker thread. Up to MAXJOBS files are
+// searched concurrently, and the output is written in the order the
+// files were queued.
+//
+
+static void __stdcall grep_thread(void *arg) {
+  search_file((struct job *) arg);
+}
+
+static void finish_job(struct options *opts) {
+  struct job *job = opts->head;
+
+  // Let the job write its output directly and wait for it to complete
+  if (job->thread != NOHANDLE) {
+    eset(job->ready);
+    waitone(job->thread, INFINITE);
+    close(job->thread);
+  }
+  if (job->ready != NOHANDLE) close(job->ready);
+
+  if (job->outlen > 0) fwrite(job->out, 1, job->outlen, stdout);
+  if (job->err) {
+    fprintf(stderr, "%s: %s\n", job->filename, strerror(job->err));
+    opts->rc = 1;
+  }
+
+  opts->head = job->next;
+  if (!opts->head) opts->tail = NULL;
+  opts->njobs--;
+  free(job->out);
+  free(job->filename);
+  free(job);
+}
+
+static int start_job(struct options *opts, char *filename) {
+  struct job *job;
+
+  // Wait for the oldest job if all workers are busy
+  if (opts->njobs == MAXJOBS) finish_job(opts);
+  if (opts->rc != 0) return 1;
+
+  job = (struct job *) malloc(sizeof(struct job));
+  if (!job) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+  memset(job, 0, sizeof(struct job));
+  job->opts = opts;
+  job->filename = strdup(filename);
+  job->f = NOHANDLE;
+  job->thread = NOHANDLE;
+  job->ready = mkevent(1, 0);
+  if (job->ready < 0) job->ready = NOHANDLE;
+  if (!job->filename) {
+    fprintf(stderr, "error: out of memory\n");
+    if (job->ready != NOHANDLE) close(job->ready);
+    free(job);
+    return 1;
+  }
+
+  if (opts->tail) {
+    opts->tail->next = job;
+  } else {
+    opts->head = job;
+  }
+  opts->tail = job;
+  opts->njobs++;
+
+  if (job->ready != NOHANDLE) job->thread = beginthread(grep_thread, 0, job, 0, "grep", NULL);
+  if (job->thread < 0) {
+    // Search the file in this thread if a worker could not be started
+    job->thread = NOHANDLE;
+    while (opts->head != job) finish_job(opts);
+    job->direct = 1;
+    search_file(job);
+    finish_job(opts);
+  }
+
+  return opts->rc;
+}
+
 int search_directory(char *path, struct options *opts) {
   struct dirent *dp;
   DIR *dirp;
@@ -131,14 +538,7 @@ int search_directory(char *path, struct options *opts) {
     if (stat(fn, &st) >= 0 && S_ISDIR(st.st_mode)) {
       rc = search_directory(fn, opts);
     } else {
-      FILE *f = fopen(fn, "r");
-      if (!f) {
-        perror(fn);
-        rc = 1;
-      } else {
-        rc = search_file(f, fn, opts);
-        fclose(f);
-      }
+      rc = start_job(opts, fn);
     }
 
     free(fn);
@@ -155,6 +555,7 @@ int search_directory(char *path, struct options *opts) {
 static void usage() {
   fprintf(stderr, "usage: grep [OPTIONS] PATTERN FILE...\n\n");
   fprintf(stderr, "  -E      Match using extended regular expressions\n");
+  fprintf(stderr, "  -F      Match fixed string\n");
   fprintf(stderr, "  -c      Print number of lines matching\n");
   fprintf(stderr, "  -i      Case-insensitive search\n");
   fprintf(stderr, "  -l      Print only names of files with matches\n");
@@ -166,22 +567,27 @@ static void usage() {
 
 shellcmd(grep) {
   struct options opts;
+  struct job job;
   int c;
   char *pattern;
   int reflags;
   int rc;
-  FILE *f;
   int i;
+  int len;
   struct stat st;
 
   // Parse command line options
   memset(&opts, 0, sizeof(struct options));
-  while ((c = getopt(argc, argv, "RrEcilnv?")) != EOF) {
+  while ((c = getopt(argc, argv, "RrEFcilnv?")) != EOF) {
     switch (c) {
       case 'E':
         opts.extended = 1;
         break;
 
+      case 'F':
+        opts.fixed = 1;
+        break;
+
       case 'R':
       case 'r':
         opts.recurse = 1;
@@ -217,42 +623,68 @@ shellcmd(grep) {
   if (optind == argc) usage();
   pattern = argv[optind++];
 
-  // Convert patttern to regex
-  reflags = opts.extended ? REG_EXTENDED : REG_BASIC;
-  if (opts.nocase) reflags |= REG_ICASE;
-  rc = regcomp(&opts.re, pattern, reflags);
-  if (rc != 0) {
-    char errmsg[128];
-    regerror(rc, &opts.re, errmsg, sizeof(errmsg));
-    fprintf(stderr, "%s: regular expression error '%s'\n", pattern, errmsg);
-    return 1;
+  if (opts.fixed) {
+    // Build skip table for fixed string search
+    opts.pattern = strdup(pattern);
+    if (!opts.pattern) {
+      fprintf(stderr, "error: out of memory\n");
+      return 1;
+    }
+    len = opts.patlen = strlen(pattern);
+    if (opts.nocase) {
+      for (i = 0; i < len; i++) opts.pattern[i] = tolower((unsigned char) opts.pattern[i]);
+    }
+    memset(opts.skip, len < 255 ? len : 255, sizeof(opts.skip));
+    for (i = 0; i < len - 1; i++) {
+      c = len - 1 - i < 255 ? len - 1 - i : 255;
+      opts.skip[(unsigned char) opts.pattern[i]] = c;
+      if (opts.nocase) opts.skip[toupper((unsigned char) opts.pattern[i])] = c;
+    }
+  } else {
+    // Convert patttern to regex
+    reflags = opts.extended ? REG_EXTENDED : REG_BASIC;
+    if (opts.nocase) reflags |= REG_ICASE;
+    rc = regcomp(&opts.re, pattern, reflags | REG_NEWLINE);
+    if (rc != 0) {
+      char errmsg[128];
+      regerror(rc, &opts.re, errmsg, sizeof(errmsg));
+      fprintf(stderr, "%s: regular expression error '%s'\n", pattern, errmsg);
+      return 1;
+    }
   }
 
   // Search files
+  rc = 0;
   if (optind == argc) {
-    rc = search_file(stdin, "<stdin>", &opts);
+    memset(&job, 0, sizeof(struct job));
+    job.opts = &opts;
+    job.filename = "<stdin>";
+    job.f = fileno(stdin);
+    job.direct = 1;
+    search_file(&job);
+    if (job.err) {
+      fprintf(stderr, "%s: %s\n", job.filename, strerror(job.err));
+      rc = 1;
+    }
   } else {
     opts.output_filename = argc - optind > 1 || opts.recurse;
     for (i = optind; i < argc; i++) {
       char *fn = argv[i];
       if (opts.recurse && stat(fn, &st) >= 0 && S_ISDIR(st.st_mode)) {
         rc = search_directory(fn, &opts);
-        if (rc != 0) break;
       } else {
-        f = fopen(fn, "r");
-        if (!f) {
-          perror(fn);
-          rc = 1;
-          break;
-        } else {
-          rc = search_file(f, fn, &opts);
-          fclose(f);
-          if (rc != 0) break;
-        }
+        rc = start_job(&opts, fn);
       }
+      if (rc != 0) break;
     }
+    while (opts.head) finish_job(&opts);
+    if (opts.rc != 0) rc = 1;
+  }
+
+  if (opts.fixed) {
+    free(opts.pattern);
+  } else {
+    regfree(&opts.re);
   }
-  regfree(&opts.re);
   return rc;
 }
-
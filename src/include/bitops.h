@@ -54,6 +54,20 @@ __inline void clear_bit(void *bitmap, int pos) {
   }
 }
 
+__inline int test_and_set_bit(void *bitmap, int pos) {
+  int result;
+
+  __asm {
+    mov eax, pos
+    mov ebx, bitmap
+    /*lock*/ bts dword ptr [ebx], eax
+    sbb eax, eax
+    mov result, eax
+  }
+
+  return result;
+}
+
 __inline int test_bit(void *bitmap, int pos) {
   int result;
 
@@ -42,6 +42,20 @@
 
 #define MAX_HTTP_HEADERS 32
 
+#define HTTPD_FILECACHE_HASHSIZE 256
+
+// Content encodings
+
+#define HTTPD_ENCODING_IDENTITY 0
+#define HTTPD_ENCODING_GZIP     1
+#define HTTPD_ENCODING_DEFLATE  2
+
+// Compression flush modes
+
+#define DEFLATE_NOFLUSH 0
+#define DEFLATE_SYNC    1
+#define DEFLATE_FINISH  2
+
 // Methods
 
 #define METHOD_GET   1
@@ -96,6 +110,8 @@ struct httpd_context;
 struct httpd_request;
 struct httpd_response;
 struct httpd_connection;
+struct httpd_worker;
+struct httpd_zstream;
 
 typedef int (*httpd_handler)(struct httpd_connection *conn);
 
@@ -122,6 +138,66 @@ typedef union {
   struct sockaddr_in sa_in;
 } httpd_sockaddr;
 
+// HTTP access log buffer
+
+struct httpd_logbuf {
+  struct critsect lock;
+  char *data;
+  int size;
+  int dropped;
+};
+
+// HTTP cached file
+
+struct httpd_cached_file {
+  struct httpd_cached_file *hash_next;
+  struct httpd_cached_file *lru_next;
+  struct httpd_cached_file *lru_prev;
+  int refcnt;
+  int stale;
+
+  char *path;
+  char *filename;
+  int isdir;
+  int encoding;
+  int incompressible;
+  char *content_type;
+  time_t mtime;
+  time_t checked;
+  int size;
+  int memsize;
+
+  char *data;
+  char *headers;
+  char etag[32];
+};
+
+// HTTP compression statistics
+
+struct httpd_zstats {
+  int streams;
+  __int64 bytes_in;
+  __int64 bytes_out;
+  clock_t cputime;
+};
+
+// HTTP file cache
+
+struct httpd_filecache {
+  struct critsect lock;
+  struct httpd_cached_file *hashtable[HTTPD_FILECACHE_HASHSIZE];
+  struct httpd_cached_file *lru_head;
+  struct httpd_cached_file *lru_tail;
+
+  int memlimit;
+  int memused;
+  int maxfilesize;
+  int interval;
+
+  int hits;
+  int misses;
+};
+
 // HTTP server
 
 struct httpd_server {
@@ -129,12 +205,15 @@ struct httpd_server {
   struct section *mimemap;
   int port;
   int sock;
-  int iomux;
+  handle_t acceptmux;
   struct critsect srvlock;
   struct httpd_context *contexts;
   struct httpd_connection *connections;
 
   int num_workers;
+  struct httpd_worker *workers;
+  int nextworker;
+  int stealinterval;
   int min_hdrbufsiz;
   int max_hdrbufsiz;
   int reqbufsiz;
@@ -143,6 +222,13 @@ struct httpd_server {
   char *indexname;
   char *swname;
   int allowdirbrowse;
+  char *statusurl;
+
+  struct httpd_filecache filecache;
+
+  int compress;
+  int compresslevel;
+  int compressmin;
 
   char *logdir;
   int nlogcolumns;
@@ -152,6 +238,30 @@ struct httpd_server {
   int logyear;
   int logmon;
   int logday;
+
+  int logbufsiz;
+  int logflush;
+  handle_t logevent;
+  handle_t logthread;
+  int logstop;
+  char *logspare;
+  int logdropped;
+};
+
+// HTTP worker
+
+struct httpd_worker {
+  struct httpd_server *server;
+  int iomux;
+  int connections;
+  clock_t busy;
+  int stolen;
+  struct httpd_zstats zstats;
+  struct httpd_logbuf log;
+
+  time_t logtime;
+  char logdate[16];
+  char logclock[16];
 };
 
 // HTTP context
@@ -189,12 +299,14 @@ struct httpd_request {
   char *referer;
   char *user_agent;
   char *accept;
+  char *accept_encoding;
   char *cookie;
   char *authorization;
   char *content_type;
   int content_length;
   char *host;
   time_t if_modified_since;
+  char *if_none_match;
   int keep_alive;
 
   char *username;
@@ -220,9 +332,12 @@ struct httpd_response {
 
 struct httpd_connection {
   struct httpd_server *server;
+  struct httpd_worker *owner;
+  struct httpd_worker *worker;
   struct httpd_connection *next;
   struct httpd_connection *prev;
   int sock;
+  int events;
   httpd_sockaddr client_addr;
   httpd_sockaddr server_addr;
 
@@ -233,15 +348,22 @@ struct httpd_connection {
   struct httpd_buffer reqbody;
   struct httpd_buffer rsphdr;
   struct httpd_buffer rspbody;
+  struct httpd_buffer rspenc;
   
   int state;
   int hdrstate;
+  int hdrlen;
 
   int hdrsent;
   
   char *fixed_rsp_data;
   int fixed_rsp_len;
 
+  struct httpd_cached_file *cached_file;
+
+  struct httpd_zstream *zstream;
+  int chunked;
+
   int fd;
   
   int keep;
@@ -271,14 +393,35 @@ httpdapi int httpd_redirect(struct httpd_response *rsp, char *newloc);
 
 httpdapi int httpd_file_handler(struct httpd_connection *conn);
 httpdapi int httpd_resource_handler(struct httpd_connection *conn);
+httpdapi int httpd_status_handler(struct httpd_connection *conn);
 
 #ifdef HTTPD_LIB
 
 // hlog.c
 
 int parse_log_columns(struct httpd_server *server, char *fields);
+int start_log(struct httpd_server *server);
+void stop_log(struct httpd_server *server);
 int log_request(struct httpd_request *req);
 
+// hcache.c
+
+void init_file_cache(struct httpd_server *server);
+struct httpd_cached_file *lookup_file_cache(struct httpd_server *server, char *path);
+struct httpd_cached_file *add_file_cache(struct httpd_server *server, char *path, char *filename, int isdir, struct stat64 *statbuf);
+void release_cached_file(struct httpd_server *server, struct httpd_cached_file *file);
+struct httpd_cached_file *get_compressed_file(struct httpd_connection *conn, struct httpd_cached_file *file, int encoding);
+
+// hzip.c
+
+void init_compression(struct httpd_server *server);
+char *encoding_name(int encoding);
+int compressible(struct httpd_server *server, char *content_type);
+int select_encoding(struct httpd_connection *conn, char *content_type);
+struct httpd_zstream *deflate_open(int encoding, int level);
+int deflate_data(struct httpd_zstream *z, char *data, int len, int flush, struct httpd_buffer *out);
+void deflate_close(struct httpd_zstream *z, struct httpd_zstats *stats);
+
 // hutils.c
 
 char *getstrconfig(struct section *cfg, char *name, char *defval);
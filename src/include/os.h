@@ -169,6 +169,7 @@ struct tms {
 #define MEM_RELEASE             0x8000
 
 #define MEM_ALIGN64K            0x10000000
+#define MEM_LARGE_PAGES         0x20000000
 
 //
 // Thread priorities
@@ -821,6 +822,21 @@ struct serial_status {
 #define _IOCW(x, y, t)   (IOC_IN |(((long) sizeof(t) & IOCPARM_MASK) << 16) | ((x) << 8)| (y))
 #define _IOCRW(x, y, t)  (IOC_INOUT |(((long) sizeof(t) & IOCPARM_MASK) << 16) | ((x) << 8)| (y))
 
+//
+// Pipes
+//
+
+#define PIPE_GETSIZE  _IOC('p', 1)                      // Get pipe buffer size
+#define PIPE_SETSIZE  _IOCW('p', 2, unsigned long)      // Set pipe buffer size
+
+#define SPLICE_NONBLOCK 0x0001                          // Do not block on pipes
+
+//
+// Files
+//
+
+#define FIOEXTENTS    _IOC('f', 1)                      // Get number of extents allocated to file
+
 //
 // Sockets
 //
@@ -1191,6 +1207,28 @@ struct peb {
   struct heap *heap;
 };
 
+//
+// Time Page
+//
+// The time page is a read-only page mapped into user space which the kernel
+// updates on each timer tick. This allows time(), gettimeofday() and clock()
+// to be serviced without a system call. The sequence number is odd while the
+// kernel is updating the page.
+//
+
+#define TIMEPAGE_ADDRESS 0x7FFDE000
+
+struct timepage {
+  unsigned long seqno;              // Update sequence number
+  unsigned long ticks;              // Timer ticks since boot
+  clock_t clocks;                   // Clock ticks since boot
+  time_t tv_sec;                    // Wall clock seconds
+  long tv_usec;                     // Wall clock microseconds
+  unsigned __int64 tsc;             // Time stamp counter at last timer tick
+  unsigned long cycles_per_tick;    // TSC cycles per timer tick (0 if no TSC)
+  unsigned long usecs_per_tick;     // Microseconds per timer tick
+};
+
 //
 // Process Object
 //
@@ -1466,6 +1504,7 @@ osapi handle_t _opendir(const char *name);
 osapi int _readdir(handle_t f, struct direntry *dirp, int count);
 
 osapi int pipe(handle_t fildes[2]);
+osapi int splice(handle_t in, handle_t out, size_t size, int flags);
 
 osapi void *vmalloc(void *addr, unsigned long size, int type, int protect, unsigned long tag);
 osapi int vmfree(void *addr, unsigned long size, int type);
@@ -1475,6 +1514,7 @@ osapi int vmlock(void *addr, unsigned long size);
 osapi int vmunlock(void *addr, unsigned long size);
 osapi void *vmmap(void *addr, unsigned long size, int protect, handle_t h, off64_t offset);
 osapi int vmsync(void *addr, unsigned long size);
+osapi void *vmclone(void *addr, unsigned long size);
 
 osapi int waitone(handle_t h, int timeout);
 osapi int waitall(handle_t *h, int count, int timeout);
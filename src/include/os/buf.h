@@ -36,6 +36,9 @@
 
 #define BUFPOOL_HASHSIZE 512
 
+#define BUF_CLUSTER_SIZE    (64 * 1024)  // Maximum size of clustered writes
+#define BUF_CLUSTER_MAX     128          // Maximum number of buffers in cluster
+
 #define BUF_STATE_FREE      0
 #define BUF_STATE_CLEAN     1
 #define BUF_STATE_DIRTY     2
@@ -48,6 +51,12 @@
 
 #define BUF_STATES          9
 
+#define BUF_FLAG_META       1   // Buffer holds file system metadata
+#define BUF_FLAG_JOURNAL    2   // Buffer modified in running journal transaction
+#define BUF_FLAG_COMMIT     4   // Buffer being committed to journal
+
+#define BUF_FLAG_NOWRITE    (BUF_FLAG_JOURNAL | BUF_FLAG_COMMIT)
+
 struct thread;
 struct buf;
 
@@ -69,6 +78,7 @@ struct buf {
   struct thread *waiters;
   blkno_t blkno;
   char *data;
+  int flags;
 };
 
 struct bufpool {
@@ -79,6 +89,7 @@ struct bufpool {
   int ioactive;
 
   void (*sync)(void *arg);
+  void (*commit)(void *arg);
   void *syncarg;
   time_t last_sync;
   int nosync;
@@ -94,6 +105,12 @@ struct bufpool {
   int blocks_written;
   int blocks_lazywrite;
   int blocks_synched;
+  int write_ios;
+
+  char *clusterbuf;      // Staging buffer for clustered writes
+  int clusterblocks;     // Maximum number of buffers in a clustered write
+  int clusterbusy;       // Staging buffer in use
+  blkno_t flushpos;      // Block following the last written cluster
 
   struct bufpool *next;
   struct bufpool *prev;
@@ -119,6 +136,8 @@ krnlapi void mark_buffer_invalid(struct bufpool *pool, struct buf *buf);
 krnlapi void release_buffer(struct bufpool *pool, struct buf *buf);
 krnlapi void invalidate_buffer(struct bufpool *pool, blkno_t blkno);
 krnlapi int flush_buffers(struct bufpool *pool, int interruptable);
+krnlapi int flush_data_buffers(struct bufpool *pool);
 krnlapi int sync_buffers(struct bufpool *pool, int interruptable);
+krnlapi int checkpoint_buffers(struct bufpool *pool);
 
 #endif
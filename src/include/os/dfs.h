@@ -46,9 +46,20 @@
 #define DFS_MAXFNAME               255
 #define DFS_MAXFILESIZE            0x7FFFFFFF
 
+#define DFS_JOURNAL_MAGIC          0x4C4A4644
+#define DFS_JOURNAL_HEADER         1
+#define DFS_JOURNAL_DESCRIPTOR     2
+#define DFS_JOURNAL_COMMIT         3
+#define DFS_JOURNAL_MAXTRANS       64
+
+#define DFS_ICACHE_HASHSIZE        256
+
 #define NOINODE                    (-1)
 #define NOBLOCK                    (-1)
 
+#define DFS_DELALLOC_WINDOW        64
+#define DFS_DELALLOC_LIMIT         1024
+
 #define FSOPT_QUICK                1
 #define FSOPT_PROGRESS             2
 #define FSOPT_FORMAT               4
@@ -60,6 +71,8 @@ struct fsoptions {
   int flags;
   int reserved_inodes;
   int reserved_blocks;
+  int journal;
+  int icache;
 };
 
 struct superblock {
@@ -80,6 +93,8 @@ struct superblock {
   unsigned int cache_buffers;
   unsigned int compress_offset;
   unsigned int compress_size;
+  blkno_t journal_block;
+  unsigned int journal_size;
 };
 
 struct groupdesc {
@@ -108,6 +123,29 @@ struct inodedesc {
   blkno_t blockdir[DFS_TOPBLOCKDIR_SIZE];
 };
 
+struct journalheader {
+  unsigned int magic;
+  unsigned int type;
+  unsigned int seq;
+  unsigned int size;
+};
+
+struct journaldesc {
+  unsigned int magic;
+  unsigned int type;
+  unsigned int seq;
+  unsigned int count;
+  unsigned int revoked;
+  blkno_t blocks[0];
+};
+
+struct journalcommit {
+  unsigned int magic;
+  unsigned int type;
+  unsigned int seq;
+  unsigned int checksum;
+};
+
 struct dentry {
   ino_t ino;
   unsigned int reclen;
@@ -126,6 +164,52 @@ struct inode {
   ino_t ino;
   struct inodedesc *desc;
   struct buf *buf;
+
+  int refcnt;                  // References from open files and lookups
+  struct inode *hash_next;     // Next inode in inode cache hash bucket
+  struct inode *lru_next;      // Next unreferenced inode in LRU list
+  struct inode *lru_prev;      // Previous unreferenced inode in LRU list
+};
+
+#ifdef KRNL_LIB
+struct journal {
+  blkno_t start;
+  unsigned int size;
+  unsigned int head;
+  unsigned int seq;
+  unsigned int committed;
+  int maxblocks;
+
+  struct buf **bufs;
+  int count;
+  blkno_t *revoked;
+  int nrevoked;
+  blkno_t *logged;
+  int logsize;
+  int nlogged;
+  int overflow;
+
+  int active;
+  int frozen;
+  struct event idle;
+  struct event thawed;
+  struct mutex lock;
+  char *iobuf;
+
+  int commits;
+  int fsyncs;
+  int blocks;
+  int checkpoints;
+};
+#endif
+
+struct delalloc {
+  struct delalloc *next;
+  ino_t ino;
+  unsigned int first;
+  int count;
+  off64_t size;
+  char *blocks[DFS_DELALLOC_WINDOW];
 };
 
 struct filsys {
@@ -143,6 +227,23 @@ struct filsys {
   struct bufpool *cache;
   struct buf **groupdesc_buffers;
   struct blkgroup *groups;
+
+#ifdef KRNL_LIB
+  struct fs *vfs;              // Mounted file system
+  struct journal *journal;
+
+  struct inode **icache;       // Inode cache hash table
+  struct inode *lru_head;      // Least recently used unreferenced inode
+  struct inode *lru_tail;      // Most recently used unreferenced inode
+  int icache_limit;            // Maximum number of unreferenced cached inodes
+  int icache_unused;           // Number of unreferenced cached inodes
+  int icache_hits;
+  int icache_misses;
+
+  struct mutex dalock;
+  struct delalloc *delalloc;
+  int delayed_blocks;
+#endif
 };
 
 #ifdef KRNL_LIB
@@ -173,8 +274,20 @@ int dfs_mount(struct fs *fs, char *opts);
 int dfs_umount(struct fs *fs);
 int dfs_statfs(struct fs *fs, struct statfs *buf);
 
+// journal.c
+int create_journal(struct filsys *fs, unsigned int blocks);
+int replay_journal(struct filsys *fs);
+int open_journal(struct filsys *fs);
+void close_journal(struct filsys *fs);
+void begin_transaction(struct filsys *fs);
+void end_transaction(struct filsys *fs);
+void journal_buffer(struct filsys *fs, struct buf *buf);
+void revoke_block(struct filsys *fs, blkno_t blkno);
+int commit_journal(struct filsys *fs);
+
 // group.c
 blkno_t new_block(struct filsys *fs, blkno_t goal);
+blkno_t new_blocks(struct filsys *fs, blkno_t goal, int count, int *allocated);
 void free_blocks(struct filsys *fs, blkno_t *blocks, int count);
 
 ino_t new_inode(struct filsys *fs, ino_t parent, int dir);
@@ -188,8 +301,11 @@ struct inode *alloc_inode(struct inode *parent, mode_t mode);
 int unlink_inode(struct inode *inode);
 int get_inode(struct filsys *fs, ino_t ino, struct inode **retval);
 void release_inode(struct inode *inode);
+blkno_t append_inode_block(struct inode *inode, blkno_t block);
 blkno_t expand_inode(struct inode *inode);
 int truncate_inode(struct inode *inode, unsigned int blocks);
+int init_inode_cache(struct filsys *fs, int limit);
+void free_inode_cache(struct filsys *fs);
 
 // dir.c
 int find_dir_entry(struct inode *dir, char *name, int len, ino_t *retval);
@@ -218,5 +334,8 @@ int dfs_futime(struct file *filp, struct utimbuf *times);
 int dfs_fstat(struct file *filp, struct stat64 *buffer);
 int dfs_fchmod(struct file *filp, int mode);
 int dfs_fchown(struct file *filp, int owner, int group);
+off64_t get_file_size(struct inode *inode);
+int flush_delayed_blocks(struct filsys *fs, ino_t ino);
+void discard_delayed_blocks(struct filsys *fs, ino_t ino);
 
 #endif
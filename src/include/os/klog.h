@@ -43,8 +43,28 @@
 #define KERN_INFO        "<6>"       // Informational
 #define KERN_DEBUG       "<7>"       // Debug-level messages
 
+//
+// Rate limiting for messages from frequently executed code. At most burst
+// messages are logged per interval ticks:
+//
+//   static struct ratelimit rs = KLOG_RATELIMIT(5 * HZ, 10);
+//
+//   if (klog_ratelimit(&rs)) kprintf(...);
+//
+
+struct ratelimit {
+  unsigned int begin;          // Start of current interval in ticks
+  int interval;                // Length of interval in ticks
+  int burst;                   // Number of messages allowed per interval
+  int printed;                 // Messages logged in current interval
+  int missed;                  // Messages suppressed in current interval
+};
+
+#define KLOG_RATELIMIT(interval, burst) {0, (interval), (burst), 0, 0}
+
 extern int kprint_enabled;
 
 krnlapi void kprintf(const char *fmt, ...);
+krnlapi int klog_ratelimit(struct ratelimit *rs);
 
 #endif
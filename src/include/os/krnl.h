@@ -92,6 +92,7 @@
 
 #include <os/iovec.h>
 #include <os/vfs.h>
+#include <os/pcache.h>
 #include <os/dfs.h>
 #include <os/devfs.h>
 #include <os/procfs.h>
@@ -137,11 +138,16 @@ void init_smbfs();
 
 void init_pipefs();
 int pipe(struct file **readpipe, struct file **writepipe);
+int splice(struct object *in, struct object *out, size_t size, int flags);
 
 // cdfs.c
 
 void init_cdfs();
 
+// tmpfs.c
+
+void init_tmpfs();
+
 // cons.c
 
 extern int serial_console;
@@ -158,7 +164,28 @@ int create_initrd();
 
 // hd.c
 
+#define HD_PARTITIONS 4
+
+struct partition {
+  dev_t dev;
+  unsigned int start;
+  unsigned int len;
+  unsigned short bootid;
+  unsigned short systid;
+};
+
+extern struct driver partition_driver;
+
 void init_hd();
+int create_partitions(dev_t devno, struct partition *parts);
+
+// ahci.c
+
+void init_ahci();
+
+// nvme.c
+
+void init_nvme();
 
 // fd.c
 
@@ -60,6 +60,8 @@ struct mach {
   unsigned long (*get_cr0)();
   void (*set_cr0)(unsigned long val);
   unsigned long (*get_cr2)();
+  unsigned long (*get_cr4)();
+  void (*set_cr4)(unsigned long val);
   unsigned __int64 (*rdtsc)();
   void (*wrmsr)(unsigned long reg, unsigned long valuelow, unsigned long valuehigh);
   void (*set_gdt_entry)(int entry, unsigned long addr, unsigned long size, int access, int granularity);
@@ -124,6 +126,14 @@ unsigned long __inline get_cr2() {
   return mach.get_cr2();
 }
 
+unsigned long __inline get_cr4() {
+  return mach.get_cr4();
+}
+
+void __inline set_cr4(unsigned long val) {
+  mach.set_cr4(val);
+}
+
 unsigned __int64 __inline rdtsc() {
   return mach.rdtsc();
 }
@@ -212,6 +222,24 @@ unsigned long __inline get_cr2() {
   return val;
 }
 
+unsigned long __inline get_cr4() {
+  unsigned long val;
+
+  __asm {
+    mov eax, cr4
+    mov val, eax
+  }
+
+  return val;
+}
+
+void __inline set_cr4(unsigned long val) {
+  __asm {
+    mov eax, val
+    mov cr4, eax
+  }
+}
+
 __declspec(naked) unsigned __int64 __inline rdtsc() {
   __asm {
     rdtsc
@@ -73,6 +73,7 @@
 #define THREAD_FPU_ENABLED       2
 #define THREAD_ALERTABLE         4
 #define THREAD_INTERRUPTED       8
+#define THREAD_TASK_INVALID      16
 
 #define ISIOOBJECT(o) ((o)->object.type == OBJECT_SOCKET || (o)->object.type == OBJECT_FILE)
 
@@ -208,6 +209,8 @@ struct thread {
   struct fpu fpustate;
 };
 
+struct cfile;
+
 struct filemap {
   struct object object;
 
@@ -220,6 +223,8 @@ struct filemap {
   int pages;
 
   handle_t self;
+  struct cfile *cfile;
+  struct filemap *next;
 };
 
 #ifdef KERNEL
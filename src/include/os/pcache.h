@@ -0,0 +1,89 @@
+//
+// pcache.h
+//
+// Page cache for memory mapped files
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#ifndef PCACHE_H
+#define PCACHE_H
+
+#define PCACHE_HASHSIZE 1024
+#define PCACHE_MAXMEM   25      // Maximum percent of memory used for page cache
+
+struct filemap;
+struct proc_file;
+
+struct cpage {
+  struct cpage *bucket;         // Next page in hash bucket
+  struct cpage *next;           // Next page in file
+  struct cpage *prev;           // Previous page in file
+  struct cpage *lru_next;       // Next page in LRU list (less recently used)
+  struct cpage *lru_prev;       // Previous page in LRU list (more recently used)
+  struct cfile *cfile;          // File the page belongs to
+  unsigned long pageno;         // Page number in file
+  unsigned long pfn;            // Page frame holding the data
+  char *data;                   // Kernel address of page data
+  int mapcount;                 // Number of mappings of the page
+  int dirty;                    // Page modified through a mapping
+  int locks;                    // Page locked for write back
+  int borrowed;                 // Page frame owned by the file system
+};
+
+struct cfile {
+  struct cfile *next;           // Next file in page cache
+  struct fs *fs;                // File system for file
+  ino_t ino;                    // Inode number for file
+  off64_t size;                 // Current file size
+  int refcnt;                   // Number of references to cached file
+  int pages;                    // Number of cached pages
+  struct cpage *pagelist;       // Cached pages for file
+  struct filemap *filemaps;     // Memory mappings of file
+};
+
+extern int cached_files;
+
+struct cfile *attach_cfile(struct file *filp, int *rc);
+struct cfile *lookup_cfile(struct file *filp);
+void release_cfile(struct cfile *cf);
+
+struct cpage *get_cached_page(struct cfile *cf, struct file *filp, unsigned long pageno, int *rc);
+
+int read_cached(struct cfile *cf, struct file *filp, void *data, size_t size, off64_t offset);
+int write_cached(struct cfile *cf, struct file *filp, void *data, size_t size, off64_t offset);
+void truncate_cached(struct cfile *cf, off64_t size);
+int adopt_cached_page(void *data);
+
+int flush_cfile(struct cfile *cf);
+void flush_page_cache();
+
+int pcache_proc(struct proc_file *pf, void *arg);
+void init_pcache();
+
+#endif
@@ -136,6 +136,8 @@
 #define PCI_ISA_BRIDGE          0x060100
 
 #define PCI_CLASS_STORAGE_IDE   0x010100
+#define PCI_CLASS_STORAGE_AHCI  0x010601
+#define PCI_CLASS_STORAGE_NVME  0x010802
 
 #define PCI_ID_ANY              0xFFFFFFFF
 
@@ -40,19 +40,23 @@ typedef unsigned long pte_t;
 #define PAGESHIFT      12
 #define PTES_PER_PAGE  (PAGESIZE / sizeof(pte_t))
 
+#define LARGEPAGESIZE  (PTES_PER_PAGE * PAGESIZE)
+
 #define PT_PRESENT   0x001
 #define PT_WRITABLE  0x002
 #define PT_USER      0x004
 #define PT_ACCESSED  0x020
 #define PT_DIRTY     0x040
+#define PT_LARGE     0x080
 
 #define PT_GUARD     0x200
 #define PT_FILE      0x400
+#define PT_COW       0x800
 
 #define PT_USER_READ    (PT_PRESENT | PT_USER)
 #define PT_USER_WRITE   (PT_PRESENT | PT_USER | PT_WRITABLE)
 
-#define PT_FLAGMASK     (PT_PRESENT | PT_WRITABLE | PT_USER | PT_ACCESSED | PT_DIRTY | PT_GUARD | PT_FILE)
+#define PT_FLAGMASK     (PT_PRESENT | PT_WRITABLE | PT_USER | PT_ACCESSED | PT_DIRTY | PT_GUARD | PT_FILE | PT_COW)
 #define PT_PROTECTMASK  (PT_WRITABLE | PT_USER | PT_GUARD)
 
 #define PT_PFNMASK   0xFFFFF000
@@ -65,6 +69,7 @@ typedef unsigned long pte_t;
 
 #define PAGES(x) (((unsigned long)(x) + (PAGESIZE - 1)) >> PAGESHIFT)
 #define PAGEADDR(x) ((unsigned long)(x) & ~(PAGESIZE - 1))
+#define LARGEPAGEADDR(x) ((unsigned long)(x) & ~(LARGEPAGESIZE - 1))
 
 #define PTOB(x) ((unsigned long)(x) << PAGESHIFT)
 #define BTOP(x) ((unsigned long)(x) >> PAGESHIFT)
@@ -88,6 +93,7 @@ struct pdirstat {
 
 extern pte_t *pdir;
 extern pte_t *ptab;
+extern int large_pages_supported;
 
 krnlapi void map_page(void *vaddr, unsigned long pfn, unsigned long flags);
 krnlapi void unmap_page(void *vaddr);
@@ -97,8 +103,13 @@ krnlapi pte_t get_page_flags(void *vaddr);
 krnlapi void set_page_flags(void *vaddr, unsigned long flags);
 krnlapi int page_mapped(void *vaddr);
 krnlapi int page_directory_mapped(void *vaddr);
+krnlapi int large_page_mapped(void *vaddr);
+krnlapi int map_large_page(void *vaddr, unsigned long pfn, unsigned long flags);
+krnlapi void unmap_large_page(void *vaddr);
+krnlapi void split_large_page(void *vaddr);
 krnlapi void unguard_page(void *vaddr);
 krnlapi void clear_dirty(void *vaddr);
+krnlapi int clone_pages(void *dst, void *src, int pages);
 
 krnlapi int mem_access(void *vaddr, int size, pte_t access);
 krnlapi int str_access(char *s, pte_t access);
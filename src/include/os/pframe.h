@@ -37,12 +37,15 @@
 #define DMA_BUFFER_START 0x10000
 #define DMA_BUFFER_PAGES 16
 
+struct cpage;
+
 struct pageframe {
   unsigned long tag;
   union {
     unsigned long locks;        // Number of locks
     unsigned long size;         // Size/buckets for kernel pages
-    handle_t owner;             // Reference to owner for file maps
+    struct cpage *cpage;        // Cached page for page cache frames
+    unsigned long shares;       // Number of extra mappings for copy-on-write pages
     struct pageframe *next;     // Next free page frame for free pages
   };
 };
@@ -55,6 +58,7 @@ extern unsigned long maxmem;
 
 krnlapi unsigned long alloc_pageframe(unsigned long tag);
 krnlapi unsigned long alloc_linear_pageframes(int pages, unsigned long tag);
+krnlapi unsigned long alloc_aligned_pageframes(int pages, int align, unsigned long tag);
 krnlapi void free_pageframe(unsigned long pfn);
 krnlapi void set_pageframe_tag(void *addr, unsigned int len, unsigned long tag);
 
@@ -49,6 +49,8 @@
 extern struct timeval systemclock;
 extern volatile unsigned int ticks;
 extern volatile unsigned int clocks;
+extern struct timepage *timepage;
+extern unsigned long cycles_per_tick;
 
 krnlapi unsigned int get_ticks();
 
@@ -59,6 +61,7 @@ krnlapi void write_cmos_reg(int reg, unsigned char val);
 
 void init_pit();
 void calibrate_delay();
+void init_timepage();
 
 krnlapi time_t get_time();
 
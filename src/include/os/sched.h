@@ -58,8 +58,17 @@ typedef void (*taskproc_t)(void *arg);
 #define DPC_EXECUTING         (1 << DPC_EXECUTING_BIT)
 #define DPC_NORAND            (1 << DPC_NORAND_BIT)
 
-#define TASK_QUEUE_ACTIVE              1
-#define TASK_QUEUE_ACTIVE_TASK_INVALID 2
+#define DPC_PRIORITY_HIGH     0
+#define DPC_PRIORITY_NORMAL   1
+#define DPC_PRIORITY_LOW      2
+
+#define DPC_PRIORITY_LEVELS   3
+
+
+#define TASK_QUEUE_MAX_WORKERS 8
+#define SYS_TASK_WORKERS       4
+
+#define LATENCY_BUCKETS       24
 
 #define TASK_QUEUED       1
 #define TASK_EXECUTING    2
@@ -75,6 +84,8 @@ struct dpc {
   void *arg;
   struct dpc *next;
   int flags;
+  int priority;
+  unsigned long queued;
 };
 
 struct task {
@@ -82,15 +93,24 @@ struct task {
   void *arg;
   struct task *next;
   int flags;
+  unsigned long queued;
 };
 
 struct task_queue {
   struct task *head;
   struct task *tail;
-  struct thread *thread;
   int maxsize;
   int size;
   int flags;
+  int active;
+  int numworkers;
+  struct thread *workers[TASK_QUEUE_MAX_WORKERS];
+};
+
+struct latency_histogram {
+  unsigned long samples;
+  unsigned long max;
+  unsigned long count[LATENCY_BUCKETS];
 };
 
 struct kernel_context {
@@ -103,9 +123,9 @@ struct kernel_context {
 extern struct thread *idlethread;
 extern struct thread *threadlist;
 extern struct task_queue sys_task_queue;
+extern struct task_queue sys_task_pool;
 
-extern struct dpc *dpc_queue_head;
-extern struct dpc *dpc_queue_tail;
+extern struct dpc *dpc_queue[DPC_PRIORITY_LEVELS];
 
 extern int in_dpc;
 extern int preempt;
@@ -158,15 +178,20 @@ int set_thread_priority(struct thread *t, int priority);
 int get_thread_times(struct thread *t, struct tms *tms);
 
 krnlapi int init_task_queue(struct task_queue *tq, int priority, int maxsize, char *name);
+krnlapi int init_task_pool(struct task_queue *tq, int priority, int maxsize, int workers, char *name);
 krnlapi void init_task(struct task *task);
 krnlapi int queue_task(struct task_queue *tq, struct task *task, taskproc_t proc, void *arg);
 
 krnlapi void init_dpc(struct dpc *dpc);
 krnlapi void queue_dpc(struct dpc *dpc, dpcproc_t proc, void *arg);
 krnlapi void queue_irq_dpc(struct dpc *dpc, dpcproc_t proc, void *arg);
+krnlapi void set_dpc_priority(struct dpc *dpc, int priority);
 
 krnlapi void add_idle_task(struct task *task, taskproc_t proc, void *arg);
 
+krnlapi unsigned long latency_stamp();
+krnlapi void record_latency(struct latency_histogram *hist, unsigned long start);
+
 void idle_task();
 krnlapi void yield();
 void dispatch_dpc_queue();
@@ -176,8 +201,12 @@ krnlapi int system_idle();
 
 void init_sched();
 
+__inline int dpcs_pending() {
+  return dpc_queue[DPC_PRIORITY_HIGH] || dpc_queue[DPC_PRIORITY_NORMAL] || dpc_queue[DPC_PRIORITY_LOW];
+}
+
 __inline void check_dpc_queue() {
-  if (dpc_queue_head) dispatch_dpc_queue();
+  if (dpcs_pending()) dispatch_dpc_queue();
 }
 
 __inline void check_preempt() {
@@ -146,7 +146,11 @@
 #define SYSCALL_VMMAP         109
 #define SYSCALL_VMSYNC        110
 #define SYSCALL_THREADTIMES   111
+#define SYSCALL_VMCLONE       112
+#define SYSCALL_SPLICE        113
 
-#define SYSCALL_MAX           111
+#define SYSCALL_MAX           113
+
+#define SYSCALL_REGARGS       0x40000000  // Parameters passed in ebx, esi, and edi
 
 #endif
@@ -104,6 +104,8 @@ struct file {
   void *data;
   char *path;
   char chbuf;
+  struct cfile *cfile;
+  unsigned long cfgen;
 };
 
 struct fsops {
@@ -153,6 +155,8 @@ struct fsops {
   
   int (*opendir)(struct file *filp, char *name);
   int (*readdir)(struct file *filp, struct direntry *dirp, int count);
+
+  int (*getpage)(struct file *filp, unsigned long pageno, char **page);
 };
 
 #ifdef KERNEL
@@ -166,6 +170,9 @@ krnlapi struct filesystem *register_filesystem(char *name, struct fsops *ops);
 krnlapi int fslookup(char *name, int full, struct fs **mntfs, char **rest);
 krnlapi struct file *newfile(struct fs *fs, char *path, int flags, int mode);
 
+int lock_fs(struct fs *fs, int fsop);
+void unlock_fs(struct fs *fs, int fsop);
+
 krnlapi int mkfs(char *devname, char *type, char *opts);
 krnlapi int mount(char *type, char *mntto, char *mntfrom, char *opts, struct fs **newfs);
 krnlapi int umount(char *path);
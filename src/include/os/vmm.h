@@ -36,6 +36,9 @@
 
 extern struct rmap *vmap;
 
+extern unsigned long cow_faults;
+extern unsigned long cow_copies;
+
 void init_vmm();
 
 krnlapi void *vmalloc(void *addr, unsigned long size, int type, int protect, unsigned long tag, int *rc);
@@ -44,6 +47,7 @@ krnlapi int vmsync(void *addr, unsigned long size);
 krnlapi int vmfree(void *addr, unsigned long size, int type);
 krnlapi void *vmrealloc(void *addr, unsigned long oldsize, unsigned long newsize, int type, int protect, unsigned long tag);
 krnlapi int vmprotect(void *addr, unsigned long size, int protect);
+krnlapi void *vmclone(void *addr, unsigned long size, int *rc);
 krnlapi int vmlock(void *addr, unsigned long size);
 krnlapi int vmunlock(void *addr, unsigned long size);
 
@@ -51,6 +55,7 @@ krnlapi void *miomap(unsigned long physaddr, int size, int protect);
 krnlapi void miounmap(void *addr, int size);
 
 int guard_page_handler(void *addr);
+int cow_page_handler(void *addr);
 int fetch_page(void *addr);
 
 int vmem_proc(struct proc_file *pf, void *arg);
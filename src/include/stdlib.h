@@ -78,6 +78,7 @@ long labs(long n);
 ldiv_t ldiv(long numer, long denom);
 char *ltoa(long val, char *buf, int radix);
 void qsort(void *base, unsigned num, unsigned width, int (*comp)(const void *, const void *));
+int radixsort32(void *base, unsigned num, unsigned width, unsigned keyofs);
 int rand();
 void srand(unsigned int seed);
 double strtod(const char *str, char **endptr);
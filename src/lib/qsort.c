@@ -1,7 +1,7 @@
 //
 // qsort.c
 //
-// Quick sort
+// Introspective sort and radix sort
 //
 // Copyright (C) 2002 Michael Ringgaard. All rights reserved.
 //
@@ -31,10 +31,54 @@
 // SUCH DAMAGE.
 // 
 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
 #define CUTOFF 8
+#define STKSIZ 32
+
+#define SWAP_BYTES 0    // Swap byte by byte
+#define SWAP_WORDS 1    // Swap word by word
+#define SWAP_WORD  2    // Swap single word
 
-static void shortsort(char *lo, char *hi, unsigned width, int (*comp)(const void *, const void *));
-static void swap(char *p, char *q, unsigned int width);
+static void shortsort(char *lo, char *hi, unsigned width, int (*comp)(const void *, const void *), int swaptype);
+static void heapsort(char *base, unsigned num, unsigned width, int (*comp)(const void *, const void *), int swaptype);
+
+static void swap(char *a, char *b, unsigned width, int swaptype) {
+  char tmp;
+  unsigned int wtmp;
+
+  if (swaptype == SWAP_WORD) {
+    wtmp = *(unsigned int *) a;
+    *(unsigned int *) a = *(unsigned int *) b;
+    *(unsigned int *) b = wtmp;
+  } else if (swaptype == SWAP_WORDS) {
+    while (width) {
+      wtmp = *(unsigned int *) a;
+      *(unsigned int *) a = *(unsigned int *) b;
+      *(unsigned int *) b = wtmp;
+      a += sizeof(unsigned int);
+      b += sizeof(unsigned int);
+      width -= sizeof(unsigned int);
+    }
+  } else {
+    while (width--) {
+      tmp = *a;
+      *a++ = *b;
+      *b++ = tmp;
+    }
+  }
+}
+
+//
+// qsort
+//
+// Quicksort with median-of-three partitioning that switches to heapsort
+// when the recursion gets deeper than 2*log2(num), so the worst case is
+// O(n log n). Elements equal to the pivot stop the partition scans, which
+// splits runs of duplicates evenly. Small partitions are insertion sorted.
+//
 
 void qsort(void *base, unsigned num, unsigned width, int (*comp)(const void *, const void *))
 {
@@ -42,12 +86,25 @@ void qsort(void *base, unsigned num, unsigned width, int (*comp)(const void *, c
   char *mid;
   char *l, *h;
   unsigned size;
-  char *lostk[30], *histk[30];
+  char *lostk[STKSIZ], *histk[STKSIZ];
+  int depthstk[STKSIZ];
   int stkptr;
+  int depth;
+  int swaptype;
 
   if (num < 2 || width == 0) return;
   stkptr = 0;
 
+  // Swap whole words if elements are word aligned
+  if ((((unsigned long) base | width) & (sizeof(unsigned int) - 1)) == 0) {
+    swaptype = width == sizeof(unsigned int) ? SWAP_WORD : SWAP_WORDS;
+  } else {
+    swaptype = SWAP_BYTES;
+  }
+
+  depth = 0;
+  for (size = num; size > 1; size >>= 1) depth += 2;
+
   lo = base;
   hi = (char *) base + width * (num - 1);
 
@@ -55,38 +112,51 @@ recurse:
   size = (hi - lo) / width + 1;
 
   if (size <= CUTOFF) {
-    shortsort(lo, hi, width, comp);
+    shortsort(lo, hi, width, comp, swaptype);
+  } else if (depth == 0) {
+    heapsort(lo, size, width, comp, swaptype);
   } else {
+    depth--;
+
+    // Move median of first, middle, and last element to lo as pivot
     mid = lo + (size / 2) * width;
-    swap(mid, lo, width);
+    if (comp(lo, mid) > 0) swap(lo, mid, width, swaptype);
+    if (comp(mid, hi) > 0) {
+      swap(mid, hi, width, swaptype);
+      if (comp(lo, mid) > 0) swap(lo, mid, width, swaptype);
+    }
+    swap(mid, lo, width, swaptype);
 
     l = lo;
     h = hi + width;
 
     for (;;) {
-      do { l += width; } while (l <= hi && comp(l, lo) <= 0);
-      do { h -= width; } while (h > lo && comp(h, lo) >= 0);
-      if (h < l) break;
-      swap(l, h, width);
+      do { l += width; } while (l < hi && comp(l, lo) < 0);
+      do { h -= width; } while (h > lo && comp(h, lo) > 0);
+      if (h <= l) break;
+      swap(l, h, width, swaptype);
     }
 
-    swap(lo, h, width);
+    swap(lo, h, width, swaptype);
 
-    if (h - 1 - lo >= hi - l) {
+    // Push larger partition and sort the smaller one first
+    if (h - lo >= hi - h) {
       if (lo + width < h) {
         lostk[stkptr] = lo;
         histk[stkptr] = h - width;
+        depthstk[stkptr] = depth;
         ++stkptr;
       }
 
-      if (l < hi) {
-        lo = l;
+      if (h + width < hi) {
+        lo = h + width;
         goto recurse;
       }
     } else {
-      if (l < hi) {
-        lostk[stkptr] = l;
+      if (h + width < hi) {
+        lostk[stkptr] = h + width;
         histk[stkptr] = hi;
+        depthstk[stkptr] = depth;
         ++stkptr;
       }
 
@@ -101,29 +171,121 @@ recurse:
   if (stkptr >= 0) {
     lo = lostk[stkptr];
     hi = histk[stkptr];
+    depth = depthstk[stkptr];
     goto recurse;
   }
 }
 
-static void shortsort(char *lo, char *hi, unsigned width, int (*comp)(const void *, const void *)) {
-  char *p, *max;
+static void shortsort(char *lo, char *hi, unsigned width, int (*comp)(const void *, const void *), int swaptype) {
+  char *p, *q;
 
-  while (hi > lo) {
-    max = lo;
-    for (p = lo + width; p <= hi; p += width) if (comp(p, max) > 0) max = p;
-    swap(max, hi, width);
-    hi -= width;
+  for (p = lo + width; p <= hi; p += width) {
+    for (q = p; q > lo && comp(q - width, q) > 0; q -= width) swap(q - width, q, width, swaptype);
   }
 }
 
-static void swap(char *a, char *b, unsigned width) {
-  char tmp;
+static void siftdown(char *base, unsigned root, unsigned num, unsigned width, int (*comp)(const void *, const void *), int swaptype) {
+  unsigned child;
 
-  if (a != b) {
-    while (width--) {
-      tmp = *a;
-      *a++ = *b;
-      *b++ = tmp;
+  while ((child = 2 * root + 1) < num) {
+    if (child + 1 < num && comp(base + child * width, base + (child + 1) * width) < 0) child++;
+    if (comp(base + root * width, base + child * width) >= 0) break;
+    swap(base + root * width, base + child * width, width, swaptype);
+    root = child;
+  }
+}
+
+static void heapsort(char *base, unsigned num, unsigned width, int (*comp)(const void *, const void *), int swaptype) {
+  unsigned i;
+
+  for (i = num / 2; i > 0; i--) siftdown(base, i - 1, num, width, comp, swaptype);
+  for (i = num - 1; i > 0; i--) {
+    swap(base, base + i * width, width, swaptype);
+    siftdown(base, 0, i, width, comp, swaptype);
+  }
+}
+
+//
+// radixsort32
+//
+// Stable LSD radix sort of elements by the unsigned 32-bit integer key at
+// offset keyofs in each element. All four digit histograms are counted in
+// one pass, and passes where all keys have the same digit are skipped.
+// Needs a temporary buffer the size of the array. Returns 0 on success, or
+// -1 with errno set if the arguments are invalid or memory is exhausted.
+//
+
+#define KEY(p) (*(unsigned int *) ((p) + keyofs))
+
+int radixsort32(void *base, unsigned num, unsigned width, unsigned keyofs) {
+  unsigned count[4][256];
+  char *tmp;
+  char *src, *dst;
+  char *p, *end;
+  unsigned key;
+  unsigned sum, n;
+  int digit, i;
+
+  if (width < keyofs + sizeof(unsigned int)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (num < 2) return 0;
+  if (num > 0xFFFFFFFF / width) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  tmp = (char *) malloc(num * width);
+  if (!tmp) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // Count occurrences of each byte value for all digits
+  memset(count, 0, sizeof(count));
+  end = (char *) base + num * width;
+  for (p = (char *) base; p < end; p += width) {
+    key = KEY(p);
+    count[0][key & 0xFF]++;
+    count[1][(key >> 8) & 0xFF]++;
+    count[2][(key >> 16) & 0xFF]++;
+    count[3][key >> 24]++;
+  }
+
+  src = (char *) base;
+  dst = tmp;
+  for (digit = 0; digit < 4; digit++) {
+    // Skip pass if all keys have the same digit
+    if (count[digit][(KEY(src) >> (digit * 8)) & 0xFF] == num) continue;
+
+    // Compute start position for each digit value
+    sum = 0;
+    for (i = 0; i < 256; i++) {
+      n = count[digit][i];
+      count[digit][i] = sum;
+      sum += n;
     }
+
+    // Distribute elements into the other buffer
+    end = src + num * width;
+    if (width == sizeof(unsigned int)) {
+      for (p = src; p < end; p += sizeof(unsigned int)) {
+        key = *(unsigned int *) p;
+        ((unsigned int *) dst)[count[digit][(key >> (digit * 8)) & 0xFF]++] = key;
+      }
+    } else {
+      for (p = src; p < end; p += width) {
+        memcpy(dst + count[digit][(KEY(p) >> (digit * 8)) & 0xFF]++ * width, p, width);
+      }
+    }
+
+    p = src;
+    src = dst;
+    dst = p;
   }
+
+  if (src != (char *) base) memcpy(base, src, num * width);
+  free(tmp);
+  return 0;
 }
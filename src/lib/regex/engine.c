@@ -121,6 +121,8 @@ static int matcher(struct re_guts *g, char *string, size_t nmatch, regmatch_t pm
   const sopno gl = g->laststate;
   char *start;
   char *stop;
+  char *first;
+  int rc;
 
   // Simplify the situation where possible
   if (g->cflags & REG_NOSUB) nmatch = 0;
@@ -135,10 +137,15 @@ static int matcher(struct re_guts *g, char *string, size_t nmatch, regmatch_t pm
 
   // Prescreening; this does wonders for this rather slow code
   if (g->must != NULL) {
-    for (dp = start; dp < stop; dp++) {
-      if (*dp == g->must[0] && stop - dp >= g->mlen && memcmp(dp, g->must, (size_t) g->mlen) == 0) break;
-    }
-    if (dp == stop) return REG_NOMATCH;  // we didn't find g->must
+    dp = findstr(start, stop, g->must, g->mlen, g->mskip);
+    if (dp == NULL) return REG_NOMATCH;  // we didn't find g->must
+  }
+
+  // All matches start with the literal prefix, so start at its first occurrence
+  first = start;
+  if (g->prefix != NULL) {
+    first = findstr(start, stop, g->prefix, g->plen, g->pskip);
+    if (first == NULL) return REG_NOMATCH;
   }
 
   // Match struct setup
@@ -155,10 +162,18 @@ static int matcher(struct re_guts *g, char *string, size_t nmatch, regmatch_t pm
   SETUP(m->tmp);
   SETUP(m->empty);
   CLEAR(m->empty);
+  start = first;
 
   // This loop does only one repetition except for backrefs
   for (;;) {
-    endp = fast(m, start, stop, gf, gl);
+    // Use the DFA if possible, otherwise simulate the NFA
+    rc = -1;
+    if (g->dfa != NULL && !(m->eflags & REG_LARGE)) rc = dfafast(g, start, stop, m->beginp, m->eflags, &endp, &m->coldp);
+    if (rc < 0) {
+      endp = fast(m, start, stop, gf, gl);
+    } else if (rc == 0) {
+      endp = NULL;
+    }
     if (endp == NULL) {
       // a miss
       STATETEARDOWN(m);
@@ -172,8 +187,17 @@ static int matcher(struct re_guts *g, char *string, size_t nmatch, regmatch_t pm
       NOTE("finding start");
       endp = slow(m, m->coldp, stop, gf, gl);
       if (endp != NULL) break;
-      assert(m->coldp < m->endp);
-      m->coldp++;
+      if (m->coldp < stop) {
+        m->coldp++;
+        continue;
+      }
+
+      // No start found, so redo the scan with the NFA if the DFA was used
+      if (rc < 0 || fast(m, start, stop, gf, gl) == NULL) {
+        STATETEARDOWN(m);
+        return REG_NOMATCH;
+      }
+      rc = -1;
     }
     if (nmatch == 1 && !g->backrefs) break; // no further info needed
 
@@ -104,6 +104,8 @@ static void dofwd(struct parse *p, sopno pos, sop value);
 static void enlarge(struct parse *p, sopno size);
 static void stripsnug(struct parse *p, struct re_guts *g);
 static void findmust(struct parse *p, struct re_guts *g);
+static void findprefix(struct parse *p, struct re_guts *g);
+static void makeskip(uch *skip, char *str, int len);
 static sopno pluscount(struct parse *p, struct re_guts *g);
 
 static char nuls[10];   // Place to point scanner in event of error
@@ -203,6 +205,9 @@ int regcomp(regex_t *preg, const char *pattern, int cflags) {
   g->neol = 0;
   g->must = NULL;
   g->mlen = 0;
+  g->prefix = NULL;
+  g->plen = 0;
+  g->dfa = NULL;
   g->nsub = 0;
   g->ncategories = 1; // Category 0 is "everything else"
   g->categories = &g->catspace[-(CHAR_MIN)];
@@ -226,7 +231,12 @@ int regcomp(regex_t *preg, const char *pattern, int cflags) {
   categorize(p, g);
   stripsnug(p, g);
   findmust(p, g);
+  findprefix(p, g);
   g->nplus = pluscount(p, g);
+  if (!g->backrefs && p->error == 0) {
+    g->dfa = (struct re_dfa *) malloc(sizeof(struct re_dfa));
+    if (g->dfa != NULL) memset(g->dfa, 0, sizeof(struct re_dfa));
+  }
   g->magic = MAGIC2;
   preg->re_nsub = g->nsub;
   preg->re_g = g;
@@ -1434,6 +1444,64 @@ static void findmust(struct parse *p, struct re_guts *g) {
   }
   assert(cp == g->must + g->mlen);
   *cp++ = '\0';   // just on general principles
+
+  makeskip(g->mskip, g->must, g->mlen);
+}
+
+//
+// findprefix - find the literal string that every match must start with
+//
+static void findprefix(struct parse *p, struct re_guts *g) {
+  sop *scan;
+  sop s;
+  int len;
+  char *cp;
+
+  // Avoid making error situations worse
+  if (p->error != 0) return;
+
+  // Count the OCHARs at the start of the strip, skipping parentheses
+  len = 0;
+  for (scan = g->strip + 1; ; scan++) {
+    s = *scan;
+    if (OP(s) == OCHAR) {
+      len++;
+    } else if (OP(s) != OLPAREN && OP(s) != ORPAREN) {
+      break;
+    }
+  }
+  if (len == 0) return;
+
+  g->prefix = malloc((size_t) len + 1);
+  if (g->prefix == NULL) return;
+  g->plen = len;
+
+  cp = g->prefix;
+  for (scan = g->strip + 1; cp < g->prefix + len; scan++) {
+    if (OP(*scan) == OCHAR) *cp++ = (char) OPND(*scan);
+  }
+  *cp = '\0';
+
+  makeskip(g->pskip, g->prefix, g->plen);
+
+  // The prefix search makes a separate search for the same must string redundant
+  if (g->must != NULL && g->mlen == g->plen && memcmp(g->must, g->prefix, g->plen) == 0) {
+    free(g->must);
+    g->must = NULL;
+    g->mlen = 0;
+  }
+}
+
+//
+// makeskip - build Boyer-Moore-Horspool skip table for string
+//
+static void makeskip(uch *skip, char *str, int len) {
+  int i;
+
+  for (i = 0; i < NC; i++) skip[i] = len < 255 ? len : 255;
+  for (i = 0; i < len - 1; i++) {
+    if (len - 1 - i < 255) skip[(uch) str[i]] = len - 1 - i;
+  }
 }
 
 //
@@ -113,6 +113,35 @@ typedef struct {
 
 // Stuff for character categories
 typedef unsigned char cat_t;
+#define NC (CHAR_MAX - CHAR_MIN + 1)
+
+//
+// Lazily built DFA for the first matching pass. Each DFA state is a set
+// of strip states together with the context of the previous character,
+// which decides the ^, $ and word boundary transitions. Transitions are
+// computed on first use and cached in the state.
+//
+
+#define DFA_CONTEXTS  5
+#define DFA_HASHSIZE  256
+#define DFA_MAXMEM    (1024 * 1024)
+
+struct re_dfastate {
+  struct re_dfastate *next[NC];   // transition on each character
+  struct re_dfastate *hash_next;  // next state in hash bucket
+  int ctx;                        // context of previous character
+  int fresh;                      // no match is underway in this state
+  int final[2];                   // match at end of string, -1 if unknown
+  char set[1];                    // actually [nstates]
+};
+
+struct re_dfa {
+  int lock;                                   // held while extending the DFA
+  int memused;                                // memory used by states
+  struct re_dfastate *start[DFA_CONTEXTS];    // fresh state for each context
+  struct re_dfastate *hashtable[DFA_HASHSIZE];
+  char *sets;                                 // fresh and scratch state sets
+};
 
 //
 // Main compiled-expression structure
@@ -140,6 +169,11 @@ struct re_guts {
   cat_t *categories;     // ->catspace[-CHAR_MIN]
   char *must;            // match must contain this string
   int mlen;              // length of must
+  char *prefix;          // match must start with this string
+  int plen;              // length of prefix
+  uch mskip[NC];         // Boyer-Moore-Horspool skip table for must
+  uch pskip[NC];         // Boyer-Moore-Horspool skip table for prefix
+  struct re_dfa *dfa;    // DFA cache, NULL if back references are used
   size_t nsub;           // copy of re_nsub
   int backrefs;          // does it use back references?
   sopno nplus;           // how deep does it nest +s?
@@ -156,7 +190,6 @@ struct re_guts {
 
 #define DUPMAX  255
 #define INFINITY  (DUPMAX + 1)
-#define NC (CHAR_MAX - CHAR_MIN + 1)
 
 // Switch off assertions (if not already off) if no REDEBUG
 #ifndef REDEBUG
@@ -40,6 +40,7 @@
 #include <limits.h>
 #include <ctype.h>
 #include <regex.h>
+#include <atomic.h>
 
 #include "regex2.h"
 
@@ -49,6 +50,41 @@
 
 static int nope = 0;    // for use in asserts; shuts lint up
 
+static int dfafast(struct re_guts *g, char *start, char *stop, char *beginp, int eflags, char **endp, char **coldp);
+
+//
+// findstr - find string in text
+//
+// Short strings are found by scanning for the first character, since the
+// Boyer-Moore-Horspool skips are too short to pay for the table lookups.
+//
+static char *findstr(char *start, char *stop, char *str, int len, uch *skip) {
+  char *p;
+  char last;
+
+  if (stop - start < len) return NULL;
+  if (len < 8) {
+    p = start;
+    stop -= len - 1;
+    while (p < stop) {
+      p = (char *) memchr(p, *str, stop - p);
+      if (p == NULL) return NULL;
+      if (memcmp(p + 1, str + 1, len - 1) == 0) return p;
+      p++;
+    }
+    return NULL;
+  }
+
+  last = str[len - 1];
+  p = start + len - 1;
+  while (p < stop) {
+    if (*p == last && memcmp(p - len + 1, str, len - 1) == 0) return p - len + 1;
+    p += skip[(uch) *p];
+  }
+
+  return NULL;
+}
+
 // Macros for manipulating states, small version
 #define states  unsigned
 #define states1 unsigned  // for later use in regexec() decision
@@ -125,6 +161,254 @@ static int nope = 0;    // for use in asserts; shuts lint up
 
 #include "engine.c"
 
+//
+// Lazy DFA for the first matching pass
+//
+// dfafast() does the same job as fast(), but the state sets and the
+// transitions between them are cached in the compiled expression, so each
+// character costs a table lookup once the DFA has been built for the input
+// seen so far. The DFA is extended under a lock by one thread at a time;
+// states are never changed or freed once they have been published, so
+// lookups need no locking. If the DFA cannot be extended, either because
+// another thread is extending it or because it has reached its memory
+// limit, dfafast() returns -1 and the caller falls back to fast().
+//
+
+#define CTX_OUT     0   // beginning of string
+#define CTX_NOTBOL  1   // beginning of string with REG_NOTBOL
+#define CTX_NEWLINE 2   // newline with REG_NEWLINE
+#define CTX_WORD    3   // word character
+#define CTX_OTHER   4   // other character
+
+#define DFA_MATCH ((struct re_dfastate *) 1)
+
+static int dfactx(struct re_guts *g, int c) {
+  if (c == '\n' && (g->cflags & REG_NEWLINE)) return CTX_NEWLINE;
+  if (ISWORD(c)) return CTX_WORD;
+  return CTX_OTHER;
+}
+
+static void dfazerowidth(struct re_guts *g, char *st, int flagch) {
+  char *tmp = g->dfa->sets + 2 * g->nstates;
+
+  // The small matcher passes state sets by value, so each step over a
+  // zero-width op only advances from the set before the step. The large
+  // matcher steps in place. Follow the matcher regexec() uses for g.
+  if (g->nstates <= CHAR_BIT * sizeof(states1)) {
+    memcpy(tmp, st, g->nstates);
+    lstep(g, g->firststate + 1, g->laststate, tmp, flagch, st);
+  } else {
+    lstep(g, g->firststate + 1, g->laststate, st, flagch, st);
+  }
+}
+
+static void dfaboundary(struct re_guts *g, char *st, int ctx, int c, int eflags) {
+  int flagch;
+  int i;
+
+  // Same as the BOL, EOL, and word boundary handling in fast()
+  flagch = '\0';
+  i = 0;
+  if (ctx == CTX_NEWLINE || ctx == CTX_OUT) {
+    flagch = BOL;
+    i = g->nbol;
+  }
+  if ((c == '\n' && (g->cflags & REG_NEWLINE)) || (c == OUT && !(eflags & REG_NOTEOL))) {
+    flagch = (flagch == BOL) ? BOLEOL : EOL;
+    i += g->neol;
+  }
+  for (; i > 0; i--) dfazerowidth(g, st, flagch);
+
+  if ((flagch == BOL || ctx == CTX_NEWLINE || ctx == CTX_OTHER) && (c != OUT && ISWORD(c))) {
+    flagch = BOW;
+  }
+  if (ctx == CTX_WORD && (flagch == EOL || (c != OUT && !ISWORD(c)))) {
+    flagch = EOW;
+  }
+  if (flagch == BOW || flagch == EOW) dfazerowidth(g, st, flagch);
+}
+
+static int dfalock(struct re_guts *g) {
+  struct re_dfa *dfa = g->dfa;
+  sopno n = g->nstates;
+
+  if (atomic_exchange(&dfa->lock, 1) != 0) return 0;
+
+  // Compute the fresh state set and allocate scratch sets on first use
+  if (dfa->sets == NULL) {
+    dfa->sets = (char *) malloc(3 * n);
+    if (dfa->sets == NULL) {
+      dfa->lock = 0;
+      return 0;
+    }
+    memset(dfa->sets, 0, n);
+    dfa->sets[g->firststate + 1] = 1;
+    lstep(g, g->firststate + 1, g->laststate, dfa->sets, NOTHING, dfa->sets);
+  }
+
+  return 1;
+}
+
+static void dfaunlock(struct re_guts *g) {
+  g->dfa->lock = 0;
+}
+
+static struct re_dfastate *dfastate(struct re_guts *g, char *set, int ctx) {
+  struct re_dfa *dfa = g->dfa;
+  struct re_dfastate *s;
+  unsigned int h;
+  int size;
+  sopno i;
+
+  // Find existing state with the same state set and context
+  h = ctx;
+  for (i = 0; i < g->nstates; i++) h = h * 31 + set[i];
+  h %= DFA_HASHSIZE;
+  for (s = dfa->hashtable[h]; s != NULL; s = s->hash_next) {
+    if (s->ctx == ctx && memcmp(s->set, set, g->nstates) == 0) return s;
+  }
+
+  // Add new state
+  size = sizeof(struct re_dfastate) + g->nstates;
+  if (dfa->memused + size > DFA_MAXMEM) return NULL;
+  s = (struct re_dfastate *) malloc(size);
+  if (s == NULL) return NULL;
+  memset(s->next, 0, sizeof(s->next));
+  memcpy(s->set, set, g->nstates);
+  s->ctx = ctx;
+  s->fresh = memcmp(set, dfa->sets, g->nstates) == 0;
+  s->final[0] = s->final[1] = -1;
+  s->hash_next = dfa->hashtable[h];
+  dfa->hashtable[h] = s;
+  dfa->memused += size;
+
+  return s;
+}
+
+static struct re_dfastate *dfastart(struct re_guts *g, int ctx) {
+  struct re_dfa *dfa = g->dfa;
+  struct re_dfastate *s;
+
+  s = dfa->start[ctx];
+  if (s != NULL) return s;
+
+  if (!dfalock(g)) return NULL;
+  s = dfa->start[ctx];
+  if (s == NULL) {
+    s = dfastate(g, dfa->sets, ctx);
+    dfa->start[ctx] = s;
+  }
+  dfaunlock(g);
+
+  return s;
+}
+
+static struct re_dfastate *dfastep(struct re_guts *g, struct re_dfastate *s, int c) {
+  struct re_dfa *dfa = g->dfa;
+  sopno n = g->nstates;
+  struct re_dfastate *t;
+  char *st;
+  char *tmp;
+
+  if (!dfalock(g)) return NULL;
+
+  t = s->next[(uch) c];
+  if (t == NULL) {
+    st = dfa->sets + n;
+    tmp = dfa->sets + 2 * n;
+    memcpy(st, s->set, n);
+    dfaboundary(g, st, s->ctx, c, 0);
+    if (st[g->laststate]) {
+      // A match ends before this character
+      t = DFA_MATCH;
+    } else {
+      memcpy(tmp, st, n);
+      memcpy(st, dfa->sets, n);
+      lstep(g, g->firststate + 1, g->laststate, tmp, c, st);
+      t = dfastate(g, st, dfactx(g, c));
+    }
+    if (t != NULL) s->next[(uch) c] = t;
+  }
+
+  dfaunlock(g);
+  return t;
+}
+
+static int dfafinal(struct re_guts *g, struct re_dfastate *s, int eflags) {
+  int noteol = (eflags & REG_NOTEOL) != 0;
+  int final;
+  char *st;
+
+  final = s->final[noteol];
+  if (final >= 0) return final;
+
+  if (!dfalock(g)) return -1;
+  st = g->dfa->sets + g->nstates;
+  memcpy(st, s->set, g->nstates);
+  dfaboundary(g, st, s->ctx, OUT, eflags);
+  final = st[g->laststate] != 0;
+  s->final[noteol] = final;
+  dfaunlock(g);
+
+  return final;
+}
+
+static int dfafast(struct re_guts *g, char *start, char *stop, char *beginp, int eflags, char **endp, char **coldp) {
+  struct re_dfastate *s;
+  struct re_dfastate *t;
+  char *p = start;
+  char *cold = NULL;
+  char *q;
+  int final;
+
+  if (start == beginp) {
+    s = dfastart(g, (eflags & REG_NOTBOL) ? CTX_NOTBOL : CTX_OUT);
+  } else {
+    s = dfastart(g, dfactx(g, *(start - 1)));
+  }
+  if (s == NULL) return -1;
+
+  while (p < stop) {
+    if (s->fresh) {
+      // No match is underway, so skip ahead to where the literal prefix occurs
+      if (g->plen > 0) {
+        q = findstr(p, stop, g->prefix, g->plen, g->pskip);
+        if (q == NULL) return 0;
+        if (q != p) {
+          p = q;
+          s = dfastart(g, dfactx(g, *(p - 1)));
+          if (s == NULL) return -1;
+        }
+      }
+      cold = p;
+    }
+
+    t = s->next[(uch) *p];
+    if (t == NULL) {
+      t = dfastep(g, s, *p);
+      if (t == NULL) return -1;
+    }
+    if (t == DFA_MATCH) {
+      *endp = p + 1;
+      *coldp = cold;
+      return 1;
+    }
+
+    s = t;
+    p++;
+  }
+
+  // Check for match at end of string
+  if (s->fresh) cold = p;
+  final = dfafinal(g, s, eflags);
+  if (final < 0) return -1;
+  if (!final) return 0;
+
+  *endp = p + 1;
+  *coldp = cold;
+  return 1;
+}
+
 #ifdef REDEBUG
 #define GOODFLAGS(f) (f)
 #else
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <regex.h>
 
 #include "regex2.h"
@@ -39,6 +40,9 @@
 //
 void regfree(regex_t *preg) {
   struct re_guts *g;
+  struct re_dfastate *s;
+  struct re_dfastate *next;
+  int i;
 
   if (preg->re_magic != MAGIC1) return; // oops
   g = preg->re_g;
@@ -51,5 +55,16 @@ void regfree(regex_t *preg) {
   if (g->sets != NULL) free(g->sets);
   if (g->setbits != NULL) free(g->setbits);
   if (g->must != NULL) free(g->must);
+  if (g->prefix != NULL) free(g->prefix);
+  if (g->dfa != NULL) {
+    for (i = 0; i < DFA_HASHSIZE; i++) {
+      for (s = g->dfa->hashtable[i]; s != NULL; s = next) {
+        next = s->hash_next;
+        free(s);
+      }
+    }
+    if (g->dfa->sets != NULL) free(g->dfa->sets);
+    free(g->dfa);
+  }
   free(g);
 }
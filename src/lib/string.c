@@ -38,6 +38,18 @@
 #include <ctype.h>
 #endif
 
+//
+// Word-at-a-time helpers. HASZERO(x) is non-zero if any byte in the 32-bit
+// word x is zero. Word scans are always aligned to a word boundary, so
+// they never read past the page holding the terminating byte.
+//
+
+#define LOMAGIC 0x01010101UL
+#define HIMAGIC 0x80808080UL
+
+#define HASZERO(x) (((x) - LOMAGIC) & ~(x) & HIMAGIC)
+#define WORDALIGNED(p) ((((unsigned long) (p)) & (sizeof(unsigned long) - 1)) == 0)
+
 char *strncpy(char *dest, const char *source, size_t n) {
   char *start = dest;
 
@@ -110,6 +122,22 @@ char *strcasestr(const char *str1, const char *str2) {
 #endif
 
 char *strchr(const char *s, int ch) {
+  const unsigned long *w;
+  unsigned long pattern = (unsigned char) ch * LOMAGIC;
+
+  // Scan bytes until the pointer is word aligned
+  while (!WORDALIGNED(s)) {
+    if (*s == (char) ch) return (char *) s;
+    if (!*s) return NULL;
+    s++;
+  }
+
+  // Skip words that contain neither the terminator nor the character
+  w = (const unsigned long *) s;
+  while (!HASZERO(*w) && !HASZERO(*w ^ pattern)) w++;
+
+  // Locate the byte within the word
+  s = (const char *) w;
   while (*s && *s != (char) ch) s++;
   if (*s == (char) ch) return (char *) s;
   return NULL;
@@ -443,67 +471,255 @@ char *stpcpy(char *dst, const char *src) {
 #pragma function(strcmp)
 #pragma function(strset)
 
-void *memset(void *p, int c, size_t n) {
-  char *pb = (char *) p;
-  char *pbend = pb + n;
-  while (pb != pbend) *pb++ = c;
-  return p;
+//
+// Blocks shorter than SHORT_BLOCK bytes are moved with plain byte string
+// instructions since the setup cost of aligning the destination dominates.
+// On processors with enhanced rep movsb/stosb (ERMS), blocks of at least
+// ERMS_BLOCK bytes are moved with a single rep movsb/stosb, which the
+// microcode performs in cache line sized chunks regardless of alignment.
+// Everything else aligns the destination to a dword boundary and moves
+// the bulk with rep movsd/stosd.
+//
+// SSE is deliberately not used. The kernel neither enables CR4.OSFXSR
+// nor saves the XMM registers on context switch, and these routines run
+// in both kernel and user mode.
+//
+
+#define SHORT_BLOCK 16
+#define ERMS_BLOCK  256
+
+#define STRING_DISPATCH_UNKNOWN  -1
+#define STRING_DISPATCH_DWORD     0
+#define STRING_DISPATCH_ERMS      1
+
+#define CPUID_LEAF7_EBX_ERMS  (1 << 9)
+
+#ifdef __i386__
+
+static int string_dispatch = STRING_DISPATCH_UNKNOWN;
+
+static int get_string_dispatch() {
+  unsigned long f1, f2;
+  unsigned long level, features;
+
+  // Check for CPUID support by toggling the ID flag in eflags
+  __asm {
+    pushfd
+    pop     eax
+    mov     f1, eax
+    xor     eax, 0x00200000
+    push    eax
+    popfd
+    pushfd
+    pop     eax
+    mov     f2, eax
+    push    f1
+    popfd
+  }
+  if (((f1 ^ f2) & 0x00200000) == 0) return STRING_DISPATCH_DWORD;
+
+  // Get highest standard CPUID leaf
+  __asm {
+    push    ebx
+    xor     eax, eax
+    cpuid
+    mov     level, eax
+    pop     ebx
+  }
+  if (level < 7) return STRING_DISPATCH_DWORD;
+
+  // Get structured extended feature flags
+  __asm {
+    push    ebx
+    mov     eax, 7
+    xor     ecx, ecx
+    cpuid
+    mov     features, ebx
+    pop     ebx
+  }
+
+  return (features & CPUID_LEAF7_EBX_ERMS) ? STRING_DISPATCH_ERMS : STRING_DISPATCH_DWORD;
 }
 
-int memcmp(const void *dst, const void *src, size_t n) {
-  if (!n) return 0;
+void *memset(void *p, int c, size_t n) {
+  unsigned long pattern = (unsigned char) c * LOMAGIC;
+
+  if (string_dispatch == STRING_DISPATCH_UNKNOWN) string_dispatch = get_string_dispatch();
+
+  if (n >= ERMS_BLOCK && string_dispatch == STRING_DISPATCH_ERMS) {
+    __asm {
+      push    edi
+      mov     edi, p
+      mov     ecx, n
+      mov     eax, pattern
+      rep     stosb
+      pop     edi
+    }
+    return p;
+  }
 
-  while (--n && *(char *) dst == *(char *) src) {
-    dst = (char *) dst + 1;
-    src = (char *) src + 1;
+  __asm {
+    push    edi
+    mov     edi, p
+    mov     ecx, n
+    mov     eax, pattern
+    cmp     ecx, SHORT_BLOCK
+    jb      fill_tail
+
+    // Fill up to the first dword boundary
+    mov     edx, edi
+    neg     edx
+    and     edx, 3
+    sub     ecx, edx
+    xchg    ecx, edx
+    rep     stosb
+
+    // Fill whole dwords
+    mov     ecx, edx
+    shr     ecx, 2
+    rep     stosd
+
+    // Fill remaining bytes
+    mov     ecx, edx
+    and     ecx, 3
+
+fill_tail:
+    rep     stosb
+    pop     edi
   }
 
-  return *((unsigned char *) dst) - *((unsigned char *) src);
+  return p;
 }
 
-#ifdef __i386__
 void *memcpy(void *dst, const void *src, size_t n) {
+  if (string_dispatch == STRING_DISPATCH_UNKNOWN) string_dispatch = get_string_dispatch();
+
+  if (n >= ERMS_BLOCK && string_dispatch == STRING_DISPATCH_ERMS) {
+    __asm {
+      push    esi
+      push    edi
+      mov     esi, src
+      mov     edi, dst
+      mov     ecx, n
+      rep     movsb
+      pop     edi
+      pop     esi
+    }
+    return dst;
+  }
+
   __asm {
-    push  esi
-    push  edi
-    mov    esi,src
-    mov    edi,dst
-    mov    ecx,n
-    
-    mov    eax,esi
-    or     eax,edi
-    or     eax,n
-    and    eax, 3
-    jz     fast_copy
-
-    rep    movsb
-    jmp    copy_done
-
-fast_copy:
-    shr    ecx,2
-    rep    movsd
-    
-copy_done:
-    mov    eax,dst
-    pop    edi
-    pop    esi
+    push    esi
+    push    edi
+    mov     esi, src
+    mov     edi, dst
+    mov     ecx, n
+    cmp     ecx, SHORT_BLOCK
+    jb      copy_tail
+
+    // Copy up to the first dword boundary in the destination
+    mov     edx, edi
+    neg     edx
+    and     edx, 3
+    sub     ecx, edx
+    xchg    ecx, edx
+    rep     movsb
+
+    // Copy whole dwords
+    mov     ecx, edx
+    shr     ecx, 2
+    rep     movsd
+
+    // Copy remaining bytes
+    mov     ecx, edx
+    and     ecx, 3
+
+copy_tail:
+    rep     movsb
+    pop     edi
+    pop     esi
   }
+
+  return dst;
 }
+
 #else
+
+void *memset(void *p, int c, size_t n) {
+  unsigned char *pb = (unsigned char *) p;
+  unsigned long pattern = (unsigned char) c * LOMAGIC;
+
+  if (n >= SHORT_BLOCK) {
+    while (!WORDALIGNED(pb)) {
+      *pb++ = (unsigned char) c;
+      n--;
+    }
+    while (n >= sizeof(unsigned long)) {
+      *(unsigned long *) pb = pattern;
+      pb += sizeof(unsigned long);
+      n -= sizeof(unsigned long);
+    }
+  }
+
+  while (n--) *pb++ = (unsigned char) c;
+  return p;
+}
+
 void *memcpy(void *dst, const void *src, size_t n) {
-  char *s = (char *) src;
-  char *end = s + n;
-  char *d = (char *) dst;
-  if ((((unsigned int) s) | ((unsigned int) d) | n) && sizeof(unsigned int) - 1) {
-    while (s != end) *d++ = *s++;
-  } else {
-    while (s != end) *((unsigned int *) d)++ = *((unsigned int *) s)++;
+  const unsigned char *s = (const unsigned char *) src;
+  unsigned char *d = (unsigned char *) dst;
+
+  if (n >= SHORT_BLOCK) {
+    while (!WORDALIGNED(d)) {
+      *d++ = *s++;
+      n--;
+    }
+    while (n >= sizeof(unsigned long)) {
+      *(unsigned long *) d = *(const unsigned long *) s;
+      d += sizeof(unsigned long);
+      s += sizeof(unsigned long);
+      n -= sizeof(unsigned long);
+    }
   }
 
+  while (n--) *d++ = *s++;
   return dst;
 }
+
 #endif
 
+int memcmp(const void *dst, const void *src, size_t n) {
+  const unsigned char *p1 = (const unsigned char *) dst;
+  const unsigned char *p2 = (const unsigned char *) src;
+
+  if (!n) return 0;
+
+  // Skip equal words. The first buffer is word aligned so only loads from
+  // the second can be misaligned, which x86 handles in hardware.
+  if (n >= SHORT_BLOCK) {
+    while (!WORDALIGNED(p1) && *p1 == *p2) {
+      p1++;
+      p2++;
+      n--;
+    }
+    if (WORDALIGNED(p1)) {
+      while (n > sizeof(unsigned long) && *(const unsigned long *) p1 == *(const unsigned long *) p2) {
+        p1 += sizeof(unsigned long);
+        p2 += sizeof(unsigned long);
+        n -= sizeof(unsigned long);
+      }
+    }
+  }
+
+  // Locate the first differing byte
+  while (--n && *p1 == *p2) {
+    p1++;
+    p2++;
+  }
+
+  return *p1 - *p2;
+}
+
 void *memccpy(void *dst, const void *src, int c, size_t n) {
   while (n && (*((char *) (dst = (char *) dst + 1) - 1) =
          *((char *)(src = (char *) src + 1) - 1)) != (char) c) {
@@ -537,8 +753,22 @@ char *strcpy(char *dst, const char *src) {
 
 size_t strlen(const char *s) {
   const char *eos = s;
-  while (*eos++);
-  return (int) (eos - s - 1);
+  const unsigned long *w;
+
+  // Scan bytes until the pointer is word aligned
+  while (!WORDALIGNED(eos)) {
+    if (!*eos) return eos - s;
+    eos++;
+  }
+
+  // Skip words without a zero byte
+  w = (const unsigned long *) eos;
+  while (!HASZERO(*w)) w++;
+
+  // Locate the terminator within the word
+  eos = (const char *) w;
+  while (*eos) eos++;
+  return eos - s;
 }
 
 int strcmp(const char *s1, const char *s2) {
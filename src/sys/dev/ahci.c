@@ -0,0 +1,751 @@
+//
+// ahci.c
+//
+// AHCI SATA disk driver with native command queuing
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os/krnl.h>
+
+#define AHCI_MAX_PORTS     32
+#define AHCI_MAX_CMDS      32
+#define AHCI_MAX_PRDS      56
+#define AHCI_MAX_XFER      ((AHCI_MAX_PRDS - 1) * PAGESIZE)
+
+#define AHCI_TIMEOUT       500
+
+//
+// HBA registers
+//
+
+#define HBA_CAP            0x00    // Host capabilities
+#define HBA_GHC            0x04    // Global host control
+#define HBA_IS             0x08    // Interrupt status
+#define HBA_PI             0x0C    // Ports implemented
+#define HBA_VS             0x10    // Version
+
+#define HBA_CAP_NP_MASK    0x1F          // Number of ports
+#define HBA_CAP_NCS_SHIFT  8             // Number of command slots
+#define HBA_CAP_NCS_MASK   0x1F
+#define HBA_CAP_SSS        (1 << 27)     // Supports staggered spin-up
+#define HBA_CAP_SNCQ       (1 << 30)     // Supports native command queuing
+
+#define HBA_GHC_HR         (1 << 0)      // HBA reset
+#define HBA_GHC_IE         (1 << 1)      // Interrupt enable
+#define HBA_GHC_AE         (1 << 31)     // AHCI enable
+
+//
+// Port registers
+//
+
+#define PORT_CLB           0x00    // Command list base address
+#define PORT_CLBU          0x04    // Command list base address upper 32 bits
+#define PORT_FB            0x08    // FIS base address
+#define PORT_FBU           0x0C    // FIS base address upper 32 bits
+#define PORT_IS            0x10    // Interrupt status
+#define PORT_IE            0x14    // Interrupt enable
+#define PORT_CMD           0x18    // Command and status
+#define PORT_TFD           0x20    // Task file data
+#define PORT_SIG           0x24    // Signature
+#define PORT_SSTS          0x28    // SATA status
+#define PORT_SCTL          0x2C    // SATA control
+#define PORT_SERR          0x30    // SATA error
+#define PORT_SACT          0x34    // SATA active (NCQ tags outstanding)
+#define PORT_CI            0x38    // Command issue
+
+#define PORT_CMD_ST        (1 << 0)      // Start
+#define PORT_CMD_SUD       (1 << 1)      // Spin-up device
+#define PORT_CMD_POD       (1 << 2)      // Power on device
+#define PORT_CMD_FRE       (1 << 4)      // FIS receive enable
+#define PORT_CMD_FR        (1 << 14)     // FIS receive running
+#define PORT_CMD_CR        (1 << 15)     // Command list running
+
+#define PORT_IS_DHRS       (1 << 0)      // Device to host register FIS
+#define PORT_IS_PSS        (1 << 1)      // PIO setup FIS
+#define PORT_IS_DSS        (1 << 2)      // DMA setup FIS
+#define PORT_IS_SDBS       (1 << 3)      // Set device bits FIS
+#define PORT_IS_IFS        (1 << 27)     // Interface fatal error
+#define PORT_IS_HBDS       (1 << 28)     // Host bus data error
+#define PORT_IS_HBFS       (1 << 29)     // Host bus fatal error
+#define PORT_IS_TFES       (1 << 30)     // Task file error
+
+#define PORT_IS_ERROR      (PORT_IS_IFS | PORT_IS_HBDS | PORT_IS_HBFS | PORT_IS_TFES)
+#define PORT_IE_MASK       (PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_DSS | PORT_IS_SDBS | PORT_IS_ERROR)
+
+#define PORT_TFD_ERR       0x01
+#define PORT_TFD_DRQ       0x08
+#define PORT_TFD_BSY       0x80
+
+#define PORT_SSTS_DET_MASK 0x0F
+#define PORT_SSTS_DET_OK   0x03          // Device present and link established
+
+#define SATA_SIG_ATA       0x00000101
+
+//
+// ATA commands
+//
+
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_IDENTIFY        0xEC
+
+#define FIS_TYPE_REG_H2D        0x27
+#define FIS_H2D_CMD             0x80
+
+//
+// Command list, command table and physical region descriptor layout
+//
+
+#define CMDHDR_CFL(n)      (n)           // Command FIS length in dwords
+#define CMDHDR_WRITE       (1 << 6)      // Write to device
+
+struct ahci_cmdhdr {
+  unsigned short flags;                  // Command flags and FIS length
+  unsigned short prdtl;                  // Number of PRD entries
+  unsigned long prdbc;                   // Bytes transferred
+  unsigned long ctba;                    // Command table base address
+  unsigned long ctbau;                   // Command table base address upper 32 bits
+  unsigned long reserved[4];
+};
+
+struct ahci_prd {
+  unsigned long dba;                     // Data base address
+  unsigned long dbau;                    // Data base address upper 32 bits
+  unsigned long reserved;
+  unsigned long dbc;                     // Byte count - 1
+};
+
+struct ahci_cmdtab {
+  unsigned char cfis[64];                // Command FIS
+  unsigned char acmd[16];                // ATAPI command
+  unsigned char reserved[48];
+  struct ahci_prd prdt[AHCI_MAX_PRDS];   // Scatter/gather list
+};
+
+//
+// Driver data
+//
+
+struct ahci_request {
+  struct thread *thread;                 // Thread waiting for completion
+  int result;                            // Completion status
+};
+
+struct ahci_port {
+  struct ahci *hba;                      // Host bus adapter
+  int portno;                            // Port number on HBA
+  char *regs;                            // Port registers
+
+  struct ahci_cmdhdr *cmdlist;           // Command list (one header per slot)
+  unsigned char *rfis;                   // Received FIS area
+  struct ahci_cmdtab *cmdtab;            // Command tables (one per slot)
+
+  struct sem slots;                      // Free command slots
+  unsigned long free;                    // Bitmap of free command slots
+  unsigned long active;                  // Bitmap of issued command slots
+  unsigned long intrstat;                // Interrupt status collected by handler
+  unsigned long errstat;                 // Interrupt status for port error
+  struct ahci_request *reqs[AHCI_MAX_CMDS];
+  struct task recover_task;              // Task for resetting port after error
+  int recovering;                        // Port reset pending
+  struct event recovered;                // Signaled when port is not being reset
+
+  int ncq;                               // Native command queuing enabled
+  int depth;                             // Queue depth
+  unsigned int capacity;                 // Disk size in sectors
+  char model[41];                        // Model name from identify
+  dev_t devno;                           // Disk device
+  struct partition parts[HD_PARTITIONS]; // Partition info
+
+  unsigned long reads;                   // Number of read commands
+  unsigned long writes;                  // Number of write commands
+  unsigned long errors;                  // Number of failed commands
+  int queued;                            // Commands currently queued
+  int maxqueued;                         // Maximum number of commands queued
+};
+
+struct ahci {
+  struct ahci *next;                     // Next HBA
+  struct unit *unit;                     // PCI unit for HBA
+  char *mmio;                            // Memory mapped HBA registers (ABAR)
+  int irq;                               // Interrupt request line
+  unsigned long cap;                     // HBA capabilities
+  int ncmds;                             // Command slots per port
+  struct ahci_port *ports[AHCI_MAX_PORTS];
+  struct interrupt intr;
+  struct dpc dpc;
+};
+
+static struct ahci *ahci_list;
+
+#define HBA_REG(hba, reg) (*(volatile unsigned long *) ((hba)->mmio + (reg)))
+#define PORT_REG(port, reg) (*(volatile unsigned long *) ((port)->regs + (reg)))
+
+static int ahci_wait(struct ahci_port *port, int reg, unsigned long mask, unsigned long value, int timeout) {
+  while ((PORT_REG(port, reg) & mask) != value) {
+    if (timeout-- <= 0) return -ETIMEOUT;
+    udelay(1000);
+  }
+  return 0;
+}
+
+static int ahci_stop_port(struct ahci_port *port) {
+  // Stop command processing and FIS reception
+  PORT_REG(port, PORT_CMD) &= ~PORT_CMD_ST;
+  if (ahci_wait(port, PORT_CMD, PORT_CMD_CR, 0, AHCI_TIMEOUT) < 0) return -ETIMEOUT;
+  PORT_REG(port, PORT_CMD) &= ~PORT_CMD_FRE;
+  if (ahci_wait(port, PORT_CMD, PORT_CMD_FR, 0, AHCI_TIMEOUT) < 0) return -ETIMEOUT;
+  return 0;
+}
+
+static int ahci_start_port(struct ahci_port *port) {
+  // Clear errors and pending interrupts
+  PORT_REG(port, PORT_SERR) = 0xFFFFFFFF;
+  PORT_REG(port, PORT_IS) = 0xFFFFFFFF;
+
+  // Enable FIS reception and wait for the device to become ready
+  PORT_REG(port, PORT_CMD) |= PORT_CMD_FRE;
+  if (ahci_wait(port, PORT_TFD, PORT_TFD_BSY | PORT_TFD_DRQ, 0, AHCI_TIMEOUT) < 0) return -ETIMEOUT;
+
+  // Start command list processing
+  PORT_REG(port, PORT_CMD) |= PORT_CMD_ST;
+  return 0;
+}
+
+static int ahci_setup_prdt(struct ahci_cmdtab *tab, char *buffer, int count) {
+  unsigned long addr;
+  char *next;
+  int len;
+  int i;
+
+  i = -1;
+  next = (char *) ((unsigned long) buffer & ~(PAGESIZE - 1)) + PAGESIZE;
+  while (count > 0) {
+    len = next - buffer;
+    if (len > count) len = count;
+    addr = virt2phys(buffer);
+
+    // Merge with previous entry if physically contiguous
+    if (i >= 0 && tab->prdt[i].dba + tab->prdt[i].dbc + 1 == addr) {
+      tab->prdt[i].dbc += len;
+    } else {
+      if (++i == AHCI_MAX_PRDS) panic("ahci: transfer too large");
+      tab->prdt[i].dba = addr;
+      tab->prdt[i].dbau = 0;
+      tab->prdt[i].reserved = 0;
+      tab->prdt[i].dbc = len - 1;
+    }
+
+    count -= len;
+    buffer = next;
+    next += PAGESIZE;
+  }
+
+  return i + 1;
+}
+
+static int ahci_command(struct ahci_port *port, int cmd, void *buffer, int count, blkno_t blkno, int write) {
+  struct ahci_request req;
+  struct ahci_cmdhdr *hdr;
+  struct ahci_cmdtab *tab;
+  unsigned char *fis;
+  int nsects = count / SECTORSIZE;
+  int tag;
+  int rc;
+
+  // Allocate command slot, waiting if all slots are in use
+  rc = wait_for_object(&port->slots, INFINITE);
+  if (rc < 0) return rc;
+
+  // Do not issue commands while the port is being reset after an error
+  while (port->recovering) {
+    rc = wait_for_object(&port->recovered, INFINITE);
+    if (rc < 0) {
+      release_sem(&port->slots, 1);
+      return rc;
+    }
+  }
+  tag = find_lowest_bit(port->free);
+  port->free &= ~(1 << tag);
+
+  // Build command FIS
+  tab = &port->cmdtab[tag];
+  fis = tab->cfis;
+  memset(fis, 0, 20);
+  fis[0] = FIS_TYPE_REG_H2D;
+  fis[1] = FIS_H2D_CMD;
+  fis[2] = cmd;
+  if (cmd != ATA_CMD_IDENTIFY) {
+    fis[4] = (unsigned char) blkno;
+    fis[5] = (unsigned char) (blkno >> 8);
+    fis[6] = (unsigned char) (blkno >> 16);
+    fis[7] = 0x40;
+    fis[8] = (unsigned char) (blkno >> 24);
+  }
+  if (cmd == ATA_CMD_READ_FPDMA || cmd == ATA_CMD_WRITE_FPDMA) {
+    // Sector count goes in the feature register, the tag in the count register
+    fis[3] = (unsigned char) nsects;
+    fis[11] = (unsigned char) (nsects >> 8);
+    fis[12] = tag << 3;
+  } else {
+    fis[12] = (unsigned char) nsects;
+    fis[13] = (unsigned char) (nsects >> 8);
+  }
+
+  // Build command header and scatter/gather list
+  hdr = &port->cmdlist[tag];
+  hdr->flags = CMDHDR_CFL(5) | (write ? CMDHDR_WRITE : 0);
+  hdr->prdtl = ahci_setup_prdt(tab, buffer, count);
+  hdr->prdbc = 0;
+
+  // Issue command
+  req.thread = self();
+  req.result = 0;
+  port->reqs[tag] = &req;
+  port->active |= (1 << tag);
+  if (++port->queued > port->maxqueued) port->maxqueued = port->queued;
+  if (port->ncq && cmd != ATA_CMD_IDENTIFY) PORT_REG(port, PORT_SACT) = (1 << tag);
+  PORT_REG(port, PORT_CI) = (1 << tag);
+
+  // Wait for command to complete
+  enter_wait(THREAD_WAIT_DEVIO);
+
+  // Release command slot
+  port->queued--;
+  port->free |= (1 << tag);
+  release_sem(&port->slots, 1);
+
+  return req.result;
+}
+
+static int ahci_transfer(struct ahci_port *port, char *buffer, size_t count, blkno_t blkno, int write) {
+  int cmd;
+  int left;
+  int len;
+  int rc;
+
+  if (count % SECTORSIZE != 0) return -EINVAL;
+  if (blkno + count / SECTORSIZE > port->capacity) return -EFAULT;
+
+  if (port->ncq) {
+    cmd = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+  } else {
+    cmd = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+  }
+
+  left = count;
+  while (left > 0) {
+    len = left;
+    if (len > AHCI_MAX_XFER) len = AHCI_MAX_XFER;
+
+    rc = ahci_command(port, cmd, buffer, len, blkno, write);
+    if (rc < 0) return rc;
+    if (write) {
+      port->writes++;
+    } else {
+      port->reads++;
+    }
+
+    buffer += len;
+    blkno += len / SECTORSIZE;
+    left -= len;
+  }
+
+  return count;
+}
+
+static void ahci_complete(struct ahci_port *port, unsigned long done, int result) {
+  struct ahci_request *req;
+  int tag;
+
+  while (done) {
+    tag = find_lowest_bit(done);
+    done &= ~(1 << tag);
+
+    req = port->reqs[tag];
+    port->reqs[tag] = NULL;
+    port->active &= ~(1 << tag);
+    if (result < 0) port->errors++;
+    if (req) {
+      req->result = result;
+      mark_thread_ready(req->thread, 1, 2);
+    }
+  }
+}
+
+static void ahci_recover(void *arg) {
+  struct ahci_port *port = (struct ahci_port *) arg;
+  unsigned long tfd = PORT_REG(port, PORT_TFD);
+
+  kprintf(KERN_ERR "%s: ahci error, status 0x%08x, tfd 0x%04x, serr 0x%08x\n",
+          port->devno != NODEV ? device(port->devno)->name : "ahci",
+          port->errstat, tfd, PORT_REG(port, PORT_SERR));
+
+  // A failed queued command aborts all outstanding commands on the port,
+  // so complete everything that is still active with an error and restart
+  // the port. This runs as a task, because stopping and starting the port
+  // can wait for the device.
+  ahci_stop_port(port);
+  ahci_complete(port, port->active, -EIO);
+  ahci_start_port(port);
+
+  // Discard interrupt status from before the reset
+  cli();
+  port->intrstat = 0;
+  sti();
+  port->recovering = 0;
+  set_event(&port->recovered);
+}
+
+static void ahci_dpc(void *arg) {
+  struct ahci *hba = (struct ahci *) arg;
+  struct ahci_port *port;
+  unsigned long intrstat;
+  unsigned long pending;
+  int i;
+
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    port = hba->ports[i];
+    if (!port) continue;
+
+    // Fetch interrupt status collected by the interrupt handler
+    cli();
+    intrstat = port->intrstat;
+    port->intrstat = 0;
+    sti();
+    if (!intrstat && !port->active) continue;
+
+    if (port->recovering) {
+      // The recovery task fails all active commands when it resets the port
+      continue;
+    } else if (intrstat & PORT_IS_ERROR) {
+      // Reset the port from a task, since this cannot wait in a DPC
+      port->errstat = intrstat;
+      port->recovering = 1;
+      reset_event(&port->recovered);
+      queue_task(&sys_task_queue, &port->recover_task, ahci_recover, port);
+    } else {
+      // Commands still in progress are set in either SACT or CI
+      pending = PORT_REG(port, PORT_SACT) | PORT_REG(port, PORT_CI);
+      ahci_complete(port, port->active & ~pending, 0);
+    }
+  }
+}
+
+static int ahci_handler(struct context *ctxt, void *arg) {
+  struct ahci *hba = (struct ahci *) arg;
+  struct ahci_port *port;
+  unsigned long intrstat;
+  unsigned long portstat;
+  int i;
+
+  // Check if the interrupt is for this HBA
+  intrstat = HBA_REG(hba, HBA_IS);
+  if (!intrstat) return 0;
+
+  // Acknowledge port interrupts and save status for the DPC
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    if (!(intrstat & (1 << i))) continue;
+    port = hba->ports[i];
+    if (port) {
+      portstat = PORT_REG(port, PORT_IS);
+      PORT_REG(port, PORT_IS) = portstat;
+      port->intrstat |= portstat;
+    } else {
+      portstat = *(volatile unsigned long *) (hba->mmio + 0x100 + i * 0x80 + PORT_IS);
+      *(volatile unsigned long *) (hba->mmio + 0x100 + i * 0x80 + PORT_IS) = portstat;
+    }
+  }
+  HBA_REG(hba, HBA_IS) = intrstat;
+
+  queue_irq_dpc(&hba->dpc, ahci_dpc, hba);
+  eoi(hba->irq);
+  return 1;
+}
+
+static int ahci_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
+  struct ahci_port *port = (struct ahci_port *) dev->privdata;
+
+  switch (cmd) {
+    case IOCTL_GETDEVSIZE:
+      return port->capacity;
+
+    case IOCTL_GETBLKSIZE:
+      return SECTORSIZE;
+
+    case IOCTL_REVALIDATE:
+      return create_partitions(port->devno, port->parts);
+  }
+
+  return -ENOSYS;
+}
+
+static int ahci_read(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
+  return ahci_transfer((struct ahci_port *) dev->privdata, buffer, count, blkno, 0);
+}
+
+static int ahci_write(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
+  return ahci_transfer((struct ahci_port *) dev->privdata, buffer, count, blkno, 1);
+}
+
+struct driver ahci_driver = {
+  "ahci",
+  DEV_TYPE_BLOCK,
+  ahci_ioctl,
+  ahci_read,
+  ahci_write
+};
+
+static void ahci_fixstring(char *dst, unsigned short *src, int words) {
+  char *p = dst;
+  int i;
+
+  // Identify strings are stored with the bytes in each word swapped
+  for (i = 0; i < words; i++) {
+    *p++ = (char) (src[i] >> 8);
+    *p++ = (char) src[i];
+  }
+  *p = 0;
+  while (p > dst && p[-1] == ' ') *--p = 0;
+}
+
+static int ahci_identify(struct ahci_port *port) {
+  unsigned short *param;
+  int qdepth;
+  int rc;
+
+  param = (unsigned short *) kmalloc(SECTORSIZE);
+  if (!param) return -ENOMEM;
+  memset(param, 0, SECTORSIZE);
+
+  rc = ahci_command(port, ATA_CMD_IDENTIFY, param, SECTORSIZE, 0, 0);
+  if (rc < 0) {
+    kfree(param);
+    return rc;
+  }
+
+  // Get disk size, using 48-bit LBA if supported
+  if (param[83] & (1 << 10)) {
+    if (param[102] || param[103] || (param[101] & 0x8000)) {
+      port->capacity = 0x7FFFFFFF;
+    } else {
+      port->capacity = param[100] | ((unsigned long) param[101] << 16);
+    }
+  } else {
+    port->capacity = param[60] | ((unsigned long) param[61] << 16);
+  }
+  ahci_fixstring(port->model, param + 27, 20);
+
+  // Use native command queuing if both the HBA and the disk support it
+  qdepth = (param[75] & 0x1F) + 1;
+  if ((port->hba->cap & HBA_CAP_SNCQ) && (param[76] & (1 << 8)) && qdepth > 1) {
+    port->ncq = 1;
+    port->depth = qdepth < port->hba->ncmds ? qdepth : port->hba->ncmds;
+  } else {
+    port->ncq = 0;
+    port->depth = 1;
+  }
+
+  kfree(param);
+  return 0;
+}
+
+static struct ahci_port *ahci_setup_port(struct ahci *hba, int portno) {
+  struct ahci_port *port;
+  char *mem;
+  int tabpages;
+  int i;
+
+  port = (struct ahci_port *) kmalloc(sizeof(struct ahci_port));
+  if (!port) return NULL;
+  memset(port, 0, sizeof(struct ahci_port));
+  port->hba = hba;
+  port->portno = portno;
+  port->regs = hba->mmio + 0x100 + portno * 0x80;
+  port->devno = NODEV;
+  init_task(&port->recover_task);
+  init_event(&port->recovered, 1, 1);
+
+  // Check for a SATA disk with an established link
+  if ((PORT_REG(port, PORT_SSTS) & PORT_SSTS_DET_MASK) != PORT_SSTS_DET_OK) goto error;
+  if (PORT_REG(port, PORT_SIG) != SATA_SIG_ATA) goto error;
+  if (ahci_stop_port(port) < 0) goto error;
+
+  // Allocate command list and received FIS area
+  mem = alloc_pages_linear(1, 'AHCI');
+  if (!mem) goto error;
+  memset(mem, 0, PAGESIZE);
+  port->cmdlist = (struct ahci_cmdhdr *) mem;
+  port->rfis = mem + 1024;
+
+  // Allocate command tables
+  tabpages = PAGES(hba->ncmds * sizeof(struct ahci_cmdtab));
+  port->cmdtab = (struct ahci_cmdtab *) alloc_pages_linear(tabpages, 'AHCI');
+  if (!port->cmdtab) goto error;
+  memset(port->cmdtab, 0, tabpages * PAGESIZE);
+  for (i = 0; i < hba->ncmds; i++) {
+    port->cmdlist[i].ctba = virt2phys(&port->cmdtab[i]);
+    port->cmdlist[i].ctbau = 0;
+  }
+
+  PORT_REG(port, PORT_CLB) = virt2phys(port->cmdlist);
+  PORT_REG(port, PORT_CLBU) = 0;
+  PORT_REG(port, PORT_FB) = virt2phys(port->rfis);
+  PORT_REG(port, PORT_FBU) = 0;
+
+  // Spin up device and start port
+  if (hba->cap & HBA_CAP_SSS) PORT_REG(port, PORT_CMD) |= PORT_CMD_SUD | PORT_CMD_POD;
+  if (ahci_start_port(port) < 0) goto error;
+  PORT_REG(port, PORT_IE) = PORT_IE_MASK;
+
+  // Only one command slot is used until the queue depth is known
+  port->free = hba->ncmds == 32 ? 0xFFFFFFFF : (1 << hba->ncmds) - 1;
+  init_sem(&port->slots, 1);
+
+  return port;
+
+error:
+  if (port->cmdtab) free_pages(port->cmdtab, PAGES(hba->ncmds * sizeof(struct ahci_cmdtab)));
+  if (port->cmdlist) free_pages(port->cmdlist, 1);
+  kfree(port);
+  return NULL;
+}
+
+static int ahci_proc(struct proc_file *pf, void *arg) {
+  struct ahci *hba;
+  struct ahci_port *port;
+  int i;
+
+  pprintf(pf, "device   port ncq depth  maxq      reads     writes errors model\n");
+  pprintf(pf, "-------- ---- --- ----- ----- ---------- ---------- ------ ----------------\n");
+  for (hba = ahci_list; hba; hba = hba->next) {
+    for (i = 0; i < AHCI_MAX_PORTS; i++) {
+      port = hba->ports[i];
+      if (!port || port->devno == NODEV) continue;
+      pprintf(pf, "%-8s %4d %3s %5d %5d %10u %10u %6u %s\n",
+              device(port->devno)->name, port->portno, port->ncq ? "yes" : "no",
+              port->depth, port->maxqueued, port->reads, port->writes, port->errors, port->model);
+    }
+  }
+
+  return 0;
+}
+
+static int install_ahci(struct unit *unit) {
+  struct ahci *hba;
+  struct ahci_port *port;
+  unsigned long abar;
+  unsigned long pi;
+  char ncqinfo[32];
+  int i;
+  int rc;
+
+  // Only initialize each HBA once
+  for (hba = ahci_list; hba; hba = hba->next) {
+    if (hba->unit == unit) return 0;
+  }
+
+  // Setup unit information
+  if (!unit) return -ENOSYS;
+  unit->vendorname = "AHCI";
+  unit->productname = "AHCI SATA Controller";
+
+  // Allocate memory for HBA
+  hba = (struct ahci *) kmalloc(sizeof(struct ahci));
+  if (!hba) return -ENOMEM;
+  memset(hba, 0, sizeof(struct ahci));
+  hba->unit = unit;
+  hba->irq = get_unit_irq(unit);
+
+  // Map the AHCI base address register (BAR5) into kernel memory
+  abar = pci_read_config_dword(unit, PCI_CONFIG_BASE_ADDR_5) & PCI_BASE_ADDRESS_MEM_MASK;
+  if (!abar) {
+    kfree(hba);
+    return -ENODEV;
+  }
+  hba->mmio = (char *) iomap(abar, 0x1100);
+  pci_enable_busmastering(unit);
+
+  // Enable AHCI mode and get capabilities
+  HBA_REG(hba, HBA_GHC) |= HBA_GHC_AE;
+  hba->cap = HBA_REG(hba, HBA_CAP);
+  hba->ncmds = ((hba->cap >> HBA_CAP_NCS_SHIFT) & HBA_CAP_NCS_MASK) + 1;
+  pi = HBA_REG(hba, HBA_PI);
+
+  // Enable interrupts
+  init_dpc(&hba->dpc);
+  register_interrupt(&hba->intr, IRQ2INTR(hba->irq), ahci_handler, hba);
+  enable_irq(hba->irq);
+  HBA_REG(hba, HBA_IS) = 0xFFFFFFFF;
+  HBA_REG(hba, HBA_GHC) |= HBA_GHC_IE;
+
+  hba->next = ahci_list;
+  if (!ahci_list) register_proc_inode("ahci", ahci_proc, NULL);
+  ahci_list = hba;
+
+  // Setup disks on all implemented ports
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    if (!(pi & (1 << i))) continue;
+    port = ahci_setup_port(hba, i);
+    if (!port) continue;
+    hba->ports[i] = port;
+
+    rc = ahci_identify(port);
+    if (rc < 0) {
+      kprintf(KERN_WARNING "ahci: error %d identifying disk on port %d\n", rc, i);
+      continue;
+    }
+    set_sem(&port->slots, port->depth);
+
+    port->devno = dev_make("sd#", &ahci_driver, unit, port);
+    if (port->ncq) {
+      sprintf(ncqinfo, ", NCQ depth %d", port->depth);
+    } else {
+      ncqinfo[0] = 0;
+    }
+    kprintf(KERN_INFO "%s: %s (%d MB)%s, port %d\n", device(port->devno)->name, port->model,
+            port->capacity / (1024 * 1024 / SECTORSIZE), ncqinfo, i);
+
+    create_partitions(port->devno, port->parts);
+  }
+
+  return 0;
+}
+
+int __declspec(dllexport) ahci(struct unit *unit, char *opts) {
+  return install_ahci(unit);
+}
+
+void init_ahci() {
+  // Try to find an AHCI controller for booting
+  struct unit *unit = lookup_unit_by_class(NULL, PCI_CLASS_STORAGE_AHCI, 0xFFFFFF);
+  if (unit) install_ahci(unit);
+}
@@ -37,7 +37,6 @@
 
 #define HD_CONTROLLERS          2
 #define HD_DRIVES               4
-#define HD_PARTITIONS           4
 
 #define MAX_PRDS                (PAGESIZE / 8)
 #define MAX_DMA_XFER_SIZE       ((MAX_PRDS - 1) * PAGESIZE)
@@ -337,14 +336,6 @@ struct hdc  {
   unsigned long prds_phys;             // Physical address of PRD list
 };
 
-struct partition {
-  dev_t dev;
-  unsigned int start;
-  unsigned int len;
-  unsigned short bootid;
-  unsigned short systid;
-};
-
 struct hd {
   struct hdc *hdc;                      // Controller
   struct hdparam param;                 // Drive parameter block
@@ -373,7 +364,6 @@ int ideprobe = 0;
 static struct hdc hdctab[HD_CONTROLLERS];
 static struct hd hdtab[HD_DRIVES];
 
-static int create_partitions(struct hd *hd);
 
 static void hd_fixstring(unsigned char *s, int len) {
   unsigned char *p = s;
@@ -767,7 +757,7 @@ static int hd_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
       return 0;
 
     case IOCTL_REVALIDATE:
-      return create_partitions(hd);
+      return create_partitions(hd->devno, hd->parts);
   }
 
   return -ENOSYS;
@@ -1323,42 +1313,42 @@ struct driver partition_driver = {
   part_write
 };
 
-static int create_partitions(struct hd *hd) {
+int create_partitions(dev_t devno, struct partition *parts) {
   struct master_boot_record mbrdata;
   struct master_boot_record *mbr = &mbrdata;
-  dev_t devno;
+  dev_t partno;
   int rc;
   int i;
   char devname[DEVNAMELEN];
 
   // Read partition table
-  rc = dev_read(hd->devno, mbr, SECTORSIZE, 0, 0);
+  rc = dev_read(devno, mbr, SECTORSIZE, 0, 0);
   if (rc < 0) {
-    kprintf(KERN_ERR "%s: error %d reading partition table\n", device(hd->devno)->name, rc);
+    kprintf(KERN_ERR "%s: error %d reading partition table\n", device(devno)->name, rc);
     return rc;
   }
 
   // Create partition devices
   if (mbr->signature != MBR_SIGNATURE) {
-    kprintf(KERN_ERR "%s: illegal boot sector signature\n", device(hd->devno)->name);
+    kprintf(KERN_ERR "%s: illegal boot sector signature\n", device(devno)->name);
     return -EIO;
   }
 
   for (i = 0; i < HD_PARTITIONS; i++) {
-    hd->parts[i].dev = hd->devno;
-    hd->parts[i].bootid = mbr->parttab[i].bootid;
-    hd->parts[i].systid = mbr->parttab[i].systid;
-    hd->parts[i].start = mbr->parttab[i].relsect;
-    hd->parts[i].len = mbr->parttab[i].numsect;
+    parts[i].dev = devno;
+    parts[i].bootid = mbr->parttab[i].bootid;
+    parts[i].systid = mbr->parttab[i].systid;
+    parts[i].start = mbr->parttab[i].relsect;
+    parts[i].len = mbr->parttab[i].numsect;
 
     if (mbr->parttab[i].systid != 0) {
-      sprintf(devname, "%s%c", device(hd->devno)->name, 'a' + i);
-      devno = dev_open(devname);
-      if (devno == NODEV) {
-        devno = dev_make(devname, &partition_driver, NULL, &hd->parts[i]);
-        kprintf(KERN_INFO "%s: partition %d on %s, %dMB (type %02x)\n", devname, i, device(hd->devno)->name, mbr->parttab[i].numsect / ((1024 * 1024) / SECTORSIZE), mbr->parttab[i].systid);
+      sprintf(devname, "%s%c", device(devno)->name, 'a' + i);
+      partno = dev_open(devname);
+      if (partno == NODEV) {
+        partno = dev_make(devname, &partition_driver, NULL, &parts[i]);
+        kprintf(KERN_INFO "%s: partition %d on %s, %dMB (type %02x)\n", devname, i, device(devno)->name, mbr->parttab[i].numsect / ((1024 * 1024) / SECTORSIZE), mbr->parttab[i].systid);
       } else {
-        dev_close(devno);
+        dev_close(partno);
       }
     }
   }
@@ -1599,7 +1589,7 @@ static void setup_hd(struct hd *hd, struct hdc *hdc, char *devname, int drvsel,
   //if (hd->hdc->bmregbase) kprintf(", bmregbase=0x%x", hd->hdc->bmregbase);
   kprintf("\n");
 
-  if (hd->media == IDE_DISK) create_partitions(hd);
+  if (hd->media == IDE_DISK) create_partitions(hd->devno, hd->parts);
 }
 
 void init_hd() {
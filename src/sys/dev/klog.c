@@ -32,8 +32,40 @@
 // 
 
 #include <os/krnl.h>
+#include <atomic.h>
 
-#define KLOG_SIZE (64 * 1024)
+#define KLOG_SIZE       (64 * 1024)
+#define KLOG_RING_SIZE  (64 * 1024)
+#define KLOG_MAXREC     1024
+
+#define KLOG_SYNC_LEVEL 2      // Messages at KERN_CRIT and above are printed synchronously
+
+#define KLOG_REC_READY  1      // Record has been completely written
+#define KLOG_REC_PAD    2      // Record is padding at the end of the ring
+#define KLOG_REC_NOCONS 4      // Record is not printed on the console
+
+//
+// Kernel log messages are written as records into a ring buffer without
+// taking any locks. Space is reserved by advancing the ring head with
+// compare-and-exchange, which is atomic with respect to interrupts, so
+// threads and interrupt handlers can log concurrently. A low priority task
+// drains the records to the text log read through /dev/klog and to the
+// console. Text written to /dev/klog from user space goes through the ring
+// to keep the order of messages, but is not printed on the console.
+//
+// Records hold the formatted message text. Formatting is not deferred to
+// the log task, because string arguments often point to buffers owned by
+// the caller that are gone by the time the record is drained.
+//
+
+struct klogrec {
+  unsigned short size;         // Record size including header
+  unsigned char flags;         // Record flags
+  unsigned char level;         // Log level
+  unsigned short len;          // Length of message text
+  unsigned short reserved;
+  unsigned int time;           // Time stamp in milliseconds since boot
+};
 
 struct klogreq {
   struct klogreq *next;
@@ -50,6 +82,19 @@ static unsigned int klog_size;
 static struct klogreq *klog_waiters;
 static struct dpc klog_dpc;
 
+static char klogring[KLOG_RING_SIZE];
+static int ring_head;
+static int ring_tail;
+static int ring_draining;
+static struct thread *klog_thread;
+static struct event klog_ready;
+static struct dpc klog_wakeup_dpc;
+
+static int klog_records;
+static int klog_dropped;
+static int klog_suppressed;
+static unsigned int klog_maxdelay;
+
 static int wait_for_klog() {
   struct klogreq req;
 
@@ -82,8 +127,11 @@ static void release_klog_waiters(void *arg) {
 }
 
 static void add_to_klog(char *buf, int size) {
-  while (size-- > 0) {
-    if (klog_size == KLOG_SIZE) {
+  int n;
+
+  while (size > 0) {
+    // Remove the oldest lines from the log to make room for the text
+    while (klog_size > 0 && klog_size + size > KLOG_SIZE) {
       while (klogbuf[klog_start] != '\n' && klog_size > 0) {
         klog_size--;
         klog_start++;
@@ -97,38 +145,184 @@ static void add_to_klog(char *buf, int size) {
       }
     }
 
-    klogbuf[klog_end++] = *buf++;
+    // Copy text up to the end of the buffer
+    n = KLOG_SIZE - klog_end;
+    if (n > size) n = size;
+    if (n > KLOG_SIZE - (int) klog_size) n = KLOG_SIZE - klog_size;
+    memcpy(klogbuf + klog_end, buf, n);
+    klog_end += n;
     if (klog_end == KLOG_SIZE) klog_end = 0;
-    klog_size++;
+    klog_size += n;
+    buf += n;
+    size -= n;
   }
 
   release_klog_waiters(NULL);
 }
 
+static void deliver_record(struct klogrec *rec) {
+  char *msg = (char *) (rec + 1);
+  int msglen = rec->len;
+  unsigned int delay;
+
+  add_to_klog(msg, msglen);
+
+  //if (debugging) dbg_output(msg);
+
+  if (kprint_enabled && !(rec->flags & KLOG_REC_NOCONS)) {
+    if (msg[0] == '<' && msg[1] >= '0' && msg[1] <= '7' && msg[2] == '>') {
+      msg += 3;
+      msglen -= 3;
+    }
+
+    console_print(msg, msglen);
+  }
+
+  delay = clocks - rec->time;
+  if (delay > klog_maxdelay) klog_maxdelay = delay;
+}
+
+static void drain_klog() {
+  struct klogrec *rec;
+  int size;
+
+  // Only one thread or interrupt handler drains the ring at a time
+  if (atomic_exchange(&ring_draining, 1)) return;
+
+  while (ring_tail != ring_head) {
+    rec = (struct klogrec *) (klogring + (ring_tail & (KLOG_RING_SIZE - 1)));
+
+    // Stop at records that are still being written
+    if (!(rec->flags & KLOG_REC_READY)) break;
+
+    size = rec->size;
+    if (!(rec->flags & KLOG_REC_PAD)) deliver_record(rec);
+
+    // Clear the record so stale flags are not mistaken for new records
+    memset(rec, 0, size);
+    ring_tail += size;
+  }
+
+  ring_draining = 0;
+}
+
+static struct klogrec *reserve_record(int size) {
+  struct klogrec *rec;
+  int head;
+  int offset;
+  int pad;
+
+  // Records are contiguous, so skip the rest of the ring if the record does
+  // not fit before the end
+  do {
+    head = ring_head;
+    offset = head & (KLOG_RING_SIZE - 1);
+    pad = offset + size > KLOG_RING_SIZE ? KLOG_RING_SIZE - offset : 0;
+    if (head + pad + size - ring_tail > KLOG_RING_SIZE) return NULL;
+  } while (atomic_compare_and_exchange(&ring_head, head + pad + size, head) != head);
+
+  if (pad) {
+    rec = (struct klogrec *) (klogring + offset);
+    rec->size = pad;
+    rec->flags = KLOG_REC_PAD | KLOG_REC_READY;
+    offset = 0;
+  }
+
+  rec = (struct klogrec *) (klogring + offset);
+  rec->size = size;
+  return rec;
+}
+
+static void wakeup_klog_task(void *arg) {
+  set_event(&klog_ready);
+}
+
+static void log_message(char *msg, int len, int flags) {
+  struct klogrec *rec;
+  int level;
+
+  if (len > KLOG_MAXREC) len = KLOG_MAXREC;
+  if (len > 2 && msg[0] == '<' && msg[1] >= '0' && msg[1] <= '7' && msg[2] == '>') {
+    level = msg[1] - '0';
+  } else {
+    level = 6;
+  }
+
+  // Reserve space for the record. If the ring is full the log task is behind,
+  // so drain the ring directly.
+  rec = reserve_record((sizeof(struct klogrec) + len + 3) & ~3);
+  if (!rec) {
+    drain_klog();
+    rec = reserve_record((sizeof(struct klogrec) + len + 3) & ~3);
+  }
+
+  if (rec) {
+    rec->level = level;
+    rec->len = len;
+    rec->time = clocks;
+    memcpy(rec + 1, msg, len);
+    rec->flags = KLOG_REC_READY | flags;
+    klog_records++;
+  } else {
+    klog_dropped++;
+  }
+
+  // Print critical messages immediately, and drain synchronously until
+  // the log task has been started
+  if (!klog_thread || (level <= KLOG_SYNC_LEVEL && !(flags & KLOG_REC_NOCONS))) {
+    drain_klog();
+  } else if ((eflags() & EFLAG_IF) == 0) {
+    if (!(klog_wakeup_dpc.flags & DPC_QUEUED)) queue_irq_dpc(&klog_wakeup_dpc, wakeup_klog_task, NULL);
+  } else {
+    set_event(&klog_ready);
+  }
+}
+
 void kprintf(const char *fmt,...) {
   va_list args;
-  char buffer[1024];
+  char buffer[KLOG_MAXREC];
   int len;
 
   va_start(args, fmt);
   len = vsprintf(buffer, fmt, args);
   va_end(args);
-    
-  add_to_klog(buffer, len);
-  
-  //if (debugging) dbg_output(buffer);
 
-  if (kprint_enabled) {
-    char *msg = buffer;
-    int msglen = len;
+  log_message(buffer, len, 0);
+}
 
-    if (msg[0] == '<' && msg[1] >= '0' && msg[1] <= '7' && msg[2] == '>') {
-      msg += 3;
-      msglen -= 3;
-    }
+int klog_ratelimit(struct ratelimit *rs) {
+  // Start new interval and report messages suppressed in the previous one
+  if (rs->begin == 0 || time_after_eq(ticks, rs->begin + rs->interval)) {
+    if (rs->missed > 0) kprintf(KERN_WARNING "klog: %d messages suppressed\n", rs->missed);
+    rs->begin = ticks;
+    rs->printed = 0;
+    rs->missed = 0;
+  }
 
-    console_print(msg, msglen);
+  if (rs->printed < rs->burst) {
+    rs->printed++;
+    return 1;
   }
+
+  rs->missed++;
+  klog_suppressed++;
+  return 0;
+}
+
+static void klog_task(void *arg) {
+  while (1) {
+    wait_for_object(&klog_ready, INFINITE);
+    drain_klog();
+  }
+}
+
+static int klogstat_proc(struct proc_file *pf, void *arg) {
+  pprintf(pf, "records    : %d\n", klog_records);
+  pprintf(pf, "dropped    : %d\n", klog_dropped);
+  pprintf(pf, "suppressed : %d\n", klog_suppressed);
+  pprintf(pf, "pending    : %d bytes\n", ring_head - ring_tail);
+  pprintf(pf, "max delay  : %d ms\n", klog_maxdelay);
+  return 0;
 }
 
 static int klog_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
@@ -173,7 +367,17 @@ static int klog_read(struct dev *dev, void *buffer, size_t count, blkno_t blkno,
 }
 
 static int klog_write(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
-  add_to_klog(buffer, count);
+  char *p = (char *) buffer;
+  size_t left = count;
+  int n;
+
+  while (left > 0) {
+    n = left > KLOG_MAXREC ? KLOG_MAXREC : left;
+    log_message(p, n, KLOG_REC_NOCONS);
+    p += n;
+    left -= n;
+  }
+
   return count;
 }
 
@@ -187,5 +391,13 @@ struct driver klog_driver = {
 
 int __declspec(dllexport) klog(struct unit *unit, char *opts) {
   dev_make("klog", &klog_driver, NULL, NULL);
+
+  // Start task for draining the kernel log ring to the console
+  init_event(&klog_ready, 0, 0);
+  init_dpc(&klog_wakeup_dpc);
+  klog_thread = create_kernel_thread(klog_task, NULL, PRIORITY_BELOW_NORMAL, "klog");
+  drain_klog();
+
+  register_proc_inode("klogstat", klogstat_proc, NULL);
   return 0;
 }
@@ -0,0 +1,782 @@
+//
+// nvme.c
+//
+// NVM Express disk driver
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os/krnl.h>
+
+#define NVME_MAX_IOQUEUES     8
+#define NVME_MAX_NAMESPACES   16
+#define NVME_ADMIN_QSIZE      32
+#define NVME_DEFAULT_QUEUES   2
+#define NVME_DEFAULT_QSIZE    64
+#define NVME_MAX_QSIZE        256
+#define NVME_PRP_ENTRIES      32
+#define NVME_MAX_XFER         (NVME_PRP_ENTRIES * PAGESIZE)
+
+//
+// Controller registers
+//
+
+#define NVME_REG_CAP          0x00    // Controller capabilities (64 bit)
+#define NVME_REG_VS           0x08    // Version
+#define NVME_REG_INTMS        0x0C    // Interrupt mask set
+#define NVME_REG_INTMC        0x10    // Interrupt mask clear
+#define NVME_REG_CC           0x14    // Controller configuration
+#define NVME_REG_CSTS         0x1C    // Controller status
+#define NVME_REG_AQA          0x24    // Admin queue attributes
+#define NVME_REG_ASQ          0x28    // Admin submission queue base address (64 bit)
+#define NVME_REG_ACQ          0x30    // Admin completion queue base address (64 bit)
+#define NVME_REG_DBS          0x1000  // Doorbell registers
+
+#define NVME_CAP_MQES(cap)    (((cap) & 0xFFFF) + 1)    // Max queue entries
+#define NVME_CAP_TO(cap)      (((cap) >> 24) & 0xFF)    // Timeout in 500 ms units
+#define NVME_CAP_DSTRD(caph)  ((caph) & 0xF)            // Doorbell stride
+#define NVME_CAP_MPSMIN(caph) (((caph) >> 16) & 0xF)    // Min memory page size
+
+#define NVME_CC_EN            (1 << 0)
+#define NVME_CC_IOSQES        (6 << 16)   // I/O submission queue entry size (64 bytes)
+#define NVME_CC_IOCQES        (4 << 20)   // I/O completion queue entry size (16 bytes)
+
+#define NVME_CSTS_RDY         (1 << 0)
+#define NVME_CSTS_CFS         (1 << 1)
+
+//
+// Admin and I/O commands
+//
+
+#define NVME_ADMIN_DELETE_SQ  0x00
+#define NVME_ADMIN_CREATE_SQ  0x01
+#define NVME_ADMIN_DELETE_CQ  0x04
+#define NVME_ADMIN_CREATE_CQ  0x05
+#define NVME_ADMIN_IDENTIFY   0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_CMD_FLUSH        0x00
+#define NVME_CMD_WRITE        0x01
+#define NVME_CMD_READ         0x02
+
+#define NVME_FEAT_NUM_QUEUES  0x07
+
+#define NVME_QUEUE_PHYS_CONTIG  (1 << 0)
+#define NVME_CQ_IRQ_ENABLED     (1 << 1)
+
+#define NVME_ID_CNS_NS        0x00
+#define NVME_ID_CNS_CTRL      0x01
+
+//
+// Submission and completion queue entries
+//
+
+struct nvme_sqe {
+  unsigned char opcode;
+  unsigned char flags;
+  unsigned short cid;
+  unsigned long nsid;
+  unsigned long reserved[2];
+  unsigned __int64 mptr;
+  unsigned __int64 prp1;
+  unsigned __int64 prp2;
+  unsigned long cdw10;
+  unsigned long cdw11;
+  unsigned long cdw12;
+  unsigned long cdw13;
+  unsigned long cdw14;
+  unsigned long cdw15;
+};
+
+struct nvme_cqe {
+  unsigned long result;
+  unsigned long reserved;
+  unsigned short sqhead;
+  unsigned short sqid;
+  unsigned short cid;
+  unsigned short status;      // Bit 0 is the phase tag
+};
+
+//
+// Driver data
+//
+
+struct nvme_request {
+  struct thread *thread;      // Thread waiting for completion
+  int status;                 // Completion status code
+  unsigned long result;       // Command specific result
+  unsigned long start;        // Time stamp for submission
+  struct latency_histogram *lat; // Latency histogram for request
+};
+
+struct nvme_queue {
+  struct nvme *nvme;          // Controller
+  int qid;                    // Queue id (0 is the admin queue)
+  int size;                   // Number of queue entries
+  struct nvme_sqe *sq;        // Submission queue
+  struct nvme_cqe *cq;        // Completion queue
+  volatile unsigned long *sqdb; // Submission queue tail doorbell
+  volatile unsigned long *cqdb; // Completion queue head doorbell
+  int sqtail;                 // Next free submission queue entry
+  int cqhead;                 // Next completion queue entry
+  int phase;                  // Expected phase tag for new completions
+
+  struct sem slots;           // Free command ids
+  int *freecids;              // Stack of free command ids
+  int nfree;                  // Number of free command ids
+  struct nvme_request **reqs; // Outstanding requests by command id
+  unsigned __int64 *prplists; // PRP list for each command id
+  unsigned long prpphys;      // Physical address of PRP lists
+
+  int outstanding;            // Commands currently outstanding
+  int maxoutstanding;         // Maximum number of commands outstanding
+  unsigned long commands;     // Total number of commands
+};
+
+struct nvme_ns {
+  struct nvme_ns *next;       // Next namespace on controller
+  struct nvme *nvme;          // Controller
+  int nsid;                   // Namespace id
+  unsigned int blocks;        // Number of blocks
+  int blksize;                // Block size
+  dev_t devno;                // Device for namespace
+  struct partition parts[HD_PARTITIONS];
+
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long errors;
+  struct latency_histogram rdlat;
+  struct latency_histogram wrlat;
+};
+
+struct nvme {
+  struct nvme *next;          // Next controller
+  struct unit *unit;          // PCI unit
+  char *mmio;                 // Memory mapped controller registers
+  int irq;                    // Interrupt request line
+  int dstrd;                  // Doorbell stride
+  int timeout;                // Controller ready timeout in ms
+  int maxxfer;                // Maximum transfer size
+  char model[41];             // Model number
+  char serial[21];            // Serial number
+
+  struct nvme_queue adminq;   // Admin queue pair
+  struct nvme_queue ioqs[NVME_MAX_IOQUEUES];
+  int nioqs;                  // Number of I/O queue pairs
+  struct nvme_ns *namespaces; // Namespaces on controller
+
+  struct interrupt intr;
+  struct dpc dpc;
+};
+
+static struct nvme *nvme_list;
+
+#define NVME_REG(nvme, reg) (*(volatile unsigned long *) ((nvme)->mmio + (reg)))
+
+//
+// Latency statistics
+//
+// Command latencies are measured from submission to completion and
+// collected in the kernel latency histograms.
+//
+
+static unsigned long nvme_percentile(struct latency_histogram *lat, int permille) {
+  unsigned __int64 threshold;
+  unsigned long total;
+  int i;
+
+  // Return the inclusive upper bound of the bucket containing the percentile
+  if (lat->samples == 0) return 0;
+  threshold = ((unsigned __int64) lat->samples * permille + 999) / 1000;
+  total = 0;
+  for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+    total += lat->count[i];
+    if (total >= threshold) return (1UL << i) - 1;
+  }
+
+  return lat->max;
+}
+
+//
+// Queue management
+//
+
+static int nvme_alloc_queue(struct nvme *nvme, struct nvme_queue *q, int qid, int size) {
+  int sqpages = PAGES(size * sizeof(struct nvme_sqe));
+  int cqpages = PAGES(size * sizeof(struct nvme_cqe));
+  int prppages = PAGES(size * NVME_PRP_ENTRIES * sizeof(unsigned __int64));
+  int i;
+
+  memset(q, 0, sizeof(struct nvme_queue));
+  q->nvme = nvme;
+  q->qid = qid;
+  q->size = size;
+  q->phase = 1;
+  q->sqdb = (volatile unsigned long *) (nvme->mmio + NVME_REG_DBS + (2 * qid) * (4 << nvme->dstrd));
+  q->cqdb = (volatile unsigned long *) (nvme->mmio + NVME_REG_DBS + (2 * qid + 1) * (4 << nvme->dstrd));
+
+  // Queues and PRP lists must be physically contiguous
+  q->sq = (struct nvme_sqe *) alloc_pages_linear(sqpages, 'NVME');
+  q->cq = (struct nvme_cqe *) alloc_pages_linear(cqpages, 'NVME');
+  q->prplists = (unsigned __int64 *) alloc_pages_linear(prppages, 'NVME');
+  q->freecids = (int *) kmalloc(size * sizeof(int));
+  q->reqs = (struct nvme_request **) kmalloc(size * sizeof(struct nvme_request *));
+  if (!q->sq || !q->cq || !q->prplists || !q->freecids || !q->reqs) return -ENOMEM;
+
+  memset(q->sq, 0, sqpages * PAGESIZE);
+  memset(q->cq, 0, cqpages * PAGESIZE);
+  memset(q->reqs, 0, size * sizeof(struct nvme_request *));
+  q->prpphys = virt2phys(q->prplists);
+
+  // One entry is kept unused so a full queue can be told from an empty one
+  for (i = 0; i < size - 1; i++) q->freecids[i] = size - 2 - i;
+  q->nfree = size - 1;
+  init_sem(&q->slots, size - 1);
+
+  return 0;
+}
+
+static void nvme_setup_prp(struct nvme_queue *q, int cid, struct nvme_sqe *sqe, char *buffer, int count) {
+  unsigned __int64 *list;
+  int len;
+  int n;
+
+  // First PRP entry may start at an offset within a page
+  sqe->prp1 = virt2phys(buffer);
+  len = PAGESIZE - ((unsigned long) buffer & (PAGESIZE - 1));
+  if (count <= len) {
+    sqe->prp2 = 0;
+    return;
+  }
+  buffer += len;
+  count -= len;
+
+  // Second PRP entry points to the next page if the transfer ends there,
+  // otherwise to a list of page addresses
+  if (count <= PAGESIZE) {
+    sqe->prp2 = virt2phys(buffer);
+    return;
+  }
+
+  list = q->prplists + cid * NVME_PRP_ENTRIES;
+  n = 0;
+  while (count > 0) {
+    if (n == NVME_PRP_ENTRIES) panic("nvme: transfer too large");
+    list[n++] = virt2phys(buffer);
+    buffer += PAGESIZE;
+    count -= PAGESIZE;
+  }
+  sqe->prp2 = q->prpphys + cid * NVME_PRP_ENTRIES * sizeof(unsigned __int64);
+}
+
+static int nvme_submit(struct nvme_queue *q, struct nvme_sqe *cmd, void *buffer, int count, struct latency_histogram *lat, unsigned long *result) {
+  struct nvme_request req;
+  struct nvme_sqe *sqe;
+  int cid;
+  int rc;
+
+  // Allocate command id, waiting if the queue is full
+  rc = wait_for_object(&q->slots, INFINITE);
+  if (rc < 0) return rc;
+  cid = q->freecids[--q->nfree];
+
+  // Copy command into submission queue
+  sqe = &q->sq[q->sqtail];
+  memcpy(sqe, cmd, sizeof(struct nvme_sqe));
+  sqe->cid = cid;
+  if (buffer) nvme_setup_prp(q, cid, sqe, buffer, count);
+
+  req.thread = self();
+  req.status = 0;
+  req.result = 0;
+  req.start = lat ? latency_stamp() : 0;
+  req.lat = lat;
+  q->reqs[cid] = &req;
+  q->commands++;
+  if (++q->outstanding > q->maxoutstanding) q->maxoutstanding = q->outstanding;
+
+  // Ring doorbell and wait for completion
+  if (++q->sqtail == q->size) q->sqtail = 0;
+  *q->sqdb = q->sqtail;
+  enter_wait(THREAD_WAIT_DEVIO);
+
+  // Release command id
+  q->outstanding--;
+  q->freecids[q->nfree++] = cid;
+  release_sem(&q->slots, 1);
+
+  if (result) *result = req.result;
+  if (req.status != 0) {
+    kprintf(KERN_ERR "nvme: command %02x on queue %d failed, status 0x%x\n", cmd->opcode, q->qid, req.status);
+    return -EIO;
+  }
+
+  return 0;
+}
+
+static int nvme_process_cq(struct nvme_queue *q) {
+  struct nvme_cqe *cqe;
+  struct nvme_request *req;
+  int n = 0;
+
+  while (1) {
+    cqe = &q->cq[q->cqhead];
+    if ((cqe->status & 1) != q->phase) break;
+
+    req = q->reqs[cqe->cid];
+    q->reqs[cqe->cid] = NULL;
+    if (req) {
+      req->status = cqe->status >> 1;
+      req->result = cqe->result;
+      if (req->lat) record_latency(req->lat, req->start);
+      mark_thread_ready(req->thread, 1, 2);
+    }
+
+    if (++q->cqhead == q->size) {
+      q->cqhead = 0;
+      q->phase ^= 1;
+    }
+    n++;
+  }
+
+  if (n) *q->cqdb = q->cqhead;
+  return n;
+}
+
+static __inline int nvme_cq_pending(struct nvme_queue *q) {
+  return q->cq && (q->cq[q->cqhead].status & 1) == q->phase;
+}
+
+static void nvme_dpc(void *arg) {
+  struct nvme *nvme = (struct nvme *) arg;
+  int i;
+
+  // Process all completion queues and unmask the interrupt again
+  nvme_process_cq(&nvme->adminq);
+  for (i = 0; i < nvme->nioqs; i++) nvme_process_cq(&nvme->ioqs[i]);
+  NVME_REG(nvme, NVME_REG_INTMC) = 1;
+}
+
+static int nvme_handler(struct context *ctxt, void *arg) {
+  struct nvme *nvme = (struct nvme *) arg;
+  int pending;
+  int i;
+
+  // Check for new completions, the pin interrupt may be shared
+  pending = nvme_cq_pending(&nvme->adminq);
+  for (i = 0; i < nvme->nioqs && !pending; i++) pending = nvme_cq_pending(&nvme->ioqs[i]);
+  if (!pending) return 0;
+
+  // Mask interrupt until the completion queues have been processed
+  NVME_REG(nvme, NVME_REG_INTMS) = 1;
+  queue_irq_dpc(&nvme->dpc, nvme_dpc, nvme);
+  eoi(nvme->irq);
+  return 1;
+}
+
+//
+// Block device interface
+//
+
+static struct nvme_queue *nvme_select_queue(struct nvme *nvme) {
+  struct nvme_queue *q = &nvme->ioqs[0];
+  int i;
+
+  // Use the I/O queue with the fewest outstanding commands
+  for (i = 1; i < nvme->nioqs; i++) {
+    if (nvme->ioqs[i].outstanding < q->outstanding) q = &nvme->ioqs[i];
+  }
+
+  return q;
+}
+
+static int nvme_transfer(struct nvme_ns *ns, char *buffer, size_t count, blkno_t blkno, int write) {
+  struct nvme *nvme = ns->nvme;
+  struct nvme_sqe cmd;
+  int left;
+  int len;
+  int nblks;
+  int rc;
+
+  if (count % ns->blksize != 0) return -EINVAL;
+  if (blkno + count / ns->blksize > ns->blocks) return -EFAULT;
+
+  left = count;
+  while (left > 0) {
+    len = left;
+    if (len > nvme->maxxfer) len = nvme->maxxfer;
+    nblks = len / ns->blksize;
+
+    memset(&cmd, 0, sizeof(struct nvme_sqe));
+    cmd.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+    cmd.nsid = ns->nsid;
+    cmd.cdw10 = blkno;
+    cmd.cdw11 = 0;
+    cmd.cdw12 = nblks - 1;
+
+    rc = nvme_submit(nvme_select_queue(nvme), &cmd, buffer, len, write ? &ns->wrlat : &ns->rdlat, NULL);
+    if (rc < 0) {
+      ns->errors++;
+      return rc;
+    }
+    if (write) {
+      ns->writes++;
+    } else {
+      ns->reads++;
+    }
+
+    buffer += len;
+    blkno += nblks;
+    left -= len;
+  }
+
+  return count;
+}
+
+static int nvme_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
+  struct nvme_ns *ns = (struct nvme_ns *) dev->privdata;
+
+  switch (cmd) {
+    case IOCTL_GETDEVSIZE:
+      return ns->blocks;
+
+    case IOCTL_GETBLKSIZE:
+      return ns->blksize;
+
+    case IOCTL_REVALIDATE:
+      return create_partitions(ns->devno, ns->parts);
+  }
+
+  return -ENOSYS;
+}
+
+static int nvme_read(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
+  return nvme_transfer((struct nvme_ns *) dev->privdata, buffer, count, blkno, 0);
+}
+
+static int nvme_write(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
+  return nvme_transfer((struct nvme_ns *) dev->privdata, buffer, count, blkno, 1);
+}
+
+struct driver nvme_driver = {
+  "nvme",
+  DEV_TYPE_BLOCK,
+  nvme_ioctl,
+  nvme_read,
+  nvme_write
+};
+
+//
+// Controller initialization
+//
+
+static int nvme_wait_ready(struct nvme *nvme, int ready) {
+  int timeout = nvme->timeout;
+
+  while ((NVME_REG(nvme, NVME_REG_CSTS) & NVME_CSTS_RDY) != (ready ? NVME_CSTS_RDY : 0)) {
+    if (NVME_REG(nvme, NVME_REG_CSTS) & NVME_CSTS_CFS) return -EIO;
+    if (timeout-- <= 0) return -ETIMEOUT;
+    udelay(1000);
+  }
+
+  return 0;
+}
+
+static int nvme_identify(struct nvme *nvme, int cns, int nsid, void *buffer) {
+  struct nvme_sqe cmd;
+
+  memset(&cmd, 0, sizeof(struct nvme_sqe));
+  cmd.opcode = NVME_ADMIN_IDENTIFY;
+  cmd.nsid = nsid;
+  cmd.cdw10 = cns;
+  return nvme_submit(&nvme->adminq, &cmd, buffer, PAGESIZE, NULL, NULL);
+}
+
+static int nvme_create_ioqueue(struct nvme *nvme, struct nvme_queue *q, int qid, int size) {
+  struct nvme_sqe cmd;
+  int rc;
+
+  rc = nvme_alloc_queue(nvme, q, qid, size);
+  if (rc < 0) return rc;
+
+  // Create completion queue before the submission queue that uses it
+  memset(&cmd, 0, sizeof(struct nvme_sqe));
+  cmd.opcode = NVME_ADMIN_CREATE_CQ;
+  cmd.prp1 = virt2phys(q->cq);
+  cmd.cdw10 = ((size - 1) << 16) | qid;
+  cmd.cdw11 = NVME_CQ_IRQ_ENABLED | NVME_QUEUE_PHYS_CONTIG;
+  rc = nvme_submit(&nvme->adminq, &cmd, NULL, 0, NULL, NULL);
+  if (rc < 0) return rc;
+
+  memset(&cmd, 0, sizeof(struct nvme_sqe));
+  cmd.opcode = NVME_ADMIN_CREATE_SQ;
+  cmd.prp1 = virt2phys(q->sq);
+  cmd.cdw10 = ((size - 1) << 16) | qid;
+  cmd.cdw11 = (qid << 16) | NVME_QUEUE_PHYS_CONTIG;
+  rc = nvme_submit(&nvme->adminq, &cmd, NULL, 0, NULL, NULL);
+  if (rc < 0) return rc;
+
+  return 0;
+}
+
+static void nvme_copy_string(char *dst, unsigned char *src, int len) {
+  memcpy(dst, src, len);
+  dst[len] = 0;
+  while (len > 0 && dst[len - 1] == ' ') dst[--len] = 0;
+}
+
+static int nvme_setup_namespace(struct nvme *nvme, int nsid, unsigned char *id) {
+  struct nvme_ns *ns;
+  unsigned long nszelo, nszehi;
+  int lbaf;
+  int lbads;
+  int rc;
+
+  rc = nvme_identify(nvme, NVME_ID_CNS_NS, nsid, id);
+  if (rc < 0) return rc;
+
+  // Skip inactive namespaces
+  nszelo = *(unsigned long *) (id + 0);
+  nszehi = *(unsigned long *) (id + 4);
+  if (nszelo == 0 && nszehi == 0) return 0;
+
+  // Get block size from the formatted LBA format
+  lbaf = id[26] & 0x0F;
+  lbads = id[128 + lbaf * 4 + 2];
+  if (lbads < 9 || lbads > PAGESHIFT) {
+    kprintf(KERN_WARNING "nvme: unsupported block size %d for namespace %d\n", 1 << lbads, nsid);
+    return -ENOSYS;
+  }
+
+  ns = (struct nvme_ns *) kmalloc(sizeof(struct nvme_ns));
+  if (!ns) return -ENOMEM;
+  memset(ns, 0, sizeof(struct nvme_ns));
+  ns->nvme = nvme;
+  ns->nsid = nsid;
+  ns->blksize = 1 << lbads;
+  ns->blocks = (nszehi || (nszelo & 0x80000000)) ? 0x7FFFFFFF : nszelo;
+
+  ns->next = nvme->namespaces;
+  nvme->namespaces = ns;
+
+  ns->devno = dev_make("nvme#", &nvme_driver, nvme->unit, ns);
+  kprintf(KERN_INFO "%s: %s namespace %d (%d MB, %d byte blocks)\n",
+          device(ns->devno)->name, nvme->model, nsid,
+          (int) ((unsigned __int64) ns->blocks * ns->blksize / (1024 * 1024)), ns->blksize);
+
+  create_partitions(ns->devno, ns->parts);
+  return 0;
+}
+
+static void nvme_print_latency(struct proc_file *pf, char *name, struct latency_histogram *lat) {
+  pprintf(pf, "%-8s %10u %8u %8u %8u %8u %8u\n", name, lat->samples,
+          nvme_percentile(lat, 500), nvme_percentile(lat, 900),
+          nvme_percentile(lat, 990), nvme_percentile(lat, 999), lat->max);
+}
+
+static int nvme_proc(struct proc_file *pf, void *arg) {
+  struct nvme *nvme;
+  struct nvme_ns *ns;
+  struct nvme_queue *q;
+  char name[DEVNAMELEN + 8];
+  int i;
+
+  for (nvme = nvme_list; nvme; nvme = nvme->next) {
+    pprintf(pf, "controller: %s (serial %s)\n", nvme->model, nvme->serial);
+    pprintf(pf, "max transfer: %d KB\n\n", nvme->maxxfer / 1024);
+
+    pprintf(pf, "queue  size   commands  maxq\n");
+    pprintf(pf, "----- ----- ---------- -----\n");
+    for (i = 0; i < nvme->nioqs; i++) {
+      q = &nvme->ioqs[i];
+      pprintf(pf, "%5d %5d %10u %5d\n", q->qid, q->size, q->commands, q->maxoutstanding);
+    }
+
+    pprintf(pf, "\nlatency (us)  samples      p50      p90      p99    p99.9      max\n");
+    pprintf(pf, "------------------- -------- -------- -------- -------- --------\n");
+    for (ns = nvme->namespaces; ns; ns = ns->next) {
+      sprintf(name, "%s rd", device(ns->devno)->name);
+      nvme_print_latency(pf, name, &ns->rdlat);
+      sprintf(name, "%s wr", device(ns->devno)->name);
+      nvme_print_latency(pf, name, &ns->wrlat);
+    }
+    pprintf(pf, "\n");
+  }
+
+  return 0;
+}
+
+static int install_nvme(struct unit *unit, char *opts) {
+  struct nvme *nvme;
+  struct nvme_sqe cmd;
+  unsigned char *id;
+  struct resource *bar;
+  unsigned long cap, caph;
+  unsigned long result;
+  int nqueues, qsize;
+  int nns;
+  int mdts;
+  int i;
+  int rc;
+
+  // Only initialize each controller once
+  for (nvme = nvme_list; nvme; nvme = nvme->next) {
+    if (nvme->unit == unit) return 0;
+  }
+
+  // Setup unit information
+  if (!unit) return -ENOSYS;
+  unit->vendorname = "NVMe";
+  unit->productname = "NVM Express Controller";
+
+  nqueues = get_num_option(opts, "queues", NVME_DEFAULT_QUEUES);
+  qsize = get_num_option(opts, "qsize", NVME_DEFAULT_QSIZE);
+  if (nqueues < 1) nqueues = 1;
+  if (nqueues > NVME_MAX_IOQUEUES) nqueues = NVME_MAX_IOQUEUES;
+  if (qsize < 2) qsize = 2;
+  if (qsize > NVME_MAX_QSIZE) qsize = NVME_MAX_QSIZE;
+
+  // Allocate memory for controller
+  nvme = (struct nvme *) kmalloc(sizeof(struct nvme));
+  if (!nvme) return -ENOMEM;
+  memset(nvme, 0, sizeof(struct nvme));
+  nvme->unit = unit;
+  nvme->irq = get_unit_irq(unit);
+
+  // Map controller registers (BAR0/BAR1) into kernel memory
+  bar = get_unit_resource(unit, RESOURCE_MEM, 0);
+  if (!bar || pci_read_config_dword(unit, PCI_CONFIG_BASE_ADDR_1) != 0) {
+    kprintf(KERN_ERR "nvme: controller registers not mapped below 4GB\n");
+    kfree(nvme);
+    return -ENODEV;
+  }
+  nvme->mmio = (char *) iomap(bar->start, bar->len);
+  pci_enable_busmastering(unit);
+
+  // Get controller capabilities
+  cap = NVME_REG(nvme, NVME_REG_CAP);
+  caph = NVME_REG(nvme, NVME_REG_CAP + 4);
+  nvme->dstrd = NVME_CAP_DSTRD(caph);
+  nvme->timeout = NVME_CAP_TO(cap) * 500;
+  if (NVME_CAP_MPSMIN(caph) != 0) {
+    kprintf(KERN_ERR "nvme: controller does not support 4K pages\n");
+    return -ENODEV;
+  }
+  if (qsize > (int) NVME_CAP_MQES(cap)) qsize = NVME_CAP_MQES(cap);
+
+  // Disable controller before setting up the admin queue
+  if (NVME_REG(nvme, NVME_REG_CC) & NVME_CC_EN) {
+    NVME_REG(nvme, NVME_REG_CC) &= ~NVME_CC_EN;
+  }
+  rc = nvme_wait_ready(nvme, 0);
+  if (rc < 0) return rc;
+
+  rc = nvme_alloc_queue(nvme, &nvme->adminq, 0, NVME_ADMIN_QSIZE);
+  if (rc < 0) return rc;
+  NVME_REG(nvme, NVME_REG_AQA) = ((NVME_ADMIN_QSIZE - 1) << 16) | (NVME_ADMIN_QSIZE - 1);
+  NVME_REG(nvme, NVME_REG_ASQ) = virt2phys(nvme->adminq.sq);
+  NVME_REG(nvme, NVME_REG_ASQ + 4) = 0;
+  NVME_REG(nvme, NVME_REG_ACQ) = virt2phys(nvme->adminq.cq);
+  NVME_REG(nvme, NVME_REG_ACQ + 4) = 0;
+
+  // Enable controller
+  NVME_REG(nvme, NVME_REG_CC) = NVME_CC_IOSQES | NVME_CC_IOCQES | NVME_CC_EN;
+  rc = nvme_wait_ready(nvme, 1);
+  if (rc < 0) {
+    kprintf(KERN_ERR "nvme: error %d enabling controller\n", rc);
+    return rc;
+  }
+
+  // Enable interrupts
+  init_dpc(&nvme->dpc);
+  register_interrupt(&nvme->intr, IRQ2INTR(nvme->irq), nvme_handler, nvme);
+  enable_irq(nvme->irq);
+  NVME_REG(nvme, NVME_REG_INTMC) = 1;
+
+  nvme->next = nvme_list;
+  if (!nvme_list) register_proc_inode("nvme", nvme_proc, NULL);
+  nvme_list = nvme;
+
+  // Identify controller
+  id = (unsigned char *) alloc_pages_linear(1, 'NVME');
+  if (!id) return -ENOMEM;
+  rc = nvme_identify(nvme, NVME_ID_CNS_CTRL, 0, id);
+  if (rc < 0) goto out;
+
+  nvme_copy_string(nvme->serial, id + 4, 20);
+  nvme_copy_string(nvme->model, id + 24, 40);
+  mdts = id[77];
+  nns = *(unsigned long *) (id + 516);
+  if (nns > NVME_MAX_NAMESPACES) nns = NVME_MAX_NAMESPACES;
+
+  nvme->maxxfer = NVME_MAX_XFER;
+  if (mdts && mdts < 16 && (PAGESIZE << mdts) < nvme->maxxfer) nvme->maxxfer = PAGESIZE << mdts;
+
+  // Request I/O queue pairs
+  memset(&cmd, 0, sizeof(struct nvme_sqe));
+  cmd.opcode = NVME_ADMIN_SET_FEATURES;
+  cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+  cmd.cdw11 = ((nqueues - 1) << 16) | (nqueues - 1);
+  rc = nvme_submit(&nvme->adminq, &cmd, NULL, 0, NULL, &result);
+  if (rc < 0) goto out;
+  if ((int) (result & 0xFFFF) + 1 < nqueues) nqueues = (result & 0xFFFF) + 1;
+  if ((int) (result >> 16) + 1 < nqueues) nqueues = (result >> 16) + 1;
+
+  // Create I/O queue pairs
+  for (i = 0; i < nqueues; i++) {
+    rc = nvme_create_ioqueue(nvme, &nvme->ioqs[i], i + 1, qsize);
+    if (rc < 0) {
+      kprintf(KERN_ERR "nvme: error %d creating I/O queue %d\n", rc, i + 1);
+      break;
+    }
+    nvme->nioqs++;
+  }
+  if (nvme->nioqs == 0) {
+    rc = -EIO;
+    goto out;
+  }
+  kprintf(KERN_INFO "nvme: %s, %d I/O queues with %d entries\n", nvme->model, nvme->nioqs, qsize);
+
+  // Create devices for active namespaces
+  for (i = 1; i <= nns; i++) nvme_setup_namespace(nvme, i, id);
+  rc = 0;
+
+out:
+  free_pages(id, 1);
+  return rc;
+}
+
+int __declspec(dllexport) nvme(struct unit *unit, char *opts) {
+  return install_nvme(unit, opts);
+}
+
+void init_nvme() {
+  // Try to find an NVMe controller for booting
+  struct unit *unit = lookup_unit_by_class(NULL, PCI_CLASS_STORAGE_NVME, 0xFFFFFF);
+  if (unit) install_nvme(unit, NULL);
+}
@@ -100,9 +100,11 @@ int dfs_utime(struct fs *fs, char *name, struct utimbuf *times) {
     return rc;
   }
 
+  begin_transaction(inode->fs);
   if (times->ctime != -1) inode->desc->ctime = times->ctime;
   if (times->modtime != -1) inode->desc->mtime = times->modtime;
   mark_inode_dirty(inode);
+  end_transaction(inode->fs);
 
   release_inode(inode);
   return 0;
@@ -116,7 +118,7 @@ int dfs_stat(struct fs *fs, char *name, struct stat64 *buffer) {
   rc = namei((struct filsys *) fs->data, name, &inode);
   if (rc < 0) return rc;
 
-  size = inode->desc->size;
+  size = get_file_size(inode);
 
   if (buffer) {
     memset(buffer, 0, sizeof(struct stat64));
@@ -131,7 +133,7 @@ int dfs_stat(struct fs *fs, char *name, struct stat64 *buffer) {
     buffer->st_atime = time(NULL);
     buffer->st_mtime = inode->desc->mtime;
     buffer->st_ctime = inode->desc->ctime;
-    buffer->st_size = inode->desc->size;
+    buffer->st_size = size;
   }
 
   release_inode(inode);
@@ -164,7 +166,7 @@ int dfs_access(struct fs *fs, char *name, int mode) {
   return rc;
 }
 
-int dfs_mkdir(struct fs *fs, char *name, int mode) {
+static int do_mkdir(struct fs *fs, char *name, int mode) {
   struct inode *parent;
   ino_t ino;
   struct inode *dir;
@@ -201,7 +203,16 @@ int dfs_mkdir(struct fs *fs, char *name, int mode) {
   return 0;
 }
 
-int dfs_rmdir(struct fs *fs, char *name) {
+int dfs_mkdir(struct fs *fs, char *name, int mode) {
+  int rc;
+
+  begin_transaction((struct filsys *) fs->data);
+  rc = do_mkdir(fs, name, mode);
+  end_transaction((struct filsys *) fs->data);
+  return rc;
+}
+
+static int do_rmdir(struct fs *fs, char *name) {
   struct inode *parent;
   struct inode *dir;
   ino_t ino;
@@ -262,7 +273,16 @@ int dfs_rmdir(struct fs *fs, char *name) {
   return 0;
 }
 
-int dfs_rename(struct fs *fs, char *oldname, char *newname) {
+int dfs_rmdir(struct fs *fs, char *name) {
+  int rc;
+
+  begin_transaction((struct filsys *) fs->data);
+  rc = do_rmdir(fs, name);
+  end_transaction((struct filsys *) fs->data);
+  return rc;
+}
+
+static int do_rename(struct fs *fs, char *oldname, char *newname) {
   struct inode *oldparent;
   struct inode *newparent;
   int oldlen;
@@ -320,7 +340,16 @@ int dfs_rename(struct fs *fs, char *oldname, char *newname) {
   return 0;
 }
 
-int dfs_link(struct fs *fs, char *oldname, char *newname) {
+int dfs_rename(struct fs *fs, char *oldname, char *newname) {
+  int rc;
+
+  begin_transaction((struct filsys *) fs->data);
+  rc = do_rename(fs, oldname, newname);
+  end_transaction((struct filsys *) fs->data);
+  return rc;
+}
+
+static int do_link(struct fs *fs, char *oldname, char *newname) {
   struct inode *inode;
   struct inode *parent;
   int len;
@@ -359,7 +388,16 @@ int dfs_link(struct fs *fs, char *oldname, char *newname) {
   return 0;
 }
 
-int dfs_unlink(struct fs *fs, char *name) {
+int dfs_link(struct fs *fs, char *oldname, char *newname) {
+  int rc;
+
+  begin_transaction((struct filsys *) fs->data);
+  rc = do_link(fs, oldname, newname);
+  end_transaction((struct filsys *) fs->data);
+  return rc;
+}
+
+static int do_unlink(struct fs *fs, char *name) {
   struct inode *dir;
   struct inode *inode;
   ino_t ino;
@@ -407,6 +445,15 @@ int dfs_unlink(struct fs *fs, char *name) {
   return 0;
 }
 
+int dfs_unlink(struct fs *fs, char *name) {
+  int rc;
+
+  begin_transaction((struct filsys *) fs->data);
+  rc = do_unlink(fs, name);
+  end_transaction((struct filsys *) fs->data);
+  return rc;
+}
+
 int dfs_chmod(struct fs *fs, char *name, int mode) {
   struct thread *thread = self();
   struct inode *inode;
@@ -420,9 +467,10 @@ int dfs_chmod(struct fs *fs, char *name, int mode) {
     return -EPERM;
   }
 
+  begin_transaction(inode->fs);
   inode->desc->mode = (inode->desc->mode & ~S_IRWXUGO) | (mode & S_IRWXUGO);
-
   mark_inode_dirty(inode);
+  end_transaction(inode->fs);
 
   release_inode(inode);
   return 0;
@@ -441,10 +489,11 @@ int dfs_chown(struct fs *fs, char *name, int owner, int group) {
     return -EPERM;
   }
 
+  begin_transaction(inode->fs);
   if (owner != -1) inode->desc->uid = owner;
   if (group != -1) inode->desc->gid = group;
-
   mark_inode_dirty(inode);
+  end_transaction(inode->fs);
 
   release_inode(inode);
   return 0;
@@ -114,7 +114,7 @@ int add_dir_entry(struct inode *dir, char *name, int len, ino_t ino) {
 
         de->reclen = minlen;
 
-        mark_buffer_updated(dir->fs->cache, buf);
+        journal_buffer(dir->fs, buf);
         release_buffer(dir->fs->cache, buf);
 
         dir->desc->mtime = time(NULL);
@@ -145,7 +145,7 @@ int add_dir_entry(struct inode *dir, char *name, int len, ino_t ino) {
   newde->namelen = len;
   memcpy(newde->name, name, len);
 
-  mark_buffer_updated(dir->fs->cache, buf);
+  journal_buffer(dir->fs, buf);
   release_buffer(dir->fs->cache, buf);
 
   return 0;
@@ -177,7 +177,7 @@ int modify_dir_entry(struct inode *dir, char *name, int len, ino_t ino, ino_t *o
       if (fnmatch(name, len, de->name, de->namelen)) {
         if (oldino) *oldino = de->ino;
         de->ino = ino;
-        mark_buffer_updated(dir->fs->cache, buf);
+        journal_buffer(dir->fs, buf);
         release_buffer(dir->fs->cache, buf);
 
         return 0;
@@ -223,7 +223,7 @@ int delete_dir_entry(struct inode *dir, char *name, int len) {
           // Merge entry with previous entry
           prevde->reclen += de->reclen;
           memset(de, 0, de->reclen);
-          mark_buffer_updated(dir->fs->cache, buf);
+          journal_buffer(dir->fs, buf);
         } else if (de->reclen == dir->fs->blocksize) {
           // Block is empty, swap this block with last block and truncate
           if (block != dir->desc->blocks - 1) {
@@ -243,7 +243,7 @@ int delete_dir_entry(struct inode *dir, char *name, int len) {
           de->reclen += nextde->reclen;
           de->namelen = nextde->namelen;
           memmove(de->name, nextde->name, nextde->namelen);
-          mark_buffer_updated(dir->fs->cache, buf);
+          journal_buffer(dir->fs, buf);
         }
 
         release_buffer(dir->fs->cache, buf);
@@ -223,6 +223,221 @@ static int create_new(struct filsys *fs, char *name, ino_t ino, int mode, struct
   return 0;
 }
 
+//
+// Delayed allocation
+//
+// Data appended to a regular file is kept in memory and disk blocks are not
+// allocated until the delayed blocks fill a window, the file system has too
+// many delayed blocks, or the file system is synced. The delayed blocks are
+// then allocated as contiguous runs following the last block of the file.
+// The delayed blocks of a file always follow its allocated blocks, and the
+// file size in the inode only covers the allocated blocks.
+//
+
+static struct delalloc *find_delalloc(struct filsys *fs, ino_t ino) {
+  struct delalloc *da;
+
+  for (da = fs->delalloc; da; da = da->next) {
+    if (da->ino == ino) return da;
+  }
+
+  return NULL;
+}
+
+static void free_delalloc(struct filsys *fs, struct delalloc *da) {
+  struct delalloc **p;
+  int i;
+
+  for (p = &fs->delalloc; *p; p = &(*p)->next) {
+    if (*p == da) {
+      *p = da->next;
+      break;
+    }
+  }
+
+  for (i = 0; i < da->count; i++) kfree(da->blocks[i]);
+  fs->delayed_blocks -= da->count;
+  kfree(da);
+}
+
+static int allocate_delayed(struct filsys *fs, struct delalloc *da) {
+  struct inode *inode;
+  struct buf *buf;
+  blkno_t goal;
+  blkno_t block;
+  off64_t size;
+  int allocated;
+  int i, n;
+  int rc;
+
+  rc = get_inode(fs, da->ino, &inode);
+  if (rc < 0) return rc;
+
+  // Place the blocks after the last block of the file
+  if (inode->desc->blocks > 0) {
+    goal = get_inode_block(inode, inode->desc->blocks - 1) + 1;
+  } else {
+    goal = inode->ino / fs->super->inodes_per_group * fs->super->blocks_per_group;
+  }
+
+  i = 0;
+  while (i < da->count) {
+    // Allocate a run of blocks for the remaining delayed blocks
+    block = new_blocks(fs, goal, da->count - i, &allocated);
+    if (block == NOBLOCK) {
+      rc = -ENOSPC;
+      break;
+    }
+
+    for (n = 0; n < allocated; n++) {
+      buf = alloc_buffer(fs->cache, block + n);
+      if (!buf) break;
+
+      if (append_inode_block(inode, block + n) == NOBLOCK) {
+        mark_buffer_invalid(fs->cache, buf);
+        release_buffer(fs->cache, buf);
+        break;
+      }
+
+      memcpy(buf->data, da->blocks[i], fs->blocksize);
+      mark_buffer_updated(fs->cache, buf);
+      release_buffer(fs->cache, buf);
+
+      kfree(da->blocks[i++]);
+    }
+
+    if (n < allocated) {
+      // Return the unused part of the run
+      for (; n < allocated; n++) {
+        goal = block + n;
+        free_blocks(fs, &goal, 1);
+      }
+      rc = -EIO;
+      break;
+    }
+
+    goal = block + allocated;
+  }
+
+  // Extend file size to cover the allocated blocks
+  size = (off64_t) inode->desc->blocks * fs->blocksize;
+  if (da->size < size) size = da->size;
+  if (size > inode->desc->size) {
+    inode->desc->size = size;
+    mark_inode_dirty(inode);
+  }
+
+  // Remove the allocated blocks from the delayed blocks
+  fs->delayed_blocks -= i;
+  da->count -= i;
+  da->first = inode->desc->blocks;
+  if (da->count > 0) {
+    memmove(da->blocks, da->blocks + i, da->count * sizeof(char *));
+  } else {
+    free_delalloc(fs, da);
+  }
+
+  release_inode(inode);
+  return rc;
+}
+
+static int write_delayed(struct inode *inode, unsigned int iblock, unsigned int start, char *p, size_t count, off64_t end) {
+  struct filsys *fs = inode->fs;
+  struct delalloc *da;
+  char *data;
+  int rc = 0;
+
+  wait_for_object(&fs->dalock, INFINITE);
+
+  // Allocate blocks if the window is full or there are too many delayed blocks
+  da = find_delalloc(fs, inode->ino);
+  if (fs->delayed_blocks >= DFS_DELALLOC_LIMIT) {
+    rc = flush_delayed_blocks(fs, NOINODE);
+    da = find_delalloc(fs, inode->ino);
+  } else if (da && iblock >= da->first + DFS_DELALLOC_WINDOW) {
+    rc = allocate_delayed(fs, da);
+    da = find_delalloc(fs, inode->ino);
+  }
+
+  // Write directly to the file if the block has been allocated or the
+  // delayed blocks cannot be reserved on disk
+  if (rc < 0 || iblock < inode->desc->blocks || (da && iblock > da->first + da->count)) {
+    release_mutex(&fs->dalock);
+    return rc;
+  }
+  if (fs->super->free_block_count <= fs->delayed_blocks + DFS_MAX_DEPTH) {
+    if (da) rc = allocate_delayed(fs, da);
+    release_mutex(&fs->dalock);
+    return rc;
+  }
+
+  if (!da) {
+    da = (struct delalloc *) kmalloc(sizeof(struct delalloc));
+    if (!da) {
+      release_mutex(&fs->dalock);
+      return -ENOMEM;
+    }
+    memset(da, 0, sizeof(struct delalloc));
+    da->ino = inode->ino;
+    da->first = inode->desc->blocks;
+    da->size = inode->desc->size;
+    da->next = fs->delalloc;
+    fs->delalloc = da;
+  }
+
+  if (iblock == da->first + da->count) {
+    data = (char *) kmalloc(fs->blocksize);
+    if (!data) {
+      release_mutex(&fs->dalock);
+      return -ENOMEM;
+    }
+    memset(data, 0, fs->blocksize);
+    da->blocks[da->count++] = data;
+    fs->delayed_blocks++;
+  }
+
+  memcpy(da->blocks[iblock - da->first] + start, p, count);
+  if (end > da->size) da->size = end;
+
+  release_mutex(&fs->dalock);
+  return count;
+}
+
+int flush_delayed_blocks(struct filsys *fs, ino_t ino) {
+  struct delalloc *da;
+  int rc = 0;
+
+  wait_for_object(&fs->dalock, INFINITE);
+  if (ino == NOINODE) {
+    while (fs->delalloc) {
+      rc = allocate_delayed(fs, fs->delalloc);
+      if (rc < 0) break;
+    }
+  } else {
+    da = find_delalloc(fs, ino);
+    if (da) rc = allocate_delayed(fs, da);
+  }
+  release_mutex(&fs->dalock);
+
+  return rc;
+}
+
+void discard_delayed_blocks(struct filsys *fs, ino_t ino) {
+  struct delalloc *da;
+
+  wait_for_object(&fs->dalock, INFINITE);
+  da = find_delalloc(fs, ino);
+  if (da) free_delalloc(fs, da);
+  release_mutex(&fs->dalock);
+}
+
+off64_t get_file_size(struct inode *inode) {
+  struct delalloc *da;
+
+  da = inode->fs->delalloc ? find_delalloc(inode->fs, inode->ino) : NULL;
+  return da ? da->size : inode->desc->size;
+}
+
 int dfs_open(struct file *filp, char *name) {
   struct filsys *fs;
   struct inode *inode;
@@ -230,6 +445,7 @@ int dfs_open(struct file *filp, char *name) {
 
   fs = (struct filsys *) filp->fs->data;
 
+  begin_transaction(fs);
   switch (filp->flags & (O_CREAT | O_EXCL | O_TRUNC | O_SPECIAL)) {
     case 0:
     case O_EXCL:
@@ -269,12 +485,14 @@ int dfs_open(struct file *filp, char *name) {
       break;
 
     default:
+      end_transaction(fs);
       return -EINVAL;
   }
+  end_transaction(fs);
 
   if (rc < 0) return rc;
 
-  if (filp->flags & O_APPEND) filp->pos = inode->desc->size;
+  if (filp->flags & O_APPEND) filp->pos = get_file_size(inode);
 
   filp->data = inode;
   filp->mode = inode->desc->mode;
@@ -289,8 +507,10 @@ int dfs_close(struct file *filp) {
 
   inode = (struct inode *) filp->data;
   if (filp->flags & F_MODIFIED) {
+    begin_transaction(inode->fs);
     inode->desc->mtime = time(NULL);
     mark_inode_dirty(inode);
+    end_transaction(inode->fs);
   }
 
   if (filp->flags & O_TEMPORARY) unlink(filp->path);
@@ -311,7 +531,26 @@ int dfs_fsync(struct file *filp) {
   int rc;
   struct inode *inode = (struct inode *) filp->data;
 
+  // Allocate delayed blocks
+  begin_transaction(inode->fs);
+  rc = flush_delayed_blocks(inode->fs, NOINODE);
+  end_transaction(inode->fs);
+  if (rc < 0) return rc;
+
+  // With a journal only the file data and the running transaction need to be
+  // written. Concurrent fsyncs share a single journal commit.
+  if (inode->fs->journal) {
+    rc = commit_journal(inode->fs);
+    if (rc < 0) return rc;
+
+    rc = flush_data_buffers(inode->fs->cache);
+    if (rc < 0) return rc;
+
+    return 0;
+  }
+
   // Flush and sync buffer cache for entire file system
+
   rc = flush_buffers(inode->fs->cache, 0);
   if (rc < 0) return rc;
 
@@ -323,42 +562,85 @@ int dfs_fsync(struct file *filp) {
 
 int dfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
   struct inode *inode;
+  struct filsys *fs;
+  struct delalloc *da;
   size_t read;
   size_t count;
   off64_t left;
+  off64_t filesize;
   char *p;
   unsigned int iblock;
   unsigned int start;
   blkno_t blk;
   struct buf *buf;
+  int delayed;
+  int rc;
 
   inode = (struct inode *) filp->data;
+  fs = inode->fs;
+
+  // Delayed blocks must be allocated before direct reads
+  if (filp->flags & O_DIRECT) {
+    begin_transaction(fs);
+    rc = flush_delayed_blocks(fs, inode->ino);
+    end_transaction(fs);
+    if (rc < 0) return rc;
+  }
+
+  // Lock delayed blocks if the read extends beyond the allocated blocks
+  filesize = get_file_size(inode);
+  delayed = filesize > (off64_t) inode->desc->blocks * fs->blocksize && pos + size > (off64_t) inode->desc->blocks * fs->blocksize;
+  if (delayed) {
+    wait_for_object(&fs->dalock, INFINITE);
+    filesize = get_file_size(inode);
+  }
+
   read = 0;
+  rc = 0;
   p = (char *) data;
-  while (pos < inode->desc->size && size > 0) {
-    if (filp->flags & F_CLOSED) return -EINTR;
+  while (pos < filesize && size > 0) {
+    if (filp->flags & F_CLOSED) {
+      rc = -EINTR;
+      break;
+    }
 
-    iblock = (unsigned int) (pos / inode->fs->blocksize);
-    start = (unsigned int) (pos % inode->fs->blocksize);
+    iblock = (unsigned int) (pos / fs->blocksize);
+    start = (unsigned int) (pos % fs->blocksize);
 
-    count = inode->fs->blocksize - start;
+    count = fs->blocksize - start;
     if (count > size) count = size;
 
-    left = inode->desc->size - (size_t) pos;
+    left = filesize - (size_t) pos;
     if (count > left) count = (size_t) left;
     if (count <= 0) break;
 
-    blk = get_inode_block(inode, iblock);
-    if (blk == NOBLOCK) return -EIO;
-
-    if (filp->flags & O_DIRECT) {
-      if (start != 0 || count != inode->fs->blocksize) return read;
-      if (dev_read(inode->fs->devno, p, count, blk, 0) != (int) count) return read;
+    if (iblock >= inode->desc->blocks) {
+      // Read data from delayed block
+      da = delayed ? find_delalloc(fs, inode->ino) : NULL;
+      if (!da || iblock < da->first || iblock >= da->first + da->count) {
+        rc = -EIO;
+        break;
+      }
+      memcpy(p, da->blocks[iblock - da->first] + start, count);
     } else {
-      buf = get_buffer(inode->fs->cache, blk);
-      if (!buf) return -EIO;
-      memcpy(p, buf->data + start, count);
-      release_buffer(inode->fs->cache, buf);
+      blk = get_inode_block(inode, iblock);
+      if (blk == NOBLOCK) {
+        rc = -EIO;
+        break;
+      }
+
+      if (filp->flags & O_DIRECT) {
+        if (start != 0 || count != fs->blocksize) break;
+        if (dev_read(fs->devno, p, count, blk, 0) != (int) count) break;
+      } else {
+        buf = get_buffer(fs->cache, blk);
+        if (!buf) {
+          rc = -EIO;
+          break;
+        }
+        memcpy(p, buf->data + start, count);
+        release_buffer(fs->cache, buf);
+      }
     }
 
     pos += count;
@@ -367,10 +649,15 @@ int dfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
     size -= count;
   }
 
+  if (delayed) release_mutex(&fs->dalock);
+  if (rc < 0) return rc;
+
   return read;
 }
 
-int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
+static int truncate_file(struct file *filp, off64_t size);
+
+static int write_file(struct file *filp, void *data, size_t size, off64_t pos) {
   struct inode *inode;
   size_t written;
   size_t count;
@@ -383,12 +670,18 @@ int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
 
   inode = (struct inode *) filp->data;
 
-  if (filp->flags & O_APPEND) pos = inode->desc->size;
+  if (filp->flags & O_APPEND) pos = get_file_size(inode);
   if (pos + size > DFS_MAXFILESIZE) return -EFBIG;
   if (S_ISDIR(inode->desc->mode)) return -EISDIR;
 
-  if (pos > inode->desc->size) {
-    rc = dfs_ftruncate(filp, pos);
+  if (pos > get_file_size(inode)) {
+    rc = truncate_file(filp, pos);
+    if (rc < 0) return rc;
+  }
+
+  // Delayed blocks must be allocated before direct writes
+  if (filp->flags & O_DIRECT) {
+    rc = flush_delayed_blocks(inode->fs, inode->ino);
     if (rc < 0) return rc;
   }
 
@@ -403,31 +696,45 @@ int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
     count = inode->fs->blocksize - start;
     if (count > size) count = size;
 
-    if (iblock < inode->desc->blocks) {
-      blk = get_inode_block(inode, iblock);
-      if (blk == NOBLOCK) return -EIO;
-    } else if (iblock == inode->desc->blocks) {
-      blk = expand_inode(inode);
-      if (blk == NOBLOCK) return -ENOSPC;
-    } else {
-      return written;
+    // Delay allocation of blocks appended to regular files
+    rc = 0;
+    if (iblock >= inode->desc->blocks && S_ISREG(inode->desc->mode) && !(filp->flags & O_DIRECT)) {
+      rc = write_delayed(inode, iblock, start, p, count, pos + count);
+      if (rc < 0) return rc;
     }
 
-    if (filp->flags & O_DIRECT) {
-      if (start != 0 || count != inode->fs->blocksize) return written;
-      if (dev_write(inode->fs->devno, p, count, blk, 0) != (int) count) return written;
-    } else {
-      if (count == inode->fs->blocksize) {
-        buf = alloc_buffer(inode->fs->cache, blk);
+    if (rc == 0) {
+      if (iblock < inode->desc->blocks) {
+        blk = get_inode_block(inode, iblock);
+        if (blk == NOBLOCK) return -EIO;
+      } else if (iblock == inode->desc->blocks) {
+        blk = expand_inode(inode);
+        if (blk == NOBLOCK) return -ENOSPC;
       } else {
-        buf = get_buffer(inode->fs->cache, blk);
+        return written;
       }
-      if (!buf) return -EIO;
 
-      memcpy(buf->data + start, p, count);
+      if (filp->flags & O_DIRECT) {
+        if (start != 0 || count != inode->fs->blocksize) return written;
+        if (dev_write(inode->fs->devno, p, count, blk, 0) != (int) count) return written;
+      } else {
+        if (count == inode->fs->blocksize) {
+          buf = alloc_buffer(inode->fs->cache, blk);
+        } else {
+          buf = get_buffer(inode->fs->cache, blk);
+        }
+        if (!buf) return -EIO;
 
-      mark_buffer_updated(inode->fs->cache, buf);
-      release_buffer(inode->fs->cache, buf);
+        memcpy(buf->data + start, p, count);
+
+        mark_buffer_updated(inode->fs->cache, buf);
+        release_buffer(inode->fs->cache, buf);
+      }
+
+      if (pos + count > inode->desc->size) {
+        inode->desc->size = pos + count;
+        mark_inode_dirty(inode);
+      }
     }
 
     filp->flags |= F_MODIFIED;
@@ -435,17 +742,44 @@ int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
     p += count;
     written += count;
     size -= count;
-
-    if (pos > inode->desc->size) {
-      inode->desc->size = pos;
-      mark_inode_dirty(inode);
-    }
   }
 
   return written;
 }
 
+int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
+  struct filsys *fs = ((struct inode *) filp->data)->fs;
+  int rc;
+
+  begin_transaction(fs);
+  rc = write_file(filp, data, size, pos);
+  end_transaction(fs);
+  return rc;
+}
+
 int dfs_ioctl(struct file *filp, int cmd, void *data, size_t size) {
+  struct inode *inode;
+  unsigned int iblock;
+  blkno_t blk;
+  blkno_t prev;
+  int extents;
+
+  inode = (struct inode *) filp->data;
+
+  switch (cmd) {
+    case FIOEXTENTS:
+      // Count the runs of consecutive blocks allocated to the file
+      extents = 0;
+      prev = NOBLOCK;
+      for (iblock = 0; iblock < inode->desc->blocks; iblock++) {
+        blk = get_inode_block(inode, iblock);
+        if (blk == NOBLOCK) return -EIO;
+        if (iblock == 0 || blk != prev + 1) extents++;
+        prev = blk;
+      }
+      return extents;
+  }
+
   return -ENOSYS;
 }
 
@@ -460,7 +794,7 @@ off64_t dfs_lseek(struct file *filp, off64_t offset, int origin) {
 
   switch (origin) {
     case SEEK_END:
-      offset += inode->desc->size;
+      offset += get_file_size(inode);
       break;
 
     case SEEK_CUR:
@@ -473,7 +807,7 @@ off64_t dfs_lseek(struct file *filp, off64_t offset, int origin) {
   return offset;
 }
 
-int dfs_ftruncate(struct file *filp, off64_t size) {
+static int truncate_file(struct file *filp, off64_t size) {
   struct inode *inode;
   int rc;
   unsigned int blocks;
@@ -486,6 +820,10 @@ int dfs_ftruncate(struct file *filp, off64_t size) {
   if (S_ISDIR(inode->desc->mode)) return -EISDIR;
 
   if (size < 0) return -EINVAL;
+
+  // Allocate delayed blocks before changing the file size
+  rc = flush_delayed_blocks(inode->fs, inode->ino);
+  if (rc < 0) return rc;
   if (size == inode->desc->size) return 0;
 
   blocks = ((size_t) size + inode->fs->blocksize - 1) / inode->fs->blocksize;
@@ -516,14 +854,26 @@ int dfs_ftruncate(struct file *filp, off64_t size) {
   return 0;
 }
 
+int dfs_ftruncate(struct file *filp, off64_t size) {
+  struct filsys *fs = ((struct inode *) filp->data)->fs;
+  int rc;
+
+  begin_transaction(fs);
+  rc = truncate_file(filp, size);
+  end_transaction(fs);
+  return rc;
+}
+
 int dfs_futime(struct file *filp, struct utimbuf *times) {
   struct inode *inode;
 
   inode = (struct inode *) filp->data;
+  begin_transaction(inode->fs);
   if (times->ctime != -1) inode->desc->ctime = times->ctime;
   if (times->modtime != -1) inode->desc->mtime = times->modtime;
   filp->flags &= ~F_MODIFIED;
   mark_inode_dirty(inode);
+  end_transaction(inode->fs);
 
   return 0;
 }
@@ -533,7 +883,7 @@ int dfs_fstat(struct file *filp, struct stat64 *buffer) {
   off64_t size;
 
   inode = (struct inode *) filp->data;
-  size = inode->desc->size;
+  size = get_file_size(inode);
   
   if (buffer) {
     memset(buffer, 0, sizeof(struct stat64));
@@ -547,7 +897,7 @@ int dfs_fstat(struct file *filp, struct stat64 *buffer) {
     buffer->st_atime = time(NULL);
     buffer->st_mtime = inode->desc->mtime;
     buffer->st_ctime = inode->desc->ctime;
-    buffer->st_size = inode->desc->size;
+    buffer->st_size = size;
   }
 
   return (int) size;
@@ -559,8 +909,10 @@ int dfs_fchmod(struct file *filp, int mode) {
 
   inode = (struct inode *) filp->data;
   if (thread->euid != 0 && thread->euid != inode->desc->uid) return -EPERM;
+  begin_transaction(inode->fs);
   inode->desc->mode = (inode->desc->mode & ~S_IRWXUGO) | (mode & S_IRWXUGO);
   mark_inode_dirty(inode);
+  end_transaction(inode->fs);
 
   return 0;
 }
@@ -571,9 +923,11 @@ int dfs_fchown(struct file *filp, int owner, int group) {
 
   inode = (struct inode *) filp->data;
   if (thread->euid != 0) return -EPERM;
+  begin_transaction(inode->fs);
   if (owner != -1) inode->desc->uid = owner;
   if (group != -1) inode->desc->gid = group;
   mark_inode_dirty(inode);
+  end_transaction(inode->fs);
 
   return 0;
 }
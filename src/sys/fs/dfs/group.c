@@ -34,7 +34,7 @@
 #include <os/krnl.h>
 
 static void mark_group_desc_dirty(struct filsys *fs, int group) {
-  mark_buffer_updated(fs->cache, fs->groupdesc_buffers[group / fs->groupdescs_per_block]);
+  journal_buffer(fs, fs->groupdesc_buffers[group / fs->groupdescs_per_block]);
 }
 
 blkno_t new_block(struct filsys *fs, blkno_t goal) {
@@ -90,7 +90,7 @@ blkno_t new_block(struct filsys *fs, blkno_t goal) {
 
 block_found:
   set_bit(buf->data, block);
-  mark_buffer_updated(fs->cache, buf);
+  journal_buffer(fs, buf);
 
   fs->super->free_block_count--;
   fs->super_dirty = 1;
@@ -104,6 +104,73 @@ block_found:
   return block;
 }
 
+blkno_t new_blocks(struct filsys *fs, blkno_t goal, int count, int *allocated) {
+  unsigned int group;
+  unsigned int limit;
+  unsigned int block;
+  unsigned int best;
+  int bestlen;
+  int len;
+  unsigned int i;
+  struct buf *buf;
+
+  // Search the groups cyclicly starting with the goal, looking for a run of
+  // free blocks long enough for the request. Use the longest run found in the
+  // first group with free blocks if no run is long enough.
+  group = goal < fs->super->block_count ? goal / fs->super->blocks_per_group : 0;
+  for (i = 0; i < fs->super->group_count; i++) {
+    if (fs->groups[group].desc->free_block_count > 0) {
+      // Get block bitmap
+      buf = get_buffer(fs->cache, fs->groups[group].desc->block_bitmap_block);
+      if (!buf) return NOBLOCK;
+
+      limit = fs->groups[group].desc->block_count;
+      block = i == 0 && goal < fs->super->block_count ? goal % fs->super->blocks_per_group : 0;
+      best = 0;
+      bestlen = 0;
+      block = find_next_zero_bit(buf->data, limit, block);
+      while (block < limit) {
+        len = 1;
+        while (len < count && block + len < limit && !test_bit(buf->data, block + len)) len++;
+        if (len > bestlen) {
+          best = block;
+          bestlen = len;
+        }
+        if (len == count) break;
+        block = find_next_zero_bit(buf->data, limit, block + len);
+      }
+
+      if (bestlen > 0) {
+        set_bits(buf->data, best, bestlen);
+        journal_buffer(fs, buf);
+
+        fs->super->free_block_count -= bestlen;
+        fs->super_dirty = 1;
+
+        if (fs->groups[group].first_free_block == best) fs->groups[group].first_free_block = best + bestlen;
+        fs->groups[group].desc->free_block_count -= bestlen;
+        mark_group_desc_dirty(fs, group);
+
+        release_buffer(fs->cache, buf);
+        *allocated = bestlen;
+        return best + group * fs->super->blocks_per_group;
+      }
+
+      release_buffer(fs->cache, buf);
+    }
+
+    // Try next group
+    group++;
+    if (group >= fs->super->group_count) group = 0;
+  }
+
+  // Free blocks may still exist before the goal in the goal group
+  block = new_block(fs, goal);
+  if (block == NOBLOCK) return NOBLOCK;
+  *allocated = 1;
+  return block;
+}
+
 void free_blocks(struct filsys *fs, blkno_t *blocks, int count) {
   unsigned int group;
   unsigned int prev_group;
@@ -126,7 +193,8 @@ void free_blocks(struct filsys *fs, blkno_t *blocks, int count) {
     }
 
     clear_bit(buf->data, block);
-    mark_buffer_updated(fs->cache, buf);
+    journal_buffer(fs, buf);
+    revoke_block(fs, blocks[i]);
 
     fs->super->free_block_count++;
     fs->super_dirty = 1;
@@ -189,7 +257,7 @@ ino_t new_inode(struct filsys *fs, ino_t parent, int dir) {
 
   // Mark inode as used
   set_bit(buf->data, ino);
-  mark_buffer_updated(fs->cache, buf);
+  journal_buffer(fs, buf);
 
   fs->super->free_inode_count--;
   fs->super_dirty = 1;
@@ -215,7 +283,7 @@ void free_inode(struct filsys *fs, ino_t ino) {
   if (!buf) return;
 
   clear_bit(buf->data, ino);
-  mark_buffer_updated(fs->cache, buf);
+  journal_buffer(fs, buf);
 
   fs->super->free_inode_count++;
   fs->super_dirty = 1;
@@ -48,7 +48,7 @@ static void split_levels(struct inode *inode, unsigned int iblock, unsigned int
 }
 
 void mark_inode_dirty(struct inode *inode) {
-  mark_buffer_updated(inode->fs->cache, inode->buf);
+  journal_buffer(inode->fs, inode->buf);
 }
 
 blkno_t get_inode_block(struct inode *inode, unsigned int iblock) {
@@ -126,7 +126,7 @@ blkno_t set_inode_block(struct inode *inode, unsigned int iblock, blkno_t block)
         dirblock = new_block(inode->fs, goal);
         if (dirblock == NOBLOCK) return NOBLOCK;
         ((blkno_t *) buf->data)[offsets[d]] = dirblock;
-        mark_buffer_updated(inode->fs->cache, buf);
+        journal_buffer(inode->fs, buf);
         release_buffer(inode->fs->cache, buf);
 
         buf = alloc_buffer(inode->fs->cache, dirblock);
@@ -152,7 +152,7 @@ blkno_t set_inode_block(struct inode *inode, unsigned int iblock, blkno_t block)
 
     // Update leaf with new block
     ((blkno_t *) buf->data)[offsets[d]] = block;
-    mark_buffer_updated(inode->fs->cache, buf);
+    journal_buffer(inode->fs, buf);
     release_buffer(inode->fs->cache, buf);
   }
 
@@ -163,27 +163,11 @@ struct inode *alloc_inode(struct inode *parent, unsigned short mode) {
   struct thread *thread = self();
   ino_t ino;
   struct inode *inode;
-  unsigned int group;
-  unsigned int block;
 
   ino = new_inode(parent->fs, parent->ino, mode & S_IFDIR);
   if (ino == NOINODE) return NULL; 
 
-  inode = (struct inode *) kmalloc(sizeof(struct inode));
-  if (!inode) return NULL;
-
-  inode->fs = parent->fs;
-  inode->ino = ino;
-
-  group = ino / inode->fs->super->inodes_per_group;
-  block = inode->fs->groups[group].desc->inode_table_block + (ino % inode->fs->super->inodes_per_group) / inode->fs->inodes_per_block;
-
-  inode->buf = get_buffer(inode->fs->cache, block);
-  if (!inode->buf) {
-    kfree(inode);
-    return NULL;
-  }
-  inode->desc = (struct inodedesc *) (inode->buf->data) + (ino % inode->fs->inodes_per_block);
+  if (get_inode(parent->fs, ino, &inode) < 0) return NULL;
 
   memset(inode->desc, 0, sizeof(struct inodedesc));
   inode->desc->mode = mode;
@@ -216,40 +200,157 @@ int unlink_inode(struct inode *inode) {
   return 0;
 }
 
+//
+// Inode cache
+//
+// Inodes are kept in a hash table while they are referenced by open files
+// and path lookups, so all users of an inode share the same object. Each
+// cached inode holds a lock on the inode table buffer with its descriptor.
+// When the last reference is released the inode is moved to an LRU list,
+// and the least recently used inodes are evicted when the number of
+// unreferenced inodes exceeds the cache limit. Changes to descriptors in
+// the same inode table block are written back together when the buffer
+// cache is synced.
+//
+
+static void remove_from_lru(struct filsys *fs, struct inode *inode) {
+  if (inode->lru_next) inode->lru_next->lru_prev = inode->lru_prev;
+  if (inode->lru_prev) inode->lru_prev->lru_next = inode->lru_next;
+  if (fs->lru_head == inode) fs->lru_head = inode->lru_next;
+  if (fs->lru_tail == inode) fs->lru_tail = inode->lru_prev;
+  inode->lru_next = inode->lru_prev = NULL;
+  fs->icache_unused--;
+}
+
+static void evict_inode(struct filsys *fs, struct inode *inode) {
+  struct inode **pp;
+
+  // Remove inode from hash table
+  pp = &fs->icache[inode->ino % DFS_ICACHE_HASHSIZE];
+  while (*pp != inode) pp = &(*pp)->hash_next;
+  *pp = inode->hash_next;
+
+  release_buffer(fs->cache, inode->buf);
+  kfree(inode);
+}
+
+static struct inode *lookup_inode(struct filsys *fs, ino_t ino) {
+  struct inode *inode;
+
+  inode = fs->icache[ino % DFS_ICACHE_HASHSIZE];
+  while (inode && inode->ino != ino) inode = inode->hash_next;
+  if (!inode) return NULL;
+
+  if (inode->refcnt++ == 0) remove_from_lru(fs, inode);
+  return inode;
+}
+
+int init_inode_cache(struct filsys *fs, int limit) {
+  fs->icache = (struct inode **) kmalloc(DFS_ICACHE_HASHSIZE * sizeof(struct inode *));
+  if (!fs->icache) return -ENOMEM;
+  memset(fs->icache, 0, DFS_ICACHE_HASHSIZE * sizeof(struct inode *));
+
+  // Each unreferenced inode can keep a buffer locked, so only a fraction of
+  // the buffer cache is used for cached inodes
+  if (limit > fs->cache->poolsize / 4) limit = fs->cache->poolsize / 4;
+  fs->icache_limit = limit;
+  fs->lru_head = fs->lru_tail = NULL;
+  fs->icache_unused = 0;
+
+  return 0;
+}
+
+void free_inode_cache(struct filsys *fs) {
+  struct inode *inode;
+
+  if (!fs->icache) return;
+
+  while (fs->lru_head) {
+    inode = fs->lru_head;
+    remove_from_lru(fs, inode);
+    evict_inode(fs, inode);
+  }
+
+  kfree(fs->icache);
+  fs->icache = NULL;
+}
+
 int get_inode(struct filsys *fs, ino_t ino, struct inode **retval)
 {
   struct inode *inode;
+  struct buf *buf;
   unsigned int group;
   unsigned int block;
 
   if (ino >= fs->super->inode_count) return -EINVAL;
 
-  inode = (struct inode *) kmalloc(sizeof(struct inode));
-  if (!inode) return -ENOMEM;
-
-  inode->fs = fs;
-  inode->ino = ino;
+  // Try to find inode in inode cache
+  inode = lookup_inode(fs, ino);
+  if (inode) {
+    fs->icache_hits++;
+    *retval = inode;
+    return 0;
+  }
+  fs->icache_misses++;
 
+  // Read the inode table block with the inode descriptor
   group = ino / fs->super->inodes_per_group;
   block = fs->groups[group].desc->inode_table_block + (ino % fs->super->inodes_per_group) / fs->inodes_per_block;
 
-  inode->buf = get_buffer(fs->cache, block);
-  if (!inode->buf) {
-    kfree(inode);
-    return -EIO;
+  buf = get_buffer(fs->cache, block);
+  if (!buf) return -EIO;
+
+  // Another thread may have added the inode to the cache while we were waiting for the buffer
+  inode = lookup_inode(fs, ino);
+  if (inode) {
+    release_buffer(fs->cache, buf);
+    *retval = inode;
+    return 0;
   }
-  inode->desc = (struct inodedesc *) (inode->buf->data) + (ino % fs->inodes_per_block);
+
+  inode = (struct inode *) kmalloc(sizeof(struct inode));
+  if (!inode) {
+    release_buffer(fs->cache, buf);
+    return -ENOMEM;
+  }
+
+  inode->fs = fs;
+  inode->ino = ino;
+  inode->buf = buf;
+  inode->desc = (struct inodedesc *) (buf->data) + (ino % fs->inodes_per_block);
+  inode->refcnt = 1;
+  inode->lru_next = inode->lru_prev = NULL;
+
+  // Add inode to hash table
+  inode->hash_next = fs->icache[ino % DFS_ICACHE_HASHSIZE];
+  fs->icache[ino % DFS_ICACHE_HASHSIZE] = inode;
 
   *retval = inode;
   return 0;
 }
 
 void release_inode(struct inode *inode) {
-  if (inode->buf) release_buffer(inode->fs->cache, inode->buf);
-  kfree(inode);
+  struct filsys *fs = inode->fs;
+
+  if (--inode->refcnt > 0) return;
+
+  // Add inode to the end of the LRU list
+  inode->lru_next = NULL;
+  inode->lru_prev = fs->lru_tail;
+  if (fs->lru_tail) fs->lru_tail->lru_next = inode;
+  fs->lru_tail = inode;
+  if (!fs->lru_head) fs->lru_head = inode;
+  fs->icache_unused++;
+
+  // Evict least recently used inodes if the cache is full
+  while (fs->icache_unused > fs->icache_limit) {
+    inode = fs->lru_head;
+    remove_from_lru(fs, inode);
+    evict_inode(fs, inode);
+  }
 }
 
-blkno_t expand_inode(struct inode *inode)
+blkno_t append_inode_block(struct inode *inode, blkno_t block)
 {
   unsigned int maxblocks;
   unsigned int dirblock;
@@ -276,13 +377,24 @@ blkno_t expand_inode(struct inode *inode)
     inode->desc->blockdir[0] = dirblock;
     inode->desc->depth++;
 
-    mark_buffer_updated(inode->fs->cache, buf);
+    journal_buffer(inode->fs, buf);
     mark_inode_dirty(inode);
     release_buffer(inode->fs->cache, buf);
   }
 
   // Allocate new block and add to inode block directory
-  return set_inode_block(inode, inode->desc->blocks, NOBLOCK);
+  if (block == NOBLOCK) return set_inode_block(inode, inode->desc->blocks, NOBLOCK);
+
+  // Add already allocated block to inode block directory
+  block = set_inode_block(inode, inode->desc->blocks, block);
+  if (block == NOBLOCK) return NOBLOCK;
+  inode->desc->blocks++;
+  mark_inode_dirty(inode);
+  return block;
+}
+
+blkno_t expand_inode(struct inode *inode) {
+  return append_inode_block(inode, NOBLOCK);
 }
 
 static void remove_blocks(struct filsys *fs, blkno_t *blocks, int count) {
@@ -307,6 +419,9 @@ int truncate_inode(struct inode *inode, unsigned int blocks) {
   // Check arguments
   if (blocks > inode->desc->blocks) return -EINVAL;
 
+  // Drop data for blocks that have not been allocated yet
+  discard_delayed_blocks(inode->fs, inode->ino);
+
   // Check for no-op case
   if (blocks == inode->desc->blocks) return 0;
   if (inode->desc->blocks == 0) return 0;
@@ -358,7 +473,7 @@ int truncate_inode(struct inode *inode, unsigned int blocks) {
           free_blocks(inode->fs, &(buf[d]->blkno), 1);
           mark_buffer_invalid(inode->fs->cache, buf[d]);
         } else {
-          mark_buffer_updated(inode->fs->cache, buf[d]);
+          journal_buffer(inode->fs, buf[d]);
           break;
         }
       }
@@ -371,7 +486,7 @@ int truncate_inode(struct inode *inode, unsigned int blocks) {
     } else {
       // Remove range of blocks in leaf directory page
       remove_blocks(inode->fs, (blkno_t *) buf[d]->data + offsets[d] + 1 - blocksleft, blocksleft);
-      mark_buffer_updated(inode->fs->cache, buf[d]);
+      journal_buffer(inode->fs, buf[d]);
 
       iblock -= blocksleft;
       blocksleft = 0;
@@ -0,0 +1,634 @@
+//
+// journal.c
+//
+// Disk filesystem metadata journal
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os/krnl.h>
+
+//
+// The journal is a contiguous run of blocks on the device. The first block
+// holds the journal header, and the rest is used as a log of transactions.
+// Each transaction consists of a descriptor block listing the home locations
+// of the logged blocks followed by the revoked blocks, copies of the metadata
+// blocks, and a commit block with a checksum of the transaction. A transaction
+// is written to the journal in one request. Metadata buffers are pinned in the
+// buffer cache until their transaction has been committed, and the journal is
+// checkpointed by writing the metadata to the home locations when the log is
+// full. On mount all valid transactions after the header are replayed.
+//
+
+#define LOGGED_EMPTY    0
+#define LOGGED_DELETED  NOBLOCK
+
+#define JOURNAL_ZEROBLKS 16
+
+#define SECTORS(fs, blk) ((blk) * ((fs)->blocksize / SECTORSIZE))
+
+struct revoke {
+  blkno_t blkno;
+  unsigned int seq;
+};
+
+static unsigned int checksum(void *data, int size) {
+  unsigned int *p = (unsigned int *) data;
+  unsigned int sum = 0;
+  int n = size / sizeof(unsigned int);
+
+  while (n-- > 0) sum = ((sum << 1) | (sum >> 31)) + *p++;
+  return sum;
+}
+
+static int max_descriptor_entries(struct filsys *fs) {
+  return (fs->blocksize - sizeof(struct journaldesc)) / sizeof(blkno_t);
+}
+
+static int write_header(struct filsys *fs, blkno_t start, unsigned int size, unsigned int seq) {
+  struct journalheader *hdr;
+  char *block;
+  int rc;
+
+  block = (char *) kmalloc(fs->blocksize);
+  if (!block) return -ENOMEM;
+  memset(block, 0, fs->blocksize);
+
+  hdr = (struct journalheader *) block;
+  hdr->magic = DFS_JOURNAL_MAGIC;
+  hdr->type = DFS_JOURNAL_HEADER;
+  hdr->seq = seq;
+  hdr->size = size;
+
+  rc = dev_write(fs->devno, block, fs->blocksize, SECTORS(fs, start), 0);
+  kfree(block);
+  return rc < 0 ? rc : 0;
+}
+
+static int read_header(struct filsys *fs, blkno_t start, unsigned int size, unsigned int *seq) {
+  struct journalheader *hdr;
+  char *block;
+  int rc;
+
+  block = (char *) kmalloc(fs->blocksize);
+  if (!block) return -ENOMEM;
+
+  rc = dev_read(fs->devno, block, fs->blocksize, SECTORS(fs, start), 0);
+  if (rc >= 0) {
+    hdr = (struct journalheader *) block;
+    if (hdr->magic != DFS_JOURNAL_MAGIC || hdr->type != DFS_JOURNAL_HEADER || hdr->size != size) {
+      rc = -EIO;
+    } else {
+      *seq = hdr->seq;
+      rc = 0;
+    }
+  }
+
+  kfree(block);
+  return rc;
+}
+
+static int format_journal(struct filsys *fs, blkno_t start, unsigned int size) {
+  char *buffer;
+  unsigned int i;
+  unsigned int n;
+  int rc;
+
+  // Clear the log so no stale transactions are replayed
+  buffer = (char *) kmalloc(JOURNAL_ZEROBLKS * fs->blocksize);
+  if (!buffer) return -ENOMEM;
+  memset(buffer, 0, JOURNAL_ZEROBLKS * fs->blocksize);
+
+  for (i = 1; i < size; i += n) {
+    n = size - i;
+    if (n > JOURNAL_ZEROBLKS) n = JOURNAL_ZEROBLKS;
+    rc = dev_write(fs->devno, buffer, n * fs->blocksize, SECTORS(fs, start + i), 0);
+    if (rc < 0) {
+      kfree(buffer);
+      return rc;
+    }
+  }
+
+  kfree(buffer);
+  return write_header(fs, start, size, 1);
+}
+
+//
+// Set of blocks logged since the last checkpoint. When one of these blocks is
+// freed a revoke record is added to the transaction, so replay does not
+// overwrite the new contents of the block with an old copy from the log.
+//
+
+static int find_logged(struct journal *j, blkno_t blkno) {
+  int i = blkno % j->logsize;
+
+  while (j->logged[i] != LOGGED_EMPTY) {
+    if (j->logged[i] == blkno) return i;
+    if (++i == j->logsize) i = 0;
+  }
+
+  return -1;
+}
+
+static void add_logged(struct journal *j, blkno_t blkno) {
+  int i;
+
+  if (find_logged(j, blkno) >= 0) return;
+
+  // Force a checkpoint when the set fills up
+  if (j->nlogged >= j->logsize / 2) {
+    j->overflow = 1;
+    return;
+  }
+
+  i = blkno % j->logsize;
+  while (j->logged[i] != LOGGED_EMPTY) {
+    if (++i == j->logsize) i = 0;
+  }
+  j->logged[i] = blkno;
+  j->nlogged++;
+}
+
+static void clear_logged(struct journal *j) {
+  memset(j->logged, 0, j->logsize * sizeof(blkno_t));
+  j->nlogged = 0;
+  j->overflow = 0;
+}
+
+//
+// Replay
+//
+
+static int read_transaction(struct filsys *fs, char *buffer, blkno_t start, unsigned int size, unsigned int pos, unsigned int next) {
+  struct journaldesc *desc = (struct journaldesc *) buffer;
+  struct journalcommit *commit;
+  unsigned int count;
+
+  // Read and check descriptor block
+  if (pos + 2 > size) return 0;
+  if (dev_read(fs->devno, buffer, fs->blocksize, SECTORS(fs, start + pos), 0) < 0) return 0;
+  if (desc->magic != DFS_JOURNAL_MAGIC || desc->type != DFS_JOURNAL_DESCRIPTOR) return 0;
+  if ((int) (desc->seq - next) < 0) return 0;
+
+  count = desc->count;
+  if (count > DFS_JOURNAL_MAXTRANS || desc->revoked > (unsigned int) max_descriptor_entries(fs) - count) return 0;
+  if (pos + count + 2 > size) return 0;
+
+  // Read logged blocks and commit block
+  if (dev_read(fs->devno, buffer + fs->blocksize, (count + 1) * fs->blocksize, SECTORS(fs, start + pos + 1), 0) < 0) return 0;
+  commit = (struct journalcommit *) (buffer + (count + 1) * fs->blocksize);
+  if (commit->magic != DFS_JOURNAL_MAGIC || commit->type != DFS_JOURNAL_COMMIT || commit->seq != desc->seq) return 0;
+  if (commit->checksum != checksum(buffer, (count + 1) * fs->blocksize)) return 0;
+
+  return count + 2;
+}
+
+static int is_revoked(struct revoke *revokes, int nrevokes, blkno_t blkno, unsigned int seq) {
+  int i;
+
+  for (i = 0; i < nrevokes; i++) {
+    if (revokes[i].blkno == blkno && (int) (revokes[i].seq - seq) >= 0) return 1;
+  }
+
+  return 0;
+}
+
+int replay_journal(struct filsys *fs) {
+  blkno_t start = fs->super->journal_block;
+  unsigned int size = fs->super->journal_size;
+  struct journaldesc *desc;
+  struct revoke *revokes;
+  struct revoke *newrevokes;
+  int nrevokes;
+  int maxrevokes;
+  char *buffer;
+  unsigned int first;
+  unsigned int next;
+  unsigned int pos;
+  unsigned int i;
+  int txns;
+  int blocks;
+  int pass;
+  int rc;
+  int n;
+
+  rc = read_header(fs, start, size, &first);
+  if (rc < 0) return rc;
+
+  buffer = (char *) kmalloc((DFS_JOURNAL_MAXTRANS + 2) * fs->blocksize);
+  if (!buffer) return -ENOMEM;
+  desc = (struct journaldesc *) buffer;
+
+  revokes = NULL;
+  nrevokes = maxrevokes = 0;
+  txns = blocks = 0;
+  next = first;
+
+  // The first pass collects the revoke records from all valid transactions.
+  // The second pass writes the logged blocks back to their home locations.
+  for (pass = 0; pass < 2; pass++) {
+    pos = 1;
+    next = first;
+    while ((n = read_transaction(fs, buffer, start, size, pos, next)) > 0) {
+      if (pass == 0) {
+        if (nrevokes + desc->revoked > (unsigned int) maxrevokes) {
+          maxrevokes = maxrevokes ? maxrevokes * 2 : 64;
+          while (nrevokes + desc->revoked > (unsigned int) maxrevokes) maxrevokes *= 2;
+          newrevokes = (struct revoke *) kmalloc(maxrevokes * sizeof(struct revoke));
+          if (!newrevokes) {
+            rc = -ENOMEM;
+            goto done;
+          }
+          if (revokes) {
+            memcpy(newrevokes, revokes, nrevokes * sizeof(struct revoke));
+            kfree(revokes);
+          }
+          revokes = newrevokes;
+        }
+
+        for (i = 0; i < desc->revoked; i++) {
+          revokes[nrevokes].blkno = desc->blocks[desc->count + i];
+          revokes[nrevokes].seq = desc->seq;
+          nrevokes++;
+        }
+      } else {
+        for (i = 0; i < desc->count; i++) {
+          if (is_revoked(revokes, nrevokes, desc->blocks[i], desc->seq)) continue;
+          rc = dev_write(fs->devno, buffer + (i + 1) * fs->blocksize, fs->blocksize, SECTORS(fs, desc->blocks[i]), 0);
+          if (rc < 0) goto done;
+          blocks++;
+        }
+        txns++;
+      }
+
+      next = desc->seq + 1;
+      pos += n;
+    }
+  }
+
+  // Mark journal as empty
+  rc = 0;
+  if (txns > 0) {
+    kprintf("dfs: replayed %d transactions (%d blocks) from journal on device %s\n", txns, blocks, device(fs->devno)->name);
+    rc = write_header(fs, start, size, next);
+  }
+
+done:
+  if (revokes) kfree(revokes);
+  kfree(buffer);
+  return rc;
+}
+
+//
+// Commit
+//
+
+static void freeze_journal(struct journal *j) {
+  j->frozen = 1;
+  reset_event(&j->thawed);
+  while (j->active > 0) wait_for_object(&j->idle, INFINITE);
+}
+
+static void thaw_journal(struct journal *j) {
+  j->frozen = 0;
+  set_event(&j->thawed);
+}
+
+static int checkpoint_journal(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  int rc;
+
+  // Write all metadata to the home locations and start over with an empty log
+  rc = checkpoint_buffers(fs->cache);
+  if (rc < 0) return rc;
+
+  rc = write_header(fs, j->start, j->size, j->seq);
+  if (rc < 0) return rc;
+
+  j->head = 1;
+  clear_logged(j);
+  j->checkpoints++;
+  return 0;
+}
+
+static int write_transaction(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  struct journaldesc *desc;
+  struct journalcommit *commit;
+  struct buf *buf;
+  int count;
+  int i;
+  int rc;
+
+  // Wait for active operations to complete and hold back new ones
+  freeze_journal(j);
+
+  // Write file data before the metadata that refers to it
+  rc = flush_data_buffers(fs->cache);
+  if (rc < 0) {
+    thaw_journal(j);
+    return rc;
+  }
+
+  if (j->count > j->maxblocks || j->count + j->nrevoked > max_descriptor_entries(fs)) {
+    // The transaction is too large for the journal. Unpin the buffers and
+    // write the metadata directly to the home locations instead.
+    for (i = 0; i < j->count; i++) j->bufs[i]->flags &= ~BUF_FLAG_JOURNAL;
+    j->count = 0;
+    j->nrevoked = 0;
+    j->committed = j->seq++;
+    rc = checkpoint_journal(fs);
+  } else if (j->count > 0 || j->nrevoked > 0) {
+    // Build descriptor block
+    desc = (struct journaldesc *) j->iobuf;
+    memset(desc, 0, fs->blocksize);
+    desc->magic = DFS_JOURNAL_MAGIC;
+    desc->type = DFS_JOURNAL_DESCRIPTOR;
+    desc->seq = j->seq;
+
+    // Copy the logged blocks into the transaction. Buffers that have been
+    // invalidated or reused since they were logged are skipped.
+    count = 0;
+    for (i = 0; i < j->count; i++) {
+      buf = j->bufs[i];
+      if (!(buf->flags & BUF_FLAG_JOURNAL)) continue;
+      buf->flags = (buf->flags & ~BUF_FLAG_JOURNAL) | BUF_FLAG_COMMIT;
+      memcpy(j->iobuf + (count + 1) * fs->blocksize, buf->data, fs->blocksize);
+      desc->blocks[count] = buf->blkno;
+      j->bufs[count++] = buf;
+    }
+    desc->count = count;
+    desc->revoked = j->nrevoked;
+    memcpy(desc->blocks + count, j->revoked, j->nrevoked * sizeof(blkno_t));
+
+    // Build commit block
+    commit = (struct journalcommit *) (j->iobuf + (count + 1) * fs->blocksize);
+    memset(commit, 0, fs->blocksize);
+    commit->magic = DFS_JOURNAL_MAGIC;
+    commit->type = DFS_JOURNAL_COMMIT;
+    commit->seq = j->seq;
+    commit->checksum = checksum(j->iobuf, (count + 1) * fs->blocksize);
+
+    // Write transaction to the journal
+    rc = dev_write(fs->devno, j->iobuf, (count + 2) * fs->blocksize, SECTORS(fs, j->start + j->head), 0);
+    if (rc < 0) {
+      // Keep the buffers in the running transaction
+      for (i = 0; i < count; i++) j->bufs[i]->flags = (j->bufs[i]->flags & ~BUF_FLAG_COMMIT) | BUF_FLAG_JOURNAL;
+      j->count = count;
+      thaw_journal(j);
+      return rc;
+    }
+
+    // The metadata buffers can now be written to the home locations
+    for (i = 0; i < count; i++) j->bufs[i]->flags &= ~BUF_FLAG_COMMIT;
+
+    j->head += count + 2;
+    j->committed = j->seq++;
+    j->count = 0;
+    j->nrevoked = 0;
+    j->commits++;
+    j->blocks += count;
+
+    // Checkpoint when the journal cannot hold another transaction
+    if (j->head + j->maxblocks + 2 > j->size || j->overflow) rc = checkpoint_journal(fs);
+  } else {
+    j->committed = j->seq++;
+    if (j->overflow) rc = checkpoint_journal(fs);
+  }
+
+  thaw_journal(j);
+  return rc < 0 ? rc : 0;
+}
+
+int commit_journal(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  unsigned int target;
+  int rc;
+
+  if (!j) return 0;
+
+  // Wait until the running transaction has been committed. Callers arriving
+  // while a commit is in progress are grouped together in the next commit.
+  if (j->count > 0 || j->nrevoked > 0 || j->overflow) {
+    target = j->seq;
+  } else {
+    target = j->committed;
+  }
+
+  rc = 0;
+  while ((int) (j->committed - target) < 0) {
+    wait_for_object(&j->lock, INFINITE);
+    if ((int) (j->committed - target) < 0) {
+      rc = write_transaction(fs);
+    } else {
+      j->fsyncs++;
+    }
+    release_mutex(&j->lock);
+    if (rc < 0) break;
+  }
+
+  return rc;
+}
+
+static void commit_handler(void *arg) {
+  commit_journal((struct filsys *) arg);
+}
+
+//
+// Transactions
+//
+
+void begin_transaction(struct filsys *fs) {
+  struct journal *j = fs->journal;
+
+  if (!j) return;
+  while (j->frozen) wait_for_object(&j->thawed, INFINITE);
+  if (j->active++ == 0) reset_event(&j->idle);
+}
+
+void end_transaction(struct filsys *fs) {
+  struct journal *j = fs->journal;
+
+  if (!j) return;
+  if (--j->active == 0) set_event(&j->idle);
+
+  // Commit large transactions to limit the number of pinned buffers
+  if (j->count >= j->maxblocks / 2 || j->overflow) commit_journal(fs);
+}
+
+void journal_buffer(struct filsys *fs, struct buf *buf) {
+  struct journal *j = fs->journal;
+  int i;
+
+  buf->flags |= BUF_FLAG_META;
+  mark_buffer_updated(fs->cache, buf);
+  if (!j || (buf->flags & BUF_FLAG_JOURNAL)) return;
+
+  // Add buffer to the running transaction
+  if (j->count == fs->cache->poolsize) {
+    j->overflow = 1;
+    return;
+  }
+  buf->flags |= BUF_FLAG_JOURNAL;
+  j->bufs[j->count++] = buf;
+  add_logged(j, buf->blkno);
+
+  // Block is no longer revoked if it is reused for metadata
+  for (i = 0; i < j->nrevoked; i++) {
+    if (j->revoked[i] == buf->blkno) {
+      j->revoked[i] = j->revoked[--j->nrevoked];
+      break;
+    }
+  }
+}
+
+void revoke_block(struct filsys *fs, blkno_t blkno) {
+  struct journal *j = fs->journal;
+  int i;
+
+  if (!j) return;
+  i = find_logged(j, blkno);
+  if (i < 0) return;
+
+  j->logged[i] = LOGGED_DELETED;
+  j->revoked[j->nrevoked++] = blkno;
+}
+
+//
+// Journal management
+//
+
+static void release_blocks(struct filsys *fs, blkno_t start, int count) {
+  blkno_t blkno;
+
+  for (blkno = start; blkno < start + count; blkno++) free_blocks(fs, &blkno, 1);
+}
+
+int create_journal(struct filsys *fs, unsigned int blocks) {
+  blkno_t start;
+  int allocated;
+  int rc;
+
+  // Allocate a contiguous run of blocks in the middle of the device
+  start = new_blocks(fs, fs->super->group_count / 2 * fs->super->blocks_per_group, blocks, &allocated);
+  if (start == NOBLOCK) return -ENOSPC;
+  if ((unsigned int) allocated != blocks) {
+    release_blocks(fs, start, allocated);
+    return -ENOSPC;
+  }
+
+  rc = format_journal(fs, start, blocks);
+  if (rc < 0) {
+    release_blocks(fs, start, blocks);
+    return rc;
+  }
+
+  fs->super->journal_block = start;
+  fs->super->journal_size = blocks;
+  fs->super_dirty = 1;
+
+  return 0;
+}
+
+int open_journal(struct filsys *fs) {
+  struct journal *j;
+  unsigned int seq;
+  int rc;
+
+  j = (struct journal *) kmalloc(sizeof(struct journal));
+  if (!j) return -ENOMEM;
+  memset(j, 0, sizeof(struct journal));
+
+  j->start = fs->super->journal_block;
+  j->size = fs->super->journal_size;
+  j->head = 1;
+
+  // Leave room for at least two transactions in the journal
+  j->maxblocks = max_descriptor_entries(fs);
+  if (j->maxblocks > DFS_JOURNAL_MAXTRANS) j->maxblocks = DFS_JOURNAL_MAXTRANS;
+  if (j->maxblocks > (int) (j->size - 1) / 2 - 2) j->maxblocks = (j->size - 1) / 2 - 2;
+  if (j->maxblocks < 4) {
+    kfree(j);
+    return -EINVAL;
+  }
+
+  // Get sequence number from header. Reinitialize the journal if it is invalid.
+  rc = read_header(fs, j->start, j->size, &seq);
+  if (rc < 0) {
+    kprintf(KERN_WARNING "dfs: invalid journal on device %s, reinitializing\n", device(fs->devno)->name);
+    rc = format_journal(fs, j->start, j->size);
+    if (rc < 0) {
+      kfree(j);
+      return rc;
+    }
+    seq = 1;
+  }
+  j->seq = seq;
+  j->committed = seq - 1;
+
+  j->logsize = j->size * 4;
+  j->bufs = (struct buf **) kmalloc(fs->cache->poolsize * sizeof(struct buf *));
+  j->revoked = (blkno_t *) kmalloc(j->logsize * sizeof(blkno_t));
+  j->logged = (blkno_t *) kmalloc(j->logsize * sizeof(blkno_t));
+  j->iobuf = (char *) kmalloc((j->maxblocks + 2) * fs->blocksize);
+  if (!j->bufs || !j->revoked || !j->logged || !j->iobuf) {
+    if (j->bufs) kfree(j->bufs);
+    if (j->revoked) kfree(j->revoked);
+    if (j->logged) kfree(j->logged);
+    if (j->iobuf) kfree(j->iobuf);
+    kfree(j);
+    return -ENOMEM;
+  }
+  clear_logged(j);
+
+  init_event(&j->idle, 1, 1);
+  init_event(&j->thawed, 1, 1);
+  init_mutex(&j->lock, 0);
+
+  fs->journal = j;
+  fs->cache->commit = commit_handler;
+  return 0;
+}
+
+void close_journal(struct filsys *fs) {
+  struct journal *j = fs->journal;
+
+  if (!j) return;
+
+  // All metadata has been written, so the journal can be marked as empty
+  write_header(fs, j->start, j->size, j->seq);
+
+  fs->cache->commit = NULL;
+  fs->journal = NULL;
+
+  kfree(j->bufs);
+  kfree(j->revoked);
+  kfree(j->logged);
+  kfree(j->iobuf);
+  kfree(j);
+}
@@ -38,11 +38,14 @@
 #define DEFAULT_CACHE_BUFFERS   1024
 #define DEFAULT_RESERVED_BLOCKS 16
 #define DEFAULT_RESERVED_INODES 16
+#define DEFAULT_JOURNAL_BLOCKS  1024
+#define MIN_JOURNAL_BLOCKS      64
+#define DEFAULT_INODE_CACHE     256
 
 #define FORMAT_BLOCKSIZE        (64 * 1024)
 
 static void mark_group_desc_dirty(struct filsys *fs, int group) {
-  mark_buffer_updated(fs->cache, fs->groupdesc_buffers[group / fs->groupdescs_per_block]);
+  journal_buffer(fs, fs->groupdesc_buffers[group / fs->groupdescs_per_block]);
 }
 
 static int log2(int n) {
@@ -59,6 +62,21 @@ static int log2(int n) {
 static void dfs_sync(void *arg) {
   struct filsys *fs = (struct filsys *) arg;
 
+  // Allocate delayed blocks and write the data before the inodes are synced.
+  // The lazy writer calls this without the file system lock, so take it to
+  // keep the allocation from changing the block bitmaps under other updates.
+  // The lock is recursive, so this also works from fsync() and umount().
+  if (fs->delalloc && (!fs->vfs || lock_fs(fs->vfs, FSOP_FSYNC) == 0)) {
+    begin_transaction(fs);
+    flush_delayed_blocks(fs, NOINODE);
+    end_transaction(fs);
+    if (fs->vfs) unlock_fs(fs->vfs, FSOP_FSYNC);
+    if (!fs->journal) flush_buffers(fs->cache, 0);
+  }
+
+  // Commit the running transaction so the metadata can be written
+  commit_journal(fs);
+
   // Write super block
   if (fs->super_dirty) {
     dev_write(fs->devno, fs->super, SECTORSIZE, 1, 0);
@@ -72,6 +90,8 @@ static int parse_options(char *opts, struct fsoptions *fsopts) {
   fsopts->inode_ratio = get_num_option(opts, "inoderatio", DEFAULT_INODE_RATIO);
   fsopts->reserved_blocks = get_num_option(opts, "resvblks", DEFAULT_RESERVED_BLOCKS);
   fsopts->reserved_inodes = get_num_option(opts, "resvinodes", DEFAULT_RESERVED_INODES);
+  fsopts->journal = get_num_option(opts, "journal", -1);
+  fsopts->icache = get_num_option(opts, "icache", DEFAULT_INODE_CACHE);
 
   fsopts->flags = 0;
   if (get_option(opts, "quick", NULL, 0, NULL)) fsopts->flags |= FSOPT_QUICK;
@@ -104,6 +124,7 @@ static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts)
   // Allocate file system
   fs = (struct filsys *) kmalloc(sizeof(struct filsys));
   memset(fs, 0, sizeof(struct filsys));
+  init_mutex(&fs->dalock, 0);
 
   // Allocate super block
   fs->super = (struct superblock *) kmalloc(SECTORSIZE);
@@ -174,6 +195,7 @@ static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts)
   fs->cache = init_buffer_pool(devno, fs->super->cache_buffers, fs->blocksize, dfs_sync, fs);
   if (!fs->cache) return NULL;
   fs->cache->nosync = 1;
+  if (init_inode_cache(fs, fsopts->icache) < 0) return NULL;
 
   // Zero all blocks on disk
   if ((fsopts->flags & FSOPT_QUICK) == 0) {
@@ -258,7 +280,7 @@ static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts)
     buf = alloc_buffer(fs->cache, gd->block_bitmap_block);
     if (!buf) return NULL;
     set_bits(buf->data, 0, blocks);
-    mark_buffer_updated(fs->cache, buf);
+    journal_buffer(fs, buf);
     release_buffer(fs->cache, buf);
 
     // Determine the block count for the group. The last group may be truncated
@@ -310,9 +332,24 @@ static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts)
   root->desc->mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
   root->desc->ctime = root->desc->mtime = time(NULL);
   root->desc->linkcount = 1;
-  mark_buffer_updated(fs->cache, root->buf);
+  journal_buffer(fs, root->buf);
   release_inode(root);
 
+  // Create journal. By default the journal uses 1/64 of the device, up to 1024
+  // blocks, and small devices are formatted without a journal.
+  if (fsopts->journal == -1) {
+    blocks = fs->super->block_count / 64;
+    if (blocks > DEFAULT_JOURNAL_BLOCKS) blocks = DEFAULT_JOURNAL_BLOCKS;
+    if (blocks < MIN_JOURNAL_BLOCKS) blocks = 0;
+  } else {
+    blocks = fsopts->journal;
+  }
+  if (blocks > 0) {
+    if (create_journal(fs, blocks) < 0 || open_journal(fs) < 0) {
+      kprintf(KERN_WARNING "dfs: unable to create journal on device %s\n", device(fs->devno)->name);
+    }
+  }
+
   // Reenable buffer cache sync
   fs->cache->nosync = 0;
 
@@ -334,6 +371,7 @@ static struct filsys *open_filesystem(char *devname, struct fsoptions *fsopts) {
   // Allocate file system
   fs = (struct filsys *) kmalloc(sizeof(struct filsys));
   memset(fs, 0, sizeof(struct filsys));
+  init_mutex(&fs->dalock, 0);
 
   // Allocate and read super block
   fs->super = (struct superblock *) kmalloc(SECTORSIZE);
@@ -366,6 +404,11 @@ static struct filsys *open_filesystem(char *devname, struct fsoptions *fsopts) {
   fs->blocksize = 1 << fs->super->log_block_size;
   fs->inodes_per_block = fs->blocksize / sizeof(struct inodedesc);
 
+  // Replay journal before any metadata is read into the buffer cache
+  if (fs->super->journal_size > 0 && replay_journal(fs) < 0) {
+    kprintf(KERN_WARNING "dfs: unable to replay journal on device %s\n", device(devno)->name);
+  }
+
   // Initialize buffer cache
   cache_buffers = (unsigned int) fsopts->cache;
   if (cache_buffers == 0) cache_buffers = fs->super->cache_buffers;
@@ -373,6 +416,7 @@ static struct filsys *open_filesystem(char *devname, struct fsoptions *fsopts) {
   if (cache_buffers > fs->super->block_count) cache_buffers = fs->super->block_count;
   fs->cache = init_buffer_pool(devno, cache_buffers, fs->blocksize, dfs_sync, fs);
   if (!fs->cache) return NULL;
+  if (init_inode_cache(fs, fsopts->icache) < 0) return NULL;
 
   // Calculate the number of group descriptors blocks
   fs->groupdescs_per_block = fs->blocksize / sizeof(struct groupdesc);
@@ -398,12 +442,48 @@ static struct filsys *open_filesystem(char *devname, struct fsoptions *fsopts) {
     fs->groups[i].first_free_inode = -1;
   }
 
+  if (fs->super->journal_size > 0) {
+    // The free counts in the super block are not journaled, so recompute
+    // them from the group descriptors
+    fs->super->free_block_count = 0;
+    fs->super->free_inode_count = 0;
+    for (i = 0; i < fs->super->group_count; i++) {
+      fs->super->free_block_count += fs->groups[i].desc->free_block_count;
+      fs->super->free_inode_count += fs->groups[i].desc->free_inode_count;
+    }
+  } else if (fsopts->journal > 0) {
+    // Add journal to existing file system
+    if (create_journal(fs, fsopts->journal) < 0) {
+      kprintf(KERN_WARNING "dfs: unable to create journal on device %s\n", device(devno)->name);
+    } else {
+      // Write the block bitmap before the super block refers to the journal
+      checkpoint_buffers(fs->cache);
+      dfs_sync(fs);
+    }
+  }
+
+  if (fs->super->journal_size > 0 && open_journal(fs) < 0) {
+    kprintf(KERN_WARNING "dfs: unable to open journal on device %s\n", device(devno)->name);
+  }
+
   return fs;
 }
 
 static void close_filesystem(struct filsys *fs) {
   unsigned int i;
 
+  // Allocate delayed blocks and drop the ones that could not be allocated
+  begin_transaction(fs);
+  flush_delayed_blocks(fs, NOINODE);
+  while (fs->delalloc) discard_delayed_blocks(fs, fs->delalloc->ino);
+  end_transaction(fs);
+
+  // Commit the metadata changes so the buffers can be written
+  commit_journal(fs);
+
+  // Release cached inodes
+  free_inode_cache(fs);
+
   // Release all group descriptors
   for (i = 0; i < fs->groupdesc_blocks; i++) release_buffer(fs->cache, fs->groupdesc_buffers[i]);
   kfree(fs->groupdesc_buffers);
@@ -412,6 +492,7 @@ static void close_filesystem(struct filsys *fs) {
   // Flush and sync buffer cache
   flush_buffers(fs->cache, 0);
   sync_buffers(fs->cache, 0);
+  close_journal(fs);
 
   // Free cache
   free_buffer_pool(fs->cache);
@@ -431,7 +512,7 @@ static void get_filesystem_status(struct filsys *fs, struct statfs *buf) {
   buf->bsize = fs->blocksize;
   buf->iosize = fs->blocksize;
   buf->blocks = fs->super->block_count;
-  buf->bfree = fs->super->free_block_count;
+  buf->bfree = fs->super->free_block_count - fs->delayed_blocks;
   buf->files = fs->super->inode_count;
   buf->ffree = fs->super->free_inode_count;
   buf->cachesize = fs->cache->poolsize * fs->cache->bufsize;
@@ -460,6 +541,7 @@ int dfs_mount(struct fs *fs, char *opts) {
     fs->data = open_filesystem(fs->mntfrom, &fsopts);
   }
   if (!fs->data) return -EIO;
+  ((struct filsys *) fs->data)->vfs = fs;
 
   return 0;
 }
@@ -30,9 +30,14 @@
 // OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
 // SUCH DAMAGE.
 // 
-
 #include <os/krnl.h>
 
+#define PIPE_DEFAULT_SIZE  (64 * 1024)
+#define PIPE_MIN_SIZE      PAGESIZE
+#define PIPE_MAX_SIZE      (1024 * 1024)
+
+#define SPLICE_BUFSIZE     (16 * 1024)
+
 int pipefs_mount(struct fs *fs, char *opts);
 int pipefs_close(struct file *filp);
 int pipefs_fsync(struct file *filp);
@@ -43,7 +48,7 @@ off64_t pipefs_lseek(struct file *filp, off64_t offset, int origin);
 int pipefs_fstat(struct file *filp, struct stat64 *buffer);
 
 struct fsops pipefsops = {
-  FSOP_READ | FSOP_WRITE,
+  FSOP_READ | FSOP_WRITE | FSOP_IOCTL,
 
   NULL,
   NULL,
@@ -89,6 +94,14 @@ struct fsops pipefsops = {
   NULL
 };
 
+//
+// A pipe has a ring buffer shared by the read and write end. Writers copy
+// data into the ring buffer and only block when it is full. If a reader is
+// already waiting when the buffer is empty, the data is handed directly to
+// the reader. A request with no buffer is used by splice() for waiting until
+// data or space is available without transferring any data.
+//
+
 struct pipereq {
   struct pipereq *next;
   struct pipe *pipe;
@@ -98,9 +111,19 @@ struct pipereq {
   int rc;
 };
 
+struct pipebuf {
+  char *data;                 // Ring buffer, allocated on first use
+  size_t size;                // Size of ring buffer
+  size_t head;                // Position of first byte in ring buffer
+  size_t count;               // Number of bytes in ring buffer
+  int refcnt;                 // Number of pipe ends using buffer
+};
+
 struct pipe {
   struct file *filp;
   struct pipe *peer;
+  struct pipebuf *buf;
+  struct mutex lock;          // Held while splice() transfers to or from buffer
   struct pipereq *waithead;
   struct pipereq *waittail;
 };
@@ -138,6 +161,165 @@ static void cancel_request(struct pipe *pipe, struct pipereq *req) {
   }
 }
 
+static void complete_request(struct pipe *pipe, int rc) {
+  struct pipereq *req = pipe->waithead;
+
+  pipe->waithead = req->next;
+  if (pipe->waithead == NULL) pipe->waittail = NULL;
+  req->rc = rc;
+  mark_thread_ready(req->thread, 1, 2);
+}
+
+static int wait_request(struct pipe *pipe, char *buffer, size_t size) {
+  struct pipereq req;
+  int rc;
+
+  req.pipe = pipe;
+  req.thread = self();
+  req.buffer = buffer;
+  req.size = size;
+  req.rc = -EINTR;
+  req.next = NULL;
+
+  if (pipe->waittail) { 
+    pipe->waittail->next = &req;
+  } else {
+    pipe->waittail = &req;
+  }
+
+  if (!pipe->waithead) pipe->waithead = &req;
+
+  rc = enter_alertable_wait(THREAD_WAIT_PIPE);
+  if (rc < 0) {
+    cancel_request(pipe, &req);
+    req.rc = rc;
+  }
+
+  return req.rc;
+}
+
+static struct pipe *reader_end(struct pipe *pipe) {
+  return (pipe->filp->flags & O_WRONLY) ? pipe->peer : pipe;
+}
+
+static struct pipe *writer_end(struct pipe *pipe) {
+  return (pipe->filp->flags & O_WRONLY) ? pipe : pipe->peer;
+}
+
+static void update_events(struct pipe *pipe) {
+  struct pipebuf *buf = pipe->buf;
+  struct pipe *reader = reader_end(pipe);
+  struct pipe *writer = writer_end(pipe);
+
+  // The read end is readable if there is buffered data, a blocked writer,
+  // or if the write end has been closed
+  if (reader) {
+    if (buf->count > 0 || !writer || writer->waithead) {
+      set_io_event(&reader->filp->iob, IOEVT_READ);
+    } else {
+      clear_io_event(&reader->filp->iob, IOEVT_READ);
+    }
+  }
+
+  // The write end is writable if there is room in the buffer, a blocked
+  // reader, or if the read end has been closed
+  if (writer) {
+    if (buf->count < buf->size || !reader || reader->waithead) {
+      set_io_event(&writer->filp->iob, IOEVT_WRITE);
+    } else {
+      clear_io_event(&writer->filp->iob, IOEVT_WRITE);
+    }
+  }
+}
+
+//
+// Ring buffer operations
+//
+
+static int alloc_pipebuf(struct pipebuf *buf) {
+  if (!buf->data) {
+    buf->data = kmalloc_tag(buf->size, 'PIPE');
+    if (!buf->data) return -ENOMEM;
+    buf->head = 0;
+  }
+
+  return 0;
+}
+
+static size_t ring_get(struct pipebuf *buf, char *data, size_t size) {
+  size_t count = 0;
+  size_t bytes;
+
+  while (size > 0 && buf->count > 0) {
+    bytes = buf->size - buf->head;
+    if (bytes > buf->count) bytes = buf->count;
+    if (bytes > size) bytes = size;
+
+    memcpy(data, buf->data + buf->head, bytes);
+    buf->head += bytes;
+    if (buf->head == buf->size) buf->head = 0;
+    buf->count -= bytes;
+
+    data += bytes;
+    size -= bytes;
+    count += bytes;
+  }
+
+  return count;
+}
+
+static size_t ring_put(struct pipebuf *buf, char *data, size_t size) {
+  size_t count = 0;
+  size_t tail;
+  size_t bytes;
+
+  if (alloc_pipebuf(buf) < 0) return 0;
+  while (size > 0 && buf->count < buf->size) {
+    tail = buf->head + buf->count;
+    if (tail >= buf->size) tail -= buf->size;
+    bytes = (tail >= buf->head ? buf->size : buf->head) - tail;
+    if (bytes > size) bytes = size;
+
+    memcpy(buf->data + tail, data, bytes);
+    buf->count += bytes;
+
+    data += bytes;
+    size -= bytes;
+    count += bytes;
+  }
+
+  return count;
+}
+
+static void feed_readers(struct pipe *reader) {
+  struct pipebuf *buf = reader->buf;
+  struct pipereq *req;
+
+  // Complete blocked readers with data from the ring buffer
+  while (reader->waithead && buf->count > 0) {
+    req = reader->waithead;
+    complete_request(reader, req->buffer ? ring_get(buf, req->buffer, req->size) : 0);
+  }
+}
+
+static void refill_from_writers(struct pipe *writer) {
+  struct pipebuf *buf = writer->buf;
+  struct pipereq *req;
+  size_t bytes;
+
+  // Move data from blocked writers into the ring buffer
+  while (writer->waithead && buf->count < buf->size) {
+    req = writer->waithead;
+    if (req->buffer) {
+      bytes = ring_put(buf, req->buffer, req->size);
+      if (bytes == 0) break;
+      req->buffer += bytes;
+      req->size -= bytes;
+    }
+    if (req->size == 0) complete_request(writer, 0);
+  }
+}
+
 void init_pipefs() {
   register_filesystem("pipefs", &pipefsops);
   mount("pipefs", "", "", NULL, &pipefs);
@@ -148,6 +330,7 @@ int pipe(struct file **readpipe, struct file **writepipe) {
   struct file *wr;
   struct pipe *rdp;
   struct pipe *wrp;
+  struct pipebuf *buf;
 
   if (!pipefs) return -ENOENT;
 
@@ -155,24 +338,37 @@ int pipe(struct file **readpipe, struct file **writepipe) {
   wr = newfile(pipefs, NULL, O_WRONLY, S_IWRITE);
   rdp = kmalloc(sizeof(struct pipe));
   wrp = kmalloc(sizeof(struct pipe));
-  if (!rd || !wr || !rdp || !wrp) {
+  buf = kmalloc(sizeof(struct pipebuf));
+  if (!rd || !wr || !rdp || !wrp || !buf) {
     kfree(rd);
     kfree(wr);
     kfree(rdp);
     kfree(wrp);
+    kfree(buf);
     return -EMFILE;
   }
 
+  buf->data = NULL;
+  buf->size = PIPE_DEFAULT_SIZE;
+  buf->head = buf->count = 0;
+  buf->refcnt = 2;
+
   rd->data = rdp;
   rdp->filp = rd;
   rdp->peer = wrp;
+  rdp->buf = buf;
+  init_mutex(&rdp->lock, 0);
   rdp->waithead = rdp->waittail = NULL;
 
   wr->data = wrp;
   wrp->filp = wr;
   wrp->peer = rdp;
+  wrp->buf = buf;
+  init_mutex(&wrp->lock, 0);
   wrp->waithead = wrp->waittail = NULL;
 
+  update_events(wrp);
+
   *readpipe = rd;
   *writepipe = wr;
 
@@ -187,6 +383,7 @@ int pipefs_mount(struct fs *fs, char *opts) {
 
 int pipefs_close(struct file *filp) {
   struct pipe *pipe = (struct pipe *) filp->data;
+  struct pipebuf *buf = pipe->buf;
 
   set_io_event(&filp->iob, IOEVT_CLOSE);
   release_all_waiters(pipe, -EINTR);
@@ -203,6 +400,10 @@ int pipefs_close(struct file *filp) {
     pipe->peer = NULL;
   }
 
+  if (--buf->refcnt == 0) {
+    kfree(buf->data);
+    kfree(buf);
+  }
   kfree(pipe);
 
   return 0;
@@ -214,70 +415,57 @@ int pipefs_fsync(struct file *filp) {
 
 int pipefs_read(struct file *filp, void *data, size_t size, off64_t pos) {
   struct pipe *pipe = (struct pipe *) filp->data;
+  struct pipebuf *buf = pipe->buf;
+  struct pipe *writer;
   char *p;
   size_t left;
   size_t count;
+  int rc;
 
   if (size == 0) return 0;
-  if (!pipe->peer) return 0;
+  rc = wait_for_object(&pipe->lock, INFINITE);
+  if (rc < 0) return rc;
 
+  // Read buffered data first, then data from blocked writers
   p = (char *) data;
-  left = size;
-  count = 0;
-  while (pipe->peer->waithead && left > 0) {
-    struct pipereq *req = pipe->peer->waithead;
-    size_t bytes = req->size;
+  count = ring_get(buf, p, size);
+  p += count;
+  left = size - count;
+
+  writer = pipe->peer;
+  if (writer) {
+    while (writer->waithead && left > 0) {
+      struct pipereq *req = writer->waithead;
+      size_t bytes = req->size;
     
-    if (bytes > left) bytes = left;
+      if (bytes > left) bytes = left;
 
-    memcpy(p, req->buffer, bytes);
-    req->buffer += bytes;
-    req->size -= bytes;
+      if (req->buffer) memcpy(p, req->buffer, bytes);
+      req->buffer += bytes;
+      req->size -= bytes;
 
-    p += bytes;
-    left -= bytes;
-    count += bytes;
+      p += bytes;
+      left -= bytes;
+      count += bytes;
 
-    if (req->size == 0) {
-      pipe->peer->waithead = req->next;
-      if (pipe->peer->waithead == NULL) pipe->peer->waittail = NULL;
-      req->rc = 0;
-      mark_thread_ready(req->thread, 1, 2);
+      if (req->size == 0) complete_request(writer, 0);
     }
+
+    // Let blocked writers continue into the free space
+    refill_from_writers(writer);
   }
 
-  if (pipe->peer->waithead == NULL) clear_io_event(&filp->iob, IOEVT_READ);
+  update_events(pipe);
+  release_mutex(&pipe->lock);
 
   if (count == 0) {
-    struct pipereq req;
-    int rc;
-
-    set_io_event(&pipe->peer->filp->iob, IOEVT_WRITE);
+    if (!pipe->peer) return 0;
     if (filp->flags & O_NONBLOCK) return -EAGAIN;
 
-    req.pipe = pipe;
-    req.thread = self();
-    req.buffer = p;
-    req.size = left;
-    req.rc = -EINTR;
-    req.next = NULL;
-
-    if (pipe->waittail) { 
-      pipe->waittail->next = &req;
-    } else {
-      pipe->waittail = &req;
-    }
-
-    if (!pipe->waithead) pipe->waithead = &req;
-
-    rc = enter_alertable_wait(THREAD_WAIT_PIPE);
-    if (rc < 0) {
-      cancel_request(pipe, &req);
-      req.rc = rc;
-    }
-
-    if (req.rc < 0) return req.rc;
-    count += req.rc;
+    rc = wait_request(pipe, p, left);
+    update_events(pipe);
+    if (rc < 0) return rc;
+    count += rc;
   }
 
   return count;
@@ -285,69 +473,130 @@ int pipefs_read(struct file *filp, void *data, size_t size, off64_t pos) {
 
 int pipefs_write(struct file *filp, void *data, size_t size, off64_t pos) {
   struct pipe *pipe = (struct pipe *) filp->data;
+  struct pipebuf *buf = pipe->buf;
+  struct pipe *reader;
   char *p;
   size_t left;
+  size_t bytes;
+  int rc;
 
   if (size == 0) return 0;
   if (!pipe->peer) return -EPIPE;
+  rc = wait_for_object(&pipe->lock, INFINITE);
+  if (rc < 0) return rc;
+
+  if (!pipe->peer) {
+    release_mutex(&pipe->lock);
+    return -EPIPE;
+  }
 
   p = (char *) data;
   left = size;
-  while (pipe->peer->waithead && left > 0) {
-    struct pipereq *req = pipe->peer->waithead;
-    size_t bytes = req->size;
-    
-    if (bytes > left) bytes = left;
-
-    memcpy(req->buffer, p, bytes);
-    req->rc = bytes;
+  reader = pipe->peer;
+
+  // Hand data directly to blocked readers. Readers only wait when the
+  // buffer is empty.
+  while (reader && reader->waithead && left > 0) {
+    struct pipereq *req = reader->waithead;
+
+    if (req->buffer) {
+      bytes = req->size;
+      if (bytes > left) bytes = left;
+      memcpy(req->buffer, p, bytes);
+      p += bytes;
+      left -= bytes;
+    } else {
+      bytes = 0;
+    }
+    complete_request(reader, bytes);
+  }
 
+  // Buffer the rest unless other writers are already waiting for room
+  if (!pipe->waithead && left > 0) {
+    bytes = ring_put(buf, p, left);
     p += bytes;
     left -= bytes;
-
-    pipe->peer->waithead = req->next;
-    if (pipe->peer->waithead == NULL) pipe->peer->waittail = NULL;
-    mark_thread_ready(req->thread, 1, 2);
   }
 
-  if (pipe->peer->waithead == NULL) clear_io_event(&filp->iob, IOEVT_WRITE);
+  if (reader) feed_readers(reader);
+  update_events(pipe);
+  release_mutex(&pipe->lock);
 
   if (left > 0) {
-    struct pipereq req;
-    int rc;
-
-    set_io_event(&pipe->peer->filp->iob, IOEVT_READ);
-    if (filp->flags & O_NONBLOCK) return size - left;
-
-    req.pipe = pipe;
-    req.thread = self();
-    req.buffer = p;
-    req.size = left;
-    req.rc = -EINTR;
-    req.next = NULL;
+    if (filp->flags & O_NONBLOCK) return left < size ? size - left : -EAGAIN;
 
-    if (pipe->waittail) { 
-      pipe->waittail->next = &req;
-    } else {
-      pipe->waittail = &req;
-    }
-
-    if (!pipe->waithead) pipe->waithead = &req;
+    rc = wait_request(pipe, p, left);
+    update_events(pipe);
+    if (rc < 0) return rc;
+  }
 
-    rc = enter_alertable_wait(THREAD_WAIT_PIPE);
-    if (rc < 0) {
-      cancel_request(pipe, &req);
-      req.rc = rc;
-    }
+  return size;
+}
 
-    if (req.rc < 0) return req.rc;
+static int resize_pipe(struct pipe *pipe, size_t size) {
+  struct pipebuf *buf = pipe->buf;
+  char *data;
+
+  // Round up to whole pages
+  if (size < PIPE_MIN_SIZE) size = PIPE_MIN_SIZE;
+  if (size > PIPE_MAX_SIZE) return -EINVAL;
+  size = PAGES(size) * PAGESIZE;
+  if (size < buf->count) return -EBUSY;
+  if (size == buf->size) return size;
+
+  // Move buffered data to new ring buffer
+  if (buf->data) {
+    data = kmalloc_tag(size, 'PIPE');
+    if (!data) return -ENOMEM;
+    buf->count = ring_get(buf, data, buf->count);
+    kfree(buf->data);
+    buf->data = data;
+    buf->head = 0;
   }
+  buf->size = size;
 
+  update_events(pipe);
   return size;
 }
 
 int pipefs_ioctl(struct file *filp, int cmd, void *data, size_t size) {
-  if (cmd == FIONBIO) return 0;
+  struct pipe *pipe = (struct pipe *) filp->data;
+  struct pipe *reader;
+  struct pipe *writer;
+  int rc;
+
+  switch (cmd) {
+    case FIONBIO:
+      return 0;
+
+    case FIONREAD:
+      if (!data || size != sizeof(unsigned long)) return -EINVAL;
+      *(unsigned long *) data = pipe->buf->count;
+      return 0;
+
+    case PIPE_GETSIZE:
+      return pipe->buf->size;
+
+    case PIPE_SETSIZE:
+      if (!data || size != sizeof(unsigned long)) return -EINVAL;
+
+      // Lock both ends so no splice is using the buffer
+      reader = reader_end(pipe);
+      writer = writer_end(pipe);
+      if (reader && wait_for_object(&reader->lock, INFINITE) < 0) return -EINTR;
+      if (writer && wait_for_object(&writer->lock, INFINITE) < 0) {
+        if (reader) release_mutex(&reader->lock);
+        return -EINTR;
+      }
+      rc = resize_pipe(pipe, *(unsigned long *) data);
+      if (writer) {
+        refill_from_writers(writer);
+        release_mutex(&writer->lock);
+      }
+      if (reader) release_mutex(&reader->lock);
+      return rc;
+  }
+
   return -ENOSYS;
 }
 
@@ -359,3 +608,193 @@ int pipefs_fstat(struct file *filp, struct stat64 *buffer) {
   // TODO: implement timestamps on create, read and write
   return -ENOSYS;
 }
+
+//
+// Splice
+//
+// splice() moves data between two handles without copying it through user
+// space. If the source is a pipe, data is written directly from its ring
+// buffer, and if the destination is a pipe, data is read directly into its
+// ring buffer. Transfers between other files and sockets go through a kernel
+// buffer.
+//
+
+static int splice_read(struct object *o, void *data, size_t size) {
+  if (o->type == OBJECT_FILE) return read((struct file *) o, data, size);
+  if (o->type == OBJECT_SOCKET) return recv((struct socket *) o, data, size, 0);
+  return -EBADF;
+}
+
+static int splice_write(struct object *o, void *data, size_t size) {
+  if (o->type == OBJECT_FILE) return write((struct file *) o, data, size);
+  if (o->type == OBJECT_SOCKET) return send((struct socket *) o, data, size, 0);
+  return -EBADF;
+}
+
+static struct pipe *get_pipe(struct object *o, int writer) {
+  struct file *filp;
+
+  if (o->type != OBJECT_FILE) return NULL;
+  filp = (struct file *) o;
+  if (filp->fs != pipefs) return NULL;
+  if (((filp->flags & O_WRONLY) != 0) != writer) return NULL;
+  return (struct pipe *) filp->data;
+}
+
+static int splice_from_pipe(struct pipe *pipe, struct object *out, size_t size, int flags) {
+  struct pipebuf *buf = pipe->buf;
+  size_t total;
+  size_t bytes;
+  int rc;
+
+  rc = wait_for_object(&pipe->lock, INFINITE);
+  if (rc < 0) return rc;
+
+  total = 0;
+  while (total < size) {
+    // Wait until there is data in the buffer
+    if (pipe->peer) refill_from_writers(pipe->peer);
+    if (buf->count == 0) {
+      if (total > 0 || !pipe->peer) break;
+      if ((flags & SPLICE_NONBLOCK) || (pipe->filp->flags & O_NONBLOCK)) {
+        rc = -EAGAIN;
+        break;
+      }
+
+      release_mutex(&pipe->lock);
+      update_events(pipe);
+      rc = wait_request(pipe, NULL, 0);
+      if (rc < 0) return rc;
+      rc = wait_for_object(&pipe->lock, INFINITE);
+      if (rc < 0) return rc;
+      continue;
+    }
+
+    // Write contiguous data directly from the ring buffer. The data is only
+    // removed from the buffer after it has been written.
+    bytes = buf->size - buf->head;
+    if (bytes > buf->count) bytes = buf->count;
+    if (bytes > size - total) bytes = size - total;
+
+    rc = splice_write(out, buf->data + buf->head, bytes);
+    if (rc <= 0) break;
+
+    buf->head += rc;
+    if (buf->head == buf->size) buf->head = 0;
+    buf->count -= rc;
+    total += rc;
+    if ((size_t) rc < bytes) break;
+  }
+
+  if (pipe->peer) refill_from_writers(pipe->peer);
+  update_events(pipe);
+  release_mutex(&pipe->lock);
+
+  return total > 0 ? (int) total : rc;
+}
+
+static int splice_to_pipe(struct object *in, struct pipe *pipe, size_t size, int flags) {
+  struct pipebuf *buf = pipe->buf;
+  size_t total;
+  size_t tail;
+  size_t bytes;
+  int rc;
+
+  rc = wait_for_object(&pipe->lock, INFINITE);
+  if (rc < 0) return rc;
+
+  rc = alloc_pipebuf(buf);
+  total = 0;
+  while (rc >= 0 && total < size) {
+    if (!pipe->peer) {
+      rc = -EPIPE;
+      break;
+    }
+
+    // Wait until there is room in the buffer behind blocked writers
+    if (buf->count == buf->size || pipe->waithead) {
+      if (total > 0) break;
+      if ((flags & SPLICE_NONBLOCK) || (pipe->filp->flags & O_NONBLOCK)) {
+        rc = -EAGAIN;
+        break;
+      }
+
+      release_mutex(&pipe->lock);
+      update_events(pipe);
+      rc = wait_request(pipe, NULL, 0);
+      if (rc < 0) return rc;
+      rc = wait_for_object(&pipe->lock, INFINITE);
+      if (rc < 0) return rc;
+      continue;
+    }
+
+    // Read directly into the free space in the ring buffer. Readers only
+    // see the data once it has been added to the buffer count.
+    tail = buf->head + buf->count;
+    if (tail >= buf->size) tail -= buf->size;
+    bytes = (tail >= buf->head ? buf->size : buf->head) - tail;
+    if (bytes > size - total) bytes = size - total;
+
+    rc = splice_read(in, buf->data + tail, bytes);
+    if (rc <= 0) break;
+
+    buf->count += rc;
+    total += rc;
+    if (pipe->peer) feed_readers(pipe->peer);
+    if ((size_t) rc < bytes) break;
+  }
+
+  update_events(pipe);
+  release_mutex(&pipe->lock);
+
+  return total > 0 ? (int) total : rc;
+}
+
+static int splice_copy(struct object *in, struct object *out, size_t size) {
+  char *buffer;
+  size_t total;
+  int bytes;
+  int written;
+  int rc;
+
+  buffer = kmalloc(SPLICE_BUFSIZE);
+  if (!buffer) return -ENOMEM;
+
+  total = 0;
+  rc = 0;
+  while (total < size) {
+    bytes = size - total;
+    if (bytes > SPLICE_BUFSIZE) bytes = SPLICE_BUFSIZE;
+
+    rc = splice_read(in, buffer, bytes);
+    if (rc <= 0) break;
+    bytes = rc;
+
+    written = 0;
+    while (written < bytes) {
+      rc = splice_write(out, buffer + written, bytes - written);
+      if (rc <= 0) break;
+      written += rc;
+    }
+    total += written;
+    if (rc <= 0 || written < SPLICE_BUFSIZE) break;
+  }
+
+  kfree(buffer);
+  return total > 0 ? (int) total : rc;
+}
+
+int splice(struct object *in, struct object *out, size_t size, int flags) {
+  struct pipe *inpipe;
+  struct pipe *outpipe;
+
+  if (size == 0) return 0;
+
+  inpipe = get_pipe(in, 0);
+  outpipe = get_pipe(out, 1);
+  if (inpipe && outpipe && inpipe->buf == outpipe->buf) return -EINVAL;
+
+  if (inpipe) return splice_from_pipe(inpipe, out, size, flags);
+  if (outpipe) return splice_to_pipe(in, outpipe, size, flags);
+  return splice_copy(in, out, size);
+}
@@ -37,12 +37,23 @@
 #define ROUNDUP(x) (((x) + 3) & ~3)
 
 #define SMB_NAMELEN             256
-#define SMB_DENTRY_CACHESIZE    16
+#define SMB_DENTRY_CACHESIZE    128           // Attribute cache entries per share
+#define SMB_DENTRY_WAYS         4             // Attribute cache associativity
+#define SMB_DIR_CACHESIZE       8             // Cached directory listings per share
+#define SMB_DIRLIST_MAXSIZE     (64 * 1024)   // Max size of cached directory listing
+#define SMB_DATA_CACHESIZE      1024          // Default data cache size in KB
+#define SMB_BLKHASH_SIZE        256
+#define SMB_ATTR_TTL            2000          // Default attribute cache timeout in ms
+#define SMB_POLL_INTERVAL       1000          // Poll interval for idle connections in ms
 #define SMB_DIRBUF_SIZE         4096
 
-#define SMB_RAW_CHUNKSIZE       (32 * 1024)
+#define SMB_LARGE_CHUNKSIZE     (32 * 1024)
 #define SMB_NORMAL_CHUNKSIZE    (4 * 1024)
 
+#define SMB_MAX_PENDING         16            // Max outstanding requests per file
+#define SMB_READAHEAD_SIZE      (128 * 1024)  // Read-ahead window per file
+#define SMB_WRITEBEHIND_SIZE    (64 * 1024)   // Write-behind window per file
+
 #define EPOC                    116444736000000000     // 00:00:00 GMT on January 1, 1970
 #define SECTIMESCALE            10000000               // 1 sec resolution
 
@@ -175,6 +186,28 @@
 #define SMB_CAP_DFS                     0x1000
 #define SMB_CAP_LARGE_READX             0x4000
 
+//
+// Oplock levels
+//
+
+#define SMB_OPLOCK_NONE                 0
+#define SMB_OPLOCK_EXCLUSIVE            1
+#define SMB_OPLOCK_BATCH                2
+#define SMB_OPLOCK_LEVEL_II             3
+
+#define SMB_OPEN_REQUEST_OPLOCK         0x02
+#define SMB_OPEN_REQUEST_BATCH_OPLOCK   0x04
+
+#define SMB_LOCKING_ANDX_OPLOCK_RELEASE 0x02
+
+//
+// Create actions
+//
+
+#define SMB_FILE_OPENED                 1
+#define SMB_FILE_CREATED                2
+#define SMB_FILE_OVERWRITTEN            3
+
 //
 // SMB file attributes and flags
 //
@@ -599,6 +632,20 @@ struct smb_write_file_response {
   unsigned short reserved;              // Reserved (must be 0)
 };
 
+//
+// SMB LOCKING request parameters
+//
+
+struct smb_locking_request {
+  struct smb_andx andx;
+  unsigned short fid;                   // File handle
+  unsigned char lock_type;              // Lock type (oplock release, shared lock)
+  unsigned char oplock_level;           // New oplock level for oplock breaks
+  unsigned long timeout;                // Lock timeout
+  unsigned short number_of_unlocks;     // Number of unlock ranges
+  unsigned short number_of_locks;       // Number of lock ranges
+};
+
 //
 // SMB RENAME request parameters
 //
@@ -723,6 +770,7 @@ struct smb {
       struct smb_read_file_request read;
       struct smb_read_raw_request readraw;
       struct smb_write_file_request write;
+      struct smb_locking_request locking;
       struct smb_trans_request trans;
       struct smb_rename_request rename;
       struct smb_delete_request del;
@@ -895,6 +943,90 @@ struct smb_share;
 struct smb_dentry {
   char path[MAXPATH];
   struct stat64 statbuf;
+  unsigned long hash;                   // Hash value for path
+  unsigned int expires;                 // Time (in ticks) entry expires
+};
+
+//
+// SMB cached directory listing
+//
+
+struct smb_dirent {
+  struct stat64 statbuf;
+  int namelen;
+  char name[0];
+};
+
+struct smb_dirlist {
+  char path[MAXPATH];                   // Directory path
+  unsigned int expires;                 // Time (in ticks) listing expires
+  int refcnt;                           // References from cache and open directories
+  int count;                            // Number of entries
+  int size;                             // Bytes used in buffer
+  int bufsize;                          // Size of buffer
+  char *buffer;                         // Directory entries
+};
+
+//
+// SMB data cache
+//
+// Cached file data is kept in blocks owned by a cache node for the path.
+// A cache node is only used by opens holding an oplock, and the cached
+// blocks are discarded if the file size or modification time reported
+// by the server has changed since the blocks were cached.
+//
+
+struct smb_cnode {
+  struct smb_cnode *next;               // Next cache node for share
+  char path[MAXPATH];                   // File path
+  smb_time mtime;                       // Last write time when cached
+  off64_t size;                         // File size when cached
+  int refcnt;                           // Open files using cache node
+  int blocks;                           // Number of cached blocks
+};
+
+struct smb_block {
+  struct smb_block *hnext;              // Next block in hash bucket
+  struct smb_block *lru_next;           // Next block in LRU list
+  struct smb_block *lru_prev;           // Previous block in LRU list
+  struct smb_cnode *cnode;              // Owner of block (NULL if free)
+  unsigned long blkno;                  // Block number in file
+  int valid;                            // Valid bytes in block
+  char *data;                           // Block data
+};
+
+struct smb_cachestat {
+  unsigned long attr_hits;
+  unsigned long attr_misses;
+  unsigned long dir_hits;
+  unsigned long dir_misses;
+  unsigned long data_hits;
+  unsigned long data_misses;
+  unsigned long oplocks;
+  unsigned long breaks;
+};
+
+//
+// SMB pending request
+//
+// Asynchronous READ_ANDX and WRITE_ANDX requests are kept on the server
+// pending list until the reply with the same multiplex id arrives. Read
+// data is received directly into the request buffer.
+//
+
+#define SMB_REQ_IDLE  0
+#define SMB_REQ_SENT  1
+#define SMB_REQ_DONE  2
+
+struct smb_pending {
+  struct smb_pending *next;             // Next pending request on server
+  unsigned short mid;                   // Multiplex id
+  unsigned char cmd;                    // Command
+  unsigned char state;                  // Request state
+  int rc;                               // Bytes transferred or error code
+  off64_t pos;                          // File position
+  char *data;                           // Buffer for read data
+  int size;                             // Number of bytes requested
 };
 
 //
@@ -902,9 +1034,22 @@ struct smb_dentry {
 //
 
 struct smb_file {
+  struct smb_file *next;                    // Next open file on share
   unsigned short fid;
   unsigned long attrs;
   struct stat64 statbuf;
+  int oplock;                               // Oplock level held for file
+  struct smb_cnode *cnode;                  // Data cache node
+  off64_t nextpos;                          // File position after last read
+  char *rabuf;                              // Read-ahead buffer
+  int rachunk;                              // Size of read-ahead requests
+  int raslots;                              // Number of read-ahead slots
+  int rahead;                               // First read-ahead slot
+  int racount;                              // Read-ahead slots in use
+  int wbnext;                               // Next write-behind slot
+  int wberr;                                // Deferred write-behind error
+  struct smb_pending ra[SMB_MAX_PENDING];   // Read-ahead requests
+  struct smb_pending wb[SMB_MAX_PENDING];   // Write-behind requests
 };
 
 //
@@ -916,6 +1061,9 @@ struct smb_directory {
   int eos;
   int entries_left;
   struct smb_file_directory_info *fi;
+  struct smb_dirlist *cached;           // Cached listing being read
+  int cachepos;                         // Position in cached listing
+  struct smb_dirlist *fill;             // Listing being built from server
   char path[MAXPATH];
   char buffer[SMB_DIRBUF_SIZE];
 };
@@ -939,8 +1087,13 @@ struct smb_server {
   int tzofs;
   unsigned long server_caps;
   unsigned long max_buffer_size;
+  unsigned short mid;                   // Next multiplex id
+  int max_mpx;                          // Max outstanding requests
+  int outstanding;                      // Outstanding asynchronous requests
+  struct smb_pending *pending;          // Asynchronous requests awaiting reply
   char buffer[SMB_MAX_BUFFER + 4];
   char auxbuf[SMB_MAX_BUFFER + 4];
+  char rcvbuf[SMB_MAX_BUFFER + 4];      // Replies to pending requests
 };
 
 //
@@ -953,8 +1106,19 @@ struct smb_share {
   unsigned short tid;
   char sharename[SMB_NAMELEN];
   time_t mounttime;
-  int next_cacheidx;
+  struct smb_file *files;               // Open files on share
+  unsigned int attrttl;                 // Attribute cache timeout in ticks
+  int oplocks;                          // Request oplocks on open
   struct smb_dentry dircache[SMB_DENTRY_CACHESIZE];
+  struct smb_dirlist *dirlists[SMB_DIR_CACHESIZE];
+  struct smb_cnode *cnodes;             // Data cache nodes
+  int nblocks;                          // Number of data cache blocks
+  struct smb_block *blocks;             // Data cache block descriptors
+  char *blkdata;                        // Data cache memory
+  struct smb_block *lru_head;           // Most recently used block
+  struct smb_block *lru_tail;           // Least recently used block
+  struct smb_block *blkhash[SMB_BLKHASH_SIZE];
+  struct smb_cachestat stats;
 };
 
 // smbutil.c
@@ -970,10 +1134,30 @@ int smb_errno(struct smb *smb);
 
 // smbcache.c
 
+int smb_init_cache(struct smb_share *share, int cachesize);
+void smb_exit_cache(struct smb_share *share);
+void smb_reset_cache(struct smb_share *share);
+
 void smb_add_to_cache(struct smb_share *share, char *path, char *filename, struct stat64 *statbuf);
-struct smb_dentry *smb_find_in_cache(struct smb_share *share, char *path);
+int smb_find_in_cache(struct smb_share *share, char *path, struct stat64 *statbuf);
 void smb_clear_cache(struct smb_share *share);
 
+struct smb_dirlist *smb_find_dirlist(struct smb_share *share, char *path);
+struct smb_dirlist *smb_new_dirlist(char *path);
+int smb_add_dirent(struct smb_dirlist *list, char *name, struct stat64 *statbuf);
+void smb_commit_dirlist(struct smb_share *share, struct smb_dirlist *list);
+void smb_release_dirlist(struct smb_dirlist *list);
+
+struct smb_cnode *smb_attach_cnode(struct smb_share *share, char *path, smb_time mtime, off64_t size);
+void smb_detach_cnode(struct smb_share *share, struct smb_cnode *cnode);
+void smb_purge_cnode(struct smb_share *share, struct smb_cnode *cnode);
+void smb_purge_path(struct smb_share *share, char *path);
+int smb_read_cache(struct smb_share *share, struct smb_cnode *cnode, char *data, size_t size, off64_t pos);
+void smb_fill_cache(struct smb_share *share, struct smb_cnode *cnode, char *data, size_t size, off64_t pos, int eof);
+void smb_update_cache(struct smb_share *share, struct smb_cnode *cnode, char *data, size_t size, off64_t pos);
+
+int smb_proc(struct proc_file *pf, void *arg);
+
 // smbproto.c
 
 struct smb *smb_init(struct smb_share *share, int aux);
@@ -982,6 +1166,11 @@ int smb_send(struct smb_share *share, struct smb *smb, unsigned char cmd, int pa
 int smb_recv(struct smb_share *share, struct smb *smb);
 int smb_request(struct smb_share *share, struct smb *smb, unsigned char cmd, int params, char *data, int datasize, int retry);
 
+int smb_submit(struct smb_share *share, struct smb *smb, struct smb_pending *req, unsigned char cmd, int params, char *data, int datasize);
+int smb_wait(struct smb_share *share, struct smb_pending *req);
+int smb_window(struct smb_share *share, int bytes, int chunksize);
+void smb_fail_pending(struct smb_server *server, int rc);
+
 int smb_trans(struct smb_share *share,
               unsigned short cmd, 
               void *reqparams, int reqparamlen,
@@ -1001,4 +1190,8 @@ int smb_release_connection(struct smb_share *share);
 int smb_check_connection(struct smb_share *share);
 int smb_reconnect(struct smb_share *share);
 
+void smb_init_poll();
+
+extern struct smb_server *servers;
+
 #endif
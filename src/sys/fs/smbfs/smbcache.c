@@ -1,7 +1,7 @@
 //
 // smbcache.c
 //
-// SMB directory entry cache
+// SMB attribute, directory and data cache
 //
 // Copyright (C) 2002 Michael Ringgaard. All rights reserved.
 //
@@ -34,34 +34,615 @@
 #include <os/krnl.h>
 #include "smb.h"
 
+static unsigned long smb_hash(char *path) {
+  unsigned long hash = 0;
+
+  while (*path) hash = (hash << 5) + hash + *path++;
+  return hash;
+}
+
+static int smb_expired(unsigned int expires) {
+  return time_after_eq(ticks, expires);
+}
+
+//
+// Attribute cache
+//
+// File attributes from stat and readdir are kept in a set associative
+// cache for attrttl ticks. Entries are indexed by a hash of the path and
+// replaced oldest first within a set.
+//
+
+static void smb_add_dentry(struct smb_share *share, char *path, struct stat64 *statbuf) {
+  unsigned long hash = smb_hash(path);
+  int set = (hash % (SMB_DENTRY_CACHESIZE / SMB_DENTRY_WAYS)) * SMB_DENTRY_WAYS;
+  struct smb_dentry *victim = NULL;
+  struct smb_dentry *d;
+  int i;
+
+  if (share->attrttl == 0 || strlen(path) >= MAXPATH) return;
+
+  for (i = 0; i < SMB_DENTRY_WAYS; i++) {
+    d = &share->dircache[set + i];
+    if (d->path[0] && d->hash == hash && strcmp(d->path, path) == 0) {
+      victim = d;
+      break;
+    }
+    if (!victim || !d->path[0] || (victim->path[0] && time_before(d->expires, victim->expires))) victim = d;
+  }
+
+  strcpy(victim->path, path);
+  memcpy(&victim->statbuf, statbuf, sizeof(struct stat64));
+  victim->hash = hash;
+  victim->expires = ticks + share->attrttl;
+}
+
 void smb_add_to_cache(struct smb_share *share, char *path, char *filename, struct stat64 *statbuf) {
-  int idx = share->next_cacheidx;
+  char fullpath[MAXPATH];
+
+  if (filename) {
+    if (strlen(path) + 1 + strlen(filename) >= MAXPATH) return;
+    strcpy(fullpath, path);
+    if (*path) strcat(fullpath, "\\");
+    strcat(fullpath, filename);
+    smb_add_dentry(share, fullpath, statbuf);
+  } else {
+    smb_add_dentry(share, path, statbuf);
+  }
+}
+
+static int smb_find_in_dirlist(struct smb_share *share, char *path, struct stat64 *statbuf) {
+  struct smb_dirlist *list;
+  struct smb_dirent *de;
+  char *name;
+  int dirlen;
+  int namelen;
+  int i, n;
+
+  name = strrchr(path, '\\');
+  if (name) {
+    dirlen = name - path;
+    name++;
+  } else {
+    dirlen = 0;
+    name = path;
+  }
+  namelen = strlen(name);
 
-  strcpy(share->dircache[idx].path, path);
-  strcat(share->dircache[idx].path, "\\");
-  strcat(share->dircache[idx].path, filename);
+  for (i = 0; i < SMB_DIR_CACHESIZE; i++) {
+    list = share->dirlists[i];
+    if (!list || smb_expired(list->expires)) continue;
+    if ((int) strlen(list->path) != dirlen || strncmp(list->path, path, dirlen) != 0) continue;
 
-  memcpy(&share->dircache[idx].statbuf, statbuf, sizeof(struct stat64));
+    de = (struct smb_dirent *) list->buffer;
+    for (n = 0; n < list->count; n++) {
+      if (de->namelen == namelen && strcmp(de->name, name) == 0) {
+        if (statbuf) memcpy(statbuf, &de->statbuf, sizeof(struct stat64));
+        return 1;
+      }
+      de = (struct smb_dirent *) ((char *) de + ROUNDUP(sizeof(struct smb_dirent) + de->namelen + 1));
+    }
+    return 0;
+  }
 
-  if (++share->next_cacheidx == SMB_DENTRY_CACHESIZE) share->next_cacheidx = 0;
+  return 0;
 }
 
-struct smb_dentry *smb_find_in_cache(struct smb_share *share, char *path) {
-  int idx;
+int smb_find_in_cache(struct smb_share *share, char *path, struct stat64 *statbuf) {
+  unsigned long hash = smb_hash(path);
+  int set = (hash % (SMB_DENTRY_CACHESIZE / SMB_DENTRY_WAYS)) * SMB_DENTRY_WAYS;
+  struct smb_dentry *d;
+  int i;
 
-  if (share->dircache[share->next_cacheidx].path[0] && strcmp(share->dircache[share->next_cacheidx].path, path) == 0) return &share->dircache[share->next_cacheidx];
+  for (i = 0; i < SMB_DENTRY_WAYS; i++) {
+    d = &share->dircache[set + i];
+    if (d->path[0] && d->hash == hash && strcmp(d->path, path) == 0) {
+      if (smb_expired(d->expires)) {
+        d->path[0] = 0;
+        break;
+      }
 
-  for (idx = 0; idx < SMB_DENTRY_CACHESIZE; idx++) {
-    if (share->dircache[idx].path[0] && strcmp(share->dircache[idx].path, path) == 0) {
-      return &share->dircache[idx];
+      if (statbuf) memcpy(statbuf, &d->statbuf, sizeof(struct stat64));
+      share->stats.attr_hits++;
+      return 1;
     }
   }
-  
-  return NULL;
+
+  // Look for file in cached listing of parent directory
+  if (smb_find_in_dirlist(share, path, statbuf)) {
+    share->stats.attr_hits++;
+    return 1;
+  }
+
+  share->stats.attr_misses++;
+  return 0;
 }
 
 void smb_clear_cache(struct smb_share *share) {
+  struct smb_dirlist *list;
   int idx;
 
   for (idx = 0; idx < SMB_DENTRY_CACHESIZE; idx++) share->dircache[idx].path[0] = 0;
+
+  for (idx = 0; idx < SMB_DIR_CACHESIZE; idx++) {
+    list = share->dirlists[idx];
+    if (list) {
+      share->dirlists[idx] = NULL;
+      smb_release_dirlist(list);
+    }
+  }
+}
+
+//
+// Directory listing cache
+//
+
+struct smb_dirlist *smb_find_dirlist(struct smb_share *share, char *path) {
+  struct smb_dirlist *list;
+  int i;
+
+  if (share->attrttl != 0) {
+    for (i = 0; i < SMB_DIR_CACHESIZE; i++) {
+      list = share->dirlists[i];
+      if (list && !smb_expired(list->expires) && strcmp(list->path, path) == 0) {
+        list->refcnt++;
+        share->stats.dir_hits++;
+        return list;
+      }
+    }
+  }
+
+  share->stats.dir_misses++;
+  return NULL;
+}
+
+struct smb_dirlist *smb_new_dirlist(char *path) {
+  struct smb_dirlist *list;
+
+  list = (struct smb_dirlist *) kmalloc(sizeof(struct smb_dirlist));
+  if (!list) return NULL;
+  memset(list, 0, sizeof(struct smb_dirlist));
+  strcpy(list->path, path);
+  list->refcnt = 1;
+
+  return list;
+}
+
+int smb_add_dirent(struct smb_dirlist *list, char *name, struct stat64 *statbuf) {
+  struct smb_dirent *de;
+  int namelen = strlen(name);
+  int reclen = ROUNDUP(sizeof(struct smb_dirent) + namelen + 1);
+  int newsize;
+  char *newbuf;
+
+  if (list->size + reclen > list->bufsize) {
+    newsize = list->bufsize ? list->bufsize * 2 : 4096;
+    while (newsize < list->size + reclen) newsize *= 2;
+    if (newsize > SMB_DIRLIST_MAXSIZE) return -E2BIG;
+
+    newbuf = (char *) krealloc(list->buffer, newsize);
+    if (!newbuf) return -ENOMEM;
+    list->buffer = newbuf;
+    list->bufsize = newsize;
+  }
+
+  de = (struct smb_dirent *) (list->buffer + list->size);
+  memcpy(&de->statbuf, statbuf, sizeof(struct stat64));
+  de->namelen = namelen;
+  memcpy(de->name, name, namelen + 1);
+
+  list->size += reclen;
+  list->count++;
+  return 0;
+}
+
+void smb_commit_dirlist(struct smb_share *share, struct smb_dirlist *list) {
+  struct smb_dirlist *old;
+  int victim = 0;
+  int i;
+
+  if (share->attrttl == 0) return;
+
+  // Replace existing listing for directory, a free slot, or the oldest listing
+  for (i = 0; i < SMB_DIR_CACHESIZE; i++) {
+    old = share->dirlists[i];
+    if (old && strcmp(old->path, list->path) == 0) {
+      victim = i;
+      break;
+    }
+    if (!old) {
+      victim = i;
+    } else if (share->dirlists[victim] && time_before(old->expires, share->dirlists[victim]->expires)) {
+      victim = i;
+    }
+  }
+
+  old = share->dirlists[victim];
+  if (old) smb_release_dirlist(old);
+
+  // The cache holds a reference to the listing until it is replaced
+  list->expires = ticks + share->attrttl;
+  list->refcnt++;
+  share->dirlists[victim] = list;
+}
+
+void smb_release_dirlist(struct smb_dirlist *list) {
+  if (--list->refcnt > 0) return;
+
+  if (list->buffer) kfree(list->buffer);
+  kfree(list);
+}
+
+//
+// Data cache
+//
+
+static struct smb_block **smb_block_bucket(struct smb_share *share, struct smb_cnode *cnode, unsigned long blkno) {
+  return &share->blkhash[(((unsigned long) cnode >> 4) + blkno) % SMB_BLKHASH_SIZE];
+}
+
+static struct smb_block *smb_lookup_block(struct smb_share *share, struct smb_cnode *cnode, unsigned long blkno) {
+  struct smb_block *blk;
+
+  for (blk = *smb_block_bucket(share, cnode, blkno); blk; blk = blk->hnext) {
+    if (blk->cnode == cnode && blk->blkno == blkno) return blk;
+  }
+
+  return NULL;
+}
+
+static void smb_lru_remove(struct smb_share *share, struct smb_block *blk) {
+  if (blk->lru_prev) blk->lru_prev->lru_next = blk->lru_next;
+  if (blk->lru_next) blk->lru_next->lru_prev = blk->lru_prev;
+  if (share->lru_head == blk) share->lru_head = blk->lru_next;
+  if (share->lru_tail == blk) share->lru_tail = blk->lru_prev;
+  blk->lru_next = blk->lru_prev = NULL;
+}
+
+static void smb_lru_insert_head(struct smb_share *share, struct smb_block *blk) {
+  blk->lru_prev = NULL;
+  blk->lru_next = share->lru_head;
+  if (share->lru_head) share->lru_head->lru_prev = blk;
+  share->lru_head = blk;
+  if (!share->lru_tail) share->lru_tail = blk;
+}
+
+static void smb_lru_insert_tail(struct smb_share *share, struct smb_block *blk) {
+  blk->lru_next = NULL;
+  blk->lru_prev = share->lru_tail;
+  if (share->lru_tail) share->lru_tail->lru_next = blk;
+  share->lru_tail = blk;
+  if (!share->lru_head) share->lru_head = blk;
+}
+
+static void smb_free_cnode(struct smb_share *share, struct smb_cnode *cnode) {
+  struct smb_cnode *cn;
+
+  if (share->cnodes == cnode) {
+    share->cnodes = cnode->next;
+  } else {
+    for (cn = share->cnodes; cn; cn = cn->next) {
+      if (cn->next == cnode) {
+        cn->next = cnode->next;
+        break;
+      }
+    }
+  }
+
+  kfree(cnode);
+}
+
+static void smb_drop_block(struct smb_share *share, struct smb_block *blk) {
+  struct smb_block **bucket;
+  struct smb_cnode *cnode = blk->cnode;
+
+  if (!cnode) return;
+
+  // Remove block from hash bucket
+  bucket = smb_block_bucket(share, cnode, blk->blkno);
+  if (*bucket == blk) {
+    *bucket = blk->hnext;
+  } else {
+    struct smb_block *b;
+
+    for (b = *bucket; b; b = b->hnext) {
+      if (b->hnext == blk) {
+        b->hnext = blk->hnext;
+        break;
+      }
+    }
+  }
+  blk->hnext = NULL;
+  blk->cnode = NULL;
+
+  // Free blocks are reused first
+  smb_lru_remove(share, blk);
+  smb_lru_insert_tail(share, blk);
+
+  if (--cnode->blocks == 0 && cnode->refcnt == 0) smb_free_cnode(share, cnode);
+}
+
+static struct smb_block *smb_alloc_block(struct smb_share *share, struct smb_cnode *cnode, unsigned long blkno) {
+  struct smb_block *blk;
+  struct smb_block **bucket;
+
+  // Reuse least recently used block
+  blk = share->lru_tail;
+  if (!blk) return NULL;
+  if (blk->cnode) smb_drop_block(share, blk);
+
+  blk->cnode = cnode;
+  blk->blkno = blkno;
+  blk->valid = 0;
+  cnode->blocks++;
+
+  bucket = smb_block_bucket(share, cnode, blkno);
+  blk->hnext = *bucket;
+  *bucket = blk;
+
+  smb_lru_remove(share, blk);
+  smb_lru_insert_head(share, blk);
+
+  return blk;
+}
+
+int smb_init_cache(struct smb_share *share, int cachesize) {
+  int i;
+
+  share->nblocks = cachesize * 1024 / SMB_BLK_SIZE;
+  if (share->nblocks == 0) return 0;
+
+  share->blocks = (struct smb_block *) kmalloc(share->nblocks * sizeof(struct smb_block));
+  share->blkdata = (char *) kmalloc(share->nblocks * SMB_BLK_SIZE);
+  if (!share->blocks || !share->blkdata) {
+    smb_exit_cache(share);
+    return -ENOMEM;
+  }
+
+  memset(share->blocks, 0, share->nblocks * sizeof(struct smb_block));
+  for (i = 0; i < share->nblocks; i++) {
+    share->blocks[i].data = share->blkdata + i * SMB_BLK_SIZE;
+    smb_lru_insert_tail(share, &share->blocks[i]);
+  }
+
+  return 0;
+}
+
+void smb_exit_cache(struct smb_share *share) {
+  struct smb_cnode *cnode;
+
+  smb_clear_cache(share);
+
+  while (share->cnodes) {
+    cnode = share->cnodes;
+    share->cnodes = cnode->next;
+    kfree(cnode);
+  }
+
+  if (share->blocks) kfree(share->blocks);
+  if (share->blkdata) kfree(share->blkdata);
+  share->blocks = NULL;
+  share->blkdata = NULL;
+  share->nblocks = 0;
+  share->lru_head = share->lru_tail = NULL;
+  memset(share->blkhash, 0, sizeof(share->blkhash));
+}
+
+void smb_reset_cache(struct smb_share *share) {
+  struct smb_file *file;
+  struct smb_cnode *cnode;
+  struct smb_cnode *next;
+
+  // Oplocks are lost when the connection to the server is lost
+  for (file = share->files; file; file = file->next) file->oplock = SMB_OPLOCK_NONE;
+
+  for (cnode = share->cnodes; cnode; cnode = next) {
+    next = cnode->next;
+    smb_purge_cnode(share, cnode);
+  }
+
+  smb_clear_cache(share);
+}
+
+struct smb_cnode *smb_attach_cnode(struct smb_share *share, char *path, smb_time mtime, off64_t size) {
+  struct smb_cnode *cnode;
+
+  if (share->nblocks == 0) return NULL;
+
+  for (cnode = share->cnodes; cnode; cnode = cnode->next) {
+    if (strcmp(cnode->path, path) == 0) break;
+  }
+
+  if (cnode) {
+    // Discard cached data if file has been changed
+    if (cnode->mtime != mtime || cnode->size != size) {
+      cnode->refcnt++;
+      smb_purge_cnode(share, cnode);
+      cnode->refcnt--;
+    }
+  } else {
+    cnode = (struct smb_cnode *) kmalloc(sizeof(struct smb_cnode));
+    if (!cnode) return NULL;
+    memset(cnode, 0, sizeof(struct smb_cnode));
+    strcpy(cnode->path, path);
+    cnode->next = share->cnodes;
+    share->cnodes = cnode;
+  }
+
+  cnode->mtime = mtime;
+  cnode->size = size;
+  cnode->refcnt++;
+
+  return cnode;
+}
+
+void smb_detach_cnode(struct smb_share *share, struct smb_cnode *cnode) {
+  if (--cnode->refcnt == 0 && cnode->blocks == 0) smb_free_cnode(share, cnode);
+}
+
+void smb_purge_cnode(struct smb_share *share, struct smb_cnode *cnode) {
+  int i;
+
+  if (cnode->blocks == 0) return;
+
+  // Keep cache node from being freed while blocks are dropped
+  cnode->refcnt++;
+  for (i = 0; i < share->nblocks && cnode->blocks > 0; i++) {
+    if (share->blocks[i].cnode == cnode) smb_drop_block(share, &share->blocks[i]);
+  }
+  smb_detach_cnode(share, cnode);
+}
+
+void smb_purge_path(struct smb_share *share, char *path) {
+  struct smb_cnode *cnode;
+
+  for (cnode = share->cnodes; cnode; cnode = cnode->next) {
+    if (strcmp(cnode->path, path) == 0) {
+      smb_purge_cnode(share, cnode);
+      break;
+    }
+  }
+}
+
+int smb_read_cache(struct smb_share *share, struct smb_cnode *cnode, char *data, size_t size, off64_t pos) {
+  struct smb_block *blk;
+  int ofs;
+  int count;
+  int bytes = 0;
+
+  while (size > 0) {
+    blk = smb_lookup_block(share, cnode, (unsigned long) (pos / SMB_BLK_SIZE));
+    if (!blk) break;
+
+    ofs = (int) (pos % SMB_BLK_SIZE);
+    if (ofs >= blk->valid) break;
+
+    count = blk->valid - ofs;
+    if ((size_t) count > size) count = size;
+    memcpy(data, blk->data + ofs, count);
+    share->stats.data_hits++;
+
+    smb_lru_remove(share, blk);
+    smb_lru_insert_head(share, blk);
+
+    data += count;
+    pos += count;
+    size -= count;
+    bytes += count;
+  }
+
+  return bytes;
+}
+
+void smb_fill_cache(struct smb_share *share, struct smb_cnode *cnode, char *data, size_t size, off64_t pos, int eof) {
+  struct smb_block *blk;
+  off64_t end = pos + size;
+  unsigned long blkno;
+  int ofs;
+  int count;
+
+  // Skip partial block at start of range
+  ofs = (int) (pos % SMB_BLK_SIZE);
+  if (ofs != 0) {
+    count = SMB_BLK_SIZE - ofs;
+    if ((size_t) count >= size) return;
+    data += count;
+    pos += count;
+  }
+
+  // Cache full blocks, and the partial last block at end of file
+  while (pos < end) {
+    count = end - pos < SMB_BLK_SIZE ? (int) (end - pos) : SMB_BLK_SIZE;
+    if (count < SMB_BLK_SIZE && !eof) break;
+
+    blkno = (unsigned long) (pos / SMB_BLK_SIZE);
+    blk = smb_lookup_block(share, cnode, blkno);
+    if (!blk) {
+      blk = smb_alloc_block(share, cnode, blkno);
+      if (!blk) break;
+      share->stats.data_misses++;
+    }
+
+    memcpy(blk->data, data, count);
+    blk->valid = count;
+
+    data += count;
+    pos += count;
+  }
+}
+
+void smb_update_cache(struct smb_share *share, struct smb_cnode *cnode, char *data, size_t size, off64_t pos) {
+  struct smb_block *blk;
+  off64_t end = pos + size;
+  int ofs;
+  int count;
+
+  while (pos < end) {
+    ofs = (int) (pos % SMB_BLK_SIZE);
+    count = SMB_BLK_SIZE - ofs;
+    if (count > end - pos) count = (int) (end - pos);
+
+    blk = smb_lookup_block(share, cnode, (unsigned long) (pos / SMB_BLK_SIZE));
+    if (blk) {
+      if (ofs <= blk->valid) {
+        // Write data through to cached block
+        memcpy(blk->data + ofs, data, count);
+        if (ofs + count > blk->valid) blk->valid = ofs + count;
+      } else {
+        // Write leaves a hole in the cached block
+        smb_drop_block(share, blk);
+      }
+    }
+
+    data += count;
+    pos += count;
+  }
+}
+
+//
+// /proc/smbfs
+//
+
+static void smb_ratio(struct proc_file *pf, unsigned long hits, unsigned long misses) {
+  if (hits + misses == 0) {
+    pprintf(pf, "     -");
+  } else {
+    pprintf(pf, " %4d%%", (int) ((hits * 100.0) / (hits + misses)));
+  }
+}
+
+int smb_proc(struct proc_file *pf, void *arg) {
+  struct smb_server *server;
+  struct smb_share *share;
+  struct smb_cachestat *st;
+  struct smb_cnode *cnode;
+  int files;
+  int cached;
+
+  pprintf(pf, "share                          attr   dir  data  files blocks oplocks breaks pending\n");
+  pprintf(pf, "------------------------------ ----- ----- ----- ----- ------ ------- ------ -------\n");
+
+  for (server = servers; server; server = server->next) {
+    for (share = server->shares; share; share = share->next) {
+      st = &share->stats;
+
+      files = 0;
+      for (cnode = share->cnodes; cnode; cnode = cnode->next) files++;
+
+      cached = 0;
+      if (share->blocks) {
+        struct smb_block *blk;
+
+        for (blk = share->lru_head; blk && blk->cnode; blk = blk->lru_next) cached++;
+      }
+
+      pprintf(pf, "%-30s", share->sharename);
+      smb_ratio(pf, st->attr_hits, st->attr_misses);
+      smb_ratio(pf, st->dir_hits, st->dir_misses);
+      smb_ratio(pf, st->data_hits, st->data_misses);
+      pprintf(pf, " %5d %6d %7lu %6lu %7d\n", files, cached, st->oplocks, st->breaks, server->outstanding);
+    }
+  }
+
+  return 0;
 }
@@ -56,6 +56,7 @@ int smb_mount(struct fs *fs, char *opts) {
   struct smb_share *share;
   int rc;
   unsigned short port;
+  int cachesize;
 
   // Get options
   ipaddr.addr = get_num_option(opts, "addr", IP_ADDR_ANY);
@@ -64,6 +65,7 @@ int smb_mount(struct fs *fs, char *opts) {
   get_option(opts, "domain", domain, sizeof(domain), "");
   get_option(opts, "password", password, sizeof(password), "");
   port = get_num_option(opts, "port", 445);
+  cachesize = get_num_option(opts, "cache", SMB_DATA_CACHESIZE);
 
   // Check arguments
   if (!fs->mntfrom) return -EINVAL;
@@ -88,10 +90,20 @@ int smb_mount(struct fs *fs, char *opts) {
   if (!share) return -ENOMEM;
   memset(share, 0, sizeof(struct smb_share));
   strcpy(share->sharename, fs->mntfrom);
+  share->attrttl = get_num_option(opts, "attrttl", SMB_ATTR_TTL) / MSECS_PER_TICK;
+  share->oplocks = get_num_option(opts, "oplocks", 1);
+
+  // Allocate data cache
+  rc = smb_init_cache(share, cachesize);
+  if (rc < 0) {
+    kfree(share);
+    return rc;
+  }
 
   // Get connection to server
   rc = smb_get_connection(share, &ipaddr, port, domain, username, password);
   if (rc < 0) {
+    smb_exit_cache(share);
     kfree(share);
     return rc;
   }
@@ -101,6 +113,7 @@ int smb_mount(struct fs *fs, char *opts) {
   if (rc == -ECONN || rc == -ERST) rc = smb_reconnect(share);
   if (rc < 0) {
     smb_release_connection(share);
+    smb_exit_cache(share);
     kfree(share);
     return rc;
   }
@@ -112,12 +125,20 @@ int smb_mount(struct fs *fs, char *opts) {
 
 int smb_umount(struct fs *fs) {
   struct smb_share *share = (struct smb_share *) fs->data;
+  struct smb_server *server = share->server;
+  int last;
+
+  // Lock server to keep the connection poller out
+  wait_for_object(&server->lock, INFINITE);
+  last = server->refcnt == 1;
 
   // Disconnect from share
   smb_disconnect_tree(share);
+  smb_exit_cache(share);
   
   // Release server connection
   smb_release_connection(share);
+  if (!last) release_mutex(&server->lock);
 
   // Deallocate share block
   kfree(share);
@@ -148,6 +169,106 @@ int smb_statfs(struct fs *fs, struct statfs *buf) {
   return 0;
 }
 
+static int smb_read_chunksize(struct smb_share *share) {
+  if (share->server->server_caps & SMB_CAP_LARGE_READX) return SMB_LARGE_CHUNKSIZE;
+  return SMB_NORMAL_CHUNKSIZE;
+}
+
+static int smb_submit_read(struct smb_share *share, struct smb_file *file, struct smb_pending *req, char *data, int size, off64_t pos) {
+  struct smb *smb;
+
+  smb = smb_init(share, 0);
+  smb->params.req.read.andx.cmd = 0xFF;
+  smb->params.req.read.fid = file->fid;
+  smb->params.req.read.offset = ((struct smb_pos *) &pos)->low_part;
+  smb->params.req.read.max_count = size;
+  smb->params.req.read.offset_high = ((struct smb_pos *) &pos)->high_part;
+
+  req->pos = pos;
+  req->data = data;
+  req->size = size;
+
+  return smb_submit(share, smb, req, SMB_COM_READ_ANDX, 12, NULL, 0);
+}
+
+static int smb_submit_write(struct smb_share *share, struct smb_file *file, struct smb_pending *req, char *data, int size, off64_t pos) {
+  struct smb *smb;
+
+  smb = smb_init(share, 0);
+  smb->params.req.write.andx.cmd = 0xFF;
+  smb->params.req.write.fid = file->fid;
+  smb->params.req.write.offset = ((struct smb_pos *) &pos)->low_part;
+  smb->params.req.write.data_length = size;
+  smb->params.req.write.data_offset = SMB_HEADER_LEN + 14 * 2;
+  smb->params.req.write.offset_high = ((struct smb_pos *) &pos)->high_part;
+
+  req->pos = pos;
+  req->data = NULL;
+  req->size = size;
+
+  return smb_submit(share, smb, req, SMB_COM_WRITE_ANDX, 14, data, size);
+}
+
+static void smb_cancel_readahead(struct smb_share *share, struct smb_file *file) {
+  // Requests cannot be recalled from the server, so wait for the replies
+  while (file->racount > 0) {
+    smb_wait(share, &file->ra[file->rahead]);
+    file->ra[file->rahead].state = SMB_REQ_IDLE;
+    file->rahead = (file->rahead + 1) % file->raslots;
+    file->racount--;
+  }
+}
+
+static void smb_readahead(struct smb_share *share, struct smb_file *file, off64_t pos) {
+  struct smb_pending *req;
+  int window;
+  int slot;
+
+  // Allocate read-ahead buffer on first sequential read
+  if (!file->rabuf) {
+    file->rachunk = smb_read_chunksize(share);
+    file->raslots = SMB_READAHEAD_SIZE / file->rachunk;
+    if (file->raslots > SMB_MAX_PENDING) file->raslots = SMB_MAX_PENDING;
+    file->rabuf = (char *) kmalloc(file->raslots * file->rachunk);
+    if (!file->rabuf) return;
+  }
+
+  // Continue after the last outstanding read-ahead request
+  if (file->racount > 0) {
+    req = &file->ra[(file->rahead + file->racount - 1) % file->raslots];
+    pos = req->pos + req->size;
+  }
+
+  window = smb_window(share, file->raslots * file->rachunk, file->rachunk);
+  while (file->racount < window && pos < file->statbuf.st_size) {
+    slot = (file->rahead + file->racount) % file->raslots;
+    req = &file->ra[slot];
+    if (smb_submit_read(share, file, req, file->rabuf + slot * file->rachunk, file->rachunk, pos) < 0) break;
+
+    file->racount++;
+    pos += file->rachunk;
+  }
+}
+
+static int smb_flush_writes(struct smb_share *share, struct smb_file *file) {
+  struct smb_pending *req;
+  int i;
+  int rc;
+
+  for (i = 0; i < SMB_MAX_PENDING; i++) {
+    req = &file->wb[i];
+    if (req->state == SMB_REQ_IDLE) continue;
+
+    rc = smb_wait(share, req);
+    req->state = SMB_REQ_IDLE;
+    if (rc != req->size && file->wberr == 0) file->wberr = rc < 0 ? rc : -EIO;
+  }
+
+  rc = file->wberr;
+  file->wberr = 0;
+  return rc;
+}
+
 int smb_open(struct file *filp, char *name) {
   struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb *smb;
@@ -263,6 +384,7 @@ int smb_open(struct file *filp, char *name) {
   smb = smb_init(share, 0);
   smb->params.req.create.andx.cmd = 0xFF;
   smb->params.req.create.name_length = strlen(name) + 1;
+  smb->params.req.create.flags = share->oplocks ? SMB_OPEN_REQUEST_OPLOCK : 0;
   smb->params.req.create.desired_access = access;
   smb->params.req.create.ext_file_attributes = attrs;
   smb->params.req.create.share_access = sharing;
@@ -277,6 +399,23 @@ int smb_open(struct file *filp, char *name) {
 
   file->fid = smb->params.rsp.create.fid;
   file->attrs = (unsigned short) smb->params.rsp.create.ext_file_attributes;
+  file->oplock = smb->params.rsp.create.oplock_level;
+  if (file->oplock != SMB_OPLOCK_NONE) share->stats.oplocks++;
+
+  // Cached attributes and data are stale if the file was created or truncated
+  if (smb->params.rsp.create.create_action != SMB_FILE_OPENED) {
+    smb_clear_cache(share);
+    smb_purge_path(share, name);
+  }
+
+  // File data can only be cached while an oplock is held
+  if (file->attrs & SMB_FILE_ATTR_DIRECTORY) {
+    file->oplock = SMB_OPLOCK_NONE;
+  } else if (file->oplock != SMB_OPLOCK_NONE) {
+    file->cnode = smb_attach_cnode(share, name, smb->params.rsp.create.last_write_time, smb->params.rsp.create.end_of_file);
+  } else {
+    smb_purge_path(share, name);
+  }
 
   if (file->attrs & SMB_FILE_ATTR_DIRECTORY) {
     file->statbuf.st_mode = S_IFDIR;
@@ -304,6 +443,8 @@ int smb_open(struct file *filp, char *name) {
     filp->pos = 0;
   }
 
+  file->next = share->files;
+  share->files = file;
   filp->data = file;
 
   return 0;
@@ -325,10 +466,16 @@ int smb_close(struct file *filp) {
       if (rc < 0) return rc;
     }
 
+    if (dir->cached) smb_release_dirlist(dir->cached);
+    if (dir->fill) smb_release_dirlist(dir->fill);
     kfree(dir);
     filp->data = NULL;
   } else {
     struct smb_file *file = (struct smb_file *) filp->data;
+    int wrc;
+
+    smb_cancel_readahead(share, file);
+    wrc = smb_flush_writes(share, file);
 
     smb = smb_init(share, 0);
     smb->params.req.close.fid = file->fid;
@@ -336,11 +483,31 @@ int smb_close(struct file *filp) {
     rc = smb_request(share, smb, SMB_COM_CLOSE, 3, NULL, 0, 0);
     if (rc < 0) return rc;
 
+    // Remove file from list of open files
+    if (share->files == file) {
+      share->files = file->next;
+    } else {
+      struct smb_file *f;
+
+      for (f = share->files; f; f = f->next) {
+        if (f->next == file) {
+          f->next = file->next;
+          break;
+        }
+      }
+    }
+
+    if (file->cnode) {
+      if (filp->flags & O_TEMPORARY) smb_purge_cnode(share, file->cnode);
+      smb_detach_cnode(share, file->cnode);
+    }
+    if (file->rabuf) kfree(file->rabuf);
     kfree(file);
     filp->data = NULL;
-  }
 
-  smb_clear_cache(share);
+    if (filp->flags & (F_MODIFIED | O_TEMPORARY)) smb_clear_cache(share);
+    if (wrc < 0) return wrc;
+  }
 
   return 0;
 }
@@ -357,6 +524,9 @@ int smb_fsync(struct file *filp) {
 
   if (filp->flags & F_DIR) return -EBADF;
 
+  rc = smb_flush_writes(share, file);
+  if (rc < 0) return rc;
+
   smb = smb_init(share, 0);
   smb->params.req.flush.fid = file->fid;
 
@@ -366,135 +536,171 @@ int smb_fsync(struct file *filp) {
   return 0;
 }
 
-static int smb_read_raw(struct smb_share *share, struct smb_file *file, void *data, size_t size, unsigned long pos) {
-  struct smb *smb;
-  unsigned char hdr[4];
-  int len;
-  int rc;
-
-  smb = smb_init(share, 0);
-  smb->params.req.readraw.fid = file->fid;
-  smb->params.req.readraw.offset = pos;
-  smb->params.req.readraw.max_count = size;
-
-  rc = smb_send(share, smb, SMB_COM_READ_RAW, 8, NULL, 0);
-  if (rc < 0) return rc;
-  
-  rc = recv_fully(share->server->sock, (char *) &hdr, 4, 0);
-  if (rc < 0) return rc;
-
-  len = hdr[3] | (hdr[2] << 8) | (hdr[1] << 16) | (hdr[0] << 24);
-  if (len == 0) return 0;
-
-  rc = recv_fully(share->server->sock, data, len, 0);
-  if (rc < 0) return rc;
-
-  return rc;
-}
-
-static int smb_read_normal(struct smb_share *share, struct smb_file *file, void *data, size_t size, off64_t pos) {
-  struct smb *smb;
-  int len;
-  int rc;
-
-  // Read from file
-  smb = smb_init(share, 0);
-  smb->params.req.read.andx.cmd = 0xFF;
-  smb->params.req.read.fid = file->fid;
-  smb->params.req.read.offset = ((struct smb_pos *) &pos)->low_part;
-  smb->params.req.read.max_count = size;
-  smb->params.req.read.offset_high = ((struct smb_pos *) &pos)->high_part;
-
-  rc = smb_request(share, smb, SMB_COM_READ_ANDX, 12, NULL, 0, 0);
-  if (rc < 0) return rc;
-
-  len = smb->params.rsp.read.data_length;
-  if (len) memcpy(data, (char *) smb + smb->params.rsp.read.data_offset + 4, len);
-
-  return len;
-}
-
 int smb_read(struct file *filp, void *data, size_t size, off64_t pos) {
   struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb_file *file = (struct smb_file *) filp->data;
+  struct smb_pending req[SMB_MAX_PENDING];
+  struct smb_pending *ra;
   char *p;
+  char *fillp;
+  off64_t fillpos;
   size_t left;
-  size_t count;
+  size_t issued;
+  int cached;
+  int sequential;
+  int eof;
+  int err;
+  int window;
+  int chunksize;
+  int count;
+  int n, i;
   int rc;
 
   if (filp->flags & F_DIR) return -EBADF;
   if (size == 0) return 0;
 
+  // Wait for outstanding writes before reading
+  rc = smb_flush_writes(share, file);
+  if (rc < 0) return rc;
+
+  sequential = pos == file->nextpos && (filp->flags & (O_RANDOM | O_DIRECT)) == 0;
   left = size;
   p = (char *) data;
+  eof = 0;
+  err = 0;
 
-  if (filp->pos < file->statbuf.st_size && pos < 0x80000000) {
-    // Read data using raw mode
-    while (1) {
-      count = left;
-      if (count > SMB_RAW_CHUNKSIZE) count = SMB_RAW_CHUNKSIZE;
+  // Copy data from data cache while holding an oplock
+  cached = file->cnode && file->oplock != SMB_OPLOCK_NONE && (filp->flags & O_DIRECT) == 0;
+  if (cached && pos < file->statbuf.st_size) {
+    count = left;
+    if (pos + count > file->statbuf.st_size) count = (int) (file->statbuf.st_size - pos);
+    count = smb_read_cache(share, file->cnode, p, count, pos);
+    pos += count;
+    p += count;
+    left -= count;
+  }
+  if (left == 0 || pos >= file->statbuf.st_size) {
+    file->nextpos = pos;
+    return size - left;
+  }
+  fillp = p;
+  fillpos = pos;
 
-      rc = smb_read_raw(share, file, p, count, (unsigned long) pos);
-      if (rc < 0) return rc;
-      if (rc == 0) break;
+  // Copy data from read-ahead buffer
+  while (left > 0 && file->racount > 0) {
+    ra = &file->ra[file->rahead];
+    if (pos < ra->pos || pos >= ra->pos + ra->size) break;
 
-      pos += rc;
-      left -= rc;
-      p += rc;
+    rc = smb_wait(share, ra);
+    if (rc < 0) {
+      err = rc;
+      break;
+    }
 
-      if (left == 0) return size;
+    if (pos >= ra->pos + rc) {
+      eof = 1;
+      break;
     }
-  }
 
-  // Read rest using normal mode
-  while (pos < file->statbuf.st_size && left > 0) {
-    count = left;
-    if (count > SMB_NORMAL_CHUNKSIZE) count = SMB_NORMAL_CHUNKSIZE;
+    count = (int) (ra->pos + rc - pos);
+    if ((size_t) count > left) count = left;
+    memcpy(p, ra->data + (pos - ra->pos), count);
+    pos += count;
+    p += count;
+    left -= count;
+
+    if (pos == ra->pos + ra->size) {
+      ra->state = SMB_REQ_IDLE;
+      file->rahead = (file->rahead + 1) % file->raslots;
+      file->racount--;
+    } else if (pos == ra->pos + rc) {
+      eof = 1;
+    }
+  }
 
-    rc = smb_read_normal(share, file, p, count, pos);
-    if (rc < 0) return rc;
-    if (rc == 0) return size - left;
+  // Discard read-ahead data if the read was not sequential
+  if (left > 0) smb_cancel_readahead(share, file);
+
+  // Read the rest with a window of pipelined requests into the caller's buffer
+  chunksize = smb_read_chunksize(share);
+  window = smb_window(share, SMB_READAHEAD_SIZE, chunksize);
+  while (!eof && !err && left > 0 && pos < file->statbuf.st_size) {
+    n = 0;
+    issued = 0;
+    while (n < window && issued < left && pos + issued < file->statbuf.st_size) {
+      count = left - issued;
+      if (count > chunksize) count = chunksize;
+
+      rc = smb_submit_read(share, file, &req[n], p + issued, count, pos + issued);
+      if (rc < 0) {
+        err = rc;
+        break;
+      }
+
+      issued += count;
+      n++;
+    }
 
-    pos += rc;
-    left -= rc;
-    p += rc;
+    // Collect replies in file order
+    for (i = 0; i < n; i++) {
+      rc = smb_wait(share, &req[i]);
+      if (eof || err) continue;
+
+      if (rc < 0) {
+        err = rc;
+      } else {
+        pos += rc;
+        p += rc;
+        left -= rc;
+        if (rc < req[i].size) eof = 1;
+      }
+    }
   }
 
-  return size - left;
-}
+  file->nextpos = pos;
 
-static int smb_write_normal(struct smb_share *share, struct smb_file *file, void *data, size_t size, off64_t pos) {
-  struct smb *smb;
-  int rc;
+  // Add data read from server to data cache unless the oplock was broken
+  if (cached && file->oplock != SMB_OPLOCK_NONE && pos > fillpos) {
+    smb_fill_cache(share, file->cnode, fillp, (size_t) (pos - fillpos), fillpos, eof || pos >= file->statbuf.st_size);
+  }
 
-  // Write to file
-  smb = smb_init(share, 0);
-  smb->params.req.write.andx.cmd = 0xFF;
-  smb->params.req.write.fid = file->fid;
-  smb->params.req.write.offset = ((struct smb_pos *) &pos)->low_part;
-  smb->params.req.write.data_length = size;
-  smb->params.req.write.data_offset = SMB_HEADER_LEN + 14 * 2;
-  smb->params.req.write.offset_high = ((struct smb_pos *) &pos)->high_part;
+  if (err && left == size) return err;
 
-  rc = smb_request(share, smb, SMB_COM_WRITE_ANDX, 14, data, size, 0);
-  if (rc < 0) return rc;
+  // Keep the read-ahead window full for sequential reads
+  if (sequential && !eof && !err) smb_readahead(share, file, pos);
 
-  return smb->params.rsp.write.count;
+  return size - left;
 }
 
 int smb_write(struct file *filp, void *data, size_t size, off64_t pos) {
   struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb_file *file = (struct smb_file *) filp->data;
+  struct smb_pending *req;
   char *p;
   size_t left;
   size_t count;
+  int window;
   int rc;
 
   if (filp->flags & F_DIR) return -EBADF;
   if (size == 0) return 0;
 
+  // Read-ahead data becomes stale when the file is written
+  smb_cancel_readahead(share, file);
+
+  // Report error from earlier write-behind requests
+  if (file->wberr) {
+    rc = file->wberr;
+    file->wberr = 0;
+    return rc;
+  }
+
   if (filp->flags & O_APPEND) pos = file->statbuf.st_size;
 
+  // Cached attributes for the file become stale on the first write
+  if ((filp->flags & F_MODIFIED) == 0) smb_clear_cache(share);
+
+  window = smb_window(share, SMB_WRITEBEHIND_SIZE, SMB_NORMAL_CHUNKSIZE);
   left = size;
   p = (char *) data;
 
@@ -502,17 +708,41 @@ int smb_write(struct file *filp, void *data, size_t size, off64_t pos) {
     count = left;
     if (count > SMB_NORMAL_CHUNKSIZE) count = SMB_NORMAL_CHUNKSIZE;
 
-    rc = smb_write_normal(share, file, p, count, pos);
+    // Wait for the oldest write in the window before reusing its slot
+    req = &file->wb[file->wbnext];
+    if (req->state != SMB_REQ_IDLE) {
+      rc = smb_wait(share, req);
+      req->state = SMB_REQ_IDLE;
+      if (rc != req->size) return rc < 0 ? rc : -EIO;
+    }
+
+    rc = smb_submit_write(share, file, req, p, count, pos);
     if (rc < 0) return rc;
+    file->wbnext = (file->wbnext + 1) % window;
+
+    // Write data through to the data cache
+    if (file->cnode) {
+      if (file->oplock != SMB_OPLOCK_NONE) {
+        smb_update_cache(share, file->cnode, p, count, pos);
+      } else {
+        smb_purge_cnode(share, file->cnode);
+      }
+    }
 
-    pos += rc;
+    pos += count;
     filp->flags |= F_MODIFIED;
-    left -= rc;
-    p += rc;
+    left -= count;
+    p += count;
 
     if (pos > file->statbuf.st_size) file->statbuf.st_size = pos;
   }
 
+  // Write-through files wait for all replies
+  if (filp->flags & O_DIRECT) {
+    rc = smb_flush_writes(share, file);
+    if (rc < 0) return rc;
+  }
+
   return size;
 }
 
@@ -555,6 +785,13 @@ int smb_ftruncate(struct file *filp, off64_t size) {
   int rc;
   int rsplen;
 
+  smb_cancel_readahead(share, file);
+  rc = smb_flush_writes(share, file);
+  if (rc < 0) return rc;
+
+  smb_clear_cache(share);
+  if (file->cnode) smb_purge_cnode(share, file->cnode);
+
   memset(&req, 0, sizeof(req));
   req.fid = file->fid;
   req.infolevel = 0x104;
@@ -566,6 +803,7 @@ int smb_ftruncate(struct file *filp, off64_t size) {
   if (rc < 0) return rc;
 
   if (filp->pos > size) filp->pos = size;
+  file->statbuf.st_size = size;
 
   return 0;
 }
@@ -579,6 +817,11 @@ int smb_futime(struct file *filp, struct utimbuf *times) {
   int rc;
   int rsplen;
 
+  rc = smb_flush_writes(share, file);
+  if (rc < 0) return rc;
+
+  smb_clear_cache(share);
+
   memset(&req, 0, sizeof(req));
   req.fid = file->fid;
   req.infolevel = 0x101;
@@ -631,7 +874,7 @@ int smb_stat(struct fs *fs, char *name, struct stat64 *buffer) {
   struct smb_pathinfo_request req;
   struct smb_file_basic_info rspb;
   struct smb_file_standard_info rsps;
-  struct smb_dentry *dentry;
+  struct stat64 statbuf;
   int rsplen;
   short dummy;
   int dummylen;
@@ -654,10 +897,9 @@ int smb_stat(struct fs *fs, char *name, struct stat64 *buffer) {
   }
 
   // Look in cache
-  dentry = smb_find_in_cache(share, name);
-  if (dentry != NULL) {
-    if (buffer) memcpy(buffer, &dentry->statbuf, sizeof(struct stat64));
-    return (int) dentry->statbuf.st_size;
+  if (smb_find_in_cache(share, name, &statbuf)) {
+    if (buffer) memcpy(buffer, &statbuf, sizeof(struct stat64));
+    return (int) statbuf.st_size;
   }
 
   // Query server for file information
@@ -699,6 +941,8 @@ int smb_stat(struct fs *fs, char *name, struct stat64 *buffer) {
     buffer->st_mtime = ft2time(rspb.last_write_time);
     buffer->st_ctime = ft2time(rspb.creation_time);
     buffer->st_size = rsps.end_of_file;
+
+    smb_add_to_cache(share, name, NULL, buffer);
   }
 
   return (int) rsps.end_of_file;
@@ -724,6 +968,8 @@ int smb_mkdir(struct fs *fs, char *name, int mode) {
   rc = smb_request(share, smb, SMB_COM_CREATE_DIRECTORY, 0, namebuf, p - namebuf, 1);
   if (rc < 0) return rc;
 
+  smb_clear_cache(share);
+
   return 0;
 }
 
@@ -747,6 +993,8 @@ int smb_rmdir(struct fs *fs, char *name) {
   rc = smb_request(share, smb, SMB_COM_DELETE_DIRECTORY, 0, namebuf, p - namebuf, 1);
   if (rc < 0) return rc;
 
+  smb_clear_cache(share);
+
   return 0;
 }
 
@@ -775,6 +1023,10 @@ int smb_rename(struct fs *fs, char *oldname, char *newname) {
   rc = smb_request(share, smb, SMB_COM_RENAME, 1, namebuf, p - namebuf, 1);
   if (rc < 0) return rc;
 
+  smb_clear_cache(share);
+  smb_purge_path(share, oldname);
+  smb_purge_path(share, newname);
+
   return 0;
 }
 
@@ -802,6 +1054,9 @@ int smb_unlink(struct fs *fs, char *name) {
   rc = smb_request(share, smb, SMB_COM_DELETE, 1, namebuf, p - namebuf, 1);
   if (rc < 0) return rc;
 
+  smb_clear_cache(share);
+  smb_purge_path(share, name);
+
   return 0;
 }
 
@@ -819,6 +1074,19 @@ int smb_opendir(struct file *filp, char *name) {
 
   dir = (struct smb_directory *) kmalloc(sizeof(struct smb_directory));
   if (!dir) return -ENOMEM;
+  dir->cached = NULL;
+  dir->cachepos = 0;
+  dir->fill = NULL;
+  strcpy(dir->path, name);
+
+  // Use cached directory listing if available
+  dir->cached = smb_find_dirlist(share, name);
+  if (dir->cached) {
+    dir->eos = 1;
+    dir->entries_left = 0;
+    filp->data = dir;
+    return 0;
+  }
 
   memset(&req, 0, sizeof(req));
   req.search_attributes = SMB_FILE_ATTR_SYSTEM | SMB_FILE_ATTR_HIDDEN | SMB_FILE_ATTR_DIRECTORY;
@@ -840,12 +1108,23 @@ int smb_opendir(struct file *filp, char *name) {
   dir->eos = rsp.end_of_search;
   dir->entries_left = rsp.search_count;
   dir->fi = (struct smb_file_directory_info *) dir->buffer;
-  strcpy(dir->path, name);
+  if (share->attrttl != 0) dir->fill = smb_new_dirlist(name);
 
   filp->data = dir;
   return 0;
 }
 
+static int smb_end_of_dir(struct smb_share *share, struct smb_directory *dir) {
+  // Add complete directory listing to cache
+  if (dir->fill) {
+    smb_commit_dirlist(share, dir->fill);
+    smb_release_dirlist(dir->fill);
+    dir->fill = NULL;
+  }
+
+  return 0;
+}
+
 int smb_readdir(struct file *filp, struct direntry *dirp, int count) {
   struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb_directory *dir = (struct smb_directory *) filp->data;
@@ -853,6 +1132,21 @@ int smb_readdir(struct file *filp, struct direntry *dirp, int count) {
 
   if (count != 1) return -EINVAL;
 
+  // Return next entry from cached listing
+  if (dir->cached) {
+    struct smb_dirent *de;
+
+    if (dir->cachepos >= dir->cached->size) return 0;
+    de = (struct smb_dirent *) (dir->cached->buffer + dir->cachepos);
+    dir->cachepos += ROUNDUP(sizeof(struct smb_dirent) + de->namelen + 1);
+
+    dirp->ino = 0;
+    dirp->namelen = de->namelen;
+    dirp->reclen = sizeof(struct direntry) - MAXPATH + dirp->namelen + 1;
+    strcpy(dirp->name, de->name);
+    return 1;
+  }
+
 again:
   if (dir->entries_left == 0) {
     struct smb_findnext_request req;
@@ -861,7 +1155,7 @@ again:
     int buflen;
     int rc;
 
-    if (dir->eos) return 0;
+    if (dir->eos) return smb_end_of_dir(share, dir);
 
     memset(&req, 0, sizeof(req));
     req.sid = dir->sid;
@@ -878,7 +1172,7 @@ again:
     dir->entries_left = rsp.search_count;
     dir->fi = (struct smb_file_directory_info *) dir->buffer;
 
-    if (dir->entries_left == 0) return 0;
+    if (dir->entries_left == 0) return smb_end_of_dir(share, dir);
   }
 
   if (dir->fi->filename[0] == '.' && (dir->fi->filename[1] == 0 || (dir->fi->filename[1] == '.' && dir->fi->filename[2] == 0))) {
@@ -904,6 +1198,11 @@ again:
   statbuf.st_size = dir->fi->end_of_file;
 
   smb_add_to_cache(share, dir->path, dir->fi->filename, &statbuf);
+  if (dir->fill && smb_add_dirent(dir->fill, dir->fi->filename, &statbuf) < 0) {
+    // Directory is too large for the cache
+    smb_release_dirlist(dir->fill);
+    dir->fill = NULL;
+  }
 
   dirp->ino = 0;
   dirp->namelen = strlen(dir->fi->filename);
@@ -967,4 +1266,6 @@ struct fsops smbfsops = {
 
 void init_smbfs() {
   register_filesystem("smbfs", &smbfsops);
+  register_proc_inode("smbfs", smb_proc, NULL);
+  smb_init_poll();
 }
@@ -34,8 +34,22 @@
 #include <os/krnl.h>
 #include "smb.h"
 
+#define SMB_FIXED_LEN (SMB_HEADER_LEN - 2)  // SMB header and word count
+#define SMB_FLAGS_REPLY 0x80                // Message is a reply
+
 struct smb_server *servers = NULL;
 
+static struct timer smb_poll_timer;
+static struct task smb_poll_task;
+
+static unsigned short smb_next_mid(struct smb_server *server) {
+  unsigned short mid = server->mid++;
+
+  // Multiplex id 0xFFFF is reserved for oplock break requests
+  if (server->mid == 0xFFFF) server->mid = 0;
+  return mid;
+}
+
 struct smb *smb_init(struct smb_share *share, int aux) {
   struct smb *smb;
   
@@ -69,6 +83,7 @@ int smb_send(struct smb_share *share, struct smb *smb, unsigned char cmd, int pa
   smb->cmd = cmd;
   smb->tid = share->tid;
   smb->uid = share->server->uid;
+  smb->mid = smb_next_mid(share->server);
   smb->wordcount = (unsigned char) params;
   smb->flags = (1 << 3);
   smb->flags2 = 1;
@@ -84,29 +99,208 @@ int smb_send(struct smb_share *share, struct smb *smb, unsigned char cmd, int pa
   return 0;
 }
 
-int smb_recv(struct smb_share *share, struct smb *smb) {
+static int smb_discard(struct socket *s, int len) {
+  char buf[256];
+  int rc;
+
+  while (len > 0) {
+    rc = recv_fully(s, buf, len > sizeof(buf) ? sizeof(buf) : len, 0);
+    if (rc <= 0) return rc < 0 ? rc : -EIO;
+    len -= rc;
+  }
+
+  return 0;
+}
+
+static int smb_complete(struct smb_server *server, struct smb_pending *req, struct smb *rsp, int len) {
+  int hdrlen;
+  int padding;
+  int count;
+  int rc;
+
+  if (rsp->error_class != SMB_SUCCESS) {
+    req->rc = smb_errno(rsp);
+    return smb_discard(server->sock, len);
+  }
+
+  // Receive parameter words and byte count
+  hdrlen = rsp->wordcount * 2 + 2;
+  if (hdrlen > len || SMB_FIXED_LEN + hdrlen > SMB_MAX_BUFFER) return -EPROTO;
+  rc = recv_fully(server->sock, (char *) rsp->params.words, hdrlen, 0);
+  if (rc < 0) return rc;
+  if (rc != hdrlen) return -EIO;
+  len -= hdrlen;
+
+  switch (req->cmd) {
+    case SMB_COM_READ_ANDX:
+      // Receive read data directly into the request buffer
+      padding = rsp->params.rsp.read.data_offset - (SMB_FIXED_LEN + hdrlen);
+      count = rsp->params.rsp.read.data_length;
+      if (rsp->wordcount < 12 || padding < 0 || padding + count > len || count > req->size) return -EPROTO;
+
+      rc = smb_discard(server->sock, padding);
+      if (rc < 0) return rc;
+      if (count > 0) {
+        rc = recv_fully(server->sock, req->data, count, 0);
+        if (rc < 0) return rc;
+        if (rc != count) return -EIO;
+      }
+
+      len -= padding + count;
+      req->rc = count;
+      break;
+
+    case SMB_COM_WRITE_ANDX:
+      if (rsp->wordcount < 6) return -EPROTO;
+      req->rc = rsp->params.rsp.write.count;
+      break;
+
+    default:
+      req->rc = 0;
+  }
+
+  return smb_discard(server->sock, len);
+}
+
+//
+// Handle oplock break request from server. Cached data is discarded when
+// the oplock is broken to none. Write-behind requests for the file have
+// already been sent, so the break can be acknowledged at once.
+//
+
+static int smb_oplock_break(struct smb_server *server, struct smb *msg, int len) {
+  struct smb_share *share;
+  struct smb_file *file;
+  unsigned short fid;
+  int oldlevel;
+  int newlevel;
+  int rc;
+
+  if (SMB_FIXED_LEN + len > SMB_MAX_BUFFER) return -EMSGSIZE;
+  rc = recv_fully(server->sock, (char *) msg->params.words, len, 0);
+  if (rc < 0) return rc;
+  if (rc != len) return -EIO;
+  if (msg->wordcount < 8) return -EPROTO;
+
+  fid = msg->params.req.locking.fid;
+  newlevel = msg->params.req.locking.oplock_level ? SMB_OPLOCK_LEVEL_II : SMB_OPLOCK_NONE;
+
+  // Find open file for break
+  file = NULL;
+  for (share = server->shares; share; share = share->next) {
+    if (share->tid != msg->tid) continue;
+    for (file = share->files; file; file = file->next) {
+      if (file->fid == fid) break;
+    }
+    if (file) break;
+  }
+  if (!file) return 0;
+
+  oldlevel = file->oplock;
+  file->oplock = newlevel;
+  share->stats.breaks++;
+  if (newlevel == SMB_OPLOCK_NONE && file->cnode) smb_purge_cnode(share, file->cnode);
+
+  // Breaks from level II oplocks are not acknowledged
+  if (oldlevel == SMB_OPLOCK_NONE || oldlevel == SMB_OPLOCK_LEVEL_II) return 0;
+
+  memset(msg, 0, sizeof(struct smb));
+  msg->params.req.locking.andx.cmd = 0xFF;
+  msg->params.req.locking.fid = fid;
+  msg->params.req.locking.lock_type = SMB_LOCKING_ANDX_OPLOCK_RELEASE;
+  msg->params.req.locking.oplock_level = newlevel == SMB_OPLOCK_LEVEL_II ? 1 : 0;
+
+  return smb_send(share, msg, SMB_COM_LOCKING_ANDX, 8, NULL, 0);
+}
+
+//
+// Receive the next message from the server. Replies to asynchronous requests
+// are dispatched to the pending request with the same multiplex id. Returns 1
+// if the reply to the synchronous request in smb has been received.
+//
+
+static int smb_receive(struct smb_server *server, struct smb *smb) {
+  struct smb *rsp = (struct smb *) server->rcvbuf;
+  struct smb_pending *req;
+  struct smb_pending *prev;
   int len;
   int rc;
 
   while (1) {
-    rc = recv_fully(share->server->sock, (char *) smb, 4, 0);
+    rc = recv_fully(server->sock, (char *) rsp, 4, 0);
     if (rc < 0) return rc;
     if (rc != 4) return -EIO;
 
-    if (smb->type == SMB_SESSION_MESSAGE) {
+    if (rsp->type == SMB_SESSION_MESSAGE) {
       break;
-    } else if (smb->type != SMB_SESSION_KEEP_ALIVE) {
+    } else if (rsp->type != SMB_SESSION_KEEP_ALIVE) {
       return -EIO;
     }
   }
 
-  len = smb->len[2] | (smb->len[1] << 8) | (smb->len[0] << 16);
-  if (len < 4 || len > SMB_MAX_BUFFER) return -EMSGSIZE;
-    
-  rc = recv_fully(share->server->sock, (char *) &smb->protocol, len, 0);
+  len = rsp->len[2] | (rsp->len[1] << 8) | (rsp->len[0] << 16);
+  if (len < SMB_FIXED_LEN) return -EIO;
+
+  rc = recv_fully(server->sock, (char *) &rsp->protocol, SMB_FIXED_LEN, 0);
   if (rc < 0) return rc;
-  if (rc != len) return -EIO;
-  if (smb->protocol[0] != 0xFF || smb->protocol[1] != 'S' || smb->protocol[2] != 'M' || smb->protocol[3] != 'B') return -EPROTO;
+  if (rc != SMB_FIXED_LEN) return -EIO;
+  if (rsp->protocol[0] != 0xFF || rsp->protocol[1] != 'S' || rsp->protocol[2] != 'M' || rsp->protocol[3] != 'B') return -EPROTO;
+  len -= SMB_FIXED_LEN;
+
+  // Oplock breaks are sent by the server as LOCKING_ANDX requests
+  if (rsp->cmd == SMB_COM_LOCKING_ANDX && rsp->mid == 0xFFFF && (rsp->flags & SMB_FLAGS_REPLY) == 0) {
+    rc = smb_oplock_break(server, rsp, len);
+    return rc < 0 ? rc : 0;
+  }
+
+  // Receive reply to synchronous request into request buffer
+  if (smb && rsp->mid == smb->mid) {
+    if (SMB_FIXED_LEN + len > SMB_MAX_BUFFER) return -EMSGSIZE;
+    memcpy(smb, rsp, 4 + SMB_FIXED_LEN);
+    rc = recv_fully(server->sock, (char *) smb->params.words, len, 0);
+    if (rc < 0) return rc;
+    if (rc != len) return -EIO;
+    return 1;
+  }
+
+  // Find pending request for reply
+  prev = NULL;
+  req = server->pending;
+  while (req && req->mid != rsp->mid) {
+    prev = req;
+    req = req->next;
+  }
+
+  // Discard replies to requests that are no longer pending
+  if (!req) return smb_discard(server->sock, len);
+
+  rc = smb_complete(server, req, rsp, len);
+  if (rc < 0) return rc;
+
+  if (prev) {
+    prev->next = req->next;
+  } else {
+    server->pending = req->next;
+  }
+  req->next = NULL;
+  req->state = SMB_REQ_DONE;
+  server->outstanding--;
+
+  return 0;
+}
+
+int smb_recv(struct smb_share *share, struct smb *smb) {
+  int rc;
+
+  while (1) {
+    rc = smb_receive(share->server, smb);
+    if (rc < 0) {
+      smb_fail_pending(share->server, rc);
+      return rc;
+    }
+    if (rc > 0) break;
+  }
+
   if (smb->error_class != SMB_SUCCESS) return smb_errno(smb);
 
   return 0;
@@ -137,6 +331,78 @@ int smb_request(struct smb_share *share, struct smb *smb, unsigned char cmd, int
   return 0;
 }
 
+//
+// Send an asynchronous request. The reply is received into the pending
+// request by smb_wait() or by any later receive on the connection. One
+// request slot is always left for synchronous requests.
+//
+
+int smb_submit(struct smb_share *share, struct smb *smb, struct smb_pending *req, unsigned char cmd, int params, char *data, int datasize) {
+  struct smb_server *server = share->server;
+  struct smb_pending *r;
+  int rc;
+
+  // Wait for the oldest request if the window is full
+  while (server->pending && server->outstanding >= server->max_mpx - 1) {
+    smb_wait(share, server->pending);
+  }
+
+  rc = smb_send(share, smb, cmd, params, data, datasize);
+  if (rc < 0) return rc;
+
+  req->next = NULL;
+  req->mid = smb->mid;
+  req->cmd = cmd;
+  req->state = SMB_REQ_SENT;
+  req->rc = 0;
+
+  if (server->pending) {
+    for (r = server->pending; r->next; r = r->next);
+    r->next = req;
+  } else {
+    server->pending = req;
+  }
+  server->outstanding++;
+
+  // Complete request at once if the server does not allow multiplexing
+  if (server->max_mpx < 2) smb_wait(share, req);
+
+  return 0;
+}
+
+int smb_wait(struct smb_share *share, struct smb_pending *req) {
+  int rc;
+
+  while (req->state == SMB_REQ_SENT) {
+    rc = smb_receive(share->server, NULL);
+    if (rc < 0) smb_fail_pending(share->server, rc);
+  }
+
+  return req->rc;
+}
+
+int smb_window(struct smb_share *share, int bytes, int chunksize) {
+  int n = bytes / chunksize;
+
+  if (n > SMB_MAX_PENDING) n = SMB_MAX_PENDING;
+  if (n > share->server->max_mpx - 1) n = share->server->max_mpx - 1;
+  if (n < 1) n = 1;
+  return n;
+}
+
+void smb_fail_pending(struct smb_server *server, int rc) {
+  struct smb_pending *req;
+
+  while (server->pending) {
+    req = server->pending;
+    server->pending = req->next;
+    req->next = NULL;
+    req->state = SMB_REQ_DONE;
+    req->rc = rc;
+  }
+  server->outstanding = 0;
+}
+
 int smb_trans_send(struct smb_share *share, unsigned short cmd, 
                    void *params, int paramlen,
                    void *data, int datalen,
@@ -169,6 +435,7 @@ int smb_trans_send(struct smb_share *share, unsigned short cmd,
   smb->cmd = SMB_COM_TRANSACTION2;
   smb->tid = share->tid;
   smb->uid = share->server->uid;
+  smb->mid = smb_next_mid(share->server);
   smb->wordcount = wordcount;
   smb->flags = (1 << 3);
   smb->flags2 = 1;
@@ -361,6 +628,7 @@ int smb_connect(struct smb_share *share) {
   server->server_caps = smb->params.rsp.negotiate.capabilities;
   server->max_buffer_size = smb->params.rsp.negotiate.max_buffer_size;
   max_mpx_count = smb->params.rsp.negotiate.max_mpx_count;
+  server->max_mpx = max_mpx_count > SMB_MAX_PENDING + 1 ? SMB_MAX_PENDING + 1 : max_mpx_count;
 
   // Setup session
   smb = smb_init(share, 1);
@@ -369,7 +637,7 @@ int smb_connect(struct smb_share *share) {
   smb->params.req.setup.max_mpx_count = max_mpx_count;
   smb->params.req.setup.ansi_password_length = strlen(server->password);
   smb->params.req.setup.unicode_password_length = 0;
-  smb->params.req.setup.capabilities = SMB_CAP_NT_SMBS;
+  smb->params.req.setup.capabilities = SMB_CAP_NT_SMBS | SMB_CAP_LARGE_READX | SMB_CAP_LEVEL_II_OPLOCKS;
 
   p = buf;
   p = addstr(p, server->password);
@@ -399,6 +667,9 @@ int smb_disconnect(struct smb_share *share) {
   struct smb *smb;
 
   if (server->sock) {
+    // Fail outstanding requests
+    smb_fail_pending(server, -ECONN);
+
     // Logoff server
     if (server->uid != 0xFFFF) {
       smb = smb_init(share, 1);
@@ -544,6 +815,7 @@ int smb_reconnect(struct smb_share *share) {
   s = server->shares;
   while (s) {
     s->tid = 0xFFFF;
+    smb_reset_cache(s);
     s = s->next;
   }
   server->uid = 0xFFFF;
@@ -558,3 +830,50 @@ int smb_reconnect(struct smb_share *share) {
 
   return 0;
 }
+
+//
+// Oplock breaks and replies to asynchronous requests are normally received
+// by the thread using the connection. Idle connections are polled from the
+// system task queue, so breaks are acknowledged without waiting for the next
+// file system operation.
+//
+
+static void smb_poll(void *arg) {
+  struct smb_server *server;
+  struct smb_server *next;
+  int avail;
+  int rc;
+
+  for (server = servers; server; server = next) {
+    next = server->next;
+    if (!server->sock) continue;
+
+    // Skip connections in use, the current lock holder receives messages
+    if (wait_for_object(&server->lock, 0) < 0) continue;
+
+    while (server->sock) {
+      rc = ioctlsocket(server->sock, FIONREAD, &avail, sizeof(int));
+      if (rc < 0 || avail == 0) break;
+
+      rc = smb_receive(server, NULL);
+      if (rc < 0) {
+        smb_fail_pending(server, rc);
+        break;
+      }
+    }
+
+    next = server->next;
+    release_mutex(&server->lock);
+  }
+}
+
+static void smb_poll_timeout(void *arg) {
+  queue_task(&sys_task_queue, &smb_poll_task, smb_poll, NULL);
+  mod_timer(&smb_poll_timer, ticks + SMB_POLL_INTERVAL / MSECS_PER_TICK);
+}
+
+void smb_init_poll() {
+  init_task(&smb_poll_task);
+  init_timer(&smb_poll_timer, smb_poll_timeout, NULL);
+  mod_timer(&smb_poll_timer, ticks + SMB_POLL_INTERVAL / MSECS_PER_TICK);
+}
@@ -0,0 +1,976 @@
+//
+// tmpfs.c
+//
+// Memory based file system
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os/krnl.h>
+
+#define TMPFS_MIN_FREE  256     // Page frames always left for the rest of the system
+
+//
+// The tmpfs file system keeps all files in kernel memory. File data is
+// stored in whole page frames indexed by page number, so holes in sparse
+// files use no memory. Memory mappings of a file map the page frames of the
+// file directly through the getpage() operation instead of copying them
+// into the page cache. The number of data pages is limited by the size
+// mount option (in KB), which defaults to half of physical memory.
+//
+
+struct tmpdirent {
+  struct tmpdirent *next;       // Next entry in directory
+  struct tmpnode *node;         // Node for entry
+  int namelen;                  // Length of name
+  char name[1];                 // Name of entry
+};
+
+struct tmpnode {
+  ino_t ino;                    // Inode number
+  int mode;                     // File type and permissions
+  uid_t uid;                    // Owner
+  gid_t gid;                    // Group
+  int nlink;                    // Number of directory entries for node
+  int refcnt;                   // Number of open files for node
+  time_t mtime;                 // Last modification time
+  time_t ctime;                 // Creation time
+  off64_t size;                 // File size or number of directory entries
+  char **pages;                 // Page frames for file data
+  unsigned long pagetabsize;    // Number of entries in page table
+  struct tmpnode *parent;       // Parent directory (directories only)
+  struct tmpdirent *entries;    // Directory entries (directories only)
+};
+
+struct tmpfs {
+  struct tmpnode *root;         // Root directory
+  ino_t nextino;                // Next inode number
+  unsigned long maxpages;       // Maximum number of data pages
+  unsigned long usedpages;      // Number of data pages in use
+  unsigned long nodes;          // Number of nodes
+};
+
+int tmpfs_mount(struct fs *fs, char *opts);
+int tmpfs_umount(struct fs *fs);
+int tmpfs_statfs(struct fs *fs, struct statfs *buf);
+
+int tmpfs_open(struct file *filp, char *name);
+int tmpfs_close(struct file *filp);
+int tmpfs_destroy(struct file *filp);
+int tmpfs_fsync(struct file *filp);
+
+int tmpfs_read(struct file *filp, void *data, size_t size, off64_t pos);
+int tmpfs_write(struct file *filp, void *data, size_t size, off64_t pos);
+
+off64_t tmpfs_tell(struct file *filp);
+off64_t tmpfs_lseek(struct file *filp, off64_t offset, int origin);
+int tmpfs_ftruncate(struct file *filp, off64_t size);
+
+int tmpfs_futime(struct file *filp, struct utimbuf *times);
+int tmpfs_utime(struct fs *fs, char *name, struct utimbuf *times);
+
+int tmpfs_fstat(struct file *filp, struct stat64 *buffer);
+int tmpfs_stat(struct fs *fs, char *name, struct stat64 *buffer);
+
+int tmpfs_access(struct fs *fs, char *name, int mode);
+
+int tmpfs_fchmod(struct file *filp, int mode);
+int tmpfs_chmod(struct fs *fs, char *name, int mode);
+int tmpfs_fchown(struct file *filp, int owner, int group);
+int tmpfs_chown(struct fs *fs, char *name, int owner, int group);
+
+int tmpfs_mkdir(struct fs *fs, char *name, int mode);
+int tmpfs_rmdir(struct fs *fs, char *name);
+
+int tmpfs_rename(struct fs *fs, char *oldname, char *newname);
+int tmpfs_link(struct fs *fs, char *oldname, char *newname);
+int tmpfs_unlink(struct fs *fs, char *name);
+
+int tmpfs_opendir(struct file *filp, char *name);
+int tmpfs_readdir(struct file *filp, struct direntry *dirp, int count);
+
+int tmpfs_getpage(struct file *filp, unsigned long pageno, char **page);
+
+struct fsops tmpfsops = {
+  FSOP_STATFS | FSOP_TELL | FSOP_LSEEK | FSOP_FSTAT,
+
+  NULL,
+  NULL,
+
+  NULL,
+  tmpfs_mount,
+  tmpfs_umount,
+
+  tmpfs_statfs,
+
+  tmpfs_open,
+  tmpfs_close,
+  tmpfs_destroy,
+  tmpfs_fsync,
+
+  tmpfs_read,
+  tmpfs_write,
+  NULL,
+
+  tmpfs_tell,
+  tmpfs_lseek,
+  tmpfs_ftruncate,
+
+  tmpfs_futime,
+  tmpfs_utime,
+
+  tmpfs_fstat,
+  tmpfs_stat,
+
+  tmpfs_access,
+
+  tmpfs_fchmod,
+  tmpfs_chmod,
+  tmpfs_fchown,
+  tmpfs_chown,
+
+  tmpfs_mkdir,
+  tmpfs_rmdir,
+
+  tmpfs_rename,
+  tmpfs_link,
+  tmpfs_unlink,
+
+  tmpfs_opendir,
+  tmpfs_readdir,
+
+  tmpfs_getpage
+};
+
+void init_tmpfs() {
+  register_filesystem("tmpfs", &tmpfsops);
+}
+
+//
+// Nodes and data pages
+//
+
+static struct tmpnode *alloc_node(struct tmpfs *tfs, int mode) {
+  struct thread *thread = self();
+  struct tmpnode *node;
+
+  node = (struct tmpnode *) kmalloc(sizeof(struct tmpnode));
+  if (!node) return NULL;
+  memset(node, 0, sizeof(struct tmpnode));
+
+  node->ino = tfs->nextino++;
+  node->mode = mode;
+  node->uid = thread->euid;
+  node->gid = thread->egid;
+  node->mtime = node->ctime = time(NULL);
+  tfs->nodes++;
+
+  return node;
+}
+
+static void release_data_page(struct tmpfs *tfs, char *page) {
+  // The page cache takes over pages that are still memory mapped
+  if (!adopt_cached_page(page)) free_pages(page, 1);
+  tfs->usedpages--;
+}
+
+static void truncate_node(struct tmpfs *tfs, struct tmpnode *node, off64_t size) {
+  unsigned long pages = (unsigned long) ((size + PAGESIZE - 1) / PAGESIZE);
+  unsigned long i;
+  int tail;
+
+  // Release pages beyond the new end of file
+  for (i = pages; i < node->pagetabsize; i++) {
+    if (node->pages[i]) {
+      release_data_page(tfs, node->pages[i]);
+      node->pages[i] = NULL;
+    }
+  }
+
+  // Clear the rest of the last page, so it reads as zeros if the file grows
+  tail = (int) (size % PAGESIZE);
+  if (tail != 0 && size < node->size && pages - 1 < node->pagetabsize && node->pages[pages - 1]) {
+    memset(node->pages[pages - 1] + tail, 0, PAGESIZE - tail);
+  }
+
+  node->size = size;
+}
+
+static void free_node(struct tmpfs *tfs, struct tmpnode *node) {
+  truncate_node(tfs, node, 0);
+  if (node->pages) kfree(node->pages);
+  tfs->nodes--;
+  kfree(node);
+}
+
+static void release_node(struct tmpfs *tfs, struct tmpnode *node) {
+  if (node->nlink == 0 && node->refcnt == 0) free_node(tfs, node);
+}
+
+static int get_page(struct tmpfs *tfs, struct tmpnode *node, unsigned long pageno, int alloc, char **retval) {
+  unsigned long newsize;
+  char **pages;
+  char *page;
+
+  *retval = NULL;
+  if (pageno < node->pagetabsize && node->pages[pageno]) {
+    *retval = node->pages[pageno];
+    return 0;
+  }
+  if (!alloc) return 0;
+
+  if (tfs->usedpages >= tfs->maxpages || freemem < TMPFS_MIN_FREE) return -ENOSPC;
+
+  // Expand page table for file
+  if (pageno >= node->pagetabsize) {
+    newsize = node->pagetabsize ? node->pagetabsize * 2 : 16;
+    while (newsize <= pageno) newsize *= 2;
+    pages = (char **) krealloc(node->pages, newsize * sizeof(char *));
+    if (!pages) return -ENOMEM;
+    memset(pages + node->pagetabsize, 0, (newsize - node->pagetabsize) * sizeof(char *));
+    node->pages = pages;
+    node->pagetabsize = newsize;
+  }
+
+  page = (char *) alloc_pages(1, 'TMPF');
+  if (!page) return -ENOMEM;
+  memset(page, 0, PAGESIZE);
+
+  node->pages[pageno] = page;
+  tfs->usedpages++;
+
+  *retval = page;
+  return 0;
+}
+
+//
+// Directories
+//
+
+static struct tmpdirent *find_entry(struct tmpnode *dir, char *name, int len) {
+  struct tmpdirent *de;
+
+  for (de = dir->entries; de; de = de->next) {
+    if (fnmatch(name, len, de->name, de->namelen)) return de;
+  }
+
+  return NULL;
+}
+
+static int add_entry(struct tmpnode *dir, char *name, int len, struct tmpnode *node) {
+  struct tmpdirent *de;
+  struct tmpdirent **link;
+
+  de = (struct tmpdirent *) kmalloc(sizeof(struct tmpdirent) + len);
+  if (!de) return -ENOMEM;
+  de->next = NULL;
+  de->node = node;
+  de->namelen = len;
+  memcpy(de->name, name, len);
+  de->name[len] = 0;
+
+  // Append new entries, so positions of open directory scans stay valid
+  link = &dir->entries;
+  while (*link) link = &(*link)->next;
+  *link = de;
+
+  dir->size++;
+  dir->mtime = time(NULL);
+  node->nlink++;
+  return 0;
+}
+
+static void remove_entry(struct tmpnode *dir, struct tmpdirent *de) {
+  struct tmpdirent **link;
+
+  for (link = &dir->entries; *link; link = &(*link)->next) {
+    if (*link == de) {
+      *link = de->next;
+      break;
+    }
+  }
+
+  dir->size--;
+  dir->mtime = time(NULL);
+  de->node->nlink--;
+  kfree(de);
+}
+
+static int lookup(struct tmpfs *tfs, char *name, int len, struct tmpnode **retval) {
+  struct tmpnode *node = tfs->root;
+  struct tmpdirent *de;
+  char *p;
+  int l;
+
+  while (1) {
+    // Skip path separator
+    if (len > 0 && (*name == PS1 || *name == PS2)) {
+      name++;
+      len--;
+    }
+    if (len == 0) break;
+    if (!S_ISDIR(node->mode)) return -ENOTDIR;
+
+    // Find next part of name
+    p = name;
+    l = 0;
+    while (l < len && *p != PS1 && *p != PS2) {
+      l++;
+      p++;
+    }
+
+    de = find_entry(node, name, l);
+    if (!de) return -ENOENT;
+
+    node = de->node;
+    name += l;
+    len -= l;
+  }
+
+  *retval = node;
+  return 0;
+}
+
+static int lookup_parent(struct tmpfs *tfs, char **name, int *len, struct tmpnode **retval) {
+  struct tmpnode *dir;
+  char *start;
+  char *p;
+  int rc;
+
+  start = *name;
+  p = start + *len - 1;
+  while (p > start && *p != PS1 && *p != PS2) p--;
+
+  if (*len > 0 && (*p == PS1 || *p == PS2)) {
+    rc = lookup(tfs, start, p - start, &dir);
+    if (rc < 0) return rc;
+    *len -= p - start + 1;
+    *name = p + 1;
+  } else {
+    dir = tfs->root;
+  }
+
+  if (!S_ISDIR(dir->mode)) return -ENOTDIR;
+  if (*len == 0) return -EPERM;
+
+  *retval = dir;
+  return 0;
+}
+
+static void free_tree(struct tmpfs *tfs, struct tmpnode *dir) {
+  struct tmpdirent *de;
+  struct tmpnode *node;
+
+  while (dir->entries) {
+    de = dir->entries;
+    node = de->node;
+    if (S_ISDIR(node->mode)) free_tree(tfs, node);
+    remove_entry(dir, de);
+    release_node(tfs, node);
+  }
+}
+
+static int stat_node(struct tmpnode *node, struct stat64 *buffer) {
+  if (buffer) {
+    memset(buffer, 0, sizeof(struct stat64));
+
+    buffer->st_mode = node->mode;
+    buffer->st_uid = node->uid;
+    buffer->st_gid = node->gid;
+    buffer->st_ino = node->ino;
+    buffer->st_nlink = node->nlink;
+    buffer->st_dev = NODEV;
+
+    buffer->st_atime = time(NULL);
+    buffer->st_mtime = node->mtime;
+    buffer->st_ctime = node->ctime;
+    buffer->st_size = node->size;
+  }
+
+  return node->size > 0x7FFFFFFF ? 0x7FFFFFFF : (int) node->size;
+}
+
+//
+// File system operations
+//
+
+int tmpfs_mount(struct fs *fs, char *opts) {
+  struct tmpfs *tfs;
+  int size;
+
+  tfs = (struct tmpfs *) kmalloc(sizeof(struct tmpfs));
+  if (!tfs) return -ENOMEM;
+  memset(tfs, 0, sizeof(struct tmpfs));
+
+  size = get_num_option(opts, "size", 0);
+  if (size > 0) {
+    tfs->maxpages = size / (PAGESIZE / 1024);
+  } else {
+    tfs->maxpages = totalmem / 2;
+  }
+
+  tfs->nextino = 1;
+  tfs->root = alloc_node(tfs, S_IFDIR | S_IRWXUGO);
+  if (!tfs->root) {
+    kfree(tfs);
+    return -ENOMEM;
+  }
+  tfs->root->uid = fs->uid;
+  tfs->root->gid = fs->gid;
+  tfs->root->nlink = 1;
+
+  fs->data = tfs;
+  return 0;
+}
+
+int tmpfs_umount(struct fs *fs) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+
+  free_tree(tfs, tfs->root);
+  free_node(tfs, tfs->root);
+  kfree(tfs);
+
+  return 0;
+}
+
+int tmpfs_statfs(struct fs *fs, struct statfs *buf) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+
+  buf->bsize = PAGESIZE;
+  buf->iosize = PAGESIZE;
+  buf->blocks = tfs->maxpages;
+  buf->bfree = tfs->maxpages - tfs->usedpages;
+  buf->files = tfs->nodes;
+  buf->ffree = -1;
+  buf->cachesize = 0;
+
+  return 0;
+}
+
+int tmpfs_open(struct file *filp, char *name) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpnode *dir;
+  struct tmpnode *node;
+  struct tmpdirent *de;
+  struct cfile *cf;
+  int len = strlen(name);
+  int rc;
+
+  if (filp->flags & O_SPECIAL) return -EINVAL;
+
+  if (filp->flags & O_CREAT) {
+    // Open file, create new file if it does not exist
+    rc = lookup_parent(tfs, &name, &len, &dir);
+    if (rc < 0) return rc;
+
+    de = find_entry(dir, name, len);
+    if (de && (filp->flags & O_EXCL)) return -EEXIST;
+
+    if (de) {
+      node = de->node;
+    } else {
+      node = alloc_node(tfs, S_IFREG | (filp->mode & S_IRWXUGO));
+      if (!node) return -ENOSPC;
+
+      rc = add_entry(dir, name, len, node);
+      if (rc < 0) {
+        free_node(tfs, node);
+        return rc;
+      }
+      filp->flags |= F_MODIFIED;
+    }
+  } else {
+    // Open existing file
+    rc = lookup(tfs, name, len, &node);
+    if (rc < 0) return rc;
+  }
+
+  filp->data = node;
+  filp->mode = node->mode;
+  filp->owner = node->uid;
+  filp->group = node->gid;
+
+  if ((filp->flags & O_TRUNC) && node->size > 0) {
+    if (S_ISDIR(node->mode)) return -EISDIR;
+    truncate_node(tfs, node, 0);
+    node->mtime = time(NULL);
+    filp->flags |= F_MODIFIED;
+
+    // Truncate the cached pages if the file is memory mapped
+    cf = lookup_cfile(filp);
+    if (cf) {
+      truncate_cached(cf, 0);
+      release_cfile(cf);
+    }
+  }
+
+  if (filp->flags & O_APPEND) filp->pos = node->size;
+  node->refcnt++;
+
+  return 0;
+}
+
+int tmpfs_close(struct file *filp) {
+  if (filp->flags & O_TEMPORARY) unlink(filp->path);
+  return 0;
+}
+
+int tmpfs_destroy(struct file *filp) {
+  struct tmpnode *node = (struct tmpnode *) filp->data;
+
+  node->refcnt--;
+  release_node((struct tmpfs *) filp->fs->data, node);
+
+  return 0;
+}
+
+int tmpfs_fsync(struct file *filp) {
+  return 0;
+}
+
+int tmpfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
+  struct tmpnode *node = (struct tmpnode *) filp->data;
+  unsigned long pageno;
+  size_t read;
+  size_t count;
+  int start;
+  char *page;
+  char *p;
+
+  if (S_ISDIR(node->mode)) return -EISDIR;
+  if (pos >= node->size) return 0;
+  if (pos + size > node->size) size = (size_t) (node->size - pos);
+
+  read = 0;
+  p = (char *) data;
+  while (size > 0) {
+    pageno = (unsigned long) (pos / PAGESIZE);
+    start = (int) (pos % PAGESIZE);
+
+    count = PAGESIZE - start;
+    if (count > size) count = size;
+
+    // Holes in sparse files read as zeros
+    page = pageno < node->pagetabsize ? node->pages[pageno] : NULL;
+    if (page) {
+      memcpy(p, page + start, count);
+    } else {
+      memset(p, 0, count);
+    }
+
+    pos += count;
+    p += count;
+    read += count;
+    size -= count;
+  }
+
+  return read;
+}
+
+int tmpfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpnode *node = (struct tmpnode *) filp->data;
+  unsigned long pageno;
+  size_t written;
+  size_t count;
+  int start;
+  char *page;
+  char *p;
+  int rc;
+
+  if (S_ISDIR(node->mode)) return -EISDIR;
+  if (filp->flags & O_APPEND) pos = node->size;
+  if (pos + size > (off64_t) tfs->maxpages * PAGESIZE) return -EFBIG;
+
+  written = 0;
+  p = (char *) data;
+  while (size > 0) {
+    pageno = (unsigned long) (pos / PAGESIZE);
+    start = (int) (pos % PAGESIZE);
+
+    count = PAGESIZE - start;
+    if (count > size) count = size;
+
+    rc = get_page(tfs, node, pageno, 1, &page);
+    if (rc < 0) {
+      if (written > 0) break;
+      return rc;
+    }
+    memcpy(page + start, p, count);
+
+    pos += count;
+    p += count;
+    written += count;
+    size -= count;
+
+    if (pos > node->size) node->size = pos;
+  }
+
+  node->mtime = time(NULL);
+  filp->flags |= F_MODIFIED;
+
+  return written;
+}
+
+off64_t tmpfs_tell(struct file *filp) {
+  return filp->pos;
+}
+
+off64_t tmpfs_lseek(struct file *filp, off64_t offset, int origin) {
+  struct tmpnode *node = (struct tmpnode *) filp->data;
+
+  switch (origin) {
+    case SEEK_END:
+      offset += node->size;
+      break;
+
+    case SEEK_CUR:
+      offset += filp->pos;
+  }
+
+  if (offset < 0) return -EINVAL;
+
+  filp->pos = offset;
+  return offset;
+}
+
+int tmpfs_ftruncate(struct file *filp, off64_t size) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpnode *node = (struct tmpnode *) filp->data;
+
+  if (S_ISDIR(node->mode)) return -EISDIR;
+  if (size < 0) return -EINVAL;
+  if (size > (off64_t) tfs->maxpages * PAGESIZE) return -EFBIG;
+  if (size == node->size) return 0;
+
+  truncate_node(tfs, node, size);
+  node->mtime = time(NULL);
+  filp->flags |= F_MODIFIED;
+
+  return 0;
+}
+
+int tmpfs_futime(struct file *filp, struct utimbuf *times) {
+  struct tmpnode *node = (struct tmpnode *) filp->data;
+
+  if (times->ctime != -1) node->ctime = times->ctime;
+  if (times->modtime != -1) node->mtime = times->modtime;
+  filp->flags &= ~F_MODIFIED;
+
+  return 0;
+}
+
+int tmpfs_utime(struct fs *fs, char *name, struct utimbuf *times) {
+  struct tmpnode *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  rc = check(node->mode, node->uid, node->gid, S_IWRITE);
+  if (rc < 0) return rc;
+
+  if (times->ctime != -1) node->ctime = times->ctime;
+  if (times->modtime != -1) node->mtime = times->modtime;
+
+  return 0;
+}
+
+int tmpfs_fstat(struct file *filp, struct stat64 *buffer) {
+  return stat_node((struct tmpnode *) filp->data, buffer);
+}
+
+int tmpfs_stat(struct fs *fs, char *name, struct stat64 *buffer) {
+  struct tmpnode *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  return stat_node(node, buffer);
+}
+
+int tmpfs_access(struct fs *fs, char *name, int mode) {
+  struct thread *thread = self();
+  struct tmpnode *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  if (mode != 0) {
+    if (thread->euid == 0) {
+      rc = mode != 1 || node->mode & 0111 ? 0 : -EACCES;
+    } else {
+      if (thread->euid != node->uid) {
+        mode >>= 3;
+        if (thread->egid != node->gid) mode >>= 3;
+      }
+      if ((mode & node->mode) == 0) rc = -EACCES;
+    }
+  }
+
+  return rc;
+}
+
+int tmpfs_fchmod(struct file *filp, int mode) {
+  struct thread *thread = self();
+  struct tmpnode *node = (struct tmpnode *) filp->data;
+
+  if (thread->euid != 0 && thread->euid != node->uid) return -EPERM;
+  node->mode = (node->mode & ~S_IRWXUGO) | (mode & S_IRWXUGO);
+
+  return 0;
+}
+
+int tmpfs_chmod(struct fs *fs, char *name, int mode) {
+  struct thread *thread = self();
+  struct tmpnode *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  if (thread->euid != 0 && thread->euid != node->uid) return -EPERM;
+  node->mode = (node->mode & ~S_IRWXUGO) | (mode & S_IRWXUGO);
+
+  return 0;
+}
+
+int tmpfs_fchown(struct file *filp, int owner, int group) {
+  struct thread *thread = self();
+  struct tmpnode *node = (struct tmpnode *) filp->data;
+
+  if (thread->euid != 0) return -EPERM;
+  if (owner != -1) node->uid = owner;
+  if (group != -1) node->gid = group;
+
+  return 0;
+}
+
+int tmpfs_chown(struct fs *fs, char *name, int owner, int group) {
+  struct thread *thread = self();
+  struct tmpnode *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  if (thread->euid != 0) return -EPERM;
+  if (owner != -1) node->uid = owner;
+  if (group != -1) node->gid = group;
+
+  return 0;
+}
+
+int tmpfs_mkdir(struct fs *fs, char *name, int mode) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpnode *parent;
+  struct tmpnode *dir;
+  int len;
+  int rc;
+
+  len = strlen(name);
+  if (len == 0) return -EEXIST;
+  rc = lookup_parent(tfs, &name, &len, &parent);
+  if (rc < 0) return rc;
+
+  if (find_entry(parent, name, len)) return -EEXIST;
+
+  dir = alloc_node(tfs, S_IFDIR | (mode & S_IRWXUGO));
+  if (!dir) return -ENOSPC;
+  dir->parent = parent;
+
+  rc = add_entry(parent, name, len, dir);
+  if (rc < 0) {
+    free_node(tfs, dir);
+    return rc;
+  }
+
+  return 0;
+}
+
+int tmpfs_rmdir(struct fs *fs, char *name) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpnode *parent;
+  struct tmpnode *dir;
+  struct tmpdirent *de;
+  int len;
+  int rc;
+
+  len = strlen(name);
+  rc = lookup_parent(tfs, &name, &len, &parent);
+  if (rc < 0) return rc;
+
+  de = find_entry(parent, name, len);
+  if (!de) return -ENOENT;
+
+  dir = de->node;
+  if (!S_ISDIR(dir->mode)) return -ENOTDIR;
+  if (dir->entries) return -ENOTEMPTY;
+
+  remove_entry(parent, de);
+  dir->parent = NULL;
+  release_node(tfs, dir);
+
+  return 0;
+}
+
+int tmpfs_rename(struct fs *fs, char *oldname, char *newname) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpnode *oldparent;
+  struct tmpnode *newparent;
+  struct tmpnode *node;
+  struct tmpnode *dir;
+  struct tmpdirent *de;
+  struct tmpdirent *target;
+  int oldlen;
+  int newlen;
+  int rc;
+
+  oldlen = strlen(oldname);
+  rc = lookup_parent(tfs, &oldname, &oldlen, &oldparent);
+  if (rc < 0) return rc;
+
+  de = find_entry(oldparent, oldname, oldlen);
+  if (!de) return -ENOENT;
+  node = de->node;
+
+  newlen = strlen(newname);
+  rc = lookup_parent(tfs, &newname, &newlen, &newparent);
+  if (rc < 0) return rc;
+
+  target = find_entry(newparent, newname, newlen);
+  if (target) return target == de ? 0 : -EEXIST;
+
+  if (check(oldparent->mode, oldparent->uid, oldparent->gid, S_IWRITE) < 0 ||
+      check(newparent->mode, newparent->uid, newparent->gid, S_IWRITE) < 0) {
+    return -EACCES;
+  }
+
+  // A directory cannot be moved into itself
+  if (S_ISDIR(node->mode)) {
+    for (dir = newparent; dir; dir = dir->parent) {
+      if (dir == node) return -EINVAL;
+    }
+  }
+
+  rc = add_entry(newparent, newname, newlen, node);
+  if (rc < 0) return rc;
+  remove_entry(oldparent, de);
+  if (S_ISDIR(node->mode)) node->parent = newparent;
+
+  return 0;
+}
+
+int tmpfs_link(struct fs *fs, char *oldname, char *newname) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpnode *node;
+  struct tmpnode *parent;
+  int len;
+  int rc;
+
+  rc = lookup(tfs, oldname, strlen(oldname), &node);
+  if (rc < 0) return rc;
+  if (S_ISDIR(node->mode)) return -EPERM;
+
+  len = strlen(newname);
+  rc = lookup_parent(tfs, &newname, &len, &parent);
+  if (rc < 0) return rc;
+
+  if (find_entry(parent, newname, len)) return -EEXIST;
+
+  return add_entry(parent, newname, len, node);
+}
+
+int tmpfs_unlink(struct fs *fs, char *name) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpnode *dir;
+  struct tmpnode *node;
+  struct tmpdirent *de;
+  int len;
+  int rc;
+
+  len = strlen(name);
+  rc = lookup_parent(tfs, &name, &len, &dir);
+  if (rc < 0) return rc;
+
+  de = find_entry(dir, name, len);
+  if (!de) return -ENOENT;
+
+  node = de->node;
+  if (S_ISDIR(node->mode)) return -EISDIR;
+
+  // The node is freed when the last open file for it is destroyed
+  remove_entry(dir, de);
+  release_node(tfs, node);
+
+  return 0;
+}
+
+int tmpfs_opendir(struct file *filp, char *name) {
+  struct tmpnode *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) filp->fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+  if (!S_ISDIR(node->mode)) return -ENOTDIR;
+
+  node->refcnt++;
+  filp->data = node;
+  filp->mode = node->mode;
+  filp->owner = node->uid;
+  filp->group = node->gid;
+
+  return 0;
+}
+
+int tmpfs_readdir(struct file *filp, struct direntry *dirp, int count) {
+  struct tmpnode *dir = (struct tmpnode *) filp->data;
+  struct tmpdirent *de;
+  off64_t n;
+
+  if (count != 1) return -EINVAL;
+
+  de = dir->entries;
+  for (n = filp->pos; de && n > 0; n--) de = de->next;
+  if (!de) return 0;
+
+  dirp->ino = de->node->ino;
+  dirp->namelen = de->namelen;
+  dirp->reclen = sizeof(struct direntry) + de->namelen + 1;
+  memcpy(dirp->name, de->name, de->namelen + 1);
+
+  filp->pos++;
+  return 1;
+}
+
+int tmpfs_getpage(struct file *filp, unsigned long pageno, char **page) {
+  // Hand out the page frame for memory mapping, allocating it for holes
+  return get_page((struct tmpfs *) filp->fs->data, (struct tmpnode *) filp->data, pageno, 1, page);
+}
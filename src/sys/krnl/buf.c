@@ -90,8 +90,8 @@ static int bufstats_proc(struct proc_file *pf, void *arg) {
   struct bufpool *pool;
   int hitratio;
 
-  pprintf(pf, "device      reads   writes   hits%%   alloc    free  update    lazy    sync\n");
-  pprintf(pf, "-------- -------- -------- ------- ------- ------- ------- ------- -------\n");
+  pprintf(pf, "device      reads   writes  lookups   hits%%   alloc    free  update    lazy    sync      ios\n");
+  pprintf(pf, "-------- -------- -------- -------- ------- ------- ------- ------- ------- ------- --------\n");
 
   pool = bufpools;
   while (pool) {
@@ -101,11 +101,13 @@ static int bufstats_proc(struct proc_file *pf, void *arg) {
       hitratio = pool->cache_hits * 100 / (pool->cache_hits + pool->cache_misses);
     }
 
-    pprintf(pf, "%-8s %8d %8d %6d%% %7d %7d %7d %7d %7d\n", 
+    pprintf(pf, "%-8s %8d %8d %8d %6d%% %7d %7d %7d %7d %7d %8d\n", 
       device(pool->devno)->name,
-      pool->blocks_read, pool->blocks_written, hitratio,
+      pool->blocks_read, pool->blocks_written, 
+      pool->cache_hits + pool->cache_misses, hitratio,
       pool->blocks_allocated, pool->blocks_freed,
-      pool->blocks_updated, pool->blocks_lazywrite, pool->blocks_synched);
+      pool->blocks_updated, pool->blocks_lazywrite, pool->blocks_synched,
+      pool->write_ios);
 
     pool = pool->next;
   }
@@ -295,14 +297,84 @@ static int read_buffer(struct bufpool *pool, struct buf *buf) {
 }
 
 //
-// write_buffer
+// find_dirty_buffer
 //
 
-static int write_buffer(struct bufpool *pool, struct buf *buf, int flush)
-{
+static struct buf *find_dirty_buffer(struct bufpool *pool, blkno_t blkno) {
+  struct buf *buf;
+
+  buf = pool->hashtable[bufhash(blkno) % BUFPOOL_HASHSIZE];
+  while (buf && buf->blkno != blkno) buf = buf->bucket.next;
+  if (buf && buf->state == BUF_STATE_DIRTY && !(buf->flags & BUF_FLAG_NOWRITE)) return buf;
+  return NULL;
+}
+
+//
+// sort_buffers
+//
+// Sort buffers by block number using shell sort
+//
+
+static void sort_buffers(struct buf **list, int count) {
+  struct buf *buf;
+  int gap, i, j;
+
+  for (gap = count / 2; gap > 0; gap /= 2) {
+    for (i = gap; i < count; i++) {
+      buf = list[i];
+      for (j = i; j >= gap && list[j - gap]->blkno > buf->blkno; j -= gap) list[j] = list[j - gap];
+      list[j] = buf;
+    }
+  }
+}
+
+//
+// cluster_around
+//
+// Collect the run of adjacent dirty buffers around a dirty buffer
+//
+
+static int cluster_around(struct bufpool *pool, struct buf *buf, struct buf **cluster) {
+  struct buf *next;
+  blkno_t first;
+  int count;
+
+  first = buf->blkno;
+  while (first > 0 && buf->blkno - first + 1 < (blkno_t) pool->clusterblocks && find_dirty_buffer(pool, first - 1)) first--;
+
+  count = 0;
+  while (count < pool->clusterblocks) {
+    next = find_dirty_buffer(pool, first + count);
+    if (!next) break;
+    cluster[count++] = next;
+  }
+
+  return count;
+}
+
+//
+// write_cluster
+//
+// Write a run of dirty buffers with consecutive block numbers to the device
+// in one request. After the write the buffers are moved to the clean list, 
+// except for the buffer to keep and buffers that have been locked by waiters.
+// If keep is NULL the write is a flush; otherwise it counts as I/O activity.
+// Returns the number of buffers written.
+//
+
+static int write_cluster(struct bufpool *pool, struct buf **cluster, int count, struct buf *keep) {
+  struct buf *buf;
+  char *data;
+  int size;
   int rc;
+  int i;
+
+  // Only one clustered write at a time can use the staging buffer
+  if (count > 1 && pool->clusterbusy) count = 1;
+
+  for (i = 0; i < count; i++) {
+    buf = cluster[i];
 
-  if (buf->state == BUF_STATE_DIRTY) {
     // Remove buffer from dirty list
     if (buf->chain.next) buf->chain.next->chain.prev = buf->chain.prev;
     if (buf->chain.prev) buf->chain.prev->chain.next = buf->chain.next;
@@ -312,27 +384,54 @@ static int write_buffer(struct bufpool *pool, struct buf *buf, int flush)
     buf->chain.next = NULL;
     buf->chain.prev = NULL;
 
-    // Write block to device from buffer
     change_state(pool, buf, BUF_STATE_WRITING);
-    if (!flush) pool->ioactive = 1;
-    rc = dev_write(pool->devno, buf->data, pool->bufsize, buf->blkno * pool->blks_per_buffer, 0);
-    pool->blocks_written++;
-  } else {
-    rc = pool->bufsize;
+    if (count > 1) memcpy(pool->clusterbuf + i * pool->bufsize, buf->data, pool->bufsize);
   }
 
-  if (rc != pool->bufsize) {
-    // Set buffer in error state and release all waiters
-    kprintf(KERN_ERR "bufpool: error %d writing block %d to %s\n", rc, buf->blkno, device(pool->devno)->name);
-    change_state(pool, buf, BUF_STATE_ERROR);
-    release_buffer_waiters(buf, rc);
+  // Write blocks to device
+  if (keep) pool->ioactive = 1;
+  size = count * pool->bufsize;
+  if (count > 1) {
+    pool->clusterbusy = 1;
+    data = pool->clusterbuf;
   } else {
-    // Lock buffer and release all waiters
-    change_state(pool, buf, BUF_STATE_LOCKED);
-    release_buffer_waiters(buf, 0);
+    data = cluster[0]->data;
+  }
+  rc = dev_write(pool->devno, data, size, cluster[0]->blkno * pool->blks_per_buffer, 0);
+  if (count > 1) pool->clusterbusy = 0;
+  pool->blocks_written += count;
+  pool->write_ios++;
+  pool->flushpos = cluster[count - 1]->blkno + 1;
+
+  if (rc != size) {
+    kprintf(KERN_ERR "bufpool: error %d writing %d blocks at %d to %s\n", rc, count, cluster[0]->blkno, device(pool->devno)->name);
   }
 
-  return rc;
+  for (i = 0; i < count; i++) {
+    buf = cluster[i];
+    if (rc != size) {
+      // Set buffer in error state and release all waiters
+      change_state(pool, buf, BUF_STATE_ERROR);
+      release_buffer_waiters(buf, rc);
+    } else {
+      // Lock buffer and release all waiters
+      change_state(pool, buf, BUF_STATE_LOCKED);
+      release_buffer_waiters(buf, 0);
+
+      // Move buffer to clean list if it is not locked
+      if (buf != keep && buf->locks == 0) {
+        change_state(pool, buf, BUF_STATE_CLEAN);
+        buf->chain.next = NULL;
+        buf->chain.prev = pool->clean.tail;
+        if (pool->clean.tail) pool->clean.tail->chain.next = buf;
+        pool->clean.tail = buf;
+        if (!pool->clean.head) pool->clean.head = buf;
+      }
+    }
+  }
+
+  if (rc != size) return rc < 0 ? rc : -EIO;
+  return count;
 }
 
 //
@@ -340,7 +439,9 @@ static int write_buffer(struct bufpool *pool, struct buf *buf, int flush)
 //
 
 static struct buf *get_new_buffer(struct bufpool *pool) {
+  struct buf *cluster[BUF_CLUSTER_MAX];
   struct buf *buf;
+  int count;
 
   while (1) {
     // Take buffer from free list if it is not empty
@@ -372,12 +473,15 @@ static struct buf *get_new_buffer(struct bufpool *pool) {
       return buf;
     }
 
-    // If the dirty list is not empty, write the oldest buffer and try to aquire it
-    if (pool->dirty.head) {
-      buf = pool->dirty.head;
-
-      // Write the least recently changed buffer to the device
-      if (!(write_buffer(pool, buf, 0) < 0)) {
+    // If the dirty list is not empty, write the oldest buffer and try to aquire it.
+    // Buffers pinned by the journal cannot be written until they are committed.
+    buf = pool->dirty.head;
+    while (buf && (buf->flags & BUF_FLAG_NOWRITE)) buf = buf->chain.next;
+    if (buf) {
+      // Write the least recently changed buffer to the device together with 
+      // the adjacent dirty buffers
+      count = cluster_around(pool, buf, cluster);
+      if (!(write_cluster(pool, cluster, count, buf) < 0) && buf->state == BUF_STATE_LOCKED) {
         // Only use the buffer if it has not been locked by other buffer waiters
         if (buf->locks == 0) {
           // Remove buffer from hash table and return buffer
@@ -404,10 +508,14 @@ static void check_sync() {
   for (pool = bufpools; pool; pool = pool->next) {
     if (now - pool->last_sync >=  SYNC_INTERVAL) {
       //dump_pool_stat(pool);
+      if (pool->commit) pool->commit(pool->syncarg);
       flush_buffers(pool, 0);
       sync_buffers(pool, 0);
     }
   }
+
+  // Write back pages modified through memory mapped files
+  flush_page_cache();
 }
 
 //
@@ -432,6 +540,9 @@ static void lazywriter_task(void *arg) {
           check_sync();
         }
 
+        // Commit journal so pinned buffers can be written
+        if (pool->commit) pool->commit(pool->syncarg);
+
         // Flush all dirty buffers
         //dump_pool_stat(pool);
         if (flush_buffers(pool, 1) < 0) set_event(&dirty_buffers);
@@ -470,9 +581,20 @@ struct bufpool *init_buffer_pool(dev_t devno, int poolsize, int bufsize, void (*
   pool->syncarg = syncarg;
   pool->last_sync = time(NULL);
 
+  // Allocate staging buffer for clustered writes
+  pool->clusterblocks = BUF_CLUSTER_SIZE / bufsize;
+  if (pool->clusterblocks > BUF_CLUSTER_MAX) pool->clusterblocks = BUF_CLUSTER_MAX;
+  if (pool->clusterblocks > 1) {
+    pool->clusterbuf = (char *) kmalloc_tag(pool->clusterblocks * bufsize, 'CACH');
+    if (pool->clusterbuf == NULL) pool->clusterblocks = 1;
+  } else {
+    pool->clusterblocks = 1;
+  }
+
   // Allocate buffer headers
   pool->bufbase = (struct buf *) kmalloc(sizeof(struct buf) * poolsize);
   if (pool->bufbase == NULL) {
+    if (pool->clusterbuf) kfree(pool->clusterbuf);
     kfree(pool);
     return NULL;
   }
@@ -481,6 +603,7 @@ struct bufpool *init_buffer_pool(dev_t devno, int poolsize, int bufsize, void (*
   // Allocate data buffers
   pool->database = (char *) kmalloc_tag(poolsize * bufsize, 'CACH');
   if (pool->database == NULL) {
+    if (pool->clusterbuf) kfree(pool->clusterbuf);
     kfree(pool->bufbase);
     kfree(pool);
     return NULL;
@@ -539,6 +662,7 @@ void free_buffer_pool(struct bufpool *pool) {
   if (pool == bufpools) bufpools = pool->next;
 
   // Deallocate all data
+  if (pool->clusterbuf) kfree(pool->clusterbuf);
   kfree(pool->database);
   kfree(pool->bufbase);
   kfree(pool);
@@ -570,6 +694,7 @@ struct buf *get_buffer(struct bufpool *pool, blkno_t blkno) {
 
   // Insert buffer into hash table
   buf->blkno = blkno;
+  buf->flags = 0;
   insert_into_hashtable(pool, buf);
 
   // Add lock on buffer
@@ -602,6 +727,7 @@ struct buf *alloc_buffer(struct bufpool *pool, blkno_t blkno) {
     } else {
       pool->blocks_allocated++;
       memset(buf->data, 0, pool->bufsize);
+      buf->flags = 0;
       return buf;
     }
   }
@@ -612,6 +738,7 @@ struct buf *alloc_buffer(struct bufpool *pool, blkno_t blkno) {
 
   // Insert buffer into hash table
   buf->blkno = blkno;
+  buf->flags = 0;
   insert_into_hashtable(pool, buf);
 
   // Clear buffer
@@ -642,6 +769,7 @@ void mark_buffer_updated(struct bufpool *pool, struct buf *buf) {
 void mark_buffer_invalid(struct bufpool *pool, struct buf *buf) {
   if (buf->state == BUF_STATE_LOCKED || buf->state == BUF_STATE_UPDATED) {
     change_state(pool, buf, BUF_STATE_INVALID);
+    buf->flags = 0;
   }
 }
 
@@ -718,11 +846,18 @@ void invalidate_buffer(struct bufpool *pool, blkno_t blkno) {
 }
 
 //
-// flush_buffers
+// flush
+//
+// Write dirty buffers in elevator order, skipping buffers with flags in skip
 //
 
-int flush_buffers(struct bufpool *pool, int interruptable) {
+static int flush(struct bufpool *pool, int interruptable, int skip) {
+  struct buf *cluster[BUF_CLUSTER_MAX];
+  struct buf **list;
   struct buf *buf;
+  int count;
+  int start;
+  int i, n;
   int rc;
 
   // Do not flush if nosync flag is set
@@ -730,58 +865,96 @@ int flush_buffers(struct bufpool *pool, int interruptable) {
 
   pool->ioactive = 0;
   while (pool->dirty.head) {
-    // Check for interrupt
-    if (interruptable && pool->ioactive) return -EINTR;
+    // Collect dirty buffers and sort them by block number
+    list = (struct buf **) kmalloc(pool->bufcount[BUF_STATE_DIRTY] * sizeof(struct buf *));
+    if (!list) return -ENOMEM;
+    count = 0;
+    for (buf = pool->dirty.head; buf; buf = buf->chain.next) {
+      if (!(buf->flags & skip)) list[count++] = buf;
+    }
+    if (count == 0) {
+      kfree(list);
+      break;
+    }
+    sort_buffers(list, count);
 
-    // Get next buffer from dirty list
-    buf = pool->dirty.head;
+    // Sweep the disk in ascending block order starting from where the last 
+    // write ended, merging adjacent dirty buffers into clustered writes
+    start = 0;
+    while (start < count && list[start]->blkno < pool->flushpos) start++;
 
-    // Flush buffer to device
-    rc = write_buffer(pool, buf, 1);
-    if (rc < 0) return rc;
+    i = 0;
+    while (i < count) {
+      // Check for interrupt
+      if (interruptable && pool->ioactive) {
+        kfree(list);
+        return -EINTR;
+      }
 
-    pool->blocks_lazywrite++;
+      // Buffers may have changed state while we were writing
+      buf = list[(start + i++) % count];
+      if (buf->state != BUF_STATE_DIRTY || (buf->flags & skip)) continue;
+
+      n = 0;
+      cluster[n++] = buf;
+      while (i < count && start + i != count && n < pool->clusterblocks) {
+        buf = list[(start + i) % count];
+        if (buf->state != BUF_STATE_DIRTY || (buf->flags & skip)) break;
+        if (buf->blkno != cluster[n - 1]->blkno + 1) break;
+        cluster[n++] = buf;
+        i++;
+      }
 
-    // Move buffer to clean list if it is not locked
-    if (buf->locks == 0) {
-      change_state(pool, buf, BUF_STATE_CLEAN);
-      buf->chain.next = NULL;
-      buf->chain.prev = pool->clean.tail;
-      if (pool->clean.tail) pool->clean.tail->chain.next = buf;
-      pool->clean.tail = buf;
-      if (!pool->clean.head) pool->clean.head = buf;
+      // Flush buffers to device
+      rc = write_cluster(pool, cluster, n, NULL);
+      if (rc < 0) {
+        kfree(list);
+        return rc;
+      }
+
+      pool->blocks_lazywrite += rc;
     }
+
+    kfree(list);
   }
 
   return 0;
 }
 
 //
-// sync_buffers
+// flush_buffers
+//
+// Write all dirty buffers except the ones pinned by the journal
 //
 
-int sync_buffers(struct bufpool *pool, int interruptable) {
-  struct buf *buf;
-  int i;
-  int rc;
+int flush_buffers(struct bufpool *pool, int interruptable) {
+  return flush(pool, interruptable, BUF_FLAG_NOWRITE);
+}
 
-  // Do not sync if nosync flag is set
-  if (pool->nosync) return 0;
+//
+// flush_data_buffers
+//
+// Write all dirty buffers that do not hold metadata
+//
 
-  // Call user sync function
-  if (pool->sync) pool->sync(pool->syncarg);
+int flush_data_buffers(struct bufpool *pool) {
+  return flush(pool, 0, BUF_FLAG_NOWRITE | BUF_FLAG_META);
+}
 
-  // If there are no updated buffers then there is nothing to do
-  if (pool->bufcount[BUF_STATE_UPDATED] == 0) {
-    pool->last_sync = time(NULL);
-    return 0;
-  }
+//
+// write_updated
+//
+
+static int write_updated(struct bufpool *pool, int interruptable) {
+  struct buf *buf;
+  int i;
+  int rc;
 
   // Find all updated buffers
   pool->ioactive = 0;
   buf = pool->bufbase;
   for (i = 0; i < pool->poolsize; i++) {
-    if (buf->state == BUF_STATE_UPDATED) {
+    if (buf->state == BUF_STATE_UPDATED && !(buf->flags & BUF_FLAG_NOWRITE)) {
       // Check for interrupt
       if (interruptable && pool->ioactive) return -EINTR;
 
@@ -795,6 +968,7 @@ int sync_buffers(struct bufpool *pool, int interruptable) {
       
       pool->blocks_written++;
       pool->blocks_synched++;
+      pool->write_ios++;
 
       // Change state from updated to locked
       change_state(pool, buf, BUF_STATE_LOCKED);
@@ -806,6 +980,50 @@ int sync_buffers(struct bufpool *pool, int interruptable) {
     buf++;
   }
 
+  return 0;
+}
+
+//
+// sync_buffers
+//
+
+int sync_buffers(struct bufpool *pool, int interruptable) {
+  int rc;
+
+  // Do not sync if nosync flag is set
+  if (pool->nosync) return 0;
+
+  // Call user sync function
+  if (pool->sync) pool->sync(pool->syncarg);
+
+  // If there are no updated buffers then there is nothing to do
+  if (pool->bufcount[BUF_STATE_UPDATED] == 0) {
+    pool->last_sync = time(NULL);
+    return 0;
+  }
+
+  // Write all updated buffers
+  rc = write_updated(pool, interruptable);
+  if (rc < 0) return rc;
+
   pool->last_sync = time(NULL);
   return 0;
 }
+
+//
+// checkpoint_buffers
+//
+// Write all dirty and updated buffers that are not pinned by the journal
+// without calling the sync function
+//
+
+int checkpoint_buffers(struct bufpool *pool) {
+  int rc;
+
+  if (pool->nosync) return 0;
+
+  rc = flush(pool, 0, BUF_FLAG_NOWRITE);
+  if (rc < 0) return rc;
+
+  return write_updated(pool, 0);
+}
@@ -187,6 +187,24 @@ static unsigned long hw_get_cr2() {
   return val;
 }
 
+static unsigned long hw_get_cr4() {
+  unsigned long val;
+
+  __asm  {
+    mov eax, cr4
+    mov val, eax
+  }
+
+  return val;
+}
+
+static void hw_set_cr4(unsigned long val) {
+  __asm {
+    mov eax, val
+    mov cr4, eax
+  }
+}
+
 static __declspec(naked) unsigned __int64 hw_rdtsc() {
   __asm  { 
     rdtsc
@@ -296,6 +314,8 @@ struct mach mach = {
   hw_get_cr0,
   hw_set_cr0,
   hw_get_cr2,
+  hw_get_cr4,
+  hw_set_cr4,
   hw_rdtsc,
   hw_wrmsr,
   hw_set_gdt_entry,
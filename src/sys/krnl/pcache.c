@@ -0,0 +1,570 @@
+//
+// pcache.c
+//
+// Page cache for memory mapped files
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os/krnl.h>
+
+#define PCACHE_FLUSH_INTERVAL  10   // Writeback interval in seconds
+#define PCACHE_EVICT_BATCH     16   // Pages evicted when the cache is full
+
+//
+// The page cache holds the pages of memory mapped files keyed by file and
+// page number. It is not a unified cache for all file data. Files that are
+// not mapped are only cached by the file systems, e.g. in the buffer pool.
+//
+// Mappings of a file point directly at the cached page frames. While a file
+// is mapped, read() and write() on the file also go through these pages, so
+// mappings and file I/O see the same data. Pages modified through a mapping
+// are detected from the dirty bits in the page tables and written back by
+// the lazy writer, by vmsync() and when the last mapping of the file is
+// removed.
+//
+// The page cache sits on top of the file system, so pages are filled with
+// read() and written back with write(). For file systems that use the
+// buffer pool, the blocks of a mapped file can be cached both in the buffer
+// pool and in the page cache. To bound this, the page cache is limited to
+// PCACHE_MAXMEM percent of memory. Pages that are neither mapped nor dirty
+// are evicted in least recently used order when the limit is reached.
+//
+// Each open file remembers its cached file, so read() and write() only need
+// to look up the inode number with fstat() after files have been added to or
+// removed from the page cache. The list of cached files is protected by the
+// page cache lock, since file systems with reentrant read() and write() do
+// not hold the file system lock during file I/O.
+//
+// File systems that keep file data in page frames of their own (tmpfs) can
+// supply a getpage() operation. The page cache then maps the frame owned by
+// the file system instead of reading a copy of it. Such borrowed pages are
+// never written back, and if the file system drops a frame while it is still
+// in the page cache, ownership passes to the page cache with
+// adopt_cached_page().
+//
+
+static struct cpage **pcache_hashtable;
+static struct cfile *cfiles;
+static struct mutex pcache_lock;
+static unsigned long cfile_generation = 1;
+int cached_files = 0;
+
+static struct cpage *lru_head;
+static struct cpage *lru_tail;
+
+static int cached_pages = 0;
+static int max_cached_pages = 0;
+static unsigned long pcache_hits = 0;
+static unsigned long pcache_misses = 0;
+static unsigned long pcache_evictions = 0;
+static unsigned long pcache_writebacks = 0;
+static time_t last_flush = 0;
+
+static unsigned long cpage_hash(struct cfile *cf, unsigned long pageno) {
+  return (((unsigned long) cf >> 4) ^ pageno) % PCACHE_HASHSIZE;
+}
+
+static struct cpage *lookup_page(struct cfile *cf, unsigned long pageno) {
+  struct cpage *cp = pcache_hashtable[cpage_hash(cf, pageno)];
+
+  while (cp) {
+    if (cp->cfile == cf && cp->pageno == pageno) return cp;
+    cp = cp->bucket;
+  }
+
+  return NULL;
+}
+
+static void lru_insert(struct cpage *cp) {
+  cp->lru_next = lru_head;
+  cp->lru_prev = NULL;
+  if (lru_head) lru_head->lru_prev = cp;
+  lru_head = cp;
+  if (!lru_tail) lru_tail = cp;
+}
+
+static void lru_remove(struct cpage *cp) {
+  if (cp->lru_next) cp->lru_next->lru_prev = cp->lru_prev;
+  if (cp->lru_prev) cp->lru_prev->lru_next = cp->lru_next;
+  if (lru_head == cp) lru_head = cp->lru_next;
+  if (lru_tail == cp) lru_tail = cp->lru_prev;
+}
+
+static void insert_page(struct cfile *cf, struct cpage *cp) {
+  unsigned long h = cpage_hash(cf, cp->pageno);
+
+  cp->bucket = pcache_hashtable[h];
+  pcache_hashtable[h] = cp;
+  cp->next = cf->pagelist;
+  cp->prev = NULL;
+  if (cf->pagelist) cf->pagelist->prev = cp;
+  cf->pagelist = cp;
+  lru_insert(cp);
+  cf->pages++;
+  cached_pages++;
+}
+
+static void remove_page(struct cpage *cp) {
+  struct cfile *cf = cp->cfile;
+  struct cpage **link = &pcache_hashtable[cpage_hash(cf, cp->pageno)];
+
+  while (*link) {
+    if (*link == cp) {
+      *link = cp->bucket;
+      break;
+    }
+    link = &(*link)->bucket;
+  }
+
+  if (cp->next) cp->next->prev = cp->prev;
+  if (cp->prev) {
+    cp->prev->next = cp->next;
+  } else {
+    cf->pagelist = cp->next;
+  }
+  lru_remove(cp);
+
+  cf->pages--;
+  cached_pages--;
+}
+
+static void free_cached_page(struct cpage *cp) {
+  remove_page(cp);
+  if (cp->borrowed) {
+    pfdb[cp->pfn].cpage = NULL;
+  } else {
+    free_pages(cp->data, 1);
+  }
+  kfree(cp);
+}
+
+static int evict_pages(int count) {
+  struct cpage *cp;
+  struct cpage *prev;
+  int evicted = 0;
+
+  // Evict least recently used pages that are not mapped, dirty, or locked
+  cp = lru_tail;
+  while (cp && evicted < count) {
+    prev = cp->lru_prev;
+    if (cp->mapcount == 0 && !cp->dirty && cp->locks == 0) {
+      free_cached_page(cp);
+      pcache_evictions++;
+      evicted++;
+    }
+    cp = prev;
+  }
+
+  return evicted;
+}
+
+static struct cfile *find_cfile(struct fs *fs, ino_t ino) {
+  struct cfile *cf;
+
+  if (ino == 0) return NULL;
+  for (cf = cfiles; cf; cf = cf->next) {
+    if (cf->fs == fs && cf->ino == ino) return cf;
+  }
+
+  return NULL;
+}
+
+static void harvest_dirty_pages(struct filemap *fm) {
+  char *vaddr = fm->addr;
+  char *end = fm->addr + PTOB(PAGES(fm->size));
+  pte_t flags;
+
+  while (vaddr < end) {
+    if (page_directory_mapped(vaddr)) {
+      flags = get_page_flags(vaddr);
+      if ((flags & (PT_FILE | PT_PRESENT | PT_DIRTY)) == (PT_FILE | PT_PRESENT | PT_DIRTY)) {
+        pfdb[virt2pfn(vaddr)].cpage->dirty = 1;
+        clear_dirty(vaddr);
+      }
+    }
+    vaddr += PAGESIZE;
+  }
+}
+
+struct cfile *attach_cfile(struct file *filp, int *rc) {
+  struct stat64 st;
+  struct cfile *cf;
+
+  // Get the inode number before taking the page cache lock, since fstat()
+  // takes the file system lock
+  *rc = fstat(filp, &st);
+  if (*rc < 0) return NULL;
+
+  wait_for_object(&pcache_lock, INFINITE);
+  cf = find_cfile(filp->fs, st.st_ino);
+  if (!cf) {
+    cf = (struct cfile *) kmalloc(sizeof(struct cfile));
+    if (!cf) {
+      release_mutex(&pcache_lock);
+      *rc = -ENOMEM;
+      return NULL;
+    }
+    memset(cf, 0, sizeof(struct cfile));
+    cf->fs = filp->fs;
+    cf->ino = st.st_ino;
+    cf->size = st.st_size;
+
+    cf->next = cfiles;
+    cfiles = cf;
+    cached_files++;
+    cfile_generation++;
+  }
+
+  cf->refcnt++;
+  release_mutex(&pcache_lock);
+  *rc = 0;
+  return cf;
+}
+
+struct cfile *lookup_cfile(struct file *filp) {
+  struct stat64 st;
+  struct cfile *cf;
+
+  if (cached_files == 0) return NULL;
+
+  // Find the cached file for the inode if the set of cached files has
+  // changed since the last lookup for the file. The caller may not hold the
+  // file system lock, so the lookup is done with the page cache lock held.
+  wait_for_object(&pcache_lock, INFINITE);
+  if (filp->cfgen != cfile_generation) {
+    filp->cfile = NULL;
+    filp->cfgen = cfile_generation;
+    for (cf = cfiles; cf; cf = cf->next) {
+      if (cf->fs == filp->fs) break;
+    }
+    if (cf && filp->fs->ops->fstat && filp->fs->ops->fstat(filp, &st) >= 0) {
+      filp->cfile = find_cfile(filp->fs, st.st_ino);
+    }
+  }
+
+  cf = filp->cfile;
+  if (cf) cf->refcnt++;
+  release_mutex(&pcache_lock);
+  return cf;
+}
+
+void release_cfile(struct cfile *cf) {
+  struct cfile **link;
+
+  wait_for_object(&pcache_lock, INFINITE);
+  if (--cf->refcnt > 0) {
+    release_mutex(&pcache_lock);
+    return;
+  }
+
+  for (link = &cfiles; *link; link = &(*link)->next) {
+    if (*link == cf) {
+      *link = cf->next;
+      break;
+    }
+  }
+  cached_files--;
+  cfile_generation++;
+  release_mutex(&pcache_lock);
+
+  while (cf->pagelist) free_cached_page(cf->pagelist);
+  kfree(cf);
+}
+
+struct cpage *get_cached_page(struct cfile *cf, struct file *filp, unsigned long pageno, int *rc) {
+  struct cpage *cp;
+  char *data;
+  off64_t pos;
+  int borrowed;
+  int bytes;
+
+  // The file system lock is not held for file systems with reentrant read(),
+  // so the page is looked up again after it has been read below
+  cp = lookup_page(cf, pageno);
+  if (cp) {
+    pcache_hits++;
+    lru_remove(cp);
+    lru_insert(cp);
+    return cp;
+  }
+  pcache_misses++;
+
+  // Make room for the page if the cache is full
+  if (cached_pages >= max_cached_pages) evict_pages(PCACHE_EVICT_BATCH);
+
+  // Use the page frame of the file system if it has one for the page
+  pos = (off64_t) pageno * PAGESIZE;
+  borrowed = 0;
+  if (filp->fs->ops->getpage && pos < cf->size) {
+    *rc = filp->fs->ops->getpage(filp, pageno, &data);
+    if (*rc < 0) return NULL;
+    borrowed = 1;
+  } else {
+    if (!filp->fs->ops->read) {
+      *rc = -ENOSYS;
+      return NULL;
+    }
+
+    data = (char *) alloc_pages(1, 'PCHE');
+    if (!data) {
+      *rc = -ENOMEM;
+      return NULL;
+    }
+
+    bytes = 0;
+    if (pos < cf->size) {
+      bytes = filp->fs->ops->read(filp, data, PAGESIZE, pos);
+      if (bytes < 0) {
+        free_pages(data, 1);
+        *rc = bytes;
+        return NULL;
+      }
+    }
+    if (bytes < PAGESIZE) memset(data + bytes, 0, PAGESIZE - bytes);
+
+    // Another thread may have loaded the page while we were reading it
+    cp = lookup_page(cf, pageno);
+    if (cp) {
+      free_pages(data, 1);
+      return cp;
+    }
+  }
+
+  cp = (struct cpage *) kmalloc(sizeof(struct cpage));
+  if (!cp) {
+    if (!borrowed) free_pages(data, 1);
+    *rc = -ENOMEM;
+    return NULL;
+  }
+  cp->cfile = cf;
+  cp->pageno = pageno;
+  cp->data = data;
+  cp->pfn = virt2pfn(data);
+  cp->mapcount = 0;
+  cp->dirty = 0;
+  cp->locks = 0;
+  cp->borrowed = borrowed;
+  pfdb[cp->pfn].cpage = cp;
+  insert_page(cf, cp);
+
+  return cp;
+}
+
+int read_cached(struct cfile *cf, struct file *filp, void *data, size_t size, off64_t offset) {
+  char *buf = (char *) data;
+  struct cpage *cp;
+  int count = 0;
+  int pgoff;
+  int len;
+  int rc;
+
+  if (offset >= cf->size) return 0;
+  if (offset + size > cf->size) size = (size_t) (cf->size - offset);
+
+  while (size > 0) {
+    pgoff = (int) (offset % PAGESIZE);
+    len = PAGESIZE - pgoff;
+    if ((size_t) len > size) len = size;
+
+    cp = get_cached_page(cf, filp, (unsigned long) (offset / PAGESIZE), &rc);
+    if (!cp) return count > 0 ? count : rc;
+    memcpy(buf, cp->data + pgoff, len);
+
+    buf += len;
+    offset += len;
+    size -= len;
+    count += len;
+  }
+
+  return count;
+}
+
+int write_cached(struct cfile *cf, struct file *filp, void *data, size_t size, off64_t offset) {
+  char *buf = (char *) data;
+  struct cpage *cp;
+  int count;
+  int left;
+  int pgoff;
+  int len;
+
+  // Write through to the file system and update the cached copies
+  if (filp->flags & O_APPEND) offset = cf->size;
+  count = filp->fs->ops->write(filp, data, size, offset);
+  if (count <= 0) return count;
+
+  left = count;
+  while (left > 0) {
+    pgoff = (int) (offset % PAGESIZE);
+    len = PAGESIZE - pgoff;
+    if (len > left) len = left;
+
+    cp = lookup_page(cf, (unsigned long) (offset / PAGESIZE));
+    if (cp && !cp->borrowed) memcpy(cp->data + pgoff, buf, len);
+
+    buf += len;
+    offset += len;
+    left -= len;
+  }
+
+  if (offset > cf->size) cf->size = offset;
+  return count;
+}
+
+void truncate_cached(struct cfile *cf, off64_t size) {
+  struct cpage *cp;
+  off64_t pos;
+
+  // Clear cached data beyond the new end of file
+  for (cp = cf->pagelist; cp; cp = cp->next) {
+    pos = (off64_t) cp->pageno * PAGESIZE;
+    if (pos >= size) {
+      memset(cp->data, 0, PAGESIZE);
+      cp->dirty = 0;
+    } else if (pos + PAGESIZE > size) {
+      memset(cp->data + (int) (size - pos), 0, PAGESIZE - (int) (size - pos));
+    }
+  }
+
+  cf->size = size;
+}
+
+int adopt_cached_page(void *data) {
+  struct cpage *cp = pfdb[virt2pfn(data)].cpage;
+
+  // Take over a page frame the file system no longer needs if it is cached
+  if (!cp || !cp->borrowed) return 0;
+  cp->borrowed = 0;
+  return 1;
+}
+
+int flush_cfile(struct cfile *cf) {
+  struct filemap *fm;
+  struct file *filp;
+  struct cpage *cp;
+  off64_t pos;
+  int dirty = 0;
+  int len;
+  int rc;
+
+  // Collect dirty bits from the page tables of all mappings of the file
+  for (fm = cf->filemaps; fm; fm = fm->next) harvest_dirty_pages(fm);
+  for (cp = cf->pagelist; cp; cp = cp->next) {
+    if (cp->borrowed) cp->dirty = 0;
+    if (cp->dirty) dirty++;
+  }
+  if (dirty == 0) return 0;
+  if (!cf->filemaps) return -EBADF;
+
+  filp = (struct file *) olock(cf->filemaps->file, OBJECT_FILE);
+  if (!filp) return -EBADF;
+  if (!filp->fs->ops->write) {
+    orel(filp);
+    return -ENOSYS;
+  }
+
+  cf->refcnt++;
+  rc = lock_fs(filp->fs, FSOP_WRITE);
+  if (rc < 0) {
+    release_cfile(cf);
+    orel(filp);
+    return rc;
+  }
+
+  for (cp = cf->pagelist; cp; cp = cp->next) {
+    if (!cp->dirty) continue;
+    cp->dirty = 0;
+
+    pos = (off64_t) cp->pageno * PAGESIZE;
+    if (pos >= cf->size) continue;
+    len = cf->size - pos < PAGESIZE ? (int) (cf->size - pos) : PAGESIZE;
+
+    // Keep the page from being evicted while it is written
+    cp->locks++;
+    rc = filp->fs->ops->write(filp, cp->data, len, pos);
+    cp->locks--;
+    if (rc < 0) {
+      cp->dirty = 1;
+      break;
+    }
+    pcache_writebacks++;
+  }
+
+  unlock_fs(filp->fs, FSOP_WRITE);
+  release_cfile(cf);
+  orel(filp);
+
+  return rc < 0 ? rc : 0;
+}
+
+void flush_page_cache() {
+  struct cfile *cf;
+  struct cfile *next;
+  time_t now = time(NULL);
+
+  if (now - last_flush < PCACHE_FLUSH_INTERVAL) return;
+  last_flush = now;
+
+  cf = cfiles;
+  while (cf) {
+    cf->refcnt++;
+    flush_cfile(cf);
+    next = cf->next;
+    release_cfile(cf);
+    cf = next;
+  }
+}
+
+int pcache_proc(struct proc_file *pf, void *arg) {
+  struct cfile *cf;
+  struct filemap *fm;
+  unsigned long lookups = pcache_hits + pcache_misses;
+  int maps;
+
+  pprintf(pf, "files: %d pages: %d (%dK) max: %dK hits: %u misses: %u hit ratio: %d%% evictions: %u writebacks: %u\n\n",
+          cached_files, cached_pages, cached_pages * (PAGESIZE / 1024), max_cached_pages * (PAGESIZE / 1024),
+          pcache_hits, pcache_misses, lookups ? pcache_hits * 100 / lookups : 0, pcache_evictions, pcache_writebacks);
+
+  pprintf(pf, "     ino       size    pages maps refs mount\n");
+  pprintf(pf, "-------- ---------- -------- ---- ---- --------------------\n");
+  for (cf = cfiles; cf; cf = cf->next) {
+    maps = 0;
+    for (fm = cf->filemaps; fm; fm = fm->next) maps++;
+    pprintf(pf, "%8d %10d %8d %4d %4d %s\n", cf->ino, (int) cf->size, cf->pages, maps, cf->refcnt, cf->fs->mntto);
+  }
+
+  return 0;
+}
+
+void init_pcache() {
+  pcache_hashtable = (struct cpage **) kmalloc(PCACHE_HASHSIZE * sizeof(struct cpage *));
+  if (!pcache_hashtable) panic("no memory for page cache");
+  memset(pcache_hashtable, 0, PCACHE_HASHSIZE * sizeof(struct cpage *));
+  max_cached_pages = totalmem / 100 * PCACHE_MAXMEM;
+  init_mutex(&pcache_lock, 0);
+}
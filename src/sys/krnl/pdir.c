@@ -36,7 +36,69 @@
 pte_t *pdir = (pte_t *) PAGEDIR_ADDRESS; // Page directory
 pte_t *ptab = (pte_t *) PTBASE;          // Page tables
 
+int large_pages_supported = 0;           // 4MB pages enabled
+
+//
+// Large pages
+//
+// With page size extensions (PSE) a page directory entry can map a 4MB
+// page directly without a page table. The page table entries in the page
+// table window are not valid for addresses in a large page, so all the
+// page table accessors below check the page directory entry first.
+//
+
+static pte_t lookup_pte(unsigned long vaddr) {
+  pte_t pde = GET_PDE(vaddr);
+
+  // Return page table entry for the 4K page within a large page
+  if (pde & PT_LARGE) return (pde & (PT_FLAGMASK | PT_LARGE)) + PTOB(PTEIDX(vaddr));
+  return GET_PTE(vaddr);
+}
+
+int large_page_mapped(void *vaddr) {
+  return (GET_PDE(vaddr) & (PT_PRESENT | PT_LARGE)) == (PT_PRESENT | PT_LARGE);
+}
+
+int map_large_page(void *vaddr, unsigned long pfn, unsigned long flags) {
+  if (!large_pages_supported) return -ENOSYS;
+  if (PGOFF(vaddr) != 0 || PTEIDX(vaddr) != 0 || pfn % PTES_PER_PAGE != 0) return -EINVAL;
+  if (GET_PDE(vaddr) & PT_PRESENT) return -EBUSY;
+
+  SET_PDE(vaddr, PTOB(pfn) | flags | PT_LARGE);
+  invlpage(vaddr);
+  return 0;
+}
+
+void unmap_large_page(void *vaddr) {
+  SET_PDE(vaddr, 0);
+  invlpage(vaddr);
+}
+
+void split_large_page(void *vaddr) {
+  pte_t pde = GET_PDE(vaddr);
+  char *base = (char *) LARGEPAGEADDR(vaddr);
+  unsigned long pfn = BTOP(pde & PT_PFNMASK);
+  unsigned long flags = pde & (PT_FLAGMASK & ~PT_LARGE);
+  unsigned long pdfn;
+  pte_t *pt;
+  int i;
+
+  // Replace large page with a page table mapping the same page frames
+  pdfn = alloc_pageframe('PTAB');
+  if (pdfn == 0xFFFFFFFF) panic("no memory for page table");
+  SET_PDE(base, PTOB(pdfn) | PT_PRESENT | PT_WRITABLE | PT_USER);
+  pt = ptab + PDEIDX(base) * PTES_PER_PAGE;
+  invlpage(pt);
+  for (i = 0; i < PTES_PER_PAGE; i++) pt[i] = PTOB(pfn + i) | flags;
+  register_page_table(pdfn);
+
+  for (i = 0; i < PTES_PER_PAGE; i++) invlpage(base + PTOB(i));
+}
+
 void map_page(void *vaddr, unsigned long pfn, unsigned long flags) {
+  // Split large page before mapping individual pages into it
+  if (large_page_mapped(vaddr)) split_large_page(vaddr);
+
   // Allocate page table if not already done
   if ((GET_PDE(vaddr) & PT_PRESENT) == 0) {
     unsigned long pdfn;
@@ -57,29 +119,39 @@ void map_page(void *vaddr, unsigned long pfn, unsigned long flags) {
 }
 
 void unmap_page(void *vaddr) {
+  if (large_page_mapped(vaddr)) split_large_page(vaddr);
   SET_PTE(vaddr, 0);
   invlpage(vaddr);
 }
 
 unsigned long virt2phys(void *vaddr) {
+  if (large_page_mapped(vaddr)) {
+    return (GET_PDE(vaddr) & PT_PFNMASK) + ((unsigned long) vaddr & (LARGEPAGESIZE - 1));
+  }
   return ((GET_PTE(vaddr) & PT_PFNMASK) + PGOFF(vaddr));
 }
 
 unsigned long virt2pfn(void *vaddr) {
+  if (large_page_mapped(vaddr)) {
+    return BTOP(GET_PDE(vaddr) & PT_PFNMASK) + PTEIDX(vaddr);
+  }
   return BTOP(GET_PTE(vaddr) & PT_PFNMASK);
 }
 
 pte_t get_page_flags(void *vaddr) {
+  if (large_page_mapped(vaddr)) return GET_PDE(vaddr) & PT_FLAGMASK;
   return GET_PTE(vaddr) & PT_FLAGMASK;
 }
 
 void set_page_flags(void *vaddr, unsigned long flags) {
+  if (large_page_mapped(vaddr)) split_large_page(vaddr);
   SET_PTE(vaddr, (GET_PTE(vaddr) & PT_PFNMASK) | flags);
   invlpage(vaddr);
 }
 
 int page_mapped(void *vaddr) {
   if ((GET_PDE(vaddr) & PT_PRESENT) == 0) return 0;
+  if (GET_PDE(vaddr) & PT_LARGE) return 1;
   if ((GET_PTE(vaddr) & PT_PRESENT) == 0) return 0;
   return 1;
 }
@@ -98,6 +170,59 @@ void clear_dirty(void *vaddr) {
   invlpage(vaddr);
 }
 
+//
+// clone_pages
+//
+// Map the pages in the source range into the destination range so both
+// ranges share the same page frames. Writable pages are write-protected
+// and marked copy-on-write in both ranges; the first write to a shared page
+// gets a private copy from the page fault handler. Page tables that are not
+// present in the source range are skipped as a whole, so cloning a sparse
+// region only costs page table work for the parts that are mapped. File
+// mapped pages and I/O mapped memory are not cloned.
+//
+
+int clone_pages(void *dst, void *src, int pages) {
+  char *s = (char *) src;
+  char *d = (char *) dst;
+  char *end = s + PTOB(pages);
+  unsigned long skip;
+  unsigned long pfn;
+  int shared = 0;
+  pte_t pte;
+
+  while (s < end) {
+    if ((GET_PDE(s) & PT_PRESENT) == 0) {
+      skip = PTES_PER_PAGE * PAGESIZE - ((unsigned long) s & (PTES_PER_PAGE * PAGESIZE - 1));
+      s += skip;
+      d += skip;
+      continue;
+    }
+
+    if (GET_PDE(s) & PT_LARGE) split_large_page(s);
+    pte = GET_PTE(s);
+    pfn = BTOP(pte & PT_PFNMASK);
+    if ((pte & (PT_PRESENT | PT_FILE)) == PT_PRESENT && pfn < maxmem) {
+      if (pte & PT_WRITABLE) {
+        pte = (pte & ~PT_WRITABLE) | PT_COW;
+        SET_PTE(s, pte);
+        invlpage(s);
+      }
+
+      pte &= PT_FLAGMASK & ~(PT_ACCESSED | PT_DIRTY);
+      if (pte & PT_GUARD) pte = (pte & ~PT_GUARD) | PT_USER;
+      map_page(d, pfn, pte);
+      pfdb[pfn].shares++;
+      shared++;
+    }
+
+    s += PAGESIZE;
+    d += PAGESIZE;
+  }
+
+  return shared;
+}
+
 int mem_access(void *vaddr, int size, pte_t access) {
   unsigned long addr;
   unsigned long next;
@@ -107,11 +232,13 @@ int mem_access(void *vaddr, int size, pte_t access) {
   next = (addr & ~PAGESIZE) + PAGESIZE;
   while (1) {
     if ((GET_PDE(addr) & PT_PRESENT) == 0) return 0;
-    pte = GET_PTE(addr);
+    pte = lookup_pte(addr);
     if ((pte & access) != access) {
       if (pte & PT_FILE) {
         if (fetch_page((void *) PAGEADDR(addr)) < 0) return 0;
-        if ((GET_PTE(addr) & access) != access) return 0;
+        if ((lookup_pte(addr) & access) != access) return 0;
+      } else if ((pte & PT_COW) && ((pte | PT_WRITABLE) & access) == access) {
+        if (cow_page_handler((void *) PAGEADDR(addr)) < 0) return 0;
       } else {
         return 0;
       }
@@ -131,11 +258,13 @@ int str_access(char *s, pte_t access) {
 
   while (1) {
     if ((GET_PDE(s) & PT_PRESENT) == 0) return 0;
-    pte = GET_PTE(s);
+    pte = lookup_pte((unsigned long) s);
     if ((pte & access) != access) {
       if (pte & PT_FILE) {
         if (fetch_page((void *) PAGEADDR(s)) < 0) return 0;
-        if ((GET_PTE(s) & access) != access) return 0;
+        if ((lookup_pte((unsigned long) s) & access) != access) return 0;
+      } else if ((pte & PT_COW) && ((pte | PT_WRITABLE) & access) == access) {
+        if (cow_page_handler((void *) PAGEADDR(s)) < 0) return 0;
       } else {
         return 0;
       }
@@ -154,6 +283,12 @@ void init_pdir() {
 
   // Clear identity mapping of the first 4 MB made by the os loader
   for (i = 0; i < PTES_PER_PAGE; i++) SET_PTE(PTOB(i), 0);
+
+  // Enable 4MB pages if supported by the processor
+  if (cpu.features & CPU_FEATURE_PSE) {
+    set_cr4(get_cr4() | CR4_PSE);
+    large_pages_supported = 1;
+  }
 }
 
 int pdir_proc(struct proc_file *pf, void *arg) {
@@ -170,16 +305,18 @@ int pdir_proc(struct proc_file *pf, void *arg) {
   int dt = 0;
   int gd = 0;
   int fi = 0;
+  int cw = 0;
+  int lg = 0;
 
   pprintf(pf, "virtaddr physaddr flags\n");
-  pprintf(pf, "-------- -------- ------\n");
+  pprintf(pf, "-------- -------- --------\n");
 
   vaddr = NULL;
   while (1) {
     if ((GET_PDE(vaddr) & PT_PRESENT) == 0) {
       vaddr += PTES_PER_PAGE * PAGESIZE;
     } else {
-      pte = GET_PTE(vaddr);
+      pte = lookup_pte((unsigned long) vaddr);
       if (pte & PT_PRESENT) {
         ma++;
         
@@ -199,15 +336,19 @@ int pdir_proc(struct proc_file *pf, void *arg) {
         if (pte & PT_DIRTY) dt++;
         if (pte & PT_GUARD) gd++;
         if (pte & PT_FILE) fi++;
+        if (pte & PT_COW) cw++;
+        if (pte & PT_LARGE) lg++;
 
-        pprintf(pf, "%08x %08x %c%c%c%c%c%c\n", 
+        pprintf(pf, "%08x %08x %c%c%c%c%c%c%c%c\n", 
                 vaddr, PAGEADDR(pte), 
                 (pte & PT_WRITABLE) ? 'w' : 'r',
                 (pte & PT_USER) ? 'u' : 's',
                 (pte & PT_ACCESSED) ? 'a' : ' ',
                 (pte & PT_DIRTY) ? 'd' : ' ',
                 (pte & PT_GUARD) ? 'g' : ' ',
-                (pte & PT_FILE) ? 'f' : ' ');
+                (pte & PT_FILE) ? 'f' : ' ',
+                (pte & PT_COW) ? 'c' : ' ',
+                (pte & PT_LARGE) ? 'l' : ' ');
       }
 
       vaddr += PAGESIZE;
@@ -216,7 +357,7 @@ int pdir_proc(struct proc_file *pf, void *arg) {
     if (!vaddr) break;
   }
 
-  pprintf(pf, "\ntotal:%d usr:%d sys:%d rw: %d ro: %d acc: %d dirty: %d guard:%d file:%d\n", ma, us, su, rw, ro, ac, dt, gd, fi);
+  pprintf(pf, "\ntotal:%d usr:%d sys:%d rw: %d ro: %d acc: %d dirty: %d guard:%d file:%d cow:%d large:%d\n", ma, us, su, rw, ro, ac, dt, gd, fi, cw, lg);
   return 0;
 }
 
@@ -247,7 +388,7 @@ int virtmem_proc(struct proc_file *pf, void *arg) {
 
       vaddr += PTES_PER_PAGE * PAGESIZE;
     } else {
-      pte_t pte = GET_PTE(vaddr);
+      pte_t pte = lookup_pte((unsigned long) vaddr);
       unsigned long pfn = pte >> PT_PFNSHIFT;
       unsigned long tag = pfn < maxmem ? pfdb[pfn].tag : 'MMIO';
 
@@ -294,7 +435,7 @@ int pdir_stat(void *addr, int len, struct pdirstat *buf) {
       vaddr += PTES_PER_PAGE * PAGESIZE;
       vaddr = (char *) ((unsigned long) vaddr & ~(PTES_PER_PAGE * PAGESIZE - 1));
     } else {
-      pte = GET_PTE(vaddr);
+      pte = lookup_pte((unsigned long) vaddr);
       if (pte & PT_PRESENT) {
         buf->present++;
         
@@ -102,6 +102,46 @@ unsigned long alloc_linear_pageframes(int pages, unsigned long tag) {
   return 0xFFFFFFFF;
 }
 
+unsigned long alloc_aligned_pageframes(int pages, int align, unsigned long tag) {
+  struct pageframe **link;
+  struct pageframe *pf;
+  unsigned long start;
+  int n;
+
+  if ((int) freemem < pages) return 0xFFFFFFFF;
+
+  // Find aligned run of free page frames
+  start = 0;
+  while (1) {
+    if (start + pages > maxmem) return 0xFFFFFFFF;
+    for (n = 0; n < pages; n++) {
+      if (pfdb[start + n].tag != 'FREE') break;
+    }
+    if (n == pages) break;
+    start = (start + n + align) / align * align;
+  }
+
+  // Remove page frames from free list
+  link = &freelist;
+  while (*link) {
+    pf = *link;
+    if (pf >= pfdb + start && pf < pfdb + start + pages) {
+      *link = pf->next;
+    } else {
+      link = &pf->next;
+    }
+  }
+
+  for (n = 0; n < pages; n++) {
+    pfdb[start + n].tag = tag;
+    pfdb[start + n].next = NULL;
+  }
+
+  freemem -= pages;
+
+  return start;
+}
+
 void free_pageframe(unsigned long pfn) {
   struct pageframe *pf;
 
@@ -192,6 +232,7 @@ int memstat_proc(struct proc_file *pf, void *arg) {
           maxmem * PAGESIZE / (1024 * 1024), 
           (totalmem - freemem) * PAGESIZE / 1024, 
           freemem * PAGESIZE / 1024, (maxmem - totalmem) * PAGESIZE / 1024);
+  pprintf(pf, "Copy-on-write %u faults, %u pages copied\n", cow_faults, cow_copies);
   
   return 0;
 }
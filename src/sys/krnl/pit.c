@@ -84,6 +84,7 @@ struct timeval systemclock = { 0, 0 };
 time_t upsince;
 unsigned long cycles_per_tick;
 unsigned long loops_per_tick;
+struct timepage *timepage;
 
 unsigned char loadtab[LOADTAB_SIZE];
 unsigned char *loadptr;
@@ -96,6 +97,19 @@ void timer_dpc(void *arg) {
   run_timer_list();
 }
 
+static void update_timepage() {
+  timepage->seqno++;
+  timepage->ticks = ticks;
+  timepage->clocks = clocks;
+  timepage->tv_sec = systemclock.tv_sec;
+  timepage->tv_usec = systemclock.tv_usec;
+  if (cpu.features & CPU_FEATURE_TSC) {
+    timepage->tsc = rdtsc();
+    timepage->cycles_per_tick = cycles_per_tick;
+  }
+  timepage->seqno++;
+}
+
 int timer_handler(struct context *ctxt, void *arg) {
   struct thread *t;
 
@@ -112,6 +126,9 @@ int timer_handler(struct context *ctxt, void *arg) {
     systemclock.tv_usec -= 1000000;
   }
 
+  // Update user time page
+  if (timepage) update_timepage();
+
   // Update thread times and load average
   t = self();
   if (in_dpc) {
@@ -352,6 +369,7 @@ void init_pit() {
 
   init_dpc(&timerdpc);
   timerdpc.flags |= DPC_NORAND; // Timer tick is a bad source for randomness
+  set_dpc_priority(&timerdpc, DPC_PRIORITY_HIGH);
   register_interrupt(&timerintr, INTR_TMR, timer_handler, NULL);
   enable_irq(IRQ_TMR);
 
@@ -367,6 +385,20 @@ void udelay(unsigned long us) {
   }
 }
 
+void init_timepage() {
+  struct timepage *tp;
+
+  tp = vmalloc((void *) TIMEPAGE_ADDRESS, PAGESIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READONLY, 'TIME', NULL);
+  if (!tp) panic("unable to allocate time page");
+  memset(tp, 0, PAGESIZE);
+  tp->usecs_per_tick = USECS_PER_TICK;
+
+  cli();
+  timepage = tp;
+  update_timepage();
+  sti();
+}
+
 unsigned int get_ticks() {
   return ticks;
 }
@@ -387,9 +419,13 @@ time_t time(time_t *time) {
 void set_time(struct timeval *tv) {
   struct tm tm;
 
+  cli();
   upsince += (tv->tv_sec - systemclock.tv_sec);
   systemclock.tv_usec = tv->tv_usec;
   systemclock.tv_sec = tv->tv_sec;
+  if (timepage) update_timepage();
+  sti();
+
   gmtime_r(&tv->tv_sec, &tm);
   set_cmos_time(&tm);
 }
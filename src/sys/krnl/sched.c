@@ -32,6 +32,7 @@
 // 
 
 #include <os/krnl.h>
+#include <atomic.h>
 
 #define DEFAULT_STACK_SIZE           (1 * 1024 * 1024)
 #define DEFAULT_INITIAL_STACK_COMMIT (8 * 1024)
@@ -48,13 +49,16 @@ struct thread *ready_queue_head[THREAD_PRIORITY_LEVELS];
 struct thread *ready_queue_tail[THREAD_PRIORITY_LEVELS];
 struct thread *threadlist;
 
-struct dpc *dpc_queue_head;
-struct dpc *dpc_queue_tail;
+struct dpc *dpc_queue[DPC_PRIORITY_LEVELS];
+
+static struct latency_histogram dpc_latency[DPC_PRIORITY_LEVELS];
+static struct latency_histogram task_latency;
 
 struct task *idle_tasks_head;
 struct task *idle_tasks_tail;
 
 struct task_queue sys_task_queue;
+struct task_queue sys_task_pool;
 
 static void tmr_alarm(void *arg);
 
@@ -484,11 +488,11 @@ static void destroy_tcb(void *arg) {
   // Deallocate TCB
   free_pages(arg, PAGES_PER_TCB);
 
-  // Set the TASK_QUEUE_ACTIVE_TASK_INVALID flag, to inform the sys task queue that the
+  // Set the THREAD_TASK_INVALID flag on the worker thread, to inform it that the
   // executing task is invalid. The destroy_tcb task is placed in the TCB, and we dont want
   // the flag to be updated after this task finish executing, because we have deallocated the
   // task.
-  sys_task_queue.flags |= TASK_QUEUE_ACTIVE_TASK_INVALID;
+  self()->flags |= THREAD_TASK_INVALID;
 }
 
 int destroy_thread(struct thread *t) {
@@ -662,6 +666,58 @@ int get_thread_times(struct thread *t, struct tms *tms) {
   return clocks;
 }
 
+//
+// Latency statistics
+//
+// Latencies are measured with the time stamp counter and collected in
+// histograms with power-of-two microsecond buckets. These are also used
+// by drivers for measuring I/O latencies.
+//
+
+unsigned long latency_stamp() {
+  if (cpu.features & CPU_FEATURE_TSC) return (unsigned long) rdtsc();
+  return 0;
+}
+
+void record_latency(struct latency_histogram *hist, unsigned long start) {
+  unsigned long cycles_per_usec;
+  unsigned long usecs;
+  int bucket;
+
+  if (!start) return;
+  cycles_per_usec = cycles_per_tick / USECS_PER_TICK;
+  if (cycles_per_usec == 0) return;
+
+  usecs = ((unsigned long) rdtsc() - start) / cycles_per_usec;
+  bucket = usecs ? find_highest_bit(usecs) + 1 : 0;
+  if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+
+  hist->count[bucket]++;
+  hist->samples++;
+  if (usecs > hist->max) hist->max = usecs;
+}
+
+//
+// Task queues
+//
+// A task queue is served by a pool of one or more worker threads. Idle
+// workers wait on the queue and are woken one at a time as tasks arrive,
+// so tasks can be drained in parallel when a task blocks.
+//
+
+static void wake_task_worker(struct task_queue *tq) {
+  struct thread *t;
+  int i;
+
+  for (i = 0; i < tq->numworkers; i++) {
+    t = tq->workers[i];
+    if (t->state == THREAD_STATE_WAITING && t->wait_reason == THREAD_WAIT_TASK) {
+      mark_thread_ready(t, 0, 0);
+      return;
+    }
+  }
+}
+
 static void task_queue_task(void *tqarg) {
   struct task_queue *tq = tqarg;
   struct task *task;
@@ -679,6 +735,7 @@ static void task_queue_task(void *tqarg) {
     tq->head = task->next;
     if (tq->tail == task) tq->tail = NULL;
     tq->size--;
+    record_latency(&task_latency, task->queued);
 
     // Execute task
     task->flags &= ~TASK_QUEUED;
@@ -686,29 +743,49 @@ static void task_queue_task(void *tqarg) {
       task->flags |= TASK_EXECUTING;
       proc = task->proc;
       arg = task->arg;
-      tq->flags |= TASK_QUEUE_ACTIVE;
+      tq->active++;
   
       proc(arg);
 
-      if (!(tq->flags & TASK_QUEUE_ACTIVE_TASK_INVALID)) task->flags &= ~TASK_EXECUTING;
-      tq->flags &= ~(TASK_QUEUE_ACTIVE | TASK_QUEUE_ACTIVE_TASK_INVALID);
+      // The THREAD_TASK_INVALID flag is set on the worker thread by tasks that
+      // deallocate themselves. The flag is per worker, so other workers in the
+      // pool running while this task blocked cannot clear or inherit it.
+      if (!(self()->flags & THREAD_TASK_INVALID)) task->flags &= ~TASK_EXECUTING;
+      self()->flags &= ~THREAD_TASK_INVALID;
+      tq->active--;
     }
+
+    // Wake up another idle worker if there are more tasks than busy workers
+    if (tq->head && tq->active > 0) wake_task_worker(tq);
   }
 }
 
-int init_task_queue(struct task_queue *tq, int priority, int maxsize, char *name) {
+int init_task_pool(struct task_queue *tq, int priority, int maxsize, int workers, char *name) {
+  int i;
+
+  if (workers < 1 || workers > TASK_QUEUE_MAX_WORKERS) return -EINVAL;
+
   memset(tq, 0, sizeof(struct task_queue));
   tq->maxsize = maxsize;
-  tq->thread = create_kernel_thread(task_queue_task, tq, priority, name);
+  for (i = 0; i < workers; i++) {
+    tq->workers[i] = create_kernel_thread(task_queue_task, tq, priority, name);
+    if (!tq->workers[i]) return -ENOMEM;
+    tq->numworkers++;
+  }
 
   return 0;
 }
 
+int init_task_queue(struct task_queue *tq, int priority, int maxsize, char *name) {
+  return init_task_pool(tq, priority, maxsize, 1, name);
+}
+
 void init_task(struct task *task) {
   task->proc = NULL;
   task->arg = NULL;
   task->next = NULL;
   task->flags = 0;
+  task->queued = 0;
 }
 
 int queue_task(struct task_queue *tq, struct task *task, taskproc_t proc, void *arg) {
@@ -720,6 +797,7 @@ int queue_task(struct task_queue *tq, struct task *task, taskproc_t proc, void *
   task->arg = arg;
   task->next = NULL;
   task->flags |= TASK_QUEUED;
+  task->queued = latency_stamp();
 
   if (tq->tail) {
     tq->tail->next = task;
@@ -730,88 +808,123 @@ int queue_task(struct task_queue *tq, struct task *task, taskproc_t proc, void *
 
   tq->size++;
 
-  if ((tq->flags & TASK_QUEUE_ACTIVE) == 0 && tq->thread->state == THREAD_STATE_WAITING) {
-    mark_thread_ready(tq->thread, 0, 0);
-  }
+  wake_task_worker(tq);
 
   return 0;
 }
 
+//
+// Deferred procedure calls
+//
+// Each DPC priority level has a lock-free LIFO list of queued DPCs. DPCs
+// are pushed onto the list with compare-and-exchange, so they can be queued
+// from interrupt handlers without disabling interrupts. The dispatcher
+// detaches the whole list for a priority level with an atomic exchange and
+// executes the batch in FIFO order. Higher priority batches are always
+// executed before lower priority batches.
+//
+
 void init_dpc(struct dpc *dpc) {
   dpc->proc = NULL;
   dpc->arg = NULL;
   dpc->next = NULL;
   dpc->flags = 0;
+  dpc->priority = DPC_PRIORITY_NORMAL;
+  dpc->queued = 0;
+}
+
+void set_dpc_priority(struct dpc *dpc, int priority) {
+  if (priority < 0) priority = 0;
+  if (priority >= DPC_PRIORITY_LEVELS) priority = DPC_PRIORITY_LEVELS - 1;
+  dpc->priority = priority;
 }
 
 void queue_irq_dpc(struct dpc *dpc, dpcproc_t proc, void *arg) {
-  if (dpc->flags & DPC_QUEUED) {
+  struct dpc **head;
+  struct dpc *next;
+
+  if (test_and_set_bit(&dpc->flags, DPC_QUEUED_BIT)) {
     dpc_lost++;
     return;
   }
 
   dpc->proc = proc;
   dpc->arg = arg;
-  dpc->next = NULL;
-  if (dpc_queue_tail) dpc_queue_tail->next = dpc;
-  dpc_queue_tail = dpc;
-  if (!dpc_queue_head) dpc_queue_head = dpc;
-  set_bit(&dpc->flags, DPC_QUEUED_BIT);
+  dpc->queued = latency_stamp();
+
+  head = &dpc_queue[dpc->priority];
+  do {
+    next = *head;
+    dpc->next = next;
+  } while (atomic_compare_and_exchange((int *) head, (int) dpc, (int) next) != (int) next);
 }
 
 void queue_dpc(struct dpc *dpc, dpcproc_t proc, void *arg) {
-  cli();
   queue_irq_dpc(dpc, proc, arg);
-  sti();
 }
 
-struct dpc *get_next_dpc() {
+static struct dpc *get_dpc_batch(int prio) {
+  struct dpc *list;
+  struct dpc *batch;
   struct dpc *dpc;
 
-  cli();
+  // Detach all queued DPCs for priority level
+  list = (struct dpc *) atomic_exchange((int *) &dpc_queue[prio], 0);
 
-  if (dpc_queue_head) {
-    dpc = dpc_queue_head;
-    dpc_queue_head = dpc->next;
-    if (dpc_queue_tail == dpc) dpc_queue_tail = NULL;
-  } else {
-    dpc = NULL;
+  // Reverse list to get the DPCs in the order they were queued
+  batch = NULL;
+  while (list) {
+    dpc = list;
+    list = dpc->next;
+    dpc->next = batch;
+    batch = dpc;
   }
 
-  sti();
-
-  return dpc;
+  return batch;
 }
 
 void dispatch_dpc_queue() {
+  struct dpc *batch;
   struct dpc *dpc;
   dpcproc_t proc;
   void *arg;
+  int prio;
 
   if (in_dpc) panic("sched: nested execution of dpc queue");
   in_dpc = 1;
 
+  // DPCs are executed with interrupts enabled
+  sti();
+
   while (1) {
-    // Get next deferred procedure call
-    // As a side effect this will enable interrupts
-    dpc = get_next_dpc();
-    if (!dpc) break;
-
-    // Execute DPC
-    proc = dpc->proc;
-    arg = dpc->arg;
-    clear_bit(&dpc->flags, DPC_QUEUED_BIT);
- 
-    if ((dpc->flags & DPC_EXECUTING) == 0) {
-      set_bit(&dpc->flags, DPC_EXECUTING_BIT);
-      proc(arg);
-      clear_bit(&dpc->flags, DPC_EXECUTING_BIT);
-      dpc_total++;
+    // Find highest priority level with queued DPCs
+    for (prio = 0; prio < DPC_PRIORITY_LEVELS; prio++) {
+      if (dpc_queue[prio]) break;
     }
+    if (prio == DPC_PRIORITY_LEVELS) break;
+
+    // Execute batch of deferred procedure calls
+    batch = get_dpc_batch(prio);
+    while (batch) {
+      dpc = batch;
+      batch = dpc->next;
+
+      proc = dpc->proc;
+      arg = dpc->arg;
+      record_latency(&dpc_latency[prio], dpc->queued);
+      clear_bit(&dpc->flags, DPC_QUEUED_BIT);
+ 
+      if ((dpc->flags & DPC_EXECUTING) == 0) {
+        set_bit(&dpc->flags, DPC_EXECUTING_BIT);
+        proc(arg);
+        clear_bit(&dpc->flags, DPC_EXECUTING_BIT);
+        dpc_total++;
+      }
  
 #ifdef RANDOMDEV
-    if ((dpc->flags & DPC_NORAND) == 0) add_dpc_randomness(dpc);
+      if ((dpc->flags & DPC_NORAND) == 0) add_dpc_randomness(dpc);
 #endif
+    }
   }
 
   in_dpc = 0;
@@ -893,7 +1006,7 @@ void yield() {
 
 int system_idle() {
   if (thread_ready_summary != 0) return 0;
-  if (dpc_queue_head != NULL) return 0;
+  if (dpcs_pending()) return 0;
   return 1;
 }
 
@@ -971,17 +1084,45 @@ static int threads_proc(struct proc_file *pf, void *arg) {
   return 0;
 }
 
+static void print_latency_bucket(struct proc_file *pf, int bucket) {
+  if (bucket == 0) {
+    pprintf(pf, "%14s", "< 1");
+  } else if (bucket == LATENCY_BUCKETS - 1) {
+    pprintf(pf, "%7s%7u", ">= ", 1UL << (bucket - 1));
+  } else {
+    pprintf(pf, "%6u-%7u", 1UL << (bucket - 1), (1UL << bucket) - 1);
+  }
+}
+
 static int dpcs_proc(struct proc_file *pf, void *arg) {
+  int i;
+
   pprintf(pf, "dpc time   : %8d\n", dpc_time);
   pprintf(pf, "total dpcs : %8d\n", dpc_total);
   pprintf(pf, "lost dpcs  : %8d\n", dpc_lost);
 
+  pprintf(pf, "\nlatency (us)        high     normal        low      tasks\n");
+  pprintf(pf, "-------------- ---------- ---------- ---------- ----------\n");
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    print_latency_bucket(pf, i);
+    pprintf(pf, " %10u %10u %10u %10u\n",
+            dpc_latency[DPC_PRIORITY_HIGH].count[i],
+            dpc_latency[DPC_PRIORITY_NORMAL].count[i],
+            dpc_latency[DPC_PRIORITY_LOW].count[i],
+            task_latency.count[i]);
+  }
+  pprintf(pf, "%14s %10u %10u %10u %10u\n", "samples",
+          dpc_latency[DPC_PRIORITY_HIGH].samples,
+          dpc_latency[DPC_PRIORITY_NORMAL].samples,
+          dpc_latency[DPC_PRIORITY_LOW].samples,
+          task_latency.samples);
+
   return 0;
 }
 
 void init_sched() {
   // Initialize scheduler
-  dpc_queue_head = dpc_queue_tail = NULL;
+  memset(dpc_queue, 0, sizeof(dpc_queue));
   memset(ready_queue_head, 0, sizeof(ready_queue_head));
   memset(ready_queue_tail, 0, sizeof(ready_queue_tail));
 
@@ -999,8 +1140,11 @@ void init_sched() {
   strcpy(idle_thread->name, "idle");
   thread_ready_summary = (1 << PRIORITY_SYSIDLE);
 
-  // Initialize system task queue
+  // Initialize system task queue. Tasks on the system task queue are run
+  // one at a time. Tasks that are safe to run in parallel, also when they
+  // block, can be queued on the system task pool instead.
   init_task_queue(&sys_task_queue, PRIORITY_NORMAL /*PRIORITY_SYSTEM*/, INFINITE, "systask");
+  init_task_pool(&sys_task_pool, PRIORITY_NORMAL, INFINITE, SYS_TASK_WORKERS, "syspool");
 
   // Register /proc/threads and /proc/dpcs
   register_proc_inode("threads", threads_proc, NULL);
@@ -203,6 +203,7 @@ static void init_filesystem() {
   init_pipefs();
   init_smbfs();
   init_cdfs();
+  init_tmpfs();
  
   // Determine boot device
   if ((syspage->ldrparams.bootdrv & 0xF0) == 0xF0) {
@@ -219,6 +220,12 @@ static void init_filesystem() {
     sprintf(bootdev, "fd%c", '0' + (syspage->ldrparams.bootdrv & 0x7F));
   }
 
+  // Disks on AHCI controllers are named sdN instead of hdN.
+  if (devno(bootdev) == NODEV && bootdev[0] == 'h') {
+    bootdev[0] = 's';
+    if (devno(bootdev) == NODEV) bootdev[0] = 'h';
+  }
+
   // If default boot device is not found try a virtual device.
   if (devno(bootdev) == NODEV && devno("vd0") != NODEV) strcpy(bootdev, "vd0");
 
@@ -240,6 +247,43 @@ static void init_filesystem() {
   if (rc < 0) panic("error mounting proc filesystem");
 }
 
+static void init_mounts() {
+  struct section *sect;
+  struct property *prop;
+  char devname[MAXPATH];
+  char *type;
+  char *opts;
+  int rc;
+
+  // Mount file systems listed in the [mount] section of krnl.ini
+  sect = find_section(krnlcfg, "mount");
+  if (!sect) return;
+
+  for (prop = sect->properties; prop; prop = prop->next) {
+    if (prop->value && strlen(prop->value) >= MAXPATH) {
+      kprintf(KERN_ERR "mount: mount specification for %s too long\n", prop->name);
+      continue;
+    }
+    strcpy(devname, prop->value ? prop->value : "");
+    type = strchr(devname, ',');
+    if (type) {
+      *type++ = 0;
+      while (*type == ' ') type++;
+      opts = strchr(type, ',');
+      if (opts) {
+        *opts++ = 0;
+        while (*opts == ' ') opts++;
+      }
+    } else {
+      type = "dfs";
+      opts = NULL;
+    }
+
+    rc = mount(type, prop->name, devname, opts, NULL);
+    if (rc < 0) kprintf(KERN_ERR "mount: error %d mounting %s %s on %s\n", rc, type, devname, prop->name);
+  }
+}
+
 static int version_proc(struct proc_file *pf, void *arg) {
   hmodule_t krnl = (hmodule_t) OSBASE;
   struct verinfo *ver;
@@ -323,6 +367,9 @@ void __stdcall start(void *hmod, char *opts, int reserved2) {
   // Initialize virtual memory manager
   init_vmm();
 
+  // Initialize page cache
+  init_pcache();
+
   // Flush tlb
   flushtlb();
 
@@ -337,6 +384,7 @@ void __stdcall start(void *hmod, char *opts, int reserved2) {
   register_proc_inode("kmodmem", kmodmem_proc, NULL);
   register_proc_inode("kheap", kheapstat_proc, NULL);
   register_proc_inode("vmem", vmem_proc, NULL);
+  register_proc_inode("pcache", pcache_proc, NULL);
 
   register_proc_inode("cpu", cpu_proc, NULL);
 
@@ -400,11 +448,16 @@ void main(void *arg) {
   memset(peb, 0, PAGESIZE);
   peb->fast_syscalls_supported = (cpu.features & CPU_FEATURE_SEP) != 0;
 
+  // Map time page into user space
+  init_timepage();
+
   // Enumerate root host buses and units
   enum_host_bus();
 
   // Initialize boot device drivers
   init_hd();
+  init_ahci();
+  init_nvme();
   init_fd();
   init_vblk();
 
@@ -456,6 +509,9 @@ void main(void *arg) {
   // Initialize network
   init_net();
 
+  // Mount additional file systems
+  init_mounts();
+
   // Install /proc/version and /proc/copyright handler
   register_proc_inode("version", version_proc, NULL);
   register_proc_inode("copyright", copyright_proc, NULL);
@@ -901,6 +901,24 @@ static int sys_vmsync(char *params) {
   return rc;
 }
 
+static int sys_vmclone(char *params) {
+  char *addr;
+  unsigned long size;
+  void *retval;
+  int rc;
+
+  addr = *(void **) params;
+  size = *(unsigned long *) (params + 4);
+
+  retval = vmclone(addr, size, &rc);
+  if (!retval) {
+    struct tib *tib = self()->tib;
+    if (tib) tib->errnum = -rc;
+  }
+
+  return (int) retval;
+}
+
 static int sys_waitone(char *params) {
   handle_t h;
   struct object *o;
@@ -2113,6 +2131,36 @@ static int sys_pipe(char *params) {
   return rc;
 }
 
+static int sys_splice(char *params) {
+  handle_t hin;
+  handle_t hout;
+  struct object *in;
+  struct object *out;
+  size_t size;
+  int flags;
+  int rc;
+
+  hin = *(handle_t *) params;
+  hout = *(handle_t *) (params + 4);
+  size = *(size_t *) (params + 8);
+  flags = *(int *) (params + 12);
+
+  in = olock(hin, OBJECT_ANY);
+  if (!in) return -EBADF;
+  out = olock(hout, OBJECT_ANY);
+  if (!out) {
+    orel(in);
+    return -EBADF;
+  }
+
+  rc = splice(in, out, size, flags);
+
+  orel(out);
+  orel(in);
+
+  return rc;
+}
+
 static int sys_setmode(char *params) {
   handle_t h;
   struct file *f;
@@ -2666,15 +2714,32 @@ struct syscall_entry syscalltab[] = {
   {"vmmap", 24, "%p,%d,%x,%d,%d-%d", sys_vmmap},
   {"vmsync", 8, "%p,%d", sys_vmsync},
   {"threadtimes", 8, "%d,%p", sys_threadtimes},
+  {"vmclone", 8, "%p,%d", sys_vmclone},
+  {"splice", 16, "%d,%d,%d,%d", sys_splice},
 };
 
 int syscall(int syscallno, char *params, struct context *ctxt) {
   int rc;
+  int regargs;
+  unsigned long args[3];
   struct thread *t = self();
 
   t->ctxt = ctxt;
+  regargs = (syscallno & SYSCALL_REGARGS) != 0;
+  syscallno &= ~SYSCALL_REGARGS;
   if (syscallno < 0 || syscallno > SYSCALL_MAX) return -ENOSYS;
 
+  // Syscalls with at most three parameters can pass them in ebx, esi, and edi
+  // instead of through a parameter block on the user stack. The parameters 
+  // are then already in kernel memory and do not need to be validated.
+  if (regargs) {
+    if (syscalltab[syscallno].paramsize > sizeof(args)) return -EINVAL;
+    args[0] = ctxt->ebx;
+    args[1] = ctxt->esi;
+    args[2] = ctxt->edi;
+    params = (char *) args;
+  }
+
 #ifdef SYSCALL_LOGENTER
 #ifndef SYSCALL_LOGWAIT
   if (syscallno != SYSCALL_WAITONE && syscallno != SYSCALL_WAITALL && syscallno != SYSCALL_WAITANY)
@@ -2695,10 +2760,14 @@ int syscall(int syscallno, char *params, struct context *ctxt) {
   sccnt[syscallno]++;
 #endif
 
-  rc = lock_buffer(params, syscalltab[syscallno].paramsize, 0);
-  if (rc >= 0) {
+  if (regargs) {
     rc = syscalltab[syscallno].func(params);
-    unlock_buffer(params, syscalltab[syscallno].paramsize);
+  } else {
+    rc = lock_buffer(params, syscalltab[syscallno].paramsize, 0);
+    if (rc >= 0) {
+      rc = syscalltab[syscallno].func(params);
+      unlock_buffer(params, syscalltab[syscallno].paramsize);
+    }
   }
 
   if (rc < 0) {
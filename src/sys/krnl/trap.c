@@ -721,6 +721,8 @@ static int pagefault_handler(struct context *ctxt, void *arg) {
         unguard_page(pageaddr);
         signal = SIGSTKFLT;
         if (guard_page_handler(pageaddr) == 0) signal = 0;
+      } else if (flags & PT_COW) {
+        if (cow_page_handler(pageaddr) == 0) signal = 0;
       } else if (flags & PT_FILE) {
         if ((flags & PT_PRESENT) == 0) {
           sti();
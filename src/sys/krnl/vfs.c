@@ -162,7 +162,7 @@ int fslookup(char *name, int full, struct fs **mntfs, char **rest) {
   return -ENOENT;
 }
 
-int __inline lock_fs(struct fs *fs, int fsop) {
+int lock_fs(struct fs *fs, int fsop) {
   if (fs->ops->reentrant & fsop) return 0;
   if (fs->ops->lockfs) {
     return fs->ops->lockfs(fs);
@@ -171,7 +171,7 @@ int __inline lock_fs(struct fs *fs, int fsop) {
   }
 }
 
-void __inline unlock_fs(struct fs *fs, int fsop) {
+void unlock_fs(struct fs *fs, int fsop) {
   if (fs->ops->reentrant & fsop) return;
   if (fs->ops->unlockfs) {
     fs->ops->unlockfs(fs);
@@ -272,6 +272,8 @@ struct file *newfile(struct fs *fs, char *path, int flags, int mode) {
   filp->data = NULL;
   filp->path = strdup(path);
   filp->chbuf = LF;
+  filp->cfile = NULL;
+  filp->cfgen = 0;
 
   return filp;
 }
@@ -627,6 +629,32 @@ int setmode(struct file *filp, int mode) {
   return oldmode;
 }
 
+static int read_file(struct file *filp, void *data, size_t size, off64_t offset) {
+  struct cfile *cf;
+  int rc;
+
+  // Read through the page cache if the file is memory mapped
+  cf = lookup_cfile(filp);
+  if (!cf) return filp->fs->ops->read(filp, data, size, offset);
+
+  rc = read_cached(cf, filp, data, size, offset);
+  release_cfile(cf);
+  return rc;
+}
+
+static int write_file(struct file *filp, void *data, size_t size, off64_t offset) {
+  struct cfile *cf;
+  int rc;
+
+  // Keep the page cache up to date if the file is memory mapped
+  cf = lookup_cfile(filp);
+  if (!cf) return filp->fs->ops->write(filp, data, size, offset);
+
+  rc = write_cached(cf, filp, data, size, offset);
+  release_cfile(cf);
+  return rc;
+}
+
 int read_translated(struct file *filp, void *data, size_t size) {
   char *buf = (char *) data;
   char *p = buf;
@@ -644,12 +672,12 @@ int read_translated(struct file *filp, void *data, size_t size) {
     filp->chbuf = LF;
     if (size == 1) return 1;
 
-    rc = filp->fs->ops->read(filp, buf + 1, size - 1, filp->pos);
+    rc = read_file(filp, buf + 1, size - 1, filp->pos);
     if (rc > 0) filp->pos += rc;
     if (rc < 0) return rc;
     bytes = rc + 1;
   } else {
-    rc = filp->fs->ops->read(filp, buf, size, filp->pos);
+    rc = read_file(filp, buf, size, filp->pos);
     if (rc > 0) filp->pos += rc;
     if (rc < 0) return rc;
     bytes = rc;
@@ -674,7 +702,7 @@ int read_translated(struct file *filp, void *data, size_t size) {
         // We must peek ahead to see if next char is an LF.
         p++;
 
-        rc = filp->fs->ops->read(filp, &peekch, 1, filp->pos);
+        rc = read_file(filp, &peekch, 1, filp->pos);
         if (rc > 0) filp->pos += rc;
         if (rc <= 0) {
           // Couldn't read ahead, store CR
@@ -709,7 +737,7 @@ int read(struct file *filp, void *data, size_t size) {
   if (filp->flags & O_TEXT) {
     rc = read_translated(filp, data, size);
   } else {
-    rc = filp->fs->ops->read(filp, data, size, filp->pos);
+    rc = read_file(filp, data, size, filp->pos);
     if (rc > 0) filp->pos += rc;
   }
   unlock_fs(filp->fs, FSOP_READ);
@@ -726,7 +754,7 @@ int pread(struct file *filp, void *data, size_t size, off64_t offset) {
   
   if (!filp->fs->ops->read) return -ENOSYS;
   if (lock_fs(filp->fs, FSOP_READ) < 0) return -ETIMEOUT;
-  rc = filp->fs->ops->read(filp, data, size, offset);
+  rc = read_file(filp, data, size, offset);
   unlock_fs(filp->fs, FSOP_READ);
   return rc;
 }
@@ -757,7 +785,7 @@ static int write_translated(struct file *filp, void *data, size_t size) {
     }
 
     // Write the buffer and update total
-    rc = filp->fs->ops->write(filp, lfbuf, q - lfbuf, filp->pos);
+    rc = write_file(filp, lfbuf, q - lfbuf, filp->pos);
     if (rc > 0) filp->pos += rc;
     if (rc < 0) return rc;
     bytes += rc;
@@ -779,7 +807,7 @@ int write(struct file *filp, void *data, size_t size) {
   if (filp->flags & O_TEXT) {
     rc = write_translated(filp, data, size);
   } else {
-    rc = filp->fs->ops->write(filp, data, size, filp->pos);
+    rc = write_file(filp, data, size, filp->pos);
     if (rc > 0) filp->pos += rc;
   }
   unlock_fs(filp->fs, FSOP_WRITE);
@@ -796,7 +824,7 @@ int pwrite(struct file *filp, void *data, size_t size, off64_t offset) {
 
   if (!filp->fs->ops->write) return -ENOSYS;
   if (lock_fs(filp->fs, FSOP_WRITE) < 0) return -ETIMEOUT;
-  rc = filp->fs->ops->write(filp, data, size, offset);
+  rc = write_file(filp, data, size, offset);
   unlock_fs(filp->fs, FSOP_WRITE);
   return rc;
 }
@@ -900,6 +928,13 @@ int ftruncate(struct file *filp, off64_t size) {
   if (!filp->fs->ops->ftruncate) return -ENOSYS;
   if (lock_fs(filp->fs, FSOP_FTRUNCATE) < 0) return -ETIMEOUT;
   rc = filp->fs->ops->ftruncate(filp, size);
+  if (rc >= 0) {
+    struct cfile *cf = lookup_cfile(filp);
+    if (cf) {
+      truncate_cached(cf, size);
+      release_cfile(cf);
+    }
+  }
   unlock_fs(filp->fs, FSOP_FTRUNCATE);
   return rc;
 }
@@ -1311,6 +1346,8 @@ int opendir(char *name, struct file **retval) {
   filp->pos = 0;
   filp->data = NULL;
   filp->path = strdup(path);
+  filp->cfile = NULL;
+  filp->cfgen = 0;
 
   fs->locks++;
   if (lock_fs(fs, FSOP_OPENDIR) < 0) {
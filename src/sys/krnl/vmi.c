@@ -171,6 +171,24 @@ static unsigned long vmi_get_cr2() {
   return val;
 }
 
+static unsigned long vmi_get_cr4() {
+  unsigned long val;
+
+  __asm {
+    VMCALL(VMI_CALL_GetCR4);
+    mov val, eax
+  }
+
+  return val;
+}
+
+static void vmi_set_cr4(unsigned long val) {
+  __asm {
+    mov eax, val
+    VMCALL(VMI_CALL_SetCR4);
+  }
+}
+
 static void vmi_wrmsr(unsigned long reg, unsigned long valuelow, unsigned long valuehigh) {
   __asm {
     mov ecx, reg
@@ -436,6 +454,8 @@ int init_vmi() {
   mach.get_cr0 = vmi_get_cr0;
   mach.set_cr0 = vmi_set_cr0;
   mach.get_cr2 = vmi_get_cr2;
+  mach.get_cr4 = vmi_get_cr4;
+  mach.set_cr4 = vmi_set_cr4;
   mach.wrmsr = vmi_wrmsr;
   mach.set_gdt_entry = vmi_set_gdt_entry;
   mach.set_idt_gate = vmi_set_idt_gate;
@@ -38,6 +38,11 @@
 
 struct rmap *vmap;
 
+static char *cowwin;                // Kernel window for copying shared pages
+
+unsigned long cow_faults;           // Number of copy-on-write faults
+unsigned long cow_copies;           // Number of shared pages copied on write
+
 static int valid_range(void *addr, int size) {
   int pages = PAGES(size);
 
@@ -74,9 +79,52 @@ static unsigned long pte_flags_from_protect(int protect) {
   return 0xFFFFFFFF;
 }
 
+static unsigned long cow_protect(void *vaddr, unsigned long flags) {
+  pte_t pte = get_page_flags(vaddr);
+  unsigned long pfn = virt2pfn(vaddr);
+
+  // Writable mappings of shared page frames must stay write-protected
+  if ((flags & PT_WRITABLE) && (pte & PT_FILE) == 0 && pfn < maxmem && pfdb[pfn].shares > 0) {
+    flags = (flags & ~PT_WRITABLE) | PT_COW;
+  }
+
+  return flags;
+}
+
+static void release_page(void *vaddr, unsigned long pfn) {
+  unmap_page(vaddr);
+  if (pfdb[pfn].shares > 0) {
+    pfdb[pfn].shares--;
+  } else {
+    free_pageframe(pfn);
+  }
+}
+
+static struct filemap *find_filemap(struct cfile *cf, char *vaddr) {
+  struct filemap *fm;
+
+  for (fm = cf->filemaps; fm; fm = fm->next) {
+    if (vaddr >= fm->addr && vaddr < fm->addr + PTOB(PAGES(fm->size))) return fm;
+  }
+
+  return NULL;
+}
+
 static int free_filemap(struct filemap *fm) {
+  struct cfile *cf = fm->cfile;
+  struct filemap **link;
   int rc;
 
+  // Write back dirty pages and detach mapping from the page cache
+  flush_cfile(cf);
+  for (link = &cf->filemaps; *link; link = &(*link)->next) {
+    if (*link == fm) {
+      *link = fm->next;
+      break;
+    }
+  }
+  release_cfile(cf);
+
   hunprotect(fm->file);
   rc = hfree(fm->file);
   if (rc < 0) return rc;
@@ -92,53 +140,28 @@ static int free_filemap(struct filemap *fm) {
 
 static int fetch_file_page(struct filemap *fm, void *addr) {
   struct file *filp;
-  unsigned long pfn;
-  unsigned long pos;
+  struct cpage *cp;
+  unsigned long pageno;
   int rc;
 
   filp = (struct file *) olock(fm->file, OBJECT_FILE);
   if (!filp) return -EBADF;
 
-  pfn = alloc_pageframe('FMAP');
-  if (pfn == 0xFFFFFFFF) {
-    orel(filp);
-    return -ENOMEM;
-  }
-
-  map_page(addr, pfn, PT_WRITABLE | PT_PRESENT);
-
-  pos = (char *) addr - fm->addr;
-  rc = pread(filp, addr, PAGESIZE, fm->offset + pos);
+  pageno = (unsigned long) (fm->offset / PAGESIZE) + BTOP((char *) addr - fm->addr);
+  rc = lock_fs(filp->fs, FSOP_READ);
   if (rc < 0) {
     orel(filp);
-    unmap_page(addr);
-    free_pageframe(pfn);
     return rc;
   }
-
-  pfdb[pfn].owner = fm->self;
-  map_page(addr, pfn, fm->protect | PT_PRESENT);
-
-  orel(filp);
-  return 0;
-}
-
-static int save_file_page(struct filemap *fm, void *addr) {
-  struct file *filp;
-  unsigned long pos;
-  int rc;
-
-  filp = (struct file *) olock(fm->file, OBJECT_FILE);
-  if (!filp) return -EBADF;
-
-  pos = (char *) addr - fm->addr;
-  rc = pwrite(filp, addr, PAGESIZE, fm->offset + pos);
-  if (rc < 0) {
+  cp = get_cached_page(fm->cfile, filp, pageno, &rc);
+  unlock_fs(filp->fs, FSOP_READ);
+  if (!cp) {
     orel(filp);
     return rc;
   }
 
-  clear_dirty(addr);
+  cp->mapcount++;
+  map_page(addr, cp->pfn, fm->protect | PT_PRESENT);
 
   orel(filp);
   return 0;
@@ -148,6 +171,7 @@ void init_vmm() {
   vmap = (struct rmap *) kmalloc(VMAP_ENTRIES * sizeof(struct rmap));
   rmap_init(vmap, VMAP_ENTRIES);
   rmap_free(vmap, BTOP(VMEM_START), BTOP(OSBASE - VMEM_START));
+  cowwin = (char *) PTOB(rmap_alloc(osvmap, 1));
 }
 
 void *vmalloc(void *addr, unsigned long size, int type, int protect, unsigned long tag, int *rc) {
@@ -170,7 +194,9 @@ void *vmalloc(void *addr, unsigned long size, int type, int protect, unsigned lo
 
   if (type & MEM_RESERVE) {
     if (addr == NULL) {
-      if (type & MEM_ALIGN64K) {
+      if ((type & MEM_LARGE_PAGES) && large_pages_supported && pages >= PTES_PER_PAGE) {
+        addr = (void *) PTOB(rmap_alloc_align(vmap, pages, PTES_PER_PAGE));
+      } else if (type & MEM_ALIGN64K) {
         addr = (void *) PTOB(rmap_alloc_align(vmap, pages, 64 * 1024 / PAGESIZE));
       } else {
         addr = (void *) PTOB(rmap_alloc(vmap, pages));
@@ -196,11 +222,26 @@ void *vmalloc(void *addr, unsigned long size, int type, int protect, unsigned lo
   if (type & MEM_COMMIT) {
     char *vaddr;
     unsigned long pfn;
+    int n;
 
     vaddr = (char *) addr;
     for (i = 0; i < pages; i++) {
+      // Use 4MB pages for aligned parts of the region if requested
+      if ((type & MEM_LARGE_PAGES) && PTEIDX(vaddr) == 0 && pages - i >= PTES_PER_PAGE && !page_directory_mapped(vaddr)) {
+        pfn = alloc_aligned_pageframes(PTES_PER_PAGE, PTES_PER_PAGE, tag);
+        if (pfn != 0xFFFFFFFF) {
+          if (map_large_page(vaddr, pfn, flags | PT_PRESENT) == 0) {
+            memset(vaddr, 0, LARGEPAGESIZE);
+            vaddr += LARGEPAGESIZE;
+            i += PTES_PER_PAGE - 1;
+            continue;
+          }
+          for (n = 0; n < PTES_PER_PAGE; n++) free_pageframe(pfn + n);
+        }
+      }
+
       if (page_mapped(vaddr)) {
-        set_page_flags(vaddr, flags | PT_PRESENT);
+        set_page_flags(vaddr, cow_protect(vaddr, flags) | PT_PRESENT);
       } else {
         pfn = alloc_pageframe(tag);
         if (pfn == 0xFFFFFFFF) {
@@ -222,11 +263,12 @@ void *vmmap(void *addr, unsigned long size, int protect, struct file *filp, off6
   int pages = PAGES(size);
   unsigned long flags = pte_flags_from_protect(protect);
   struct filemap *fm;
-  int i;
+  struct cfile *cf;
+  int i, err;
   char *vaddr;
 
   if (rc) *rc = 0;
-  if (size == 0 || flags == 0xFFFFFFFF) {
+  if (size == 0 || flags == 0xFFFFFFFF || (offset & (PAGESIZE - 1)) != 0) {
     if (rc) *rc = -EINVAL;
     return NULL;
   }
@@ -244,8 +286,16 @@ void *vmmap(void *addr, unsigned long size, int protect, struct file *filp, off6
     }
   }
 
+  cf = attach_cfile(filp, &err);
+  if (!cf) {
+    rmap_free(vmap, BTOP(addr), pages);
+    if (rc) *rc = err;
+    return NULL;
+  }
+
   fm = (struct filemap *) kmalloc(sizeof(struct filemap));
   if (!fm) {
+    release_cfile(cf);
     rmap_free(vmap, BTOP(addr), pages);
     if (rc) *rc = -ENOMEM;
     return NULL;
@@ -265,6 +315,9 @@ void *vmmap(void *addr, unsigned long size, int protect, struct file *filp, off6
   fm->addr = addr;
   fm->size = size;
   fm->protect = flags | PT_FILE;
+  fm->cfile = cf;
+  fm->next = cf->filemaps;
+  cf->filemaps = fm;
 
   vaddr = (char *) addr;
   flags = (flags & ~PT_USER) | PT_FILE;
@@ -277,7 +330,8 @@ void *vmmap(void *addr, unsigned long size, int protect, struct file *filp, off6
 }
 
 int vmsync(void *addr, unsigned long size) {
-  struct filemap *fm = NULL;
+  struct cfile *cf = NULL;
+  struct cpage *cp;
   int pages = PAGES(size);
   int i, rc;
   char *vaddr;
@@ -291,27 +345,24 @@ int vmsync(void *addr, unsigned long size) {
     if (page_directory_mapped(vaddr)) {
       pte_t flags = get_page_flags(vaddr);
       if ((flags & (PT_FILE | PT_PRESENT | PT_DIRTY)) == (PT_FILE | PT_PRESENT | PT_DIRTY)) {
-        unsigned long pfn = BTOP(virt2phys(vaddr));
-        struct filemap *newfm = (struct filemap *) hlookup(pfdb[pfn].owner);
-        if (newfm != fm) {
-          if (fm) {
-            rc = unlock_filemap(fm);
+        cp = pfdb[virt2pfn(vaddr)].cpage;
+        cp->dirty = 1;
+        clear_dirty(vaddr);
+
+        if (cp->cfile != cf) {
+          if (cf) {
+            rc = flush_cfile(cf);
             if (rc < 0) return rc;
           }
-          fm = newfm;
-          rc = wait_for_object(fm, INFINITE);
-          if (rc < 0) return rc;
+          cf = cp->cfile;
         }
-        
-        rc = save_file_page(fm, vaddr);
-        if (rc < 0) return rc;
       }
     }
     vaddr += PAGESIZE;
   }
 
-  if (fm) {
-    rc = unlock_filemap(fm);
+  if (cf) {
+    rc = flush_cfile(cf);
     if (rc < 0) return rc;
   }
 
@@ -331,13 +382,31 @@ int vmfree(void *addr, unsigned long size, int type) {
   if (type & (MEM_DECOMMIT | MEM_RELEASE)) {
     vaddr = (char *) addr;
     for (i = 0; i < pages; i++) {
+      if (large_page_mapped(vaddr)) {
+        if (PTEIDX(vaddr) == 0 && pages - i >= PTES_PER_PAGE) {
+          unsigned long pfn = virt2pfn(vaddr);
+          int n;
+
+          unmap_large_page(vaddr);
+          for (n = 0; n < PTES_PER_PAGE; n++) free_pageframe(pfn + n);
+          vaddr += LARGEPAGESIZE;
+          i += PTES_PER_PAGE - 1;
+          continue;
+        }
+        split_large_page(vaddr);
+      }
+
       if (page_directory_mapped(vaddr)) {
         pte_t flags = get_page_flags(vaddr);
         unsigned long pfn = BTOP(virt2phys(vaddr));
 
         if (flags & PT_FILE) {
-          handle_t h = (flags & PT_PRESENT) ? pfdb[pfn].owner : pfn;
-          struct filemap *newfm = (struct filemap *) hlookup(h);
+          struct filemap *newfm;
+          if (flags & PT_PRESENT) {
+            newfm = find_filemap(pfdb[pfn].cpage->cfile, vaddr);
+          } else {
+            newfm = (struct filemap *) hlookup(pfn);
+          }
           if (newfm != fm) {
             if (fm) {
               if (fm->pages == 0) {
@@ -352,11 +421,14 @@ int vmfree(void *addr, unsigned long size, int type) {
             if (rc < 0) return rc;
           }
           fm->pages--;
+          if (flags & PT_PRESENT) {
+            struct cpage *cp = pfdb[pfn].cpage;
+            if (flags & PT_DIRTY) cp->dirty = 1;
+            cp->mapcount--;
+          }
           unmap_page(vaddr);
-          if (flags & PT_PRESENT) free_pageframe(pfn);
         } else  if (flags & PT_PRESENT) {
-          unmap_page(vaddr);
-          free_pageframe(pfn);
+          release_page(vaddr, pfn);
         }
       }
 
@@ -396,8 +468,19 @@ int vmprotect(void *addr, unsigned long size, int protect) {
 
   vaddr = (char *) addr;
   for (i = 0; i < pages; i++) {
+    if (large_page_mapped(vaddr) && PTEIDX(vaddr) == 0 && pages - i >= PTES_PER_PAGE) {
+      unsigned long pfn = virt2pfn(vaddr);
+      pte_t pte = get_page_flags(vaddr);
+
+      unmap_large_page(vaddr);
+      map_large_page(vaddr, pfn, (pte & ~PT_PROTECTMASK) | flags);
+      vaddr += LARGEPAGESIZE;
+      i += PTES_PER_PAGE - 1;
+      continue;
+    }
+
     if (page_mapped(vaddr)) {
-      set_page_flags(vaddr, (get_page_flags(vaddr) & ~PT_PROTECTMASK) | flags);
+      set_page_flags(vaddr, (get_page_flags(vaddr) & ~(PT_PROTECTMASK | PT_COW)) | cow_protect(vaddr, flags));
     }
     vaddr += PAGESIZE;
   }
@@ -405,6 +488,31 @@ int vmprotect(void *addr, unsigned long size, int protect) {
   return 0;
 }
 
+void *vmclone(void *addr, unsigned long size, int *rc) {
+  int pages = PAGES(size);
+  void *clone;
+
+  if (rc) *rc = 0;
+  if (size == 0) {
+    if (rc) *rc = -EINVAL;
+    return NULL;
+  }
+  addr = (void *) PAGEADDR(addr);
+  if (!valid_range(addr, size)) {
+    if (rc) *rc = -EFAULT;
+    return NULL;
+  }
+
+  clone = (void *) PTOB(rmap_alloc(vmap, pages));
+  if (clone == NULL) {
+    if (rc) *rc = -ENOMEM;
+    return NULL;
+  }
+
+  clone_pages(clone, addr, pages);
+  return clone;
+}
+
 int vmlock(void *addr, unsigned long size) {
   return -ENOSYS;
 }
@@ -464,6 +572,36 @@ int guard_page_handler(void *addr) {
   return 0;
 }
 
+int cow_page_handler(void *addr) {
+  pte_t flags = get_page_flags(addr);
+  unsigned long pfn = virt2pfn(addr);
+  unsigned long newpfn;
+
+  if ((flags & (PT_PRESENT | PT_COW)) != (PT_PRESENT | PT_COW)) return -EFAULT;
+  cow_faults++;
+
+  // If this is the last mapping of the page frame just make it writable
+  flags = (flags & ~PT_COW) | PT_WRITABLE;
+  if (pfdb[pfn].shares == 0) {
+    set_page_flags(addr, flags);
+    return 0;
+  }
+
+  // Copy the shared page to a new private page frame
+  newpfn = alloc_pageframe(pfdb[pfn].tag);
+  if (newpfn == 0xFFFFFFFF) return -ENOMEM;
+
+  map_page(cowwin, newpfn, PT_WRITABLE | PT_PRESENT);
+  memcpy(cowwin, addr, PAGESIZE);
+  unmap_page(cowwin);
+
+  pfdb[pfn].shares--;
+  map_page(addr, newpfn, flags);
+  cow_copies++;
+
+  return 0;
+}
+
 int fetch_page(void *addr) {
   struct filemap *fm;
   int rc;
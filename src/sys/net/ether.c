@@ -37,6 +37,8 @@
 static const struct eth_addr ethbroadcast = {{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}};
 struct queue *ether_queue;
 
+static struct ratelimit ether_errors = KLOG_RATELIMIT(5 * HZ, 10);
+
 struct ether_msg {
   struct pbuf *p;
   struct netif *netif;
@@ -219,7 +221,7 @@ err_t ether_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipaddr)
     // Queue packet for transmission, when the ARP reply returns
     err = arp_queue(netif, p, queryaddr);
     if (err < 0) {
-      kprintf(KERN_ERR "ether: error %d queueing packet\n", err);
+      if (klog_ratelimit(&ether_errors)) kprintf(KERN_ERR "ether: error %d queueing packet\n", err);
       stats.link.drop++;
       stats.link.memerr++;
       return err;
@@ -250,7 +252,7 @@ err_t ether_output(struct netif *netif, struct pbuf *p, struct ip_addr *ipaddr)
   } else {
     err = dev_transmit((dev_t) netif->state, p);
     if (err < 0) {
-      kprintf(KERN_ERR "ether: error %d sending packet\n", err);
+      if (klog_ratelimit(&ether_errors)) kprintf(KERN_ERR "ether: error %d sending packet\n", err);
       return err;
     }
   }
@@ -271,7 +273,7 @@ err_t ether_input(struct netif *netif, struct pbuf *p) {
   if ((netif->flags & NETIF_UP) == 0) return -ENETDOWN;
 
   if (p->len < ETHER_HLEN) {
-    kprintf("ether: Packet dropped due to too short packet %d %s\n", p->len, netif->name);
+    if (klog_ratelimit(&ether_errors)) kprintf("ether: Packet dropped due to too short packet %d %s\n", p->len, netif->name);
     stats.link.lenerr++;
     stats.link.drop++;
     return -EINVAL;
@@ -284,7 +286,7 @@ err_t ether_input(struct netif *netif, struct pbuf *p) {
   msg->netif = netif;
 
   if (enqueue(ether_queue, msg, 0) < 0) {
-    if (!debugging) kprintf("ether: drop (queue full)\n");
+    if (!debugging && klog_ratelimit(&ether_errors)) kprintf("ether: drop (queue full)\n");
     kfree(msg);
     stats.link.memerr++;
     stats.link.drop++;
@@ -70,16 +70,79 @@ __declspec(naked) int syscall_int48(int syscallno, void *params) {
   }
 }
 
+//
+// Register based syscalls
+//
+// Syscalls with no more than three parameters pass these in ebx, esi, and
+// edi. This saves the kernel from validating a parameter block on the user
+// stack.
+//
+
+static __declspec(naked) int regsyscall(int syscallno, int arg1, int arg2, int arg3) {
+  __asm {
+    // Save registers below ebp, since sysexit returns with esp set to ebp
+    push  ebx
+    push  esi
+    push  edi
+    push  ebp
+    mov   ebp, esp
+
+    mov   eax, 20[ebp]
+    or    eax, SYSCALL_REGARGS
+    mov   ebx, 24[ebp]
+    mov   esi, 28[ebp]
+    mov   edi, 32[ebp]
+    mov   ecx, offset regsys_return
+
+    sysenter
+
+regsys_return:
+    pop   ebp
+    pop   edi
+    pop   esi
+    pop   ebx
+    ret
+  }
+}
+
+static __declspec(naked) int regsyscall_int48(int syscallno, int arg1, int arg2, int arg3) {
+  __asm {
+    push  ebp
+    mov   ebp, esp
+    push  ebx
+    push  esi
+    push  edi
+
+    mov   eax, 8[ebp]
+    or    eax, SYSCALL_REGARGS
+    mov   ebx, 12[ebp]
+    mov   esi, 16[ebp]
+    mov   edi, 20[ebp]
+
+    int   48
+
+    pop   edi
+    pop   esi
+    pop   ebx
+    leave
+    ret
+  }
+}
+
+static void patch_syscall(void *func, void *target) {
+  // Inject a 'JMP target' at the entry of func
+  char *sc = (char *) func;
+  char *tc = (char *) target;
+  sc[0] = 0xEB;
+  sc[1] = (tc - sc - 2);
+}
+
 void init_syscall() {
   // If the processor does not support sysenter patch the 
-  // syscall routine with a jump to syscall_int48
-
+  // syscall routines with a jump to the int 48 versions
   if (!getpeb()->fast_syscalls_supported) {
-    // Inject a 'JMP syscall_int48' at the entry of syscall
-    char *sc = (char *) syscall;
-    char *sc48 = (char *) syscall_int48;
-    sc[0] = 0xEB;
-    sc[1] = (sc48 - sc - 2);
+    patch_syscall(syscall, syscall_int48);
+    patch_syscall(regsyscall, regsyscall_int48);
   }
 }
 
@@ -157,19 +220,19 @@ handle_t open(const char *name, int flags, ...) {
 }
 
 int close(handle_t h) {
-  return syscall(SYSCALL_CLOSE, &h);
+  return regsyscall(SYSCALL_CLOSE, h, 0, 0);
 }
 
 int fsync(handle_t f) {
-  return syscall(SYSCALL_FSYNC, &f);
+  return regsyscall(SYSCALL_FSYNC, f, 0, 0);
 }
 
 int read(handle_t f, void *data, size_t size) {
-  return syscall(SYSCALL_READ, &f);
+  return regsyscall(SYSCALL_READ, f, (int) data, size);
 }
 
 int write(handle_t f, const void *data, size_t size) {
-  return syscall(SYSCALL_WRITE, &f);
+  return regsyscall(SYSCALL_WRITE, f, (int) data, size);
 }
 
 int pread(handle_t f, void *data, size_t size, off64_t offset) {
@@ -185,11 +248,11 @@ int ioctl(handle_t f, int cmd, const void *data, size_t size) {
 }
 
 int readv(handle_t f, const struct iovec *iov, int count) {
-  return syscall(SYSCALL_READV, &f);
+  return regsyscall(SYSCALL_READV, f, (int) iov, count);
 }
 
 int writev(handle_t f, const struct iovec *iov, int count) {
-  return syscall(SYSCALL_WRITEV, &f);
+  return regsyscall(SYSCALL_WRITEV, f, (int) iov, count);
 }
 
 /*static*/ loff_t _tell(handle_t f, off64_t *retval) {
@@ -374,16 +437,20 @@ int vmsync(void *addr, unsigned long size) {
   return syscall(SYSCALL_VMSYNC, &addr);
 }
 
+void *vmclone(void *addr, unsigned long size) {
+  return (void *) syscall(SYSCALL_VMCLONE, &addr);
+}
+
 int waitone(handle_t h, int timeout) {
-  return syscall(SYSCALL_WAITONE, &h);
+  return regsyscall(SYSCALL_WAITONE, h, timeout, 0);
 }
 
 int waitall(handle_t *h, int count, int timeout) {
-  return syscall(SYSCALL_WAITALL, &h);
+  return regsyscall(SYSCALL_WAITALL, (int) h, count, timeout);
 }
 
 int waitany(handle_t *h, int count, int timeout) {
-  return syscall(SYSCALL_WAITANY, &h);
+  return regsyscall(SYSCALL_WAITANY, (int) h, count, timeout);
 }
 
 handle_t mkevent(int manual_reset, int initial_state) {
@@ -391,15 +458,15 @@ handle_t mkevent(int manual_reset, int initial_state) {
 }
 
 int epulse(handle_t h) {
-  return syscall(SYSCALL_EPULSE, &h);
+  return regsyscall(SYSCALL_EPULSE, h, 0, 0);
 }
 
 int eset(handle_t h) {
-  return syscall(SYSCALL_ESET, &h);
+  return regsyscall(SYSCALL_ESET, h, 0, 0);
 }
 
 int ereset(handle_t h) {
-  return syscall(SYSCALL_ERESET, &h);
+  return regsyscall(SYSCALL_ERESET, h, 0, 0);
 }
 
 void exitos(int mode) {
@@ -407,15 +474,62 @@ void exitos(int mode) {
 }
 
 handle_t dup(handle_t h) {
-  return syscall(SYSCALL_DUP, &h);
+  return regsyscall(SYSCALL_DUP, h, 0, 0);
+}
+
+static __declspec(naked) unsigned __int64 read_tsc() {
+  __asm {
+    rdtsc
+    ret
+  }
 }
 
 time_t time(time_t *timeptr) {
-  return syscall(SYSCALL_TIME, &timeptr);
+  struct timepage *tp = (struct timepage *) TIMEPAGE_ADDRESS;
+  time_t t;
+
+  t = *(volatile time_t *) &tp->tv_sec;
+  if (timeptr) *timeptr = t;
+  return t;
 }
 
 int gettimeofday(struct timeval *tv, void *tzp) {
-  return syscall(SYSCALL_GETTIMEOFDAY, &tv);
+  volatile struct timepage *tp = (volatile struct timepage *) TIMEPAGE_ADDRESS;
+  unsigned long seqno;
+  unsigned long elapsed;
+  unsigned long cycles_per_usec;
+  unsigned __int64 tsc;
+  unsigned long cycles_per_tick;
+  long usec;
+
+  if (!tv) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Take a consistent snapshot of the time page
+  do {
+    seqno = tp->seqno;
+    tv->tv_sec = tp->tv_sec;
+    usec = tp->tv_usec;
+    tsc = tp->tsc;
+    cycles_per_tick = tp->cycles_per_tick;
+  } while ((seqno & 1) || seqno != tp->seqno);
+
+  // Interpolate time since last timer tick using the time stamp counter
+  cycles_per_usec = cycles_per_tick / tp->usecs_per_tick;
+  if (cycles_per_usec > 0) {
+    elapsed = (unsigned long) (read_tsc() - tsc) / cycles_per_usec;
+    if (elapsed >= tp->usecs_per_tick) elapsed = tp->usecs_per_tick - 1;
+    usec += elapsed;
+    if (usec >= 1000000) {
+      tv->tv_sec++;
+      usec -= 1000000;
+    }
+  }
+  tv->tv_usec = usec;
+
+  return 0;
 }
 
 int settimeofday(struct timeval *tv) {
@@ -423,7 +537,7 @@ int settimeofday(struct timeval *tv) {
 }
 
 clock_t clock() {
-  return syscall(SYSCALL_CLOCK, NULL);
+  return ((volatile struct timepage *) TIMEPAGE_ADDRESS)->clocks;
 }
 
 handle_t mksem(int initial_count) {
@@ -431,11 +545,11 @@ handle_t mksem(int initial_count) {
 }
 
 int semrel(handle_t h, int count) {
-  return syscall(SYSCALL_SEMREL, &h);
+  return regsyscall(SYSCALL_SEMREL, h, count, 0);
 }
 
 int accept(int s, struct sockaddr *addr, int *addrlen) {
-  return syscall(SYSCALL_ACCEPT, &s);
+  return regsyscall(SYSCALL_ACCEPT, s, (int) addr, (int) addrlen);
 }
 
 int bind(int s, const struct sockaddr *name, int namelen) {
@@ -459,7 +573,7 @@ int getsockopt(int s, int level, int optname, void *optval, int *optlen) {
 }
 
 int listen(int s, int backlog) {
-  return syscall(SYSCALL_LISTEN, &s);
+  return regsyscall(SYSCALL_LISTEN, s, backlog, 0);
 }
 
 int recv(int s, void *data, int size, unsigned int flags) {
@@ -503,11 +617,11 @@ int dispatch(handle_t iomux, handle_t h, int events, int context) {
 }
 
 int recvmsg(int s, struct msghdr *hdr, unsigned int flags) {
-  return syscall(SYSCALL_RECVMSG, (void *) &s);
+  return regsyscall(SYSCALL_RECVMSG, s, (int) hdr, flags);
 }
 
 int sendmsg(int s, struct msghdr *hdr, unsigned int flags) {
-  return syscall(SYSCALL_SENDMSG, (void *) &s);
+  return regsyscall(SYSCALL_SENDMSG, s, (int) hdr, flags);
 }
 
 int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct timeval *timeout) {
@@ -518,6 +632,10 @@ int pipe(handle_t fildes[2]) {
   return syscall(SYSCALL_PIPE, (void *) &fildes);
 }
 
+int splice(handle_t in, handle_t out, size_t size, int flags) {
+  return syscall(SYSCALL_SPLICE, &in);
+}
+
 handle_t dup2(handle_t h1, handle_t h2) {
   return syscall(SYSCALL_DUP2, (void *) &h1);
 }
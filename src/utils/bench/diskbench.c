@@ -0,0 +1,209 @@
+//
+// diskbench.c
+//
+// Block device I/O benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <os/dev.h>
+
+#define SECTORSIZE         512
+#define DEFAULT_BLKSIZE    4096
+#define DEFAULT_DEPTH      1
+#define DEFAULT_OPS        10000
+#define MAX_DEPTH          32
+
+struct job {
+  int dev;                   // Device handle
+  int write;                 // Write instead of read
+  int random;                // Random instead of sequential offsets
+  int blksize;               // Transfer size
+  int ops;                   // Number of operations
+  unsigned long blocks;      // Number of blocks on device
+  unsigned long seed;        // Random generator state
+  unsigned long next;        // Next block for sequential access
+  char *buffer;              // Transfer buffer
+  double latency;            // Total latency for job
+  int errors;                // Number of failed operations
+};
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static unsigned long next_block(struct job *job) {
+  unsigned long blk;
+
+  if (job->random) {
+    job->seed = job->seed * 1103515245 + 12345;
+    blk = (job->seed >> 8) % job->blocks;
+  } else {
+    blk = job->next;
+    if (++job->next == job->blocks) job->next = 0;
+  }
+
+  return blk;
+}
+
+static void __stdcall worker(void *arg) {
+  struct job *job = (struct job *) arg;
+  double start;
+  off64_t offset;
+  int i;
+  int rc;
+
+  for (i = 0; i < job->ops; i++) {
+    offset = (off64_t) next_block(job) * job->blksize;
+    start = now();
+    if (job->write) {
+      rc = pwrite(job->dev, job->buffer, job->blksize, offset);
+    } else {
+      rc = pread(job->dev, job->buffer, job->blksize, offset);
+    }
+    job->latency += now() - start;
+    if (rc != job->blksize) job->errors++;
+  }
+}
+
+static void usage() {
+  fprintf(stderr, "usage: diskbench [options] device\n");
+  fprintf(stderr, "  -w        write instead of read (destroys data on device)\n");
+  fprintf(stderr, "  -r        random instead of sequential offsets\n");
+  fprintf(stderr, "  -b SIZE   block size in bytes (default %d)\n", DEFAULT_BLKSIZE);
+  fprintf(stderr, "  -q DEPTH  number of outstanding requests (default %d)\n", DEFAULT_DEPTH);
+  fprintf(stderr, "  -n OPS    number of operations per request stream (default %d)\n", DEFAULT_OPS);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct job jobs[MAX_DEPTH];
+  handle_t threads[MAX_DEPTH];
+  char *devname = NULL;
+  int write = 0;
+  int random = 0;
+  int blksize = DEFAULT_BLKSIZE;
+  int depth = DEFAULT_DEPTH;
+  int ops = DEFAULT_OPS;
+  int sectors;
+  int dev;
+  int errors;
+  int total;
+  double start, elapsed, latency;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-w") == 0) {
+      write = 1;
+    } else if (strcmp(argv[i], "-r") == 0) {
+      random = 1;
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      blksize = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+      depth = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      ops = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && !devname) {
+      devname = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (!devname || blksize <= 0 || blksize % SECTORSIZE != 0) usage();
+  if (depth < 1 || depth > MAX_DEPTH || ops <= 0) usage();
+
+  dev = open(devname, write ? O_RDWR : O_RDONLY);
+  if (dev < 0) {
+    perror(devname);
+    return 1;
+  }
+  sectors = ioctl(dev, IOCTL_GETDEVSIZE, NULL, 0);
+  if (sectors <= 0) {
+    fprintf(stderr, "%s: unable to get device size\n", devname);
+    return 1;
+  }
+
+  // Each request stream works on its own buffer and part of the device
+  memset(jobs, 0, sizeof(jobs));
+  for (i = 0; i < depth; i++) {
+    jobs[i].dev = dev;
+    jobs[i].write = write;
+    jobs[i].random = random;
+    jobs[i].blksize = blksize;
+    jobs[i].ops = ops;
+    jobs[i].blocks = (unsigned long) sectors / (blksize / SECTORSIZE);
+    jobs[i].seed = 4711 + i;
+    jobs[i].next = jobs[i].blocks / depth * i;
+    jobs[i].buffer = vmalloc(NULL, blksize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, 'BNCH');
+    if (!jobs[i].buffer) {
+      fprintf(stderr, "diskbench: out of memory\n");
+      return 1;
+    }
+    memset(jobs[i].buffer, 0xA5, blksize);
+  }
+
+  // Run request streams in parallel to keep the device queue filled
+  start = now();
+  for (i = 0; i < depth; i++) {
+    threads[i] = beginthread(worker, 0, &jobs[i], CREATE_SUSPENDED, "diskbench", NULL);
+  }
+  for (i = 0; i < depth; i++) resume(threads[i]);
+  for (i = 0; i < depth; i++) {
+    waitone(threads[i], INFINITE);
+    close(threads[i]);
+  }
+  elapsed = now() - start;
+
+  total = 0;
+  errors = 0;
+  latency = 0.0;
+  for (i = 0; i < depth; i++) {
+    total += jobs[i].ops;
+    errors += jobs[i].errors;
+    latency += jobs[i].latency;
+    vmfree(jobs[i].buffer, blksize, MEM_RELEASE);
+  }
+  close(dev);
+
+  printf("%s: %s %s, bs=%d, qd=%d\n", devname, random ? "random" : "sequential", write ? "write" : "read", blksize, depth);
+  printf("  ops       %10d (%d errors)\n", total, errors);
+  printf("  iops      %10.0f\n", total / (elapsed / 1000000.0));
+  printf("  bandwidth %10.2f MB/s\n", (double) total * blksize / elapsed);
+  printf("  latency   %10.1f us\n", latency / total);
+
+  return 0;
+}
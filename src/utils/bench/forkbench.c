@@ -0,0 +1,133 @@
+//
+// forkbench.c
+//
+// Fork and copy-on-write clone benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_SIZE_MB    50
+#define DEFAULT_ITERATIONS 100
+
+static char *region;
+static char *copy;
+static unsigned long region_size;
+
+typedef void (*benchproc_t)();
+
+static void bench_fork_exit() {
+  int pid;
+
+  pid = vfork();
+  if (pid == 0) _exit(0);
+  waitpid(pid, NULL, 0);
+}
+
+static void bench_clone() {
+  char *clone = vmclone(region, region_size);
+  if (!clone) {
+    perror("vmclone");
+    exit(1);
+  }
+  vmfree(clone, region_size, MEM_RELEASE);
+}
+
+static void bench_clone_touch() {
+  unsigned long ofs;
+  char *clone = vmclone(region, region_size);
+  if (!clone) {
+    perror("vmclone");
+    exit(1);
+  }
+  for (ofs = 0; ofs < region_size; ofs += PAGESIZE) clone[ofs]++;
+  vmfree(clone, region_size, MEM_RELEASE);
+}
+
+static void bench_memcpy() {
+  memcpy(copy, region, region_size);
+}
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void run(char *name, benchproc_t proc, int iterations) {
+  double start, end;
+  int i;
+
+  start = now();
+  for (i = 0; i < iterations; i++) proc();
+  end = now();
+
+  printf("%-24s %10d %10.3f us/call\n", name, iterations, (end - start) / iterations);
+}
+
+int main(int argc, char *argv[]) {
+  int mb = DEFAULT_SIZE_MB;
+  int iterations = DEFAULT_ITERATIONS;
+
+  if (argc > 1) mb = atoi(argv[1]);
+  if (argc > 2) iterations = atoi(argv[2]);
+  if (mb <= 0 || iterations <= 0) {
+    fprintf(stderr, "usage: forkbench [MB] [ITERATIONS]\n");
+    return 1;
+  }
+
+  region_size = mb * 1024 * 1024;
+  region = vmalloc(NULL, region_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, 'BNCH');
+  copy = vmalloc(NULL, region_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, 'BNCH');
+  if (!region || !copy) {
+    fprintf(stderr, "forkbench: unable to allocate %d MB\n", mb);
+    return 1;
+  }
+  memset(region, 0xAA, region_size);
+
+  printf("region size: %d MB\n", mb);
+  printf("benchmark                 iterations    latency\n");
+  printf("------------------------ ---------- ----------\n");
+
+  run("fork+exit", bench_fork_exit, iterations);
+  run("cow clone+free", bench_clone, iterations);
+  run("cow clone+touch+free", bench_clone_touch, iterations);
+  run("memcpy", bench_memcpy, iterations);
+
+  vmfree(copy, region_size, MEM_RELEASE);
+  vmfree(region, region_size, MEM_RELEASE);
+  return 0;
+}
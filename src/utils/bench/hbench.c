@@ -0,0 +1,291 @@
+//
+// hbench.c
+//
+// HTTP server load generator
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+#define DEFAULT_PORT        80
+#define DEFAULT_REQUESTS    1000
+#define DEFAULT_CONNECTIONS 1
+#define DEFAULT_DEPTH       8
+#define MAX_CONNECTIONS     64
+
+#define BUFSIZE             (64 * 1024)
+
+struct client {
+  struct sockaddr_in addr;
+  char *request;
+  int reqlen;
+  int requests;
+  int depth;
+  int completed;
+  int errors;
+  int bytes;
+};
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static int read_response(int s, char *buf, int *len) {
+  char *p;
+  char *hdrend;
+  int content_length;
+  int total;
+  int left;
+  int n;
+
+  // Read until the end of the response header
+  while (1) {
+    buf[*len] = 0;
+    hdrend = strstr(buf, "\r\n\r\n");
+    if (hdrend) break;
+    if (*len == BUFSIZE - 1) return -1;
+    n = recv(s, buf + *len, BUFSIZE - 1 - *len, 0);
+    if (n <= 0) return -1;
+    *len += n;
+  }
+  hdrend += 4;
+
+  // Get content length
+  content_length = -1;
+  p = buf;
+  while (p < hdrend) {
+    if (strnicmp(p, "Content-Length:", 15) == 0) {
+      content_length = atoi(p + 15);
+      break;
+    }
+    p = strchr(p, '\n');
+    if (!p) break;
+    p++;
+  }
+  if (content_length < 0) return -1;
+  if (strncmp(buf + 9, "304", 3) == 0) content_length = 0;
+
+  // Keep data for next response in buffer if the body has been received
+  total = (hdrend - buf) + content_length;
+  if (*len >= total) {
+    n = *len - total;
+    memmove(buf, buf + total, n);
+    *len = n;
+    return total;
+  }
+
+  // Skip rest of response body
+  left = total - *len;
+  *len = 0;
+  while (left > 0) {
+    n = recv(s, buf, BUFSIZE - 1, 0);
+    if (n <= 0) return -1;
+    if (n > left) {
+      memmove(buf, buf + left, n - left);
+      *len = n - left;
+      left = 0;
+    } else {
+      left -= n;
+    }
+  }
+
+  return total;
+}
+
+static void __stdcall client_thread(void *arg) {
+  struct client *c = (struct client *) arg;
+  char *buf;
+  char *batch;
+  int len;
+  int s;
+  int i;
+  int n;
+  int rc;
+
+  buf = (char *) malloc(BUFSIZE);
+  batch = (char *) malloc(c->reqlen * c->depth);
+  if (!buf || !batch) {
+    c->errors++;
+    return;
+  }
+  for (i = 0; i < c->depth; i++) memcpy(batch + i * c->reqlen, c->request, c->reqlen);
+
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0 || connect(s, (struct sockaddr *) &c->addr, sizeof(c->addr)) < 0) {
+    c->errors++;
+    if (s >= 0) close(s);
+    free(buf);
+    free(batch);
+    return;
+  }
+
+  len = 0;
+  while (c->completed < c->requests) {
+    // Send a batch of requests without waiting for the responses
+    n = c->requests - c->completed;
+    if (n > c->depth) n = c->depth;
+    if (send(s, batch, n * c->reqlen, 0) != n * c->reqlen) {
+      c->errors++;
+      break;
+    }
+
+    // Read responses
+    for (i = 0; i < n; i++) {
+      rc = read_response(s, buf, &len);
+      if (rc < 0) {
+        c->errors++;
+        break;
+      }
+      c->bytes += rc;
+      c->completed++;
+    }
+    if (i < n) break;
+  }
+
+  close(s);
+  free(buf);
+  free(batch);
+}
+
+static void run(struct client *clients, int connections, int requests, int depth) {
+  handle_t threads[MAX_CONNECTIONS];
+  double start;
+  double elapsed;
+  int completed = 0;
+  int errors = 0;
+  int bytes = 0;
+  int i;
+
+  start = now();
+  for (i = 0; i < connections; i++) {
+    clients[i].requests = requests / connections;
+    clients[i].depth = depth;
+    clients[i].completed = 0;
+    clients[i].errors = 0;
+    clients[i].bytes = 0;
+    threads[i] = beginthread(client_thread, 0, &clients[i], 0, "hbench", NULL);
+  }
+  for (i = 0; i < connections; i++) {
+    if (threads[i] >= 0) {
+      waitone(threads[i], INFINITE);
+      close(threads[i]);
+    }
+    completed += clients[i].completed;
+    errors += clients[i].errors;
+    bytes += clients[i].bytes;
+  }
+  elapsed = now() - start;
+
+  printf("depth %2d: %d requests in %.3f s, %.1f requests/s, %.1f KB/s, %d errors\n",
+         depth, completed, elapsed / 1000000.0,
+         completed * 1000000.0 / elapsed, bytes * 1000000.0 / elapsed / 1024, errors);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: hbench [options] host[:port] [path]\n");
+  fprintf(stderr, "  -c CONNS   number of concurrent connections (default %d)\n", DEFAULT_CONNECTIONS);
+  fprintf(stderr, "  -n REQS    total number of requests (default %d)\n", DEFAULT_REQUESTS);
+  fprintf(stderr, "  -p DEPTH   number of pipelined requests per connection (default %d)\n", DEFAULT_DEPTH);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  struct client clients[MAX_CONNECTIONS];
+  struct sockaddr_in addr;
+  struct hostent *hp;
+  char request[1024];
+  char *host = NULL;
+  char *path = "/";
+  char *p;
+  int port = DEFAULT_PORT;
+  int connections = DEFAULT_CONNECTIONS;
+  int requests = DEFAULT_REQUESTS;
+  int depth = DEFAULT_DEPTH;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      connections = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      requests = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      depth = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && !host) {
+      host = argv[i];
+    } else if (argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (!host || connections < 1 || connections > MAX_CONNECTIONS || requests < connections || depth < 1) usage();
+
+  // Resolve server address
+  p = strchr(host, ':');
+  if (p) {
+    *p++ = 0;
+    port = atoi(p);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  hp = gethostbyname(host);
+  if (hp) {
+    memcpy(&addr.sin_addr, hp->h_addr, hp->h_length);
+  } else {
+    addr.sin_addr.s_addr = inet_addr(host);
+    if (addr.sin_addr.s_addr == INADDR_NONE) {
+      fprintf(stderr, "hbench: unknown host %s\n", host);
+      return 1;
+    }
+  }
+
+  if (strlen(path) + strlen(host) > sizeof(request) - 64) usage();
+  sprintf(request, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: Keep-Alive\r\n\r\n", path, host);
+
+  for (i = 0; i < connections; i++) {
+    memcpy(&clients[i].addr, &addr, sizeof(addr));
+    clients[i].request = request;
+    clients[i].reqlen = strlen(request);
+  }
+
+  printf("%s:%d%s: %d requests on %d connection(s)\n", host, port, path, requests, connections);
+  run(clients, connections, requests, 1);
+  if (depth > 1) run(clients, connections, requests, depth);
+
+  return 0;
+}
@@ -0,0 +1,175 @@
+//
+// logbench.c
+//
+// Log append benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DEFAULT_FILES      8
+#define DEFAULT_RECSIZE    200
+#define DEFAULT_RECORDS    20000
+#define MAX_FILES          64
+
+struct iostat {
+  int blocks;                // Blocks written to device
+  int ios;                   // Write requests issued to device
+};
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static int get_iostat(char *devname, struct iostat *st) {
+  FILE *f;
+  char line[256];
+  char name[64];
+  int reads, writes, lookups, hits, alloc, freed, update, lazy, sync, ios;
+
+  // Find the buffer pool statistics for the device
+  f = fopen("/proc/bufstats", "r");
+  if (!f) return -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%63s %d %d %d %d%% %d %d %d %d %d %d", name, &reads, &writes, &lookups, &hits, &alloc, &freed, &update, &lazy, &sync, &ios) != 11) continue;
+    if (strcmp(name, devname) == 0) {
+      st->blocks = writes;
+      st->ios = ios;
+      fclose(f);
+      return 0;
+    }
+  }
+  fclose(f);
+  return -1;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: logbench [options] directory\n");
+  fprintf(stderr, "  -f FILES  number of log files appended to in turn (default %d)\n", DEFAULT_FILES);
+  fprintf(stderr, "  -s SIZE   record size in bytes (default %d)\n", DEFAULT_RECSIZE);
+  fprintf(stderr, "  -n RECS   total number of records (default %d)\n", DEFAULT_RECORDS);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int fd[MAX_FILES];
+  char path[MAXPATH];
+  char *dir = NULL;
+  char *devname;
+  char *record;
+  int files = DEFAULT_FILES;
+  int recsize = DEFAULT_RECSIZE;
+  int records = DEFAULT_RECORDS;
+  struct statfs fs;
+  struct iostat before, after;
+  int extents, maxextents, blocks;
+  double start, elapsed;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      files = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      recsize = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      records = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && !dir) {
+      dir = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (!dir || files < 1 || files > MAX_FILES || recsize <= 0 || records <= 0) usage();
+
+  if (statfs(dir, &fs) < 0) {
+    perror(dir);
+    return 1;
+  }
+  devname = fs.mntfrom;
+  if (strncmp(devname, "/dev/", 5) == 0) devname += 5;
+
+  record = malloc(recsize);
+  if (!record) {
+    fprintf(stderr, "logbench: out of memory\n");
+    return 1;
+  }
+  memset(record, 'x', recsize);
+  record[recsize - 1] = '\n';
+
+  for (i = 0; i < files; i++) {
+    sprintf(path, "%s/log%d.dat", dir, i);
+    fd[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd[i] < 0) {
+      perror(path);
+      return 1;
+    }
+  }
+
+  // Interleave small appends to all log files and sync at the end
+  if (get_iostat(devname, &before) < 0) memset(&before, 0, sizeof(struct iostat));
+  start = now();
+  for (i = 0; i < records; i++) {
+    if (write(fd[i % files], record, recsize) != recsize) {
+      perror("write");
+      return 1;
+    }
+  }
+  fsync(fd[0]);
+  elapsed = now() - start;
+  if (get_iostat(devname, &after) < 0) memset(&after, 0, sizeof(struct iostat));
+
+  // Count the extents each log file ended up in
+  extents = 0;
+  maxextents = 0;
+  for (i = 0; i < files; i++) {
+    int n = ioctl(fd[i], FIOEXTENTS, NULL, 0);
+    if (n > 0) {
+      extents += n;
+      if (n > maxextents) maxextents = n;
+    }
+    close(fd[i]);
+  }
+
+  blocks = after.blocks - before.blocks;
+  printf("%s: %d files, %d records of %d bytes\n", dir, files, records, recsize);
+  printf("  throughput %10.2f MB/s\n", (double) records * recsize / elapsed);
+  printf("  extents    %10.1f per file (max %d)\n", (double) extents / files, maxextents);
+  printf("  blocks     %10d written to %s\n", blocks, devname);
+  printf("  write ios  %10d (%.1f blocks per request)\n", after.ios - before.ios, after.ios > before.ios ? (double) blocks / (after.ios - before.ios) : 0.0);
+
+  free(record);
+  return 0;
+}
@@ -0,0 +1,191 @@
+//
+// pipebench.c
+//
+// Pipe throughput benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DEFAULT_SIZE_MB    64
+#define DATAFILE           "pipebench.dat"
+#define READ_BUFSIZE       4096
+#define FILE_BUFSIZE       (64 * 1024)
+
+struct producer {
+  handle_t pipe;             // Write end of pipe
+  handle_t file;             // Data file for cat benchmarks
+  int chunk;                 // Write size
+  unsigned long total;       // Bytes to write
+  int splice;                // Use splice() instead of read()/write()
+};
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void __stdcall produce(void *arg) {
+  struct producer *p = (struct producer *) arg;
+  unsigned long left = p->total;
+  char *buffer;
+  int bytes;
+  int rc;
+
+  buffer = malloc(FILE_BUFSIZE);
+  memset(buffer, 'x', FILE_BUFSIZE);
+  for (bytes = 79; bytes < FILE_BUFSIZE; bytes += 80) buffer[bytes] = '\n';
+
+  if (p->file != NOHANDLE) lseek(p->file, 0, SEEK_SET);
+  while (left > 0) {
+    bytes = left < (unsigned long) p->chunk ? left : p->chunk;
+    if (p->splice) {
+      rc = splice(p->file, p->pipe, bytes, 0);
+    } else if (p->file != NOHANDLE) {
+      rc = read(p->file, buffer, bytes);
+      if (rc > 0) rc = write(p->pipe, buffer, rc);
+    } else {
+      rc = write(p->pipe, buffer, bytes);
+    }
+    if (rc <= 0) break;
+    left -= rc;
+  }
+
+  close(p->pipe);
+  free(buffer);
+}
+
+static void run(char *name, handle_t file, int chunk, unsigned long total, int splice, int pipesize) {
+  struct producer p;
+  handle_t fildes[2];
+  handle_t thread;
+  char buffer[READ_BUFSIZE];
+  unsigned long bytes;
+  unsigned long lines;
+  double start, elapsed;
+  int rc;
+  int i;
+
+  if (pipe(fildes) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  if (pipesize > 0) {
+    unsigned long size = pipesize;
+    ioctl(fildes[1], PIPE_SETSIZE, &size, sizeof(size));
+  }
+
+  p.pipe = fildes[1];
+  p.file = file;
+  p.chunk = chunk;
+  p.total = total;
+  p.splice = splice;
+
+  // Count bytes and lines like wc while the producer fills the pipe
+  start = now();
+  thread = beginthread(produce, 0, &p, 0, "producer", NULL);
+  bytes = lines = 0;
+  while ((rc = read(fildes[0], buffer, READ_BUFSIZE)) > 0) {
+    bytes += rc;
+    for (i = 0; i < rc; i++) if (buffer[i] == '\n') lines++;
+  }
+  waitone(thread, INFINITE);
+  elapsed = now() - start;
+  close(thread);
+  close(fildes[0]);
+
+  printf("%-28s %6d %8.1f MB/s %10lu lines%s\n", name, chunk, bytes / elapsed, lines, bytes != total ? " (short)" : "");
+}
+
+static handle_t make_datafile(unsigned long total) {
+  handle_t f;
+  char *buffer;
+  unsigned long left;
+  int bytes;
+
+  f = open(DATAFILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (f < 0) return NOHANDLE;
+
+  buffer = malloc(FILE_BUFSIZE);
+  memset(buffer, 'x', FILE_BUFSIZE);
+  for (bytes = 79; bytes < FILE_BUFSIZE; bytes += 80) buffer[bytes] = '\n';
+  left = total;
+  while (left > 0) {
+    bytes = left < FILE_BUFSIZE ? left : FILE_BUFSIZE;
+    if (write(f, buffer, bytes) != bytes) break;
+    left -= bytes;
+  }
+  free(buffer);
+
+  return f;
+}
+
+int main(int argc, char *argv[]) {
+  int mb = DEFAULT_SIZE_MB;
+  unsigned long total;
+  handle_t file;
+
+  if (argc > 1) mb = atoi(argv[1]);
+  if (mb <= 0) {
+    fprintf(stderr, "usage: pipebench [MB]\n");
+    return 1;
+  }
+  total = mb * 1024 * 1024;
+
+  printf("transfer size: %d MB\n", mb);
+  printf("benchmark                     chunk   throughput\n");
+  printf("---------------------------- ------ ------------\n");
+
+  run("write|wc", NOHANDLE, 80, total / 16, 0, 0);
+  run("write|wc", NOHANDLE, 512, total, 0, 0);
+  run("write|wc", NOHANDLE, 4096, total, 0, 0);
+  run("write|wc", NOHANDLE, 65536, total, 0, 0);
+  run("write|wc (4K pipe)", NOHANDLE, 512, total, 0, 4096);
+  run("write|wc (1M pipe)", NOHANDLE, 512, total, 0, 1024 * 1024);
+
+  file = make_datafile(total);
+  if (file == NOHANDLE) {
+    perror(DATAFILE);
+    return 1;
+  }
+  run("cat file|wc", file, 4096, total, 0, 0);
+  run("cat file|wc", file, 65536, total, 0, 0);
+  run("splice file|wc", file, 4096, total, 1, 0);
+  run("splice file|wc", file, 65536, total, 1, 0);
+  close(file);
+  unlink(DATAFILE);
+
+  return 0;
+}
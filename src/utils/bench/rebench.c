@@ -0,0 +1,236 @@
+//
+// rebench.c
+//
+// Regular expression matching benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+#include <sys/time.h>
+
+#define DEFAULT_VOLUME  (8 * 1024 * 1024)
+
+static char *patterns[] = {
+  "timeout",
+  "connection (refused|reset)",
+  "^[0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+ .* 404 ",
+  "GET /[a-z]+/[a-z0-9_]+\\.(html|css|js) ",
+  "(ERROR|WARN).*user=[a-z]+[0-9]",
+  "[[:<:]]sess[a-z]*=[0-9a-f]+[[:>:]]",
+  "\"[^\"]*Mozilla[^\"]*\"$",
+  "x+y+z+",
+  NULL
+};
+
+static char *methods[] = {"GET", "GET", "GET", "POST", "HEAD"};
+static char *dirs[] = {"index", "static", "images", "api", "docs", "user"};
+static char *exts[] = {"html", "css", "js", "png", "gif", "txt"};
+static char *levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+static char *messages[] = {
+  "request completed", "cache miss for key", "connection refused by peer",
+  "read timeout after 30s", "session started", "connection reset", "disk flush done",
+};
+static char *agents[] = {"Mozilla/5.0 (X11)", "curl/7.29", "Mozilla/4.0 (compatible)", "Wget/1.14"};
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+#define PICK(a) (a[rand() % (sizeof(a) / sizeof(a[0]))])
+
+static char *generate(int volume) {
+  char *buf;
+  char *p;
+  char *end;
+
+  // Mix of web server access log lines and application log lines
+  buf = (char *) malloc(volume + 512);
+  if (!buf) return NULL;
+  p = buf;
+  end = buf + volume;
+  while (p < end) {
+    if (rand() % 3) {
+      p += sprintf(p, "%d.%d.%d.%d - - [12/Mar/2013:10:%02d:%02d] \"%s /%s/%s%d.%s HTTP/1.1\" %d %d \"-\" \"%s\"\n",
+                   rand() % 256, rand() % 256, rand() % 256, rand() % 256, rand() % 60, rand() % 60,
+                   PICK(methods), PICK(dirs), PICK(dirs), rand() % 100, PICK(exts),
+                   rand() % 10 ? 200 : 404, rand() % 50000, PICK(agents));
+    } else {
+      p += sprintf(p, "2013-03-12 10:%02d:%02d %s [worker%d] %s user=%s%d sessid=%x\n",
+                   rand() % 60, rand() % 60, PICK(levels), rand() % 8, PICK(messages),
+                   PICK(dirs), rand() % 10, rand());
+    }
+  }
+  *p = 0;
+
+  return buf;
+}
+
+static char *readfile(char *filename) {
+  FILE *f;
+  char *buf;
+  int size;
+
+  f = fopen(filename, "rb");
+  if (!f) return NULL;
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buf = (char *) malloc(size + 1);
+  if (!buf || fread(buf, 1, size, f) != (size_t) size) {
+    fclose(f);
+    return NULL;
+  }
+  buf[size] = 0;
+  fclose(f);
+
+  return buf;
+}
+
+static int splitlines(char *buf, char ***lines) {
+  char *p;
+  int n;
+  int i;
+
+  n = 0;
+  for (p = buf; *p; p++) if (*p == '\n') n++;
+  *lines = (char **) malloc((n + 1) * sizeof(char *));
+  if (!*lines) return -1;
+
+  i = 0;
+  p = buf;
+  while (*p) {
+    (*lines)[i++] = p;
+    while (*p && *p != '\n') p++;
+    if (*p) *p++ = 0;
+  }
+
+  return i;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: rebench [options] [pattern...]\n");
+  fprintf(stderr, "  -f FILE   match lines from file instead of generated log\n");
+  fprintf(stderr, "  -v BYTES  size of generated log (default %d)\n", DEFAULT_VOLUME);
+  fprintf(stderr, "  -i        ignore case\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int volume = DEFAULT_VOLUME;
+  char *filename = NULL;
+  int cflags = REG_EXTENDED;
+  char **pats = patterns;
+  char *buf;
+  char **lines;
+  int nlines;
+  int bytes;
+  int i, j;
+  int matches;
+  regex_t re;
+  regmatch_t pmatch[10];
+  double start, tcomp, tmatch, tsub;
+  char errbuf[256];
+  int rc;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      filename = argv[++i];
+    } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+      volume = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-i") == 0) {
+      cflags |= REG_ICASE;
+    } else {
+      usage();
+    }
+  }
+  if (i < argc) pats = argv + i;
+
+  if (filename) {
+    buf = readfile(filename);
+    if (!buf) {
+      perror(filename);
+      return 1;
+    }
+  } else {
+    buf = generate(volume);
+    if (!buf) {
+      fprintf(stderr, "rebench: out of memory\n");
+      return 1;
+    }
+  }
+  bytes = strlen(buf);
+  nlines = splitlines(buf, &lines);
+  if (nlines < 0) {
+    fprintf(stderr, "rebench: out of memory\n");
+    return 1;
+  }
+  printf("%d lines, %d bytes\n\n", nlines, bytes);
+
+  // Each pattern is matched against every line twice, first just testing
+  // for a match and then also finding the subexpression positions
+  printf("compile us    match MB/s  submatch MB/s   matches  pattern\n");
+  for (i = 0; pats[i]; i++) {
+    start = now();
+    rc = regcomp(&re, pats[i], cflags);
+    tcomp = now() - start;
+    if (rc != 0) {
+      regerror(rc, &re, errbuf, sizeof(errbuf));
+      printf("%s: %s\n", pats[i], errbuf);
+      continue;
+    }
+
+    matches = 0;
+    start = now();
+    for (j = 0; j < nlines; j++) {
+      if (regexec(&re, lines[j], 0, NULL, 0) == 0) matches++;
+    }
+    tmatch = now() - start;
+
+    start = now();
+    for (j = 0; j < nlines; j++) {
+      regexec(&re, lines[j], 10, pmatch, 0);
+    }
+    tsub = now() - start;
+
+    if (tmatch < 1) tmatch = 1;
+    if (tsub < 1) tsub = 1;
+    printf("%10.1f  %12.1f  %13.1f  %8d  %s\n", tcomp, bytes / tmatch, bytes / tsub, matches, pats[i]);
+    regfree(&re);
+  }
+
+  return 0;
+}
@@ -0,0 +1,123 @@
+//
+// scbench.c
+//
+// System call latency benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <os/syscall.h>
+
+#define DEFAULT_ITERATIONS 1000000
+
+typedef void (*benchproc_t)();
+
+static void bench_null() {
+  syscall(SYSCALL_NULL, NULL);
+}
+
+static void bench_getpid() {
+  getpid();
+}
+
+static void bench_time() {
+  time(NULL);
+}
+
+static void bench_time_syscall() {
+  time_t *t = NULL;
+  syscall(SYSCALL_TIME, &t);
+}
+
+static void bench_gettimeofday() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+}
+
+static void bench_gettimeofday_syscall() {
+  struct timeval tv;
+  struct timeval *tvp = &tv;
+  syscall(SYSCALL_GETTIMEOFDAY, &tvp);
+}
+
+static void bench_clock() {
+  clock();
+}
+
+static void bench_close() {
+  close(-1);
+}
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void run(char *name, benchproc_t proc, int iterations) {
+  double start, end;
+  int i;
+
+  start = now();
+  for (i = 0; i < iterations; i++) proc();
+  end = now();
+
+  printf("%-24s %10d %10.3f us/call\n", name, iterations, (end - start) / iterations);
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = DEFAULT_ITERATIONS;
+
+  if (argc > 1) iterations = atoi(argv[1]);
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: scbench [ITERATIONS]\n");
+    return 1;
+  }
+
+  printf("syscall path: %s\n", getpeb()->fast_syscalls_supported ? "sysenter" : "int 48");
+  printf("benchmark                 iterations    latency\n");
+  printf("------------------------ ---------- ----------\n");
+
+  run("null syscall", bench_null, iterations);
+  run("close (regargs)", bench_close, iterations);
+  run("getpid", bench_getpid, iterations);
+  run("time", bench_time, iterations);
+  run("time (syscall)", bench_time_syscall, iterations);
+  run("gettimeofday", bench_gettimeofday, iterations);
+  run("gettimeofday (syscall)", bench_gettimeofday_syscall, iterations);
+  run("clock", bench_clock, iterations);
+
+  return 0;
+}
@@ -0,0 +1,215 @@
+//
+// smbbench.c
+//
+// SMB file system throughput benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+
+//
+// Run smbbench on a directory mounted from a local Samba server to measure
+// sequential and random throughput over smbfs. A writable share like
+//
+//   [bench]
+//   path = /srv/bench
+//   read only = no
+//   guest ok = yes
+//
+// can be mounted with
+//
+//   mount \\server\bench /mnt/bench smbfs user=guest
+//
+// Read-ahead is disabled by opening the file with O_RANDOM and write-behind
+// is disabled with O_DIRECT, so each test is also run without pipelining.
+//
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DEFAULT_SIZE_MB    16
+#define DEFAULT_BLKSIZE    4096
+#define MAX_BLKSIZE        (1024 * 1024)
+#define RANDOM_OPS         2000
+#define DATAFILE           "smbbench.dat"
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void report(char *name, int blksize, double bytes, double elapsed, int errors) {
+  printf("%-28s %7d %8.2f MB/s%s\n", name, blksize, bytes / elapsed, errors ? " (errors)" : "");
+}
+
+static void seqwrite(char *name, char *fn, int flags, char *buffer, int blksize, unsigned long total) {
+  handle_t f;
+  unsigned long left;
+  double start, elapsed;
+  int errors = 0;
+  int rc;
+
+  f = open(fn, O_WRONLY | O_CREAT | O_TRUNC | flags, 0644);
+  if (f < 0) {
+    perror(fn);
+    exit(1);
+  }
+
+  // Include close in the timing so all write-behind replies are counted
+  start = now();
+  left = total;
+  while (left > 0) {
+    rc = write(f, buffer, left < (unsigned long) blksize ? left : blksize);
+    if (rc <= 0) {
+      errors++;
+      break;
+    }
+    left -= rc;
+  }
+  if (close(f) < 0) errors++;
+  elapsed = now() - start;
+
+  report(name, blksize, (double) (total - left), elapsed, errors);
+}
+
+static void seqread(char *name, char *fn, int flags, char *buffer, int blksize) {
+  handle_t f;
+  double bytes;
+  double start, elapsed;
+  int rc;
+
+  f = open(fn, O_RDONLY | flags);
+  if (f < 0) {
+    perror(fn);
+    exit(1);
+  }
+
+  start = now();
+  bytes = 0.0;
+  while ((rc = read(f, buffer, blksize)) > 0) bytes += rc;
+  elapsed = now() - start;
+  close(f);
+
+  report(name, blksize, bytes, elapsed, rc < 0);
+}
+
+static void randread(char *name, char *fn, char *buffer, int blksize, unsigned long total) {
+  handle_t f;
+  unsigned long blocks;
+  unsigned long seed = 4711;
+  double bytes;
+  double start, elapsed;
+  int errors = 0;
+  int i;
+  int rc;
+
+  f = open(fn, O_RDONLY | O_RANDOM);
+  if (f < 0) {
+    perror(fn);
+    exit(1);
+  }
+
+  blocks = total / blksize;
+  start = now();
+  bytes = 0.0;
+  for (i = 0; i < RANDOM_OPS; i++) {
+    seed = seed * 1103515245 + 12345;
+    rc = pread(f, buffer, blksize, (off64_t) ((seed >> 8) % blocks) * blksize);
+    if (rc != blksize) errors++;
+    if (rc > 0) bytes += rc;
+  }
+  elapsed = now() - start;
+  close(f);
+
+  report(name, blksize, bytes, elapsed, errors);
+  printf("%-28s %7d %8.0f ops/s\n", name, blksize, RANDOM_OPS / (elapsed / 1000000.0));
+}
+
+static void usage() {
+  fprintf(stderr, "usage: smbbench [options] directory\n");
+  fprintf(stderr, "  -s MB     size of test file (default %d MB)\n", DEFAULT_SIZE_MB);
+  fprintf(stderr, "  -b SIZE   transfer size in bytes (default %d)\n", DEFAULT_BLKSIZE);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *dir = NULL;
+  int mb = DEFAULT_SIZE_MB;
+  int blksize = DEFAULT_BLKSIZE;
+  unsigned long total;
+  char fn[MAXPATH];
+  char *buffer;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      mb = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      blksize = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && !dir) {
+      dir = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (!dir || mb <= 0 || blksize <= 0 || blksize > MAX_BLKSIZE) usage();
+
+  total = mb * 1024 * 1024;
+  if (total < (unsigned long) blksize) usage();
+  sprintf(fn, "%s/%s", dir, DATAFILE);
+
+  buffer = malloc(MAX_BLKSIZE);
+  if (!buffer) {
+    fprintf(stderr, "smbbench: out of memory\n");
+    return 1;
+  }
+  memset(buffer, 0xA5, MAX_BLKSIZE);
+
+  printf("file: %s size: %d MB\n", fn, mb);
+  printf("benchmark                    blksize   throughput\n");
+  printf("---------------------------- ------- ------------\n");
+
+  seqwrite("write (write-through)", fn, O_DIRECT, buffer, blksize, total);
+  seqwrite("write (write-behind)", fn, 0, buffer, blksize, total);
+  seqwrite("write (write-behind)", fn, 0, buffer, 64 * 1024, total);
+  seqread("read (no read-ahead)", fn, O_RANDOM, buffer, blksize);
+  seqread("read (read-ahead)", fn, 0, buffer, blksize);
+  seqread("read (pipelined)", fn, O_RANDOM, buffer, 64 * 1024);
+  seqread("read (pipelined)", fn, O_RANDOM, buffer, MAX_BLKSIZE);
+  randread("random read", fn, buffer, blksize, total);
+
+  unlink(fn);
+  free(buffer);
+
+  return 0;
+}
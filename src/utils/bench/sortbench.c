@@ -0,0 +1,283 @@
+//
+// sortbench.c
+//
+// Sorting benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DEFAULT_COUNT  1000000
+
+#define INPUT_RANDOM     0
+#define INPUT_SORTED     1
+#define INPUT_REVERSED   2
+#define INPUT_DUPLICATES 3
+
+static char *inputnames[] = {"random", "sorted", "reversed", "duplicates"};
+
+struct record {
+  unsigned int key;
+  char data[12];
+};
+
+static int comparisons;
+
+//
+// Reference version of the previous quicksort implementation
+//
+
+#define CUTOFF 8
+
+static void ref_swap(char *a, char *b, unsigned width) {
+  char tmp;
+
+  if (a != b) {
+    while (width--) {
+      tmp = *a;
+      *a++ = *b;
+      *b++ = tmp;
+    }
+  }
+}
+
+static void ref_shortsort(char *lo, char *hi, unsigned width, int (*comp)(const void *, const void *)) {
+  char *p, *max;
+
+  while (hi > lo) {
+    max = lo;
+    for (p = lo + width; p <= hi; p += width) if (comp(p, max) > 0) max = p;
+    ref_swap(max, hi, width);
+    hi -= width;
+  }
+}
+
+static void ref_qsort(void *base, unsigned num, unsigned width, int (*comp)(const void *, const void *)) {
+  char *lo, *hi;
+  char *mid;
+  char *l, *h;
+  unsigned size;
+  char *lostk[30], *histk[30];
+  int stkptr;
+
+  if (num < 2 || width == 0) return;
+  stkptr = 0;
+
+  lo = base;
+  hi = (char *) base + width * (num - 1);
+
+recurse:
+  size = (hi - lo) / width + 1;
+
+  if (size <= CUTOFF) {
+    ref_shortsort(lo, hi, width, comp);
+  } else {
+    mid = lo + (size / 2) * width;
+    ref_swap(mid, lo, width);
+
+    l = lo;
+    h = hi + width;
+
+    for (;;) {
+      do { l += width; } while (l <= hi && comp(l, lo) <= 0);
+      do { h -= width; } while (h > lo && comp(h, lo) >= 0);
+      if (h < l) break;
+      ref_swap(l, h, width);
+    }
+
+    ref_swap(lo, h, width);
+
+    if (h - 1 - lo >= hi - l) {
+      if (lo + width < h) {
+        lostk[stkptr] = lo;
+        histk[stkptr] = h - width;
+        ++stkptr;
+      }
+
+      if (l < hi) {
+        lo = l;
+        goto recurse;
+      }
+    } else {
+      if (l < hi) {
+        lostk[stkptr] = l;
+        histk[stkptr] = hi;
+        ++stkptr;
+      }
+
+      if (lo + width < h) {
+        hi = h - width;
+        goto recurse;
+      }
+    }
+  }
+
+  --stkptr;
+  if (stkptr >= 0) {
+    lo = lostk[stkptr];
+    hi = histk[stkptr];
+    goto recurse;
+  }
+}
+
+//
+// Benchmark drivers
+//
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static int compare_int(const void *a, const void *b) {
+  unsigned int x = *(unsigned int *) a;
+  unsigned int y = *(unsigned int *) b;
+
+  comparisons++;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_record(const void *a, const void *b) {
+  unsigned int x = ((struct record *) a)->key;
+  unsigned int y = ((struct record *) b)->key;
+
+  comparisons++;
+  return x < y ? -1 : x > y;
+}
+
+static void generate(int input, unsigned int *keys, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    switch (input) {
+      case INPUT_RANDOM:
+        keys[i] = (rand() << 16) ^ rand();
+        break;
+
+      case INPUT_SORTED:
+        keys[i] = i;
+        break;
+
+      case INPUT_REVERSED:
+        keys[i] = count - i;
+        break;
+
+      case INPUT_DUPLICATES:
+        keys[i] = rand() % 16;
+        break;
+    }
+  }
+}
+
+static int check(char *base, int count, int width) {
+  int i;
+
+  for (i = 1; i < count; i++) {
+    if (*(unsigned int *) (base + (i - 1) * width) > *(unsigned int *) (base + i * width)) return 0;
+  }
+  return 1;
+}
+
+static void run(char *name, int input, unsigned int *keys, char *data, int count, int width, int sort) {
+  int (*comp)(const void *, const void *);
+  double start, t;
+  int i;
+
+  // Fill elements with keys
+  for (i = 0; i < count; i++) *(unsigned int *) (data + i * width) = keys[i];
+  comp = width == sizeof(unsigned int) ? compare_int : compare_record;
+  comparisons = 0;
+
+  start = now();
+  switch (sort) {
+    case 0: ref_qsort(data, count, width, comp); break;
+    case 1: qsort(data, count, width, comp); break;
+    case 2: radixsort32(data, count, width, 0); break;
+  }
+  t = now() - start;
+
+  printf("%-8s %-11s %6d  %10.1f  %12d  %s\n",
+         name, inputnames[input], width, t / 1000.0, comparisons,
+         check(data, count, width) ? "" : "FAILED");
+}
+
+static void usage() {
+  fprintf(stderr, "usage: sortbench [options]\n");
+  fprintf(stderr, "  -n COUNT  number of elements to sort (default %d)\n", DEFAULT_COUNT);
+  fprintf(stderr, "  -o        also run the previous qsort implementation\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int count = DEFAULT_COUNT;
+  int old = 0;
+  unsigned int *keys;
+  char *data;
+  int input;
+  int width;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0) {
+      old = 1;
+    } else {
+      usage();
+    }
+  }
+  if (count < 1) usage();
+
+  keys = (unsigned int *) malloc(count * sizeof(unsigned int));
+  data = (char *) malloc(count * sizeof(struct record));
+  if (!keys || !data) {
+    fprintf(stderr, "sortbench: out of memory\n");
+    return 1;
+  }
+
+  printf("sort     input        width    time ms   comparisons\n");
+  for (input = INPUT_RANDOM; input <= INPUT_DUPLICATES; input++) {
+    srand(input + 1);
+    generate(input, keys, count);
+    for (width = sizeof(unsigned int); width <= sizeof(struct record); width += sizeof(struct record) - sizeof(unsigned int)) {
+      if (old) run("oldqsort", input, keys, data, count, width, 0);
+      run("qsort", input, keys, data, count, width, 1);
+      run("radix", input, keys, data, count, width, 2);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,185 @@
+//
+// statbench.c
+//
+// File system metadata lookup benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DEFAULT_DEPTH      4
+#define DEFAULT_FILES      100
+#define DEFAULT_ROUNDS     100
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static int get_lookups(char *devname) {
+  FILE *f;
+  char line[256];
+  char name[64];
+  int reads, writes, lookups;
+
+  // Get the number of buffer pool lookups for the device
+  f = fopen("/proc/bufstats", "r");
+  if (!f) return -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%63s %d %d %d", name, &reads, &writes, &lookups) != 4) continue;
+    if (strcmp(name, devname) == 0) {
+      fclose(f);
+      return lookups;
+    }
+  }
+  fclose(f);
+  return -1;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: statbench [options] directory\n");
+  fprintf(stderr, "  -d DEPTH  directory depth of test files (default %d)\n", DEFAULT_DEPTH);
+  fprintf(stderr, "  -f FILES  number of test files (default %d)\n", DEFAULT_FILES);
+  fprintf(stderr, "  -r ROUNDS number of passes over the files (default %d)\n", DEFAULT_ROUNDS);
+  exit(1);
+}
+
+static void report(char *op, int ops, double elapsed, int lookups) {
+  printf("  %-10s %8.2f us/op %8.2f buffer lookups/op\n", op, elapsed / ops, lookups >= 0 ? (double) lookups / ops : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+  char path[MAXPATH];
+  char *dir = NULL;
+  char *devname;
+  int depth = DEFAULT_DEPTH;
+  int files = DEFAULT_FILES;
+  int rounds = DEFAULT_ROUNDS;
+  struct statfs fs;
+  struct stat st;
+  int before;
+  double start;
+  int len;
+  int fd;
+  int i, j;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      depth = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      files = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && !dir) {
+      dir = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (!dir || depth < 0 || files < 1 || rounds < 1) usage();
+
+  if (statfs(dir, &fs) < 0) {
+    perror(dir);
+    return 1;
+  }
+  devname = fs.mntfrom;
+  if (strncmp(devname, "/dev/", 5) == 0) devname += 5;
+
+  // Create directory tree with test files at the bottom
+  strcpy(path, dir);
+  for (i = 0; i < depth; i++) {
+    sprintf(path + strlen(path), "/d%d", i);
+    if (mkdir(path, 0755) < 0 && stat(path, &st) < 0) {
+      perror(path);
+      return 1;
+    }
+  }
+  len = strlen(path);
+
+  for (i = 0; i < files; i++) {
+    sprintf(path + len, "/f%d", i);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror(path);
+      return 1;
+    }
+    close(fd);
+  }
+
+  printf("%s: %d files at depth %d, %d rounds\n", dir, files, depth, rounds);
+
+  // stat() all files
+  before = get_lookups(devname);
+  start = now();
+  for (j = 0; j < rounds; j++) {
+    for (i = 0; i < files; i++) {
+      sprintf(path + len, "/f%d", i);
+      if (stat(path, &st) < 0) {
+        perror(path);
+        return 1;
+      }
+    }
+  }
+  report("stat", rounds * files, now() - start, before >= 0 ? get_lookups(devname) - before : -1);
+
+  // open() and close() all files
+  before = get_lookups(devname);
+  start = now();
+  for (j = 0; j < rounds; j++) {
+    for (i = 0; i < files; i++) {
+      sprintf(path + len, "/f%d", i);
+      fd = open(path, O_RDONLY);
+      if (fd < 0) {
+        perror(path);
+        return 1;
+      }
+      close(fd);
+    }
+  }
+  report("open/close", rounds * files, now() - start, before >= 0 ? get_lookups(devname) - before : -1);
+
+  // Remove test files and directories
+  for (i = 0; i < files; i++) {
+    sprintf(path + len, "/f%d", i);
+    unlink(path);
+  }
+  for (i = depth; i > 0; i--) {
+    path[len] = 0;
+    rmdir(path);
+    while (len > 0 && path[len] != '/') len--;
+  }
+
+  return 0;
+}
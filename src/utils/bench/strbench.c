@@ -0,0 +1,269 @@
+//
+// strbench.c
+//
+// Memory and string function benchmark
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DEFAULT_VOLUME  (16 * 1024 * 1024)
+#define MAX_SIZE        (64 * 1024)
+#define BUFFER_SIZE     (MAX_SIZE + 64)
+
+static int sizes[] = {4, 15, 16, 64, 256, 1024, 4096, 65536, 0};
+static int alignments[][2] = {{0, 0}, {1, 0}, {0, 3}, {1, 2}, {-1, -1}};
+
+static char *srcbuf;
+static char *dstbuf;
+static volatile int sink;
+
+//
+// Reference versions of the previous byte oriented implementations
+//
+
+static void *ref_memset(void *p, int c, size_t n) {
+  char *pb = (char *) p;
+  char *pbend = pb + n;
+  while (pb != pbend) *pb++ = c;
+  return p;
+}
+
+static int ref_memcmp(const void *dst, const void *src, size_t n) {
+  if (!n) return 0;
+
+  while (--n && *(char *) dst == *(char *) src) {
+    dst = (char *) dst + 1;
+    src = (char *) src + 1;
+  }
+
+  return *((unsigned char *) dst) - *((unsigned char *) src);
+}
+
+static void *ref_memcpy(void *dst, const void *src, size_t n) {
+  char *s = (char *) src;
+  char *end = s + n;
+  char *d = (char *) dst;
+
+  if ((((unsigned int) s) | ((unsigned int) d) | n) & (sizeof(unsigned int) - 1)) {
+    while (s != end) *d++ = *s++;
+  } else {
+    while (s != end) {
+      *(unsigned int *) d = *(unsigned int *) s;
+      d += sizeof(unsigned int);
+      s += sizeof(unsigned int);
+    }
+  }
+
+  return dst;
+}
+
+static size_t ref_strlen(const char *s) {
+  const char *eos = s;
+  while (*eos++);
+  return (int) (eos - s - 1);
+}
+
+static char *ref_strchr(const char *s, int ch) {
+  while (*s && *s != (char) ch) s++;
+  if (*s == (char) ch) return (char *) s;
+  return NULL;
+}
+
+//
+// Benchmark drivers
+//
+
+#define OP_MEMCPY  0
+#define OP_MEMSET  1
+#define OP_MEMCMP  2
+#define OP_STRLEN  3
+#define OP_STRCHR  4
+
+static char *opnames[] = {"memcpy", "memset", "memcmp", "strlen", "strchr"};
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static void prepare(int op, char *dst, char *src, int size) {
+  // Buffers are equal up to the size, so memcmp scans the whole block
+  // and strings are terminated after size characters
+  memset(srcbuf, 'a', BUFFER_SIZE);
+  memset(dstbuf, 'a', BUFFER_SIZE);
+  if (op == OP_STRLEN || op == OP_STRCHR) src[size] = 0;
+  if (op == OP_MEMCMP) dst[size - 1] = 'b';
+}
+
+static int run(int op, int ref, char *dst, char *src, int size, int iterations) {
+  int i;
+  int result = 0;
+
+  for (i = 0; i < iterations; i++) {
+    switch (op) {
+      case OP_MEMCPY:
+        if (ref) ref_memcpy(dst, src, size); else memcpy(dst, src, size);
+        break;
+
+      case OP_MEMSET:
+        if (ref) ref_memset(dst, i, size); else memset(dst, i, size);
+        break;
+
+      case OP_MEMCMP:
+        result += ref ? ref_memcmp(dst, src, size) : memcmp(dst, src, size);
+        break;
+
+      case OP_STRLEN:
+        result += ref ? ref_strlen(src) : strlen(src);
+        break;
+
+      case OP_STRCHR:
+        result += (ref ? ref_strchr(src, 'x') : strchr(src, 'x')) != NULL;
+        break;
+    }
+  }
+
+  return result;
+}
+
+static int verify(int op, char *dst, char *src, int size) {
+  int result;
+
+  switch (op) {
+    case OP_MEMCPY:
+      memset(dst, 0, size + 8);
+      memcpy(dst, src, size);
+      return memcmp(dst, src, size) == 0 && dst[size] == 0;
+
+    case OP_MEMSET:
+      memset(dst, 0, size + 8);
+      memset(dst, 0x5A, size);
+      for (result = 0; result < size; result++) if (dst[result] != 0x5A) return 0;
+      return dst[size] == 0;
+
+    case OP_MEMCMP:
+      result = memcmp(dst, src, size);
+      return (result > 0) == (ref_memcmp(dst, src, size) > 0) && result != 0;
+
+    case OP_STRLEN:
+      return strlen(src) == (size_t) size;
+
+    case OP_STRCHR:
+      src[size / 2] = 'x';
+      result = strchr(src, 'x') == src + size / 2 && strchr(src, 0) == src + size;
+      src[size / 2] = 'a';
+      return result;
+  }
+
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: strbench [options]\n");
+  fprintf(stderr, "  -f FUNC   only benchmark function (memcpy, memset, memcmp, strlen, strchr)\n");
+  fprintf(stderr, "  -v BYTES  bytes processed per measurement (default %d)\n", DEFAULT_VOLUME);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int volume = DEFAULT_VOLUME;
+  char *func = NULL;
+  int op, i, j;
+  int size, iterations;
+  char *src, *dst;
+  double start, tref, tnew;
+  int failures = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      func = argv[++i];
+    } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+      volume = atoi(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+  if (volume < MAX_SIZE) usage();
+
+  // Allocate page aligned buffers so the alignment offsets are exact
+  srcbuf = (char *) malloc(BUFFER_SIZE + PAGESIZE);
+  dstbuf = (char *) malloc(BUFFER_SIZE + PAGESIZE);
+  if (!srcbuf || !dstbuf) {
+    fprintf(stderr, "strbench: out of memory\n");
+    return 1;
+  }
+  srcbuf = (char *) (((unsigned long) srcbuf + PAGESIZE - 1) & ~(PAGESIZE - 1));
+  dstbuf = (char *) (((unsigned long) dstbuf + PAGESIZE - 1) & ~(PAGESIZE - 1));
+
+  printf("function    size  dst src      old MB/s     new MB/s  speedup\n");
+  for (op = OP_MEMCPY; op <= OP_STRCHR; op++) {
+    if (func && strcmp(func, opnames[op]) != 0) continue;
+
+    for (i = 0; sizes[i]; i++) {
+      size = sizes[i];
+      iterations = volume / size;
+      for (j = 0; alignments[j][0] >= 0; j++) {
+        dst = dstbuf + alignments[j][0];
+        src = srcbuf + alignments[j][1];
+
+        prepare(op, dst, src, size);
+        if (!verify(op, dst, src, size)) {
+          printf("%-8s %7d  %3d %3d  FAILED\n", opnames[op], size, alignments[j][0], alignments[j][1]);
+          failures++;
+          continue;
+        }
+        prepare(op, dst, src, size);
+
+        start = now();
+        sink = run(op, 1, dst, src, size, iterations);
+        tref = now() - start;
+
+        start = now();
+        sink = run(op, 0, dst, src, size, iterations);
+        tnew = now() - start;
+
+        if (tref < 1) tref = 1;
+        if (tnew < 1) tnew = 1;
+        printf("%-8s %7d  %3d %3d  %11.1f  %11.1f  %6.2fx\n",
+               opnames[op], size, alignments[j][0], alignments[j][1],
+               (double) size * iterations / tref, (double) size * iterations / tnew,
+               tref / tnew);
+      }
+    }
+  }
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+//
+// tlbbench.c
+//
+// TLB miss benchmark for 4K and 4MB pages
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define DEFAULT_SIZE_MB  256
+#define DEFAULT_ACCESSES 10000000
+
+static unsigned long checksum;
+
+static double now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static double walk(unsigned long *array, unsigned long words, int accesses) {
+  unsigned long idx;
+  unsigned long seed = 1;
+  unsigned long sum = 0;
+  double start, end;
+  int i;
+
+  // Touch a pseudo-random page on each access so nearly every load misses the TLB
+  start = now();
+  for (i = 0; i < accesses; i++) {
+    seed = seed * 1103515245 + 12345;
+    idx = (seed >> 4) % words;
+    sum += array[idx];
+  }
+  end = now();
+
+  checksum += sum;
+  return (end - start) * 1000.0 / accesses;
+}
+
+static double run(char *name, unsigned long size, int type, int accesses) {
+  unsigned long *array;
+  unsigned long words = size / sizeof(unsigned long);
+  unsigned long n;
+  double latency;
+
+  array = (unsigned long *) vmalloc(NULL, size, MEM_RESERVE | MEM_COMMIT | type, PAGE_READWRITE, 'BNCH');
+  if (!array) {
+    fprintf(stderr, "tlbbench: unable to allocate %lu MB\n", size / (1024 * 1024));
+    return 0.0;
+  }
+  for (n = 0; n < words; n += PAGESIZE / sizeof(unsigned long)) array[n] = n;
+
+  latency = walk(array, words, accesses);
+  printf("%-24s %10d %10.2f ns/access\n", name, accesses, latency);
+
+  vmfree(array, size, MEM_RELEASE);
+  return latency;
+}
+
+int main(int argc, char *argv[]) {
+  int mb = DEFAULT_SIZE_MB;
+  int accesses = DEFAULT_ACCESSES;
+  double small, large;
+
+  if (argc > 1) mb = atoi(argv[1]);
+  if (argc > 2) accesses = atoi(argv[2]);
+  if (mb <= 0 || accesses <= 0) {
+    fprintf(stderr, "usage: tlbbench [MB] [ACCESSES]\n");
+    return 1;
+  }
+
+  printf("array size: %d MB\n", mb);
+  printf("benchmark                   accesses    latency\n");
+  printf("------------------------ ---------- ----------\n");
+
+  small = run("4K pages", mb * 1024 * 1024, 0, accesses);
+  large = run("4MB pages", mb * 1024 * 1024, MEM_LARGE_PAGES, accesses);
+  if (small > 0.0 && large > 0.0) {
+    printf("speedup with large pages: %.2fx\n", small / large);
+  }
+
+  return 0;
+}
@@ -0,0 +1,344 @@
+//
+// hcache.c
+//
+// HTTP static file cache
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <httpd.h>
+
+//
+// The file cache keeps the contents of small static files in memory
+// together with a prebuilt block of the response headers that do not
+// change between requests. Entries are looked up by translated path and
+// revalidated against the file modification time when the check interval
+// has elapsed. Unreferenced entries are kept on an LRU list and evicted
+// when the cache exceeds its memory limit. Compressed variants of a file
+// are stored as separate entries for the same path and are recompressed
+// when the modification time of the file changes.
+//
+
+char *get_extension(char *path);
+
+static unsigned int hash_path(char *path) {
+  unsigned int h = 0;
+  while (*path) h = h * 31 + (unsigned char) *path++;
+  return h % HTTPD_FILECACHE_HASHSIZE;
+}
+
+static struct httpd_cached_file *find_cached_file(struct httpd_filecache *cache, char *path, int encoding) {
+  struct httpd_cached_file *file;
+
+  file = cache->hashtable[hash_path(path)];
+  while (file && (file->encoding != encoding || strcmp(file->path, path) != 0)) file = file->hash_next;
+  return file;
+}
+
+static void unlink_lru(struct httpd_filecache *cache, struct httpd_cached_file *file) {
+  if (file->lru_next) file->lru_next->lru_prev = file->lru_prev;
+  if (file->lru_prev) file->lru_prev->lru_next = file->lru_next;
+  if (cache->lru_head == file) cache->lru_head = file->lru_next;
+  if (cache->lru_tail == file) cache->lru_tail = file->lru_prev;
+  file->lru_next = file->lru_prev = NULL;
+}
+
+static void unlink_hash(struct httpd_filecache *cache, struct httpd_cached_file *file) {
+  struct httpd_cached_file **pp = &cache->hashtable[hash_path(file->path)];
+
+  while (*pp) {
+    if (*pp == file) {
+      *pp = file->hash_next;
+      break;
+    }
+    pp = &(*pp)->hash_next;
+  }
+  file->hash_next = NULL;
+  file->stale = 1;
+}
+
+static void free_cached_file(struct httpd_filecache *cache, struct httpd_cached_file *file) {
+  cache->memused -= file->memsize;
+  if (file->filename != file->path) free(file->filename);
+  free(file->path);
+  free(file->headers);
+  free(file->data);
+  free(file);
+}
+
+static void evict_cached_files(struct httpd_filecache *cache, int needed) {
+  struct httpd_cached_file *file;
+
+  // Evict least recently used files until there is room for the new file
+  while (cache->memused + needed > cache->memlimit && cache->lru_head) {
+    file = cache->lru_head;
+    unlink_lru(cache, file);
+    unlink_hash(cache, file);
+    free_cached_file(cache, file);
+  }
+}
+
+static void insert_cached_file(struct httpd_filecache *cache, struct httpd_cached_file *file) {
+  struct httpd_cached_file *f;
+
+  // Replace any existing entry for the path
+  f = find_cached_file(cache, file->path, file->encoding);
+  if (f) {
+    unlink_hash(cache, f);
+    if (f->refcnt == 0) {
+      unlink_lru(cache, f);
+      free_cached_file(cache, f);
+    }
+  }
+
+  // Make room for new file and insert it into the cache
+  evict_cached_files(cache, file->memsize);
+  file->hash_next = cache->hashtable[hash_path(file->path)];
+  cache->hashtable[hash_path(file->path)] = file;
+  cache->memused += file->memsize;
+}
+
+static char *build_headers(struct httpd_server *server, struct httpd_cached_file *file) {
+  char datebuf[32];
+  char buf[512];
+  int n;
+
+  n = sprintf(buf, "Last-Modified: %s\r\nETag: %s\r\n", rfctime(file->mtime, datebuf), file->etag);
+  if (file->content_type && strlen(file->content_type) < sizeof(buf) - n - 96) {
+    n += sprintf(buf + n, "Content-Type: %s\r\n", file->content_type);
+  }
+  if (file->encoding != HTTPD_ENCODING_IDENTITY) {
+    n += sprintf(buf + n, "Content-Encoding: %s\r\n", encoding_name(file->encoding));
+  }
+  if (compressible(server, file->content_type)) {
+    n += sprintf(buf + n, "Vary: Accept-Encoding\r\n");
+  }
+
+  return strdup(buf);
+}
+
+void init_file_cache(struct httpd_server *server) {
+  struct httpd_filecache *cache = &server->filecache;
+
+  mkcs(&cache->lock);
+  cache->memlimit = getnumconfig(server->cfg, "filecache", 1024 * 1024);
+  cache->maxfilesize = getnumconfig(server->cfg, "filecachemaxsize", 64 * 1024);
+  cache->interval = getnumconfig(server->cfg, "filecachecheck", 2);
+}
+
+struct httpd_cached_file *lookup_file_cache(struct httpd_server *server, char *path) {
+  struct httpd_filecache *cache = &server->filecache;
+  struct httpd_cached_file *file;
+  struct stat64 statbuf;
+  time_t now;
+
+  if (cache->memlimit <= 0) return NULL;
+
+  // Find file in cache and take a reference to it
+  enter(&cache->lock);
+  file = find_cached_file(cache, path, HTTPD_ENCODING_IDENTITY);
+  if (!file) {
+    cache->misses++;
+    leave(&cache->lock);
+    return NULL;
+  }
+  if (file->refcnt++ == 0) unlink_lru(cache, file);
+  leave(&cache->lock);
+
+  // Revalidate file if check interval has elapsed
+  now = time(0);
+  if (now - file->checked >= cache->interval) {
+    if (stat64(file->filename, &statbuf) < 0 || 
+        (statbuf.st_mode & S_IFMT) != S_IFREG ||
+        statbuf.st_mtime != file->mtime || 
+        statbuf.st_size != file->size) {
+      // File has changed, remove it from the cache
+      enter(&cache->lock);
+      if (!file->stale) unlink_hash(cache, file);
+      cache->misses++;
+      leave(&cache->lock);
+      release_cached_file(server, file);
+      return NULL;
+    }
+    file->checked = now;
+  }
+
+  enter(&cache->lock);
+  cache->hits++;
+  leave(&cache->lock);
+
+  return file;
+}
+
+struct httpd_cached_file *add_file_cache(struct httpd_server *server, char *path, char *filename, int isdir, struct stat64 *statbuf) {
+  struct httpd_filecache *cache = &server->filecache;
+  struct httpd_cached_file *file;
+  int size;
+  int fd;
+  int n;
+
+  size = (int) statbuf->st_size;
+  if (cache->memlimit <= 0 || size > cache->maxfilesize || size > cache->memlimit / 4) return NULL;
+
+  file = (struct httpd_cached_file *) malloc(sizeof(struct httpd_cached_file));
+  if (!file) return NULL;
+  memset(file, 0, sizeof(struct httpd_cached_file));
+
+  // Read file into memory
+  file->data = (char *) malloc(size > 0 ? size : 1);
+  if (!file->data) goto errorexit;
+  fd = open(filename, O_RDONLY | O_BINARY);
+  if (fd < 0) goto errorexit;
+  n = read(fd, file->data, size);
+  close(fd);
+  if (n != size) goto errorexit;
+
+  // Build response headers
+  file->isdir = isdir;
+  file->size = size;
+  file->mtime = statbuf->st_mtime;
+  file->checked = time(0);
+  file->content_type = httpd_get_mimetype(server, get_extension(filename));
+  sprintf(file->etag, "\"%lx-%x\"", (unsigned long) statbuf->st_mtime, size);
+  file->headers = build_headers(server, file);
+  file->path = strdup(path);
+  file->filename = strcmp(path, filename) == 0 ? file->path : strdup(filename);
+  if (!file->headers || !file->path || !file->filename) goto errorexit;
+
+  file->refcnt = 1;
+  file->memsize = sizeof(struct httpd_cached_file) + size + strlen(file->headers) + 2 * strlen(path) + 2;
+
+  enter(&cache->lock);
+  insert_cached_file(cache, file);
+  leave(&cache->lock);
+
+  return file;
+
+errorexit:
+  if (file->filename && file->filename != file->path) free(file->filename);
+  if (file->path) free(file->path);
+  if (file->headers) free(file->headers);
+  if (file->data) free(file->data);
+  free(file);
+  return NULL;
+}
+
+void release_cached_file(struct httpd_server *server, struct httpd_cached_file *file) {
+  struct httpd_filecache *cache = &server->filecache;
+
+  enter(&cache->lock);
+  if (--file->refcnt == 0) {
+    if (file->stale) {
+      // File has been removed from cache
+      free_cached_file(cache, file);
+    } else {
+      // Add file to the end of the LRU list and trim cache
+      file->lru_prev = cache->lru_tail;
+      if (cache->lru_tail) cache->lru_tail->lru_next = file;
+      cache->lru_tail = file;
+      if (!cache->lru_head) cache->lru_head = file;
+      evict_cached_files(cache, 0);
+    }
+  }
+  leave(&cache->lock);
+}
+
+struct httpd_cached_file *get_compressed_file(struct httpd_connection *conn, struct httpd_cached_file *file, int encoding) {
+  struct httpd_server *server = conn->server;
+  struct httpd_filecache *cache = &server->filecache;
+  struct httpd_cached_file *zfile;
+  struct httpd_zstream *z;
+  struct httpd_buffer buf;
+  int rc;
+
+  // Find compressed variant for the same version of the file
+  enter(&cache->lock);
+  zfile = find_cached_file(cache, file->path, encoding);
+  if (zfile && zfile->mtime == file->mtime) {
+    if (zfile->refcnt++ == 0) unlink_lru(cache, zfile);
+    cache->hits++;
+    leave(&cache->lock);
+    return zfile;
+  }
+  leave(&cache->lock);
+
+  // Compress file
+  z = deflate_open(encoding, server->compresslevel);
+  if (!z) return NULL;
+  memset(&buf, 0, sizeof(struct httpd_buffer));
+  rc = deflate_data(z, file->data, file->size, DEFLATE_FINISH, &buf);
+  deflate_close(z, &conn->worker->zstats);
+
+  // Do not use the compressed variant if compression does not reduce size
+  if (rc < 0 || buffer_size(&buf) >= file->size) {
+    file->incompressible = 1;
+    free_buffer(&buf);
+    return NULL;
+  }
+
+  zfile = (struct httpd_cached_file *) malloc(sizeof(struct httpd_cached_file));
+  if (!zfile) {
+    free_buffer(&buf);
+    return NULL;
+  }
+  memset(zfile, 0, sizeof(struct httpd_cached_file));
+
+  zfile->data = buf.floor;
+  zfile->size = buffer_size(&buf);
+  zfile->isdir = file->isdir;
+  zfile->encoding = encoding;
+  zfile->mtime = file->mtime;
+  zfile->checked = file->checked;
+  zfile->content_type = file->content_type;
+  sprintf(zfile->etag, "\"%lx-%x-%s\"", (unsigned long) file->mtime, file->size, encoding_name(encoding));
+  zfile->headers = build_headers(server, zfile);
+  zfile->path = strdup(file->path);
+  zfile->filename = zfile->path;
+  if (!zfile->headers || !zfile->path) {
+    if (zfile->path) free(zfile->path);
+    if (zfile->headers) free(zfile->headers);
+    free(zfile->data);
+    free(zfile);
+    return NULL;
+  }
+  zfile->refcnt = 1;
+  zfile->memsize = sizeof(struct httpd_cached_file) + zfile->size + strlen(zfile->headers) + strlen(zfile->path) + 1;
+
+  enter(&cache->lock);
+  insert_cached_file(cache, zfile);
+  leave(&cache->lock);
+
+  return zfile;
+}
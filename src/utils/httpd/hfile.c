@@ -82,6 +82,7 @@ int ls(struct httpd_connection *conn) {
   dir = _opendir(conn->req->path_translated);
   if (dir < 0) return httpd_return_file_error(conn, errno);
 
+  conn->rsp->content_type = "text/html";
   urllen = strlen(conn->req->decoded_url);
   if (urllen > 0 && conn->req->decoded_url[urllen - 1] == '/') urllen--;
   httpd_send(conn->rsp, "<HTML><HEAD><TITLE>Index of ", -1);
@@ -159,23 +160,75 @@ int ls(struct httpd_connection *conn) {
   return 0;
 }
 
+static int send_cached_file(struct httpd_connection *conn, struct httpd_cached_file *file) {
+  struct httpd_request *req = conn->req;
+  struct httpd_response *rsp = conn->rsp;
+  struct httpd_cached_file *zfile;
+  int encoding;
+  int rc;
+
+  // Use the compressed variant of the file if the client accepts it
+  encoding = select_encoding(conn, file->content_type);
+  if (encoding && !file->incompressible && file->size >= conn->server->compressmin) {
+    zfile = get_compressed_file(conn, file, encoding);
+    if (zfile) {
+      release_cached_file(conn->server, file);
+      file = zfile;
+    }
+  }
+
+  // The connection holds a reference to the file until the response has been sent
+  conn->cached_file = file;
+
+  // Content type and last modified time are in the prebuilt headers
+  rsp->content_length = file->size;
+  rsp->content_type = NULL;
+  rsp->last_modified = 0;
+
+  if (req->if_none_match ? strcmp(req->if_none_match, file->etag) == 0 : file->mtime <= req->if_modified_since) {
+    return httpd_send_header(rsp, 304, "Not Modified", file->headers);
+  }
+
+  rc = httpd_send_header(rsp, 200, "OK", file->headers);
+  if (rc < 0) return rc;
+
+  if (strcmp(req->method, "HEAD") == 0) return 0;
+
+  // The header and file data are sent together in one gather write
+  return httpd_send_fixed_data(rsp, file->data, file->size);
+}
+
 int httpd_file_handler(struct httpd_connection *conn) {
   int rc;
   int fd;
   struct stat64 statbuf;
+  struct httpd_cached_file *file;
   char *filename;
   char buf[MAXPATH];
+  int urllen;
+  int isdir = 0;
 
   if (strcmp(conn->req->method, "GET") != 0 && strcmp(conn->req->method, "HEAD") != 0) {
     return httpd_send_error(conn->rsp, 405, "Method Not Allowed", NULL);
   }
 
+  // Check file cache. Directory index files are only served from the cache
+  // for URLs ending in a slash, since other URLs must be redirected.
+  file = lookup_file_cache(conn->server, conn->req->path_translated);
+  if (file) {
+    urllen = strlen(conn->req->decoded_url);
+    if (!file->isdir || (urllen > 0 && conn->req->decoded_url[urllen - 1] == '/')) {
+      return send_cached_file(conn, file);
+    }
+    release_cached_file(conn->server, file);
+  }
+
   filename = conn->req->path_translated;
   rc = stat64(filename, &statbuf);
   if (rc < 0) return httpd_return_file_error(conn, errno);
 
   if ((statbuf.st_mode & S_IFMT) == S_IFDIR) {
-    int urllen = strlen(conn->req->decoded_url);
+    urllen = strlen(conn->req->decoded_url);
 
     if (urllen < 1 || urllen >= MAXPATH - 1) return 400;
 
@@ -205,11 +258,16 @@ int httpd_file_handler(struct httpd_connection *conn) {
       } else {
         if ((statbuf.st_mode & S_IFMT) == S_IFDIR) return 500;
         filename = buf;
+        isdir = 1;
       }
     }
   }
 
   if ((statbuf.st_mode & S_IFMT) == S_IFREG) {
+    // Add small files to the file cache
+    file = add_file_cache(conn->server, conn->req->path_translated, filename, isdir, &statbuf);
+    if (file) return send_cached_file(conn, file);
+
     conn->rsp->content_length = (int) statbuf.st_size;
     conn->rsp->last_modified = statbuf.st_mtime;
     conn->rsp->content_type = httpd_get_mimetype(conn->server, get_extension(filename));
@@ -39,7 +39,13 @@
 
 #include <httpd.h>
 
-#define MAX_LOGLINE_SIZE (32 * 1024)
+//
+// Access log lines are formatted into a per-worker log buffer and written
+// to the log file by a background log thread. The log thread flushes the
+// buffers when one of them is half full or when the log flush interval
+// has elapsed. If a worker buffer is full, the log line is dropped and
+// the number of dropped lines is recorded in the log file.
+//
 
 char *logfieldnames[] = {
   "date",
@@ -125,32 +131,139 @@ int write_log(struct httpd_server *server, char *data, int len, struct tm *tm) {
   return write(server->logfd, data, len);
 }
 
+static void flush_log(struct httpd_server *server) {
+  struct httpd_worker *worker;
+  time_t now = time(0);
+  struct tm tm;
+  char buf[64];
+  char *data;
+  int size;
+  int dropped;
+  int i;
+
+  gmtime_r(&now, &tm);
+  for (i = 0; i < server->num_workers; i++) {
+    worker = &server->workers[i];
+
+    // Swap the worker log buffer with the spare buffer
+    enter(&worker->log.lock);
+    data = worker->log.data;
+    size = worker->log.size;
+    dropped = worker->log.dropped;
+    if (size > 0) {
+      worker->log.data = server->logspare;
+      worker->log.size = 0;
+      server->logspare = data;
+    }
+    worker->log.dropped = 0;
+    leave(&worker->log.lock);
+
+    // Write log lines to log file
+    if (size > 0) write_log(server, data, size, &tm);
+    if (dropped > 0) {
+      server->logdropped += dropped;
+      sprintf(buf, "#Remark: %d log entries dropped\r\n", dropped);
+      write_log(server, buf, strlen(buf), &tm);
+    }
+  }
+}
+
+static void __stdcall httpd_log_thread(void *arg) {
+  struct httpd_server *server = (struct httpd_server *) arg;
+
+  while (!server->logstop) {
+    waitone(server->logevent, server->logflush);
+    flush_log(server);
+  }
+
+  // Write out log entries buffered by the workers before stopping
+  flush_log(server);
+}
+
+int start_log(struct httpd_server *server) {
+  int i;
+
+  if (server->nlogcolumns == 0 || server->logdir == NULL) return 0;
+  if (server->logbufsiz < 1024) server->logbufsiz = 1024;
+
+  // Allocate log buffers for workers and a spare buffer for the log thread
+  for (i = 0; i < server->num_workers; i++) {
+    server->workers[i].log.data = (char *) malloc(server->logbufsiz);
+    if (!server->workers[i].log.data) return -1;
+  }
+  server->logspare = (char *) malloc(server->logbufsiz);
+  if (!server->logspare) return -1;
+
+  // Start log thread
+  server->logevent = mkevent(0, 0);
+  if (server->logevent < 0) return -1;
+  server->logthread = beginthread(httpd_log_thread, 0, server, 0, "httplog", NULL);
+  if (server->logthread < 0) return -1;
+
+  return 0;
+}
+
+void stop_log(struct httpd_server *server) {
+  if (!server->logthread) return;
+
+  // Signal the log thread and wait for its final flush
+  server->logstop = 1;
+  eset(server->logevent);
+  waitone(server->logthread, INFINITE);
+  close(server->logthread);
+  server->logthread = 0;
+
+  if (server->logfd >= 0) {
+    close(server->logfd);
+    server->logfd = -1;
+    server->logyear = 0;
+  }
+}
+
 int log_request(struct httpd_request *req) {
-  char line[MAX_LOGLINE_SIZE];
-  char *p = line;
-  char *end = line + MAX_LOGLINE_SIZE;
   struct httpd_connection *conn = req->conn;
+  struct httpd_server *server = conn->server;
+  struct httpd_worker *worker = conn->worker;
   struct httpd_response *rsp = conn->rsp;
-  time_t now = time(0);
-  struct tm *tm = gmtime(&now);
+  time_t now;
+  struct tm tm;
   char buf[32];
+  char *line;
+  char *p;
+  char *end;
   char *value;
   int n;
+  int len;
   int field;
+  int wakeup;
 
-  if (req->conn->server->nlogcolumns == 0 || req->conn->server->logdir == NULL) return 0;
+  if (server->nlogcolumns == 0 || server->logdir == NULL || !worker) return 0;
 
-  for (n = 0; n < req->conn->server->nlogcolumns; n++) {
-    field = req->conn->server->logcoumns[n];
+  // Format the date and time only once per second
+  now = time(0);
+  if (now != worker->logtime) {
+    gmtime_r(&now, &tm);
+    strftime(worker->logdate, sizeof(worker->logdate), "%Y-%m-%d", &tm);
+    strftime(worker->logclock, sizeof(worker->logclock), "%H:%M:%S", &tm);
+    worker->logtime = now;
+  }
+
+  // Format log line directly into the worker log buffer
+  enter(&worker->log.lock);
+  line = p = worker->log.data + worker->log.size;
+  end = worker->log.data + server->logbufsiz;
+
+  for (n = 0; n < server->nlogcolumns; n++) {
+    field = server->logcoumns[n];
     value = buf;
 
     switch (field) {
       case HTTP_LOG_DATE: 
-        strftime(buf, sizeof(buf), "%Y-%m-%d", tm);
+        value = worker->logdate;
         break;
 
       case HTTP_LOG_TIME:
-        strftime(buf, sizeof(buf), "%H:%M:%S", tm);
+        value = worker->logclock;
         break;
 
       case HTTP_LOG_TIME_TAKEN:
@@ -227,17 +340,11 @@ int log_request(struct httpd_request *req) {
 
     if (!value || !*value) value = "-";
     if (n > 0) {
-      if (p == end) {
-        errno = EBUF;
-        return -1;
-      }
+      if (p == end) goto overflow;
       *p++ = ' ';
     }
     while (*value) {
-      if (p == end) {
-        errno = EBUF;
-        return -1;
-      }
+      if (p == end) goto overflow;
       if (*value == ' ') {
         *p++ = '+';
       } else {
@@ -247,25 +354,23 @@ int log_request(struct httpd_request *req) {
     }
   }
 
-  if (p == end) {
-    errno = EBUF;
-    return -1;
-  }
+  if (end - p < 2) goto overflow;
   *p++ = '\r';
-  if (p == end) {
-    errno = EBUF;
-    return -1;
-  }
   *p++ = '\n';
-  if (p == end) {
-    errno = EBUF;
-    return -1;
-  }
-  *p++ = 0;
 
-  enter(&conn->server->srvlock);
-  write_log(conn->server, line, p - line - 1, tm);
-  leave(&conn->server->srvlock);
+  // Wake up log thread when the buffer becomes half full
+  len = p - line;
+  wakeup = worker->log.size < server->logbufsiz / 2 && worker->log.size + len >= server->logbufsiz / 2;
+  worker->log.size += len;
+  leave(&worker->log.lock);
 
-  return p - line - 1;
+  if (wakeup) eset(server->logevent);
+  return len;
+
+overflow:
+  // Drop log line if there is no room in the log buffer
+  worker->log.dropped++;
+  leave(&worker->log.lock);
+  eset(server->logevent);
+  return 0;
 }
@@ -161,6 +161,7 @@ struct httpd_server *httpd_initialize(struct section *cfg) {
   server->cfg = cfg;
   server->port = getnumconfig(cfg, "port", 80);
   server->num_workers = getnumconfig(cfg, "workerthreads", 1);
+  server->stealinterval = getnumconfig(cfg, "stealinterval", 50);
   server->min_hdrbufsiz = getnumconfig(cfg, "minhdrsize", 1024);
   server->max_hdrbufsiz = getnumconfig(cfg, "maxhdrsize", 16 * 1024);
   server->reqbufsiz = getnumconfig(cfg, "requestbuffer", 4096);
@@ -169,10 +170,16 @@ struct httpd_server *httpd_initialize(struct section *cfg) {
   server->indexname = getstrconfig(cfg, "indexname", "index.htm");
   server->swname = getstrconfig(cfg, "swname", gettib()->peb->osname);
   server->allowdirbrowse = getnumconfig(cfg, "allowdirbrowse", 1);
+  server->statusurl = getstrconfig(cfg, "status", NULL);
 
   parse_log_columns(server, getstrconfig(cfg, "logcolumns", "date time c-ip cs-username s-ip s-port cs-method cs-uri-stem cs-uri-query sc-status cs(user-agent)"));
   server->logdir = getstrconfig(cfg, "logdir", NULL);
   server->logfd = -1;
+  server->logbufsiz = getnumconfig(cfg, "logbuffer", 64 * 1024);
+  server->logflush = getnumconfig(cfg, "logflush", 1000);
+
+  init_file_cache(server);
+  init_compression(server);
 
   if (cfg) {
     name = getstrconfig(cfg, "mimemap", "mimetypes");
@@ -183,7 +190,14 @@ struct httpd_server *httpd_initialize(struct section *cfg) {
 }
 
 int httpd_terminate(struct httpd_server *server) {
-  return -ENOSYS;
+  // Stop accepting new connections and write out buffered log entries
+  if (server->workers) {
+    close(server->sock);
+    server->sock = -1;
+  }
+  stop_log(server);
+
+  return 0;
 }
 
 char *httpd_get_mimetype(struct httpd_server *server, char *ext) {
@@ -260,11 +274,60 @@ struct httpd_context *httpd_add_resource_context(struct httpd_server *server, ch
   return context;
 }
 
+int httpd_status_handler(struct httpd_connection *conn) {
+  struct httpd_server *server = conn->server;
+  struct httpd_filecache *cache = &server->filecache;
+  struct httpd_worker *worker;
+  struct httpd_zstats zstats;
+  char buf[256];
+  int ratio;
+  int i;
+
+  if (strcmp(conn->req->method, "GET") != 0 && strcmp(conn->req->method, "HEAD") != 0) {
+    return httpd_send_error(conn->rsp, 405, "Method Not Allowed", NULL);
+  }
+
+  conn->rsp->content_type = "text/plain";
+  memset(&zstats, 0, sizeof(struct httpd_zstats));
+
+  for (i = 0; i < server->num_workers; i++) {
+    worker = &server->workers[i];
+    sprintf(buf, "worker %d: %d connections, %d stolen\r\n", i, worker->connections, worker->stolen);
+    httpd_send(conn->rsp, buf, -1);
+
+    zstats.streams += worker->zstats.streams;
+    zstats.bytes_in += worker->zstats.bytes_in;
+    zstats.bytes_out += worker->zstats.bytes_out;
+    zstats.cputime += worker->zstats.cputime;
+  }
+
+  sprintf(buf, "file cache: %d hits, %d misses, %d KB used of %d KB\r\n", 
+          cache->hits, cache->misses, cache->memused / 1024, cache->memlimit / 1024);
+  httpd_send(conn->rsp, buf, -1);
+
+  // Compression ratio is the compressed size in percent of the original size
+  ratio = zstats.bytes_in > 0 ? (int) (zstats.bytes_out * 100 / zstats.bytes_in) : 100;
+  sprintf(buf, "compression: %d streams, %d KB in, %d KB out, ratio %d%%, %d ms cpu\r\n",
+          zstats.streams, (int) (zstats.bytes_in / 1024), (int) (zstats.bytes_out / 1024), ratio, (int) zstats.cputime);
+  httpd_send(conn->rsp, buf, -1);
+
+  return 0;
+}
+
+int httpd_wait(struct httpd_connection *conn, int events) {
+  // Connections are always dispatched on the iomux of the owning worker.
+  // The events are saved so a stolen connection can be redispatched.
+  conn->events = events;
+  return dispatch(conn->owner->iomux, conn->sock, events, (int) conn);
+}
+
 void httpd_accept(struct httpd_server *server) {
   int sock;
   httpd_sockaddr addr;
   struct httpd_connection *conn;
+  struct httpd_worker *worker;
   int addrlen;
+  int i, n;
 
   addrlen = sizeof(addr);
   sock = accept(server->sock, &addr.sa, &addrlen);
@@ -288,9 +351,20 @@ void httpd_accept(struct httpd_server *server) {
   conn->next = server->connections;
   conn->prev = NULL;
   server->connections = conn;
+
+  // Assign connection to the worker with the fewest connections, starting
+  // the search round-robin so ties are spread over the workers
+  worker = NULL;
+  for (i = 0; i < server->num_workers; i++) {
+    n = (server->nextworker + i) % server->num_workers;
+    if (!worker || server->workers[n].connections < worker->connections) worker = &server->workers[n];
+  }
+  server->nextworker = (server->nextworker + 1) % server->num_workers;
+  worker->connections++;
+  conn->owner = worker;
   leave(&server->srvlock);
 
-  dispatch(server->iomux, conn->sock, IOEVT_READ | IOEVT_CLOSE | IOEVT_ERROR, (int) conn);
+  httpd_wait(conn, IOEVT_READ | IOEVT_CLOSE | IOEVT_ERROR);
 }
 
 void httpd_finish_processing(struct httpd_connection *conn) {
@@ -310,6 +384,7 @@ void httpd_finish_processing(struct httpd_connection *conn) {
 int httpd_terminate_request(struct httpd_connection *conn)
 {
   int off = 0;
+  int left;
 
   if (!conn->keep) return 0;
   
@@ -321,14 +396,38 @@ int httpd_terminate_request(struct httpd_connection *conn)
   conn->fixed_rsp_data = NULL;
   conn->fixed_rsp_len = 0;
 
+  if (conn->cached_file) {
+    release_cached_file(conn->server, conn->cached_file);
+    conn->cached_file = NULL;
+  }
+
+  if (conn->zstream) {
+    deflate_close(conn->zstream, &conn->worker->zstats);
+    conn->zstream = NULL;
+  }
+  conn->chunked = 0;
+
   ioctl(conn->sock, FIONBIO, &off, sizeof(off));
 
   //printf("terminate request, %d bytes in reqhdr\n", buffer_size(&conn->reqhdr));
 
-  free_buffer(&conn->reqhdr);
+  // Keep pipelined requests received after the current request
+  while (conn->reqhdr.start < conn->reqhdr.end && (*conn->reqhdr.start == '\r' || *conn->reqhdr.start == '\n')) {
+    conn->reqhdr.start++;
+  }
+  left = buffer_size(&conn->reqhdr);
+  if (left > 0) {
+    memmove(conn->reqhdr.floor, conn->reqhdr.start, left);
+    conn->reqhdr.start = conn->reqhdr.floor;
+    conn->reqhdr.end = conn->reqhdr.floor + left;
+  } else {
+    free_buffer(&conn->reqhdr);
+  }
+
   free_buffer(&conn->reqbody);
   free_buffer(&conn->rsphdr);
   free_buffer(&conn->rspbody);
+  free_buffer(&conn->rspenc);
 
   conn->keep = 0;
   conn->hdrsent = 0;
@@ -346,15 +445,25 @@ void httpd_close_connection(struct httpd_connection *conn) {
     close(conn->fd);
     conn->fd = -1;
   }
+  if (conn->cached_file) {
+    release_cached_file(server, conn->cached_file);
+    conn->cached_file = NULL;
+  }
+  if (conn->zstream) {
+    deflate_close(conn->zstream, &conn->worker->zstats);
+    conn->zstream = NULL;
+  }
   free_buffer(&conn->reqhdr);
   free_buffer(&conn->reqbody);
   free_buffer(&conn->rsphdr);
   free_buffer(&conn->rspbody);
+  free_buffer(&conn->rspenc);
 
   enter(&server->srvlock);
   if (conn->next) conn->next->prev = conn->prev;
   if (conn->prev) conn->prev->next = conn->next;
   if (conn == server->connections) server->connections = conn->next;
+  if (conn->owner) conn->owner->connections--;
   leave(&server->srvlock);
 
   free(conn);
@@ -392,7 +501,7 @@ int httpd_recv(struct httpd_request *req, char *data, int len) {
     }
 
     buf->start = buf->floor;
-    buf->end = buf->floor + rc;
+    buf->end = buf->floor + n;
   }
 
   // Copy data from request body buffer
@@ -405,6 +514,10 @@ int httpd_recv(struct httpd_request *req, char *data, int len) {
 }
 
 int httpd_send_header(struct httpd_response *rsp, int state, char *title, char *headers) {
+  struct httpd_connection *conn = rsp->conn;
+  struct httpd_server *server = conn->server;
+  int hasbody;
+  int encoding;
   int rc;
   char buf[2048];
   char datebuf[32];
@@ -431,10 +544,33 @@ int httpd_send_header(struct httpd_response *rsp, int state, char *title, char *
     if (rc < 0) return rc;
   }
 
+  // Compress response body if the client accepts the encoding
+  hasbody = state >= 200 && state != 204 && state != 304 && stricmp(conn->req->method, "HEAD") != 0;
+  if (state == 200 && compressible(server, rsp->content_type)) {
+    rc = bufcat(&rsp->conn->rsphdr, "Vary: Accept-Encoding\r\n");
+    if (rc < 0) return rc;
+
+    encoding = select_encoding(conn, rsp->content_type);
+    if (hasbody && encoding && (rsp->content_length < 0 || rsp->content_length >= server->compressmin)) {
+      conn->zstream = deflate_open(encoding, server->compresslevel);
+      if (conn->zstream) {
+        sprintf(buf, "Content-Encoding: %s\r\n", encoding_name(encoding));
+        rc = bufcat(&rsp->conn->rsphdr, buf);
+        if (rc < 0) return rc;
+        rsp->content_length = -1;
+      }
+    }
+  }
+
+  // Use chunked transfer encoding if the length of the body is unknown
   if (rsp->content_length >= 0) {
     sprintf(buf, "Content-Length: %d\r\n", rsp->content_length);
     rc = bufcat(&rsp->conn->rsphdr, buf);
     if (rc < 0) return rc;
+  } else if (hasbody && conn->req->http11) {
+    rc = bufcat(&rsp->conn->rsphdr, "Transfer-Encoding: chunked\r\n");
+    if (rc < 0) return rc;
+    conn->chunked = 1;
   }
 
   if (headers) {
@@ -442,7 +578,7 @@ int httpd_send_header(struct httpd_response *rsp, int state, char *title, char *
     if (rc < 0) return rc;
   }
 
-  if (rsp->content_length < 0) rsp->keep_alive = 0;
+  if (rsp->content_length < 0 && !conn->chunked) rsp->keep_alive = 0;
   if (state >= 500) rsp->keep_alive = 0;
 
   if (rsp->keep_alive) {
@@ -496,6 +632,161 @@ int httpd_redirect(struct httpd_response *rsp, char *newloc) {
   return rc;
 }
 
+static int httpd_encode(struct httpd_connection *conn, char *data, int len, int flush) {
+  struct httpd_buffer *buf = &conn->rspenc;
+  char chunkhdr[16];
+  int chunk;
+  int rc;
+  int n;
+
+  if (buffer_empty(buf)) clear_buffer(buf);
+
+  // Reserve room for the chunk size in front of the chunk data
+  chunk = buf->end - buf->floor;
+  if (conn->chunked) {
+    rc = expand_buffer(buf, 10);
+    if (rc < 0) return rc;
+    buf->end += 10;
+  }
+
+  // Compress data into the encoded response buffer
+  if (conn->zstream) {
+    rc = deflate_data(conn->zstream, data, len, flush, buf);
+    if (flush == DEFLATE_FINISH) {
+      deflate_close(conn->zstream, &conn->worker->zstats);
+      conn->zstream = NULL;
+    }
+    if (rc < 0) return rc;
+  } else if (len > 0) {
+    rc = bufncat(buf, data, len);
+    if (rc < 0) return rc;
+  }
+
+  // Fill in chunk size and add last chunk at the end of the body
+  if (conn->chunked) {
+    n = buf->end - (buf->floor + chunk + 10);
+    if (n == 0) {
+      buf->end -= 10;
+    } else {
+      sprintf(chunkhdr, "%08x\r\n", n);
+      memcpy(buf->floor + chunk, chunkhdr, 10);
+      rc = bufncat(buf, "\r\n", 2);
+      if (rc < 0) return rc;
+    }
+
+    if (flush == DEFLATE_FINISH) {
+      rc = bufncat(buf, "0\r\n\r\n", 5);
+      if (rc < 0) return rc;
+      conn->chunked = 0;
+    }
+  }
+
+  return 0;
+}
+
+static int httpd_encode_body(struct httpd_connection *conn) {
+  int bytes;
+  int rc;
+  int n;
+
+  // Encode response body from buffer, fixed data or file until there is
+  // encoded data to send or the body has been completed
+  while (buffer_empty(&conn->rspenc) && (conn->zstream || conn->chunked)) {
+    if (!buffer_empty(&conn->rspbody)) {
+      rc = httpd_encode(conn, conn->rspbody.start, buffer_size(&conn->rspbody), DEFLATE_NOFLUSH);
+      clear_buffer(&conn->rspbody);
+    } else if (conn->fixed_rsp_len > 0) {
+      n = conn->fixed_rsp_len;
+      if (n > conn->server->rspbufsiz) n = conn->server->rspbufsiz;
+      rc = httpd_encode(conn, conn->fixed_rsp_data, n, DEFLATE_NOFLUSH);
+      conn->fixed_rsp_data += n;
+      conn->fixed_rsp_len -= n;
+    } else if (conn->fd >= 0) {
+      if (conn->rspbody.floor == NULL) {
+        rc = allocate_buffer(&conn->rspbody, conn->server->rspbufsiz);
+        if (rc < 0) return rc;
+      }
+
+      bytes = read(conn->fd, conn->rspbody.floor, buffer_capacity(&conn->rspbody));
+      if (bytes < 0) return bytes;
+
+      conn->rspbody.start = conn->rspbody.floor;
+      conn->rspbody.end = conn->rspbody.floor + bytes;
+
+      if (bytes == 0) {
+        close(conn->fd);
+        conn->fd = -1;
+      }
+      rc = 0;
+    } else {
+      rc = httpd_encode(conn, NULL, 0, DEFLATE_FINISH);
+    }
+    if (rc < 0) return rc;
+  }
+
+  return 0;
+}
+
+static int httpd_sendv(struct httpd_response *rsp, char *data, int len, int flush) {
+  struct httpd_connection *conn = rsp->conn;
+  struct iovec iov[4];
+  int rc;
+  int n = 0;
+
+  // Generate standard header if no header has been sent
+  if (!conn->hdrsent && buffer_empty(&conn->rsphdr)) {
+    rc = httpd_send_header(rsp, 200, "OK", NULL);
+    if (rc < 0) return rc;
+  }
+
+  // Compress and/or chunk encode buffered response body and data
+  if (conn->zstream || conn->chunked) {
+    if (!buffer_empty(&conn->rspbody)) {
+      rc = httpd_encode(conn, conn->rspbody.start, buffer_size(&conn->rspbody), DEFLATE_NOFLUSH);
+      if (rc < 0) return rc;
+      clear_buffer(&conn->rspbody);
+    }
+
+    rc = httpd_encode(conn, data, len, flush);
+    if (rc < 0) return rc;
+    data = NULL;
+  }
+
+  // Send header, encoded or buffered response body, and data in one gather write
+  if (!buffer_empty(&conn->rsphdr)) {
+    iov[n].iov_base = conn->rsphdr.start;
+    iov[n].iov_len = buffer_size(&conn->rsphdr);
+    n++;
+  }
+  if (!buffer_empty(&conn->rspenc)) {
+    iov[n].iov_base = conn->rspenc.start;
+    iov[n].iov_len = buffer_size(&conn->rspenc);
+    n++;
+  }
+  if (!buffer_empty(&conn->rspbody)) {
+    iov[n].iov_base = conn->rspbody.start;
+    iov[n].iov_len = buffer_size(&conn->rspbody);
+    n++;
+  }
+  if (data && len > 0) {
+    iov[n].iov_base = data;
+    iov[n].iov_len = len;
+    n++;
+  }
+
+  if (n > 0) {
+    rc = writev(conn->sock, iov, n);
+    if (rc < 0) return rc;
+  }
+
+  conn->rsphdr.start = conn->rsphdr.end;
+  clear_buffer(&conn->rspbody);
+  clear_buffer(&conn->rspenc);
+  conn->hdrsent = 1;
+
+  return len;
+}
+
 int httpd_send(struct httpd_response *rsp, char *data, int len) {
   struct httpd_buffer *buf = &rsp->conn->rspbody;
   int rc;
@@ -504,14 +795,8 @@ int httpd_send(struct httpd_response *rsp, char *data, int len) {
 
   if (len == -1) len = strlen(data);
 
-  // Send directly if data larger than buffer
-  if (len > rsp->conn->server->rspbufsiz) {
-    rc = httpd_flush(rsp);
-    if (rc < 0) return rc;
-
-    rc = send(rsp->conn->sock, data, len, 0);
-    return rc;
-  }
+  // Send directly together with buffered data if data larger than buffer
+  if (len > rsp->conn->server->rspbufsiz) return httpd_sendv(rsp, data, len, DEFLATE_NOFLUSH);
 
   // Allocate response body buffer if not already done
   if (!buf->floor) {
@@ -523,7 +808,7 @@ int httpd_send(struct httpd_response *rsp, char *data, int len) {
   while (left > 0) {
     // Send buffer if full
     if (buf->ceil == buf->end) {
-      rc = httpd_flush(rsp);
+      rc = httpd_sendv(rsp, NULL, 0, DEFLATE_NOFLUSH);
       if (rc < 0) return rc;
     }
 
@@ -540,38 +825,10 @@ int httpd_send(struct httpd_response *rsp, char *data, int len) {
 }
 
 int httpd_flush(struct httpd_response *rsp) {
-  struct httpd_buffer *buf;
   int rc;
 
-  // Send response header if not already done
-  if (!rsp->conn->hdrsent) {
-    buf = &rsp->conn->rsphdr;
-
-    // Generate standard header
-    if (buf->start == buf->end) {
-      rc = httpd_send_header(rsp, 200, "OK", NULL);
-      if (rc < 0) return rc;
-    }
-
-    // Send header
-    if (buf->end != buf->start) {
-      rc = send(rsp->conn->sock, buf->start, buf->end - buf->start, 0);
-      if (rc < 0) return rc;
-
-      buf->start = buf->end;
-    }
-
-    rsp->conn->hdrsent = 1;
-  }
-
-  // Send response body
-  buf = &rsp->conn->rspbody;
-  if (buf->end != buf->start) {
-    rc = send(rsp->conn->sock, buf->start, buf->end - buf->start, 0);
-    if (rc < 0) return rc;
-
-    buf->start = buf->end = buf->floor;
-  }
+  rc = httpd_sendv(rsp, NULL, 0, DEFLATE_SYNC);
+  if (rc < 0) return rc;
 
   return 0;
 }
@@ -825,6 +1082,8 @@ int httpd_parse_request(struct httpd_request *req) {
       req->user_agent = s;
     } else if (stricmp(l, "Accept") == 0) {
       req->accept = s;
+    } else if (stricmp(l, "Accept-encoding") == 0) {
+      req->accept_encoding = s;
     } else if (stricmp(l, "Cookie") == 0) {
       req->cookie = s;
     } else if (stricmp(l, "Authorization") == 0) {
@@ -837,6 +1096,8 @@ int httpd_parse_request(struct httpd_request *req) {
       req->host = s;
     } else if (stricmp(l, "If-modified-since") == 0) {
       req->if_modified_since = timerfc(s);
+    } else if (stricmp(l, "If-none-match") == 0) {
+      req->if_none_match = s;
     } else if (stricmp(l, "Connection") == 0) {
       req->keep_alive = stricmp(s, "keep-alive") == 0;
     }
@@ -932,42 +1193,21 @@ int httpd_translate_path(struct httpd_request *req) {
 }
 
 int httpd_write(struct httpd_connection *conn) {
+  struct iovec iov[4];
   int left;
   int bytes;
   int rc;
+  int n;
 
-  // Sent any remaining data in response header
-  left = conn->rsphdr.end - conn->rsphdr.start;
-  if (left > 0) {
-    bytes = send(conn->sock, conn->rsphdr.start, left, 0);
-    if (bytes < 0) return bytes;
-    conn->rsphdr.start += bytes;
-    if (bytes < left) return 1;
-  }
-
-  // Sent any remaining fixed response data
-  left = conn->fixed_rsp_len;
-  if (left > 0) {
-    bytes = send(conn->sock, conn->fixed_rsp_data, left, 0);
-    if (bytes < 0) return bytes;
-    conn->fixed_rsp_data += bytes;
-    conn->fixed_rsp_len -= bytes;
-    if (bytes < left) return 1;
-  }
-
-  // Send response body
   while (1) {
-    // Send any remaining data in response body buffer
-    left = conn->rspbody.end - conn->rspbody.start;
-    if (left > 0) {
-      bytes = send(conn->sock, conn->rspbody.start, left, 0);
-      if (bytes < 0) return bytes;
-      conn->rspbody.start += bytes;
-      if (bytes < left) return 1;
-    }
-
-    // Fill response buffer
-    if (conn->fd >= 0) {
+    if (conn->zstream || conn->chunked) {
+      // Encode more of the response body
+      if (buffer_empty(&conn->rspenc)) {
+        rc = httpd_encode_body(conn);
+        if (rc < 0) return rc;
+      }
+    } else if (conn->fd >= 0 && buffer_empty(&conn->rspbody)) {
+      // Fill response buffer from file
       // Allocate response body buffer if not already done
       if (conn->rspbody.floor == NULL) {
         rc = allocate_buffer(&conn->rspbody, conn->server->rspbufsiz);
@@ -977,19 +1217,72 @@ int httpd_write(struct httpd_connection *conn) {
       // Read from file
       bytes = read(conn->fd, conn->rspbody.floor, buffer_capacity(&conn->rspbody));
       if (bytes < 0) return bytes;
-      if (bytes == 0) return 0;
 
       conn->rspbody.start = conn->rspbody.floor;
       conn->rspbody.end = conn->rspbody.floor + bytes;
-    } else {
-      return 0;
+
+      if (bytes == 0) {
+        close(conn->fd);
+        conn->fd = -1;
+      }
+    }
+
+    // Gather remaining response header, encoded response body, fixed
+    // response data, and response body
+    n = 0;
+    if (!buffer_empty(&conn->rsphdr)) {
+      iov[n].iov_base = conn->rsphdr.start;
+      iov[n].iov_len = buffer_size(&conn->rsphdr);
+      n++;
+    }
+    if (!buffer_empty(&conn->rspenc)) {
+      iov[n].iov_base = conn->rspenc.start;
+      iov[n].iov_len = buffer_size(&conn->rspenc);
+      n++;
+    }
+    if (conn->fixed_rsp_len > 0) {
+      iov[n].iov_base = conn->fixed_rsp_data;
+      iov[n].iov_len = conn->fixed_rsp_len;
+      n++;
+    }
+    if (!buffer_empty(&conn->rspbody)) {
+      iov[n].iov_base = conn->rspbody.start;
+      iov[n].iov_len = buffer_size(&conn->rspbody);
+      n++;
     }
+    if (n == 0) return 0;
+
+    left = buffer_size(&conn->rsphdr) + buffer_size(&conn->rspenc) + conn->fixed_rsp_len + buffer_size(&conn->rspbody);
+    bytes = writev(conn->sock, iov, n);
+    if (bytes < 0) return bytes;
+
+    // Consume the data that has been sent
+    n = buffer_size(&conn->rsphdr);
+    if (n > bytes) n = bytes;
+    conn->rsphdr.start += n;
+    rc = bytes - n;
+
+    n = buffer_size(&conn->rspenc);
+    if (n > rc) n = rc;
+    conn->rspenc.start += n;
+    rc -= n;
+
+    n = conn->fixed_rsp_len;
+    if (n > rc) n = rc;
+    conn->fixed_rsp_data += n;
+    conn->fixed_rsp_len -= n;
+    rc -= n;
+
+    conn->rspbody.start += rc;
+
+    if (bytes < left) return 1;
   }
 }
 
 int httpd_process(struct httpd_connection *conn) {
   struct httpd_request req;
   struct httpd_response rsp;
+  char *end;
   int rc;
   int size;
   int on = 1;
@@ -1007,8 +1300,12 @@ int httpd_process(struct httpd_connection *conn) {
   conn->keep = 0;
   conn->hdrsent = 0;
 
-  // Parse HTTP request
+  // Parse HTTP request. Only the request header is parsed, leaving any
+  // request body and pipelined requests in the request header buffer.
+  end = conn->reqhdr.end;
+  conn->reqhdr.end = conn->reqhdr.floor + conn->hdrlen;
   rc = httpd_parse_request(&req);
+  conn->reqhdr.end = end;
   if (rc < 0) goto errorexit;
   rsp.keep_alive = req.keep_alive;
 
@@ -1057,6 +1354,12 @@ int httpd_process(struct httpd_connection *conn) {
   rc = log_request(&req);
   if (rc < 0) goto errorexit;
 
+  // Requests with a body are not pipelined since the handler may not have
+  // read all of the body
+  if (req.content_length > 0) {
+    if (!buffer_empty(&conn->reqhdr) || !buffer_empty(&conn->reqbody)) rsp.keep_alive = 0;
+  }
+
   // Prepare for sending back response
   rc = ioctl(conn->sock, FIONBIO, &on, sizeof(on));
   if (rc < 0) goto errorexit;
@@ -1073,97 +1376,196 @@ errorexit:
 int httpd_io(struct httpd_connection *conn) {
   int rc;
 
-  switch (conn->state) {
-    case HTTP_STATE_IDLE:
-      rc = allocate_buffer(&conn->reqhdr, conn->server->min_hdrbufsiz);
-      if (rc < 0) return rc;
-      conn->state = HTTP_STATE_READ_REQUEST;
-      conn->hdrstate = HDR_STATE_FIRSTWORD;
-      // Fall through
-
-    case HTTP_STATE_READ_REQUEST:
-      if (buffer_capacity(&conn->reqhdr) >= conn->server->max_hdrbufsiz) return -EBUF;
-      rc = expand_buffer(&conn->reqhdr, 1);
-      if (rc < 0) return rc;
+  while (1) {
+    switch (conn->state) {
+      case HTTP_STATE_IDLE:
+        conn->hdrstate = HDR_STATE_FIRSTWORD;
+        if (buffer_empty(&conn->reqhdr)) {
+          if (!conn->reqhdr.floor) {
+            rc = allocate_buffer(&conn->reqhdr, conn->server->min_hdrbufsiz);
+            if (rc < 0) return rc;
+          }
+          conn->state = HTTP_STATE_READ_REQUEST;
+          break;
+        }
 
-      rc = recv(conn->sock, conn->reqhdr.end, buffer_left(&conn->reqhdr), 0);
-      if (rc <= 0) {
-        if (errno == ECONNRESET && buffer_size(&conn->reqhdr) == 0) {
-          // Keep-Alive connection closed
-          conn->state = HTTP_STATE_TERMINATED;
-          httpd_close_connection(conn);
+        // Check for a pipelined request received with the previous request
+        rc = httpd_check_header(conn);
+        if (rc < 0) return rc;
+        if (rc == 0) {
+          conn->state = HTTP_STATE_READ_REQUEST;
+          rc = httpd_wait(conn, IOEVT_READ | IOEVT_CLOSE | IOEVT_ERROR);
+          if (rc < 0) return rc;
           return 1;
         }
+        conn->hdrlen = conn->reqhdr.start - conn->reqhdr.floor;
+        conn->state = HTTP_STATE_PROCESSING;
+        break;
 
-        return rc;
-      }
+      case HTTP_STATE_READ_REQUEST:
+        if (buffer_capacity(&conn->reqhdr) >= conn->server->max_hdrbufsiz) return -EBUF;
+        rc = expand_buffer(&conn->reqhdr, 1);
+        if (rc < 0) return rc;
 
-      conn->reqhdr.end += rc;
+        rc = recv(conn->sock, conn->reqhdr.end, buffer_left(&conn->reqhdr), 0);
+        if (rc <= 0) {
+          if (errno == ECONNRESET && buffer_size(&conn->reqhdr) == 0) {
+            // Keep-Alive connection closed
+            conn->state = HTTP_STATE_TERMINATED;
+            httpd_close_connection(conn);
+            return 1;
+          }
 
-      rc = httpd_check_header(conn);
-      if (rc < 0) return rc;
-      if (rc == 0) {
-        rc = dispatch(conn->server->iomux, conn->sock, IOEVT_READ | IOEVT_CLOSE | IOEVT_ERROR, (int) conn);
-        if (rc < 0) return rc;
-        return 1;
-      }
-      conn->state = HTTP_STATE_PROCESSING;
-      // Fall through
+          return rc;
+        }
 
-    case HTTP_STATE_PROCESSING:
-      rc = httpd_process(conn);
-      if (rc < 0) return rc;
-      conn->state = HTTP_STATE_WRITE_RESPONSE;
-      // Fall through
+        conn->reqhdr.end += rc;
 
-    case HTTP_STATE_WRITE_RESPONSE:
-      rc = httpd_write(conn);
-      if (rc < 0) return rc;
+        rc = httpd_check_header(conn);
+        if (rc < 0) return rc;
+        if (rc == 0) {
+          rc = httpd_wait(conn, IOEVT_READ | IOEVT_CLOSE | IOEVT_ERROR);
+          if (rc < 0) return rc;
+          return 1;
+        }
+        conn->hdrlen = conn->reqhdr.start - conn->reqhdr.floor;
+        conn->state = HTTP_STATE_PROCESSING;
+        break;
 
-      if (rc > 0) {
-        rc = dispatch(conn->server->iomux, conn->sock, IOEVT_WRITE | IOEVT_CLOSE | IOEVT_ERROR, (int) conn);
+      case HTTP_STATE_PROCESSING:
+        rc = httpd_process(conn);
         if (rc < 0) return rc;
-      } else {
-        rc = httpd_terminate_request(conn);
+        conn->state = HTTP_STATE_WRITE_RESPONSE;
+        break;
+
+      case HTTP_STATE_WRITE_RESPONSE:
+        rc = httpd_write(conn);
+        if (rc < 0) return rc;
+
         if (rc > 0) {
-          conn->state = HTTP_STATE_IDLE;
-          rc = dispatch(conn->server->iomux, conn->sock, IOEVT_READ | IOEVT_CLOSE | IOEVT_ERROR, (int) conn);
+          rc = httpd_wait(conn, IOEVT_WRITE | IOEVT_CLOSE | IOEVT_ERROR);
           if (rc < 0) return rc;
-        } else {
+          return 1;
+        }
+
+        rc = httpd_terminate_request(conn);
+        if (rc == 0) {
           conn->state = HTTP_STATE_TERMINATED;
           httpd_close_connection(conn);
+          return 1;
         }
-      }
-      return 1;
 
-    case HTTP_STATE_TERMINATED:
-      return 1;
+        // Process pipelined requests before waiting for more data
+        conn->state = HTTP_STATE_IDLE;
+        if (!buffer_empty(&conn->reqhdr)) break;
 
-    default:
-      errno = EINVAL;
-      return -1;
+        rc = httpd_wait(conn, IOEVT_READ | IOEVT_CLOSE | IOEVT_ERROR);
+        if (rc < 0) return rc;
+        return 1;
+
+      case HTTP_STATE_TERMINATED:
+        return 1;
+
+      default:
+        errno = EINVAL;
+        return -1;
+    }
   }
 }
 
-void __stdcall httpd_worker(void *arg) {
+static struct httpd_worker *httpd_idle_worker(struct httpd_server *server) {
+  struct httpd_worker *worker;
+  int i;
+
+  for (i = 0; i < server->num_workers; i++) {
+    worker = &server->workers[i];
+    if (worker->busy == 0) return worker;
+  }
+
+  return NULL;
+}
+
+void httpd_steal(struct httpd_server *server) {
+  struct httpd_worker *victim;
+  struct httpd_worker *worker;
+  struct httpd_connection *conn;
+  clock_t now = clock();
+  clock_t busy;
+  int rc;
+  int i;
+
+  // Move ready connections from workers that have been busy with the same
+  // request for longer than the steal interval, e.g. a large directory
+  // listing, to idle workers. The ready connection is redispatched on the
+  // iomux of the idle worker, which is signaled at once since the socket
+  // is still ready. The connection stays with its owner for later requests.
+  for (i = 0; i < server->num_workers; i++) {
+    victim = &server->workers[i];
+    busy = victim->busy;
+    if (busy == 0 || now - busy < server->stealinterval) continue;
+
+    worker = httpd_idle_worker(server);
+    if (!worker) return;
+
+    rc = waitone(victim->iomux, 0);
+    if (rc < 0) continue;
+    conn = (struct httpd_connection *) rc;
+    if (dispatch(worker->iomux, conn->sock, conn->events, (int) conn) < 0) {
+      httpd_wait(conn, conn->events);
+    } else {
+      worker->stolen++;
+    }
+  }
+}
+
+void __stdcall httpd_acceptor(void *arg) {
   struct httpd_server *server = (struct httpd_server *) arg;
+  int timeout;
+  int rc;
+
+  // Periodically look for work to steal from busy workers
+  if (server->num_workers > 1 && server->stealinterval > 0) {
+    timeout = server->stealinterval;
+  } else {
+    timeout = INFINITE;
+  }
+
+  while (1) {
+    rc = waitone(server->acceptmux, timeout);
+    if (rc < 0) {
+      if (errno != ETIMEOUT) break;
+      httpd_steal(server);
+      continue;
+    }
+
+    // Accept new connection and hand it to a worker
+    httpd_accept(server);
+    if (dispatch(server->acceptmux, server->sock, IOEVT_ACCEPT, 0) < 0) break;
+  }
+}
+
+void __stdcall httpd_worker(void *arg) {
+  struct httpd_worker *worker = (struct httpd_worker *) arg;
   struct httpd_connection *conn;
   int rc;
 
+  // Idle workers block on their iomux until one of their connections, or a
+  // connection stolen from a busy worker, is ready
   while (1) {
-    rc = waitone(server->iomux, INFINITE);
+    rc = waitone(worker->iomux, INFINITE);
     if (rc < 0) break;
 
+    worker->busy = clock();
+    if (worker->busy == 0) worker->busy = 1;
+
     conn = (struct httpd_connection *) rc;
-    if (conn == NULL) {
-      httpd_accept(server);
-      dispatch(server->iomux, server->sock, IOEVT_ACCEPT, 0);
-    } else {
-      rc = httpd_io(conn);
-      if (rc <= 0) {
-        httpd_close_connection(conn);
-      }
+    conn->worker = worker;
+    rc = httpd_io(conn);
+    if (rc <= 0) {
+      httpd_close_connection(conn);
     }
+
+    worker->busy = 0;
   }
 }
 
@@ -1196,13 +1598,36 @@ int httpd_start(struct httpd_server *server) {
   ioctl(sock, FIONBIO, NULL, 0);
 
   server->sock = sock;
-  server->iomux = mkiomux(0);
-  dispatch(server->iomux, server->sock, IOEVT_ACCEPT, 0);
+
+  // Add status page if configured. It is added last so it takes precedence
+  // over the contexts added by the application.
+  if (server->statusurl) httpd_add_context(server, server->statusurl, httpd_status_handler, NULL, NULL);
+
+  // Each worker has its own iomux for the connections assigned to it. New
+  // connections are accepted by a separate thread with its own iomux.
+  if (server->num_workers < 1) server->num_workers = 1;
+  server->workers = (struct httpd_worker *) malloc(server->num_workers * sizeof(struct httpd_worker));
+  if (!server->workers) return -1;
+  memset(server->workers, 0, server->num_workers * sizeof(struct httpd_worker));
+  for (i = 0; i < server->num_workers; i++) {
+    server->workers[i].server = server;
+    server->workers[i].iomux = mkiomux(0);
+    if (server->workers[i].iomux < 0) return -1;
+    mkcs(&server->workers[i].log.lock);
+  }
+  server->acceptmux = mkiomux(0);
+  if (server->acceptmux < 0) return -1;
+  dispatch(server->acceptmux, server->sock, IOEVT_ACCEPT, 0);
+
+  rc = start_log(server);
+  if (rc < 0) return rc;
 
   for (i = 0; i < server->num_workers; i++) {
-    hthread = beginthread(httpd_worker, 0, server, 0, "http", NULL);
+    hthread = beginthread(httpd_worker, 0, &server->workers[i], 0, "http", NULL);
     close(hthread);
   }
+  hthread = beginthread(httpd_acceptor, 0, server, 0, "httpaccept", NULL);
+  close(hthread);
 
   return 0;
 }
@@ -0,0 +1,778 @@
+//
+// hzip.c
+//
+// HTTP response compression
+//
+// Copyright (C) 2013 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <httpd.h>
+
+//
+// Streaming deflate encoder (RFC 1951) with gzip (RFC 1952) and zlib
+// (RFC 1950) framing. Input is collected in a sliding window and matched
+// against the previous 32K of data using hash chains. Literals and matches
+// are buffered as symbols and emitted as a block using either the fixed
+// Huffman codes or dynamic codes built from the symbol frequencies of the
+// block, whichever is smaller.
+//
+
+#define WSIZE          32768
+#define WMASK          (WSIZE - 1)
+#define HASH_BITS      14
+#define HASH_SIZE      (1 << HASH_BITS)
+#define HASH_MASK      (HASH_SIZE - 1)
+
+#define MIN_MATCH      3
+#define MAX_MATCH      258
+#define MIN_LOOKAHEAD  (MAX_MATCH + MIN_MATCH + 1)
+#define MAX_DIST       (WSIZE - MIN_LOOKAHEAD)
+#define TOO_FAR        4096
+
+#define MAX_SYMBOLS    16384
+#define MAX_BITS       15
+#define MAX_BL_BITS    7
+#define END_BLOCK      256
+#define L_CODES        286
+#define D_CODES        30
+#define BL_CODES       19
+
+struct httpd_zstream {
+  int encoding;
+  int maxchain;
+  int nicelen;
+  int started;
+  int error;
+
+  unsigned char window[2 * WSIZE];
+  unsigned short head[HASH_SIZE];
+  unsigned short prev[WSIZE];
+  int strstart;
+  int lookahead;
+
+  unsigned char symlen[MAX_SYMBOLS];
+  unsigned short symdist[MAX_SYMBOLS];
+  int nsyms;
+  int litfreq[L_CODES];
+  int distfreq[D_CODES];
+
+  unsigned long bitbuf;
+  int bitcnt;
+  struct httpd_buffer *out;
+
+  unsigned long checksum;
+  unsigned long insize;
+  unsigned long outsize;
+  clock_t cputime;
+};
+
+static const int lbase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const int lextra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const int dbase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const int dextra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const unsigned char bl_order[BL_CODES] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static unsigned long crc_table[256];
+static unsigned char length_code[256];
+static unsigned char dist_code[512];
+
+static unsigned char fixed_litlen[288];
+static unsigned short fixed_litcode[288];
+static unsigned char fixed_distlen[D_CODES];
+static unsigned short fixed_distcode[D_CODES];
+
+static void gen_codes(unsigned char *lens, unsigned short *codes, int n) {
+  int count[MAX_BITS + 1];
+  int next[MAX_BITS + 1];
+  int code;
+  int bits;
+  int len;
+  int rev;
+  int i;
+
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < n; i++) count[lens[i]]++;
+  count[0] = 0;
+
+  code = 0;
+  for (bits = 1; bits <= MAX_BITS; bits++) {
+    code = (code + count[bits - 1]) << 1;
+    next[bits] = code;
+  }
+
+  // Codes are stored bit reversed since they are sent starting with the
+  // most significant bit
+  for (i = 0; i < n; i++) {
+    len = lens[i];
+    if (len == 0) continue;
+    code = next[len]++;
+    rev = 0;
+    while (len-- > 0) {
+      rev = (rev << 1) | (code & 1);
+      code >>= 1;
+    }
+    codes[i] = rev;
+  }
+}
+
+static void init_tables() {
+  unsigned long c;
+  int code;
+  int len;
+  int dist;
+  int n;
+  int k;
+
+  for (n = 0; n < 256; n++) {
+    c = n;
+    for (k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc_table[n] = c;
+  }
+
+  len = 0;
+  for (code = 0; code < 28; code++) {
+    for (n = 0; n < (1 << lextra[code]); n++) length_code[len++] = code;
+  }
+  length_code[255] = 28;
+
+  dist = 0;
+  for (code = 0; code < 16; code++) {
+    for (n = 0; n < (1 << dextra[code]); n++) dist_code[dist++] = code;
+  }
+  dist >>= 7;
+  for (code = 16; code < D_CODES; code++) {
+    for (n = 0; n < (1 << (dextra[code] - 7)); n++) dist_code[256 + dist++] = code;
+  }
+
+  for (n = 0; n < 144; n++) fixed_litlen[n] = 8;
+  for (n = 144; n < 256; n++) fixed_litlen[n] = 9;
+  for (n = 256; n < 280; n++) fixed_litlen[n] = 7;
+  for (n = 280; n < 288; n++) fixed_litlen[n] = 8;
+  gen_codes(fixed_litlen, fixed_litcode, 288);
+
+  for (n = 0; n < D_CODES; n++) fixed_distlen[n] = 5;
+  gen_codes(fixed_distlen, fixed_distcode, D_CODES);
+}
+
+static void update_checksum(struct httpd_zstream *z, unsigned char *data, int len) {
+  unsigned long crc;
+  unsigned long a, b;
+  int n;
+
+  if (z->encoding == HTTPD_ENCODING_GZIP) {
+    crc = z->checksum;
+    while (len-- > 0) crc = crc_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    z->checksum = crc;
+  } else {
+    a = z->checksum & 0xFFFF;
+    b = z->checksum >> 16;
+    while (len > 0) {
+      n = len < 5552 ? len : 5552;
+      len -= n;
+      while (n-- > 0) {
+        a += *data++;
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+    }
+    z->checksum = (b << 16) | a;
+  }
+}
+
+static void put_byte(struct httpd_zstream *z, int c) {
+  struct httpd_buffer *out = z->out;
+
+  if (out->end == out->ceil && expand_buffer(out, 1024) < 0) {
+    z->error = 1;
+    return;
+  }
+
+  *out->end++ = c;
+  z->outsize++;
+}
+
+static void send_bits(struct httpd_zstream *z, unsigned int value, int bits) {
+  z->bitbuf |= (unsigned long) value << z->bitcnt;
+  z->bitcnt += bits;
+  while (z->bitcnt >= 8) {
+    put_byte(z, z->bitbuf & 0xFF);
+    z->bitbuf >>= 8;
+    z->bitcnt -= 8;
+  }
+}
+
+static void align_bits(struct httpd_zstream *z) {
+  if (z->bitcnt > 0) put_byte(z, z->bitbuf & 0xFF);
+  z->bitbuf = 0;
+  z->bitcnt = 0;
+}
+
+static void put_long(struct httpd_zstream *z, unsigned long value, int bigendian) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (bigendian) {
+      put_byte(z, (value >> (24 - i * 8)) & 0xFF);
+    } else {
+      put_byte(z, (value >> (i * 8)) & 0xFF);
+    }
+  }
+}
+
+static void build_lengths(int *freq, int n, int maxbits, unsigned char *lens) {
+  int sym[L_CODES];
+  int weight[2 * L_CODES];
+  int parent[2 * L_CODES];
+  int count[33];
+  unsigned long total;
+  int leaf, node, next;
+  int child;
+  int bits;
+  int m;
+  int i, j, k, s;
+
+  // Collect used symbols sorted by increasing frequency
+  m = 0;
+  for (i = 0; i < n; i++) {
+    lens[i] = 0;
+    if (freq[i] == 0) continue;
+    for (j = m; j > 0 && freq[sym[j - 1]] > freq[i]; j--) sym[j] = sym[j - 1];
+    sym[j] = i;
+    m++;
+  }
+
+  // A code needs at least two symbols to be complete
+  if (m < 2) {
+    s = m == 1 ? sym[0] : 0;
+    lens[s] = 1;
+    lens[s == 0 ? 1 : 0] = 1;
+    return;
+  }
+
+  // Build Huffman tree by merging the two lightest nodes. Leaves are taken
+  // from the sorted symbol list and new nodes are created in order of
+  // increasing weight, so both lists can be consumed from the front.
+  for (i = 0; i < m; i++) weight[i] = freq[sym[i]];
+  leaf = 0;
+  node = m;
+  for (next = m; next < 2 * m - 1; next++) {
+    weight[next] = 0;
+    for (k = 0; k < 2; k++) {
+      if (leaf < m && (node >= next || weight[leaf] <= weight[node])) {
+        child = leaf++;
+      } else {
+        child = node++;
+      }
+      parent[child] = next;
+      weight[next] += weight[child];
+    }
+  }
+
+  // Compute depth of each node and count the leaves at each depth
+  memset(count, 0, sizeof(count));
+  weight[2 * m - 2] = 0;
+  for (i = 2 * m - 3; i >= 0; i--) {
+    weight[i] = weight[parent[i]] + 1;
+    if (i < m) count[weight[i] > 32 ? 32 : weight[i]]++;
+  }
+
+  // Limit code lengths to maxbits by moving leaves up the tree until the
+  // Kraft sum is one again
+  for (i = maxbits + 1; i <= 32; i++) {
+    count[maxbits] += count[i];
+    count[i] = 0;
+  }
+  total = 0;
+  for (i = maxbits; i > 0; i--) total += (unsigned long) count[i] << (maxbits - i);
+  while (total != (1UL << maxbits)) {
+    count[maxbits]--;
+    for (i = maxbits - 1; i > 0; i--) {
+      if (count[i]) {
+        count[i]--;
+        count[i + 1] += 2;
+        break;
+      }
+    }
+    total--;
+  }
+
+  // Assign the longest codes to the least frequent symbols
+  j = 0;
+  for (bits = maxbits; bits > 0; bits--) {
+    for (k = count[bits]; k > 0; k--) lens[sym[j++]] = bits;
+  }
+}
+
+static void compress_symbols(struct httpd_zstream *z, unsigned char *litlen, unsigned short *litcode, unsigned char *distlen, unsigned short *distcode) {
+  int code;
+  int dist;
+  int len;
+  int i;
+
+  for (i = 0; i < z->nsyms; i++) {
+    len = z->symlen[i];
+    dist = z->symdist[i];
+    if (dist == 0) {
+      send_bits(z, litcode[len], litlen[len]);
+    } else {
+      code = length_code[len];
+      send_bits(z, litcode[257 + code], litlen[257 + code]);
+      if (lextra[code]) send_bits(z, len + MIN_MATCH - lbase[code], lextra[code]);
+
+      dist--;
+      code = dist < 256 ? dist_code[dist] : dist_code[256 + (dist >> 7)];
+      send_bits(z, distcode[code], distlen[code]);
+      if (dextra[code]) send_bits(z, dist + 1 - dbase[code], dextra[code]);
+    }
+  }
+
+  send_bits(z, litcode[END_BLOCK], litlen[END_BLOCK]);
+}
+
+static void flush_block(struct httpd_zstream *z, int last) {
+  unsigned char litlen[L_CODES];
+  unsigned short litcode[L_CODES];
+  unsigned char distlen[D_CODES];
+  unsigned short distcode[D_CODES];
+  unsigned char lens[L_CODES + D_CODES];
+  unsigned char rle[L_CODES + D_CODES];
+  unsigned char rlextra[L_CODES + D_CODES];
+  int blfreq[BL_CODES];
+  unsigned char bllen[BL_CODES];
+  unsigned short blcode[BL_CODES];
+  unsigned long fixedsize;
+  unsigned long dynsize;
+  unsigned long extra;
+  int hlit, hdist, hclen;
+  int nrle;
+  int len;
+  int run;
+  int n;
+  int i;
+
+  z->litfreq[END_BLOCK] = 1;
+
+  // Build dynamic codes for literals/lengths and distances
+  build_lengths(z->litfreq, L_CODES, MAX_BITS, litlen);
+  build_lengths(z->distfreq, D_CODES, MAX_BITS, distlen);
+  gen_codes(litlen, litcode, L_CODES);
+  gen_codes(distlen, distcode, D_CODES);
+
+  hlit = L_CODES;
+  while (hlit > 257 && litlen[hlit - 1] == 0) hlit--;
+  hdist = D_CODES;
+  while (hdist > 1 && distlen[hdist - 1] == 0) hdist--;
+
+  // Run length encode the code lengths
+  memcpy(lens, litlen, hlit);
+  memcpy(lens + hlit, distlen, hdist);
+  n = hlit + hdist;
+  memset(blfreq, 0, sizeof(blfreq));
+  nrle = 0;
+  i = 0;
+  while (i < n) {
+    len = lens[i];
+    run = 1;
+    while (i + run < n && lens[i + run] == len) run++;
+
+    if (len == 0 && run >= 3) {
+      if (run > 138) run = 138;
+      if (run >= 11) {
+        rle[nrle] = 18;
+        rlextra[nrle] = run - 11;
+      } else {
+        rle[nrle] = 17;
+        rlextra[nrle] = run - 3;
+      }
+      i += run;
+    } else if (i > 0 && lens[i - 1] == len && run >= 3) {
+      if (run > 6) run = 6;
+      rle[nrle] = 16;
+      rlextra[nrle] = run - 3;
+      i += run;
+    } else {
+      rle[nrle] = len;
+      rlextra[nrle] = 0;
+      i++;
+    }
+    blfreq[rle[nrle++]]++;
+  }
+
+  build_lengths(blfreq, BL_CODES, MAX_BL_BITS, bllen);
+  gen_codes(bllen, blcode, BL_CODES);
+  hclen = BL_CODES;
+  while (hclen > 4 && bllen[bl_order[hclen - 1]] == 0) hclen--;
+
+  // Compute the size of the block with fixed and dynamic codes
+  extra = 0;
+  fixedsize = 3;
+  dynsize = 3 + 5 + 5 + 4 + 3 * hclen;
+  for (i = 0; i < L_CODES; i++) {
+    fixedsize += (unsigned long) z->litfreq[i] * fixed_litlen[i];
+    dynsize += (unsigned long) z->litfreq[i] * litlen[i];
+    if (i > 256) extra += (unsigned long) z->litfreq[i] * lextra[i - 257];
+  }
+  for (i = 0; i < D_CODES; i++) {
+    fixedsize += (unsigned long) z->distfreq[i] * fixed_distlen[i];
+    dynsize += (unsigned long) z->distfreq[i] * distlen[i];
+    extra += (unsigned long) z->distfreq[i] * dextra[i];
+  }
+  for (i = 0; i < nrle; i++) {
+    dynsize += bllen[rle[i]];
+    if (rle[i] == 16) dynsize += 2;
+    if (rle[i] == 17) dynsize += 3;
+    if (rle[i] == 18) dynsize += 7;
+  }
+
+  // Emit block
+  send_bits(z, last, 1);
+  if (fixedsize <= dynsize) {
+    send_bits(z, 1, 2);
+    compress_symbols(z, fixed_litlen, fixed_litcode, fixed_distlen, fixed_distcode);
+  } else {
+    send_bits(z, 2, 2);
+    send_bits(z, hlit - 257, 5);
+    send_bits(z, hdist - 1, 5);
+    send_bits(z, hclen - 4, 4);
+    for (i = 0; i < hclen; i++) send_bits(z, bllen[bl_order[i]], 3);
+    for (i = 0; i < nrle; i++) {
+      send_bits(z, blcode[rle[i]], bllen[rle[i]]);
+      if (rle[i] == 16) send_bits(z, rlextra[i], 2);
+      if (rle[i] == 17) send_bits(z, rlextra[i], 3);
+      if (rle[i] == 18) send_bits(z, rlextra[i], 7);
+    }
+    compress_symbols(z, litlen, litcode, distlen, distcode);
+  }
+
+  memset(z->litfreq, 0, sizeof(z->litfreq));
+  memset(z->distfreq, 0, sizeof(z->distfreq));
+  z->nsyms = 0;
+}
+
+static int insert_string(struct httpd_zstream *z, int pos) {
+  unsigned char *p = z->window + pos;
+  int h;
+  int prev;
+
+  h = ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & HASH_MASK;
+  prev = z->head[h];
+  z->prev[pos & WMASK] = prev;
+  z->head[h] = pos;
+
+  return prev;
+}
+
+static int longest_match(struct httpd_zstream *z, int cur, int *start) {
+  unsigned char *scan = z->window + z->strstart;
+  unsigned char *match;
+  int limit = z->strstart > MAX_DIST ? z->strstart - MAX_DIST : 0;
+  int maxlen = z->lookahead < MAX_MATCH ? z->lookahead : MAX_MATCH;
+  int chain = z->maxchain;
+  int best = MIN_MATCH - 1;
+  int len;
+
+  do {
+    match = z->window + cur;
+    if (match[best] != scan[best] || match[0] != scan[0] || match[1] != scan[1]) continue;
+
+    len = 2;
+    while (len < maxlen && match[len] == scan[len]) len++;
+    if (len > best) {
+      *start = cur;
+      best = len;
+      if (len >= z->nicelen || len >= maxlen) break;
+    }
+  } while ((cur = z->prev[cur & WMASK]) > limit && --chain > 0);
+
+  return best >= MIN_MATCH ? best : 0;
+}
+
+static void slide_window(struct httpd_zstream *z) {
+  int i;
+
+  memcpy(z->window, z->window + WSIZE, WSIZE);
+  z->strstart -= WSIZE;
+
+  for (i = 0; i < HASH_SIZE; i++) z->head[i] = z->head[i] >= WSIZE ? z->head[i] - WSIZE : 0;
+  for (i = 0; i < WSIZE; i++) z->prev[i] = z->prev[i] >= WSIZE ? z->prev[i] - WSIZE : 0;
+}
+
+static void deflate_window(struct httpd_zstream *z, int flush) {
+  int start;
+  int dist;
+  int len;
+  int cur;
+  int i;
+
+  // Unless flushing, keep enough lookahead for a maximum length match
+  while (z->lookahead >= MIN_LOOKAHEAD || (flush && z->lookahead > 0)) {
+    len = 0;
+    if (z->lookahead >= MIN_MATCH) {
+      cur = insert_string(z, z->strstart);
+      if (cur != 0 && z->strstart - cur <= MAX_DIST) len = longest_match(z, cur, &start);
+      if (len == MIN_MATCH && z->strstart - start > TOO_FAR) len = 0;
+    }
+
+    if (len) {
+      dist = z->strstart - start;
+      z->symlen[z->nsyms] = len - MIN_MATCH;
+      z->symdist[z->nsyms] = dist;
+      z->nsyms++;
+      z->litfreq[257 + length_code[len - MIN_MATCH]]++;
+      dist--;
+      z->distfreq[dist < 256 ? dist_code[dist] : dist_code[256 + (dist >> 7)]]++;
+
+      for (i = 1; i < len; i++) {
+        if (z->lookahead - i >= MIN_MATCH) insert_string(z, z->strstart + i);
+      }
+      z->strstart += len;
+      z->lookahead -= len;
+    } else {
+      z->symlen[z->nsyms] = z->window[z->strstart];
+      z->symdist[z->nsyms] = 0;
+      z->nsyms++;
+      z->litfreq[z->window[z->strstart]]++;
+      z->strstart++;
+      z->lookahead--;
+    }
+
+    if (z->nsyms == MAX_SYMBOLS) flush_block(z, 0);
+  }
+}
+
+static clock_t cputime() {
+  struct tms tms;
+
+  times(&tms);
+  return tms.tms_utime + tms.tms_stime;
+}
+
+struct httpd_zstream *deflate_open(int encoding, int level) {
+  struct httpd_zstream *z;
+
+  z = (struct httpd_zstream *) malloc(sizeof(struct httpd_zstream));
+  if (!z) return NULL;
+  memset(z->head, 0, sizeof(z->head));
+  memset(z->litfreq, 0, sizeof(z->litfreq));
+  memset(z->distfreq, 0, sizeof(z->distfreq));
+
+  if (level < 1) level = 1;
+  if (level > 9) level = 9;
+  z->encoding = encoding;
+  z->maxchain = 1 << (level + 1);
+  z->nicelen = level >= 8 ? MAX_MATCH : 32 * level;
+  z->started = 0;
+  z->error = 0;
+  z->strstart = 0;
+  z->lookahead = 0;
+  z->nsyms = 0;
+  z->bitbuf = 0;
+  z->bitcnt = 0;
+  z->out = NULL;
+  z->checksum = encoding == HTTPD_ENCODING_GZIP ? 0xFFFFFFFF : 1;
+  z->insize = 0;
+  z->outsize = 0;
+  z->cputime = 0;
+
+  return z;
+}
+
+int deflate_data(struct httpd_zstream *z, char *data, int len, int flush, struct httpd_buffer *out) {
+  clock_t start = cputime();
+  int n;
+
+  z->out = out;
+
+  // Write stream header
+  if (!z->started) {
+    if (z->encoding == HTTPD_ENCODING_GZIP) {
+      put_byte(z, 0x1F);
+      put_byte(z, 0x8B);
+      put_byte(z, 8);
+      put_byte(z, 0);
+      put_long(z, 0, 0);
+      put_byte(z, 0);
+      put_byte(z, 0xFF);
+    } else {
+      put_byte(z, 0x78);
+      put_byte(z, 0x01);
+    }
+    z->started = 1;
+  }
+
+  // Copy data into window and compress it
+  while (len > 0) {
+    if (z->strstart + z->lookahead == 2 * WSIZE) slide_window(z);
+    n = 2 * WSIZE - z->strstart - z->lookahead;
+    if (n > len) n = len;
+    memcpy(z->window + z->strstart + z->lookahead, data, n);
+    update_checksum(z, z->window + z->strstart + z->lookahead, n);
+    z->lookahead += n;
+    z->insize += n;
+    data += n;
+    len -= n;
+
+    deflate_window(z, 0);
+  }
+
+  if (flush == DEFLATE_FINISH) {
+    // Emit final block and stream trailer
+    deflate_window(z, 1);
+    flush_block(z, 1);
+    align_bits(z);
+    if (z->encoding == HTTPD_ENCODING_GZIP) {
+      put_long(z, z->checksum ^ 0xFFFFFFFF, 0);
+      put_long(z, z->insize, 0);
+    } else {
+      put_long(z, z->checksum, 1);
+    }
+  } else if (flush == DEFLATE_SYNC) {
+    // Emit pending symbols followed by an empty stored block to byte align
+    // the output so the client can decode all data sent so far
+    deflate_window(z, 1);
+    if (z->nsyms > 0) flush_block(z, 0);
+    send_bits(z, 0, 3);
+    align_bits(z);
+    put_byte(z, 0x00);
+    put_byte(z, 0x00);
+    put_byte(z, 0xFF);
+    put_byte(z, 0xFF);
+  }
+
+  z->out = NULL;
+  z->cputime += cputime() - start;
+
+  if (z->error) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  return 0;
+}
+
+void deflate_close(struct httpd_zstream *z, struct httpd_zstats *stats) {
+  if (stats) {
+    stats->streams++;
+    stats->bytes_in += z->insize;
+    stats->bytes_out += z->outsize;
+    stats->cputime += z->cputime;
+  }
+
+  free(z);
+}
+
+//
+// Content negotiation
+//
+
+void init_compression(struct httpd_server *server) {
+  init_tables();
+
+  server->compress = getnumconfig(server->cfg, "compress", 1);
+  server->compresslevel = getnumconfig(server->cfg, "compresslevel", 6);
+  server->compressmin = getnumconfig(server->cfg, "compressmin", 256);
+}
+
+char *encoding_name(int encoding) {
+  switch (encoding) {
+    case HTTPD_ENCODING_GZIP: return "gzip";
+    case HTTPD_ENCODING_DEFLATE: return "deflate";
+  }
+
+  return "identity";
+}
+
+int compressible(struct httpd_server *server, char *content_type) {
+  if (!server->compress || !content_type) return 0;
+
+  if (strnicmp(content_type, "text/", 5) == 0) return 1;
+  if (strstr(content_type, "javascript")) return 1;
+  if (strstr(content_type, "json")) return 1;
+  if (strstr(content_type, "xml")) return 1;
+
+  return 0;
+}
+
+static int accepts_encoding(char *accept, char *name) {
+  char *s = accept;
+  char *q;
+  int len = strlen(name);
+
+  // Look for the encoding in the comma separated list, honoring q=0
+  while (*s) {
+    while (*s == ' ' || *s == ',') s++;
+    if (strnicmp(s, name, len) == 0 && (s[len] == 0 || s[len] == ',' || s[len] == ';' || s[len] == ' ')) {
+      q = s + len;
+      while (*q == ' ') q++;
+      if (*q != ';') return 1;
+      q++;
+      while (*q == ' ') q++;
+      if (*q != 'q' || q[1] != '=') return 1;
+      return atof(q + 2) > 0.0;
+    }
+    while (*s && *s != ',') s++;
+  }
+
+  return 0;
+}
+
+int select_encoding(struct httpd_connection *conn, char *content_type) {
+  char *accept = conn->req->accept_encoding;
+
+  if (!accept || !compressible(conn->server, content_type)) return 0;
+  if (accepts_encoding(accept, "gzip")) return HTTPD_ENCODING_GZIP;
+  if (accepts_encoding(accept, "deflate")) return HTTPD_ENCODING_DEFLATE;
+
+  return 0;
+}
@@ -31,12 +31,19 @@
 // SUCH DAMAGE.
 // 
 
+#include <os.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+
+#define SHELL "sh.exe"
+
+#define MAX_JOBS        16    // Maximum number of handles for waitany()
+#define STAMP_HASHSIZE  256
 
 struct buffer {
   char *start;
@@ -58,6 +65,8 @@ struct list {
 #define PENDING     1
 #define CLEAN       2
 #define DIRTY       3
+#define BUILDING    4
+#define BUILT       5
 
 struct rule {
   char *target;
@@ -69,6 +78,19 @@ struct rule {
   struct rule *build_next;
 };
 
+struct stamp {
+  char *filename;
+  time_t timestamp;
+  struct stamp *next;
+};
+
+struct job {
+  struct rule *rule;
+  struct item *command;
+  handle_t handle;
+  FILE *output;
+};
+
 struct project {
   struct rule *rules_head;  
   struct rule *rules_tail;
@@ -78,8 +100,12 @@ struct project {
   int silent;
   int debug;
   int always_build;
+  int jobs;
+  int timing;
   char oldcwd[FILENAME_MAX];
 
+  struct stamp *stamps[STAMP_HASHSIZE];
+
   struct rule *build_first;
   struct rule *build_last;
   struct rule *phony;
@@ -181,14 +207,25 @@ void list_free(struct list *l)  {
 
 void project_init(struct project *prj) {
   memset(prj, 0, sizeof(struct project));
+  prj->jobs = 1;
   getcwd(prj->oldcwd, FILENAME_MAX);
 }
 
 void project_free(struct project *prj) {
   struct rule *r;
+  struct stamp *s;
+  int i;
   
   list_free(&prj->targets);
 
+  for (i = 0; i < STAMP_HASHSIZE; i++) {
+    while ((s = prj->stamps[i]) != NULL) {
+      prj->stamps[i] = s->next;
+      free(s->filename);
+      free(s);
+    }
+  }
+
   r = prj->rules_head;
   while (r != NULL) {
     struct rule *next;
@@ -483,11 +520,29 @@ int parse_makefile(struct project *prj, FILE *f) {
   return 0;
 }
 
-time_t get_timestamp(char *filename) {
+unsigned int strhash(char *s) {
+  unsigned int hash = 0;
+  while (*s) hash = hash * 31 + (unsigned char) *s++;
+  return hash;
+}
+
+time_t get_timestamp(struct project *prj, char *filename) {
   struct stat st;
-  
-  if (stat(filename, &st) < 0) return -1;
-  return st.st_mtime;
+  struct stamp *s;
+  unsigned int h = strhash(filename) % STAMP_HASHSIZE;
+
+  // Files like common headers are dependencies of many rules, so the
+  // modification times are cached to only stat each file once
+  for (s = prj->stamps[h]; s; s = s->next) {
+    if (strcmp(s->filename, filename) == 0) return s->timestamp;
+  }
+
+  s = (struct stamp *) malloc(sizeof(struct stamp));
+  s->filename = strdup(filename);
+  s->timestamp = stat(filename, &st) < 0 ? -1 : st.st_mtime;
+  s->next = prj->stamps[h];
+  prj->stamps[h] = s;
+  return s->timestamp;
 }
 
 void mark_for_build(struct project *prj, struct rule *rule) {
@@ -511,7 +566,7 @@ int check_rule(struct project *prj, struct rule *rule) {
   if (rule->status != UNCHECKED) return 0;
       
   // Get timestamp for target
-  rule->timestamp = get_timestamp(rule->target);
+  rule->timestamp = get_timestamp(prj, rule->target);
   
   // If this target does not exist we need to build this rule
   if (rule->timestamp == -1) {
@@ -543,7 +598,7 @@ int check_rule(struct project *prj, struct rule *rule) {
       }
     } else {
       // No rule for dependent, just check the timestamp.
-      time_t t = get_timestamp(item->value);
+      time_t t = get_timestamp(prj, item->value);
       if (rule->timestamp < t) {
         if (prj->debug)  printf("build %s because it is older than %s\n", rule->target, item->value);
         dirty = 1;
@@ -607,7 +662,11 @@ int build_targets(struct project *prj) {
       if (expand_macros(command->value, prj, r, cmd) < 0) return -1;
       if (!prj->silent) printf("%s\n", cmd->start);
       if (!prj->dry_run) {
-        if (system(cmd->start) != 0) return -1;
+        int rc = system(cmd->start);
+        if (rc != 0) {
+          fprintf(stderr, "Error %d building %s\n", rc, r->target);
+          return -1;
+        }
       }
 
       command = command->next;
@@ -617,6 +676,173 @@ int build_targets(struct project *prj) {
   return 0;
 }
 
+int rule_ready(struct project *prj, struct rule *rule) {
+  struct item *item;
+  struct rule *dep;
+
+  // A rule can be built when none of its dependencies are still to be built
+  item = rule->dependencies.head;
+  while (item) {
+    dep = find_rule(prj, item->value);
+    if (dep && (dep->status == DIRTY || dep->status == BUILDING)) return 0;
+    item = item->next;
+  }
+  return 1;
+}
+
+int start_command(struct project *prj, struct job *job) {
+  struct buffer *cmd = &prj->value;
+  handle_t output = fileno(job->output);
+  struct tib *tib;
+  struct process *proc;
+  char *cmdline;
+  int i;
+
+  // Expand macros in command and echo it to the job output
+  if (expand_macros(job->command->value, prj, job->rule, cmd) < 0) return -1;
+  if (!prj->silent) {
+    write(output, cmd->start, strlen(cmd->start));
+    write(output, "\n", 1);
+  }
+
+  // Start shell for running the command
+  cmdline = (char *) malloc(strlen(SHELL) + 1 + strlen(cmd->start) + 1);
+  strcpy(cmdline, SHELL);
+  strcat(cmdline, " ");
+  strcat(cmdline, cmd->start);
+  job->handle = spawn(P_SUSPEND, SHELL, cmdline, NULL, &tib);
+  free(cmdline);
+  if (job->handle < 0) {
+    perror(SHELL);
+    return -1;
+  }
+
+  // Redirect stdout and stderr to the job output
+  proc = tib->proc;
+  for (i = 1; i < 3; i++) {
+    if (proc->iob[i] != NOHANDLE) close(proc->iob[i]);
+    proc->iob[i] = dup(output);
+  }
+
+  resume(job->handle);
+  return 0;
+}
+
+void flush_output(struct job *job) {
+  handle_t output = fileno(job->output);
+  char buf[4096];
+  int n;
+
+  // Copy output from job to stdout and reset the output file
+  lseek(output, 0, SEEK_SET);
+  while ((n = read(output, buf, sizeof(buf))) > 0) fwrite(buf, 1, n, stdout);
+  fflush(stdout);
+  ftruncate(output, 0);
+  lseek(output, 0, SEEK_SET);
+}
+
+int build_parallel(struct project *prj) {
+  struct job jobs[MAX_JOBS];
+  handle_t handles[MAX_JOBS];
+  int slots[MAX_JOBS];
+  struct rule *first = prj->build_first;
+  struct rule *r;
+  struct job *job;
+  int running = 0;
+  int failed = 0;
+  int i, n, rc;
+
+  // Each job slot has its own output file so the output from commands
+  // running in parallel is not interleaved
+  memset(jobs, 0, sizeof(jobs));
+  for (i = 0; i < prj->jobs; i++) {
+    jobs[i].output = tmpfile();
+    if (!jobs[i].output) {
+      perror("tmpfile");
+      failed = 1;
+      break;
+    }
+  }
+
+  while (1) {
+    // Start jobs for rules where all dependencies have been built
+    while (!failed && running < prj->jobs) {
+      while (first && first->status != DIRTY) first = first->build_next;
+      r = first;
+      while (r && (r->status != DIRTY || !rule_ready(prj, r))) r = r->build_next;
+      if (!r) break;
+
+      if (!r->commands.head) {
+        r->status = BUILT;
+        continue;
+      }
+
+      for (job = jobs; job->rule; job++);
+      job->rule = r;
+      job->command = r->commands.head;
+      r->status = BUILDING;
+      if (start_command(prj, job) < 0) {
+        flush_output(job);
+        job->rule = NULL;
+        failed = 1;
+        break;
+      }
+      running++;
+    }
+
+    // On failure, wait for running jobs to complete before stopping
+    if (running == 0) break;
+
+    // Wait for one of the running commands to terminate
+    n = 0;
+    for (i = 0; i < prj->jobs; i++) {
+      if (jobs[i].rule) {
+        handles[n] = jobs[i].handle;
+        slots[n++] = i;
+      }
+    }
+    rc = waitany(handles, n, INFINITE);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      perror("waitany");
+      failed = 1;
+      break;
+    }
+    job = &jobs[slots[rc]];
+
+    // Get exit code and output from command
+    rc = waitone(job->handle, 0);
+    close(job->handle);
+    flush_output(job);
+
+    if (rc != 0) {
+      fprintf(stderr, "Error %d building %s\n", rc, job->rule->target);
+      job->rule = NULL;
+      running--;
+      failed = 1;
+    } else if (job->command->next && !failed) {
+      // Run next command in rule
+      job->command = job->command->next;
+      if (start_command(prj, job) < 0) {
+        flush_output(job);
+        job->rule = NULL;
+        running--;
+        failed = 1;
+      }
+    } else {
+      job->rule->status = BUILT;
+      job->rule = NULL;
+      running--;
+    }
+  }
+
+  for (i = 0; i < prj->jobs; i++) {
+    if (jobs[i].output) fclose(jobs[i].output);
+  }
+
+  return failed ? -1 : 0;
+}
+
 void usage() {
   fprintf(stderr, "usage: make [ -f <makefile> ] [ options ] ... [ targets ] ... \n\n");
   fprintf(stderr, "  -B            Unconditionally build all targets.\n");
@@ -624,8 +850,10 @@ void usage() {
   fprintf(stderr, "  -d            Output debug messages.\n");
   fprintf(stderr, "  -f <file>     Read <file> as makefile.\n");
   fprintf(stderr, "  -h            Print this message.\n");
+  fprintf(stderr, "  -j <jobs>     Run up to <jobs> commands in parallel (max %d).\n", MAX_JOBS);
   fprintf(stderr, "  -n            Display commands but do not build.\n");
   fprintf(stderr, "  -s            Do not print commands as they are executed.\n");
+  fprintf(stderr, "  -t            Print elapsed build time.\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -637,13 +865,14 @@ int main(int argc, char *argv[]) {
   FILE *mf;
   struct project prj;
   char curdir[FILENAME_MAX];
+  struct timeval start, end;
 
   // Initialize project
   setup_predefined_variables();
   project_init(&prj);
     
   // Parse command line options
-  while ((c = getopt(argc, argv, "BC:df:hns")) != EOF) {
+  while ((c = getopt(argc, argv, "BC:df:hj:nst")) != EOF) {
     switch (c) {
       case 'B':
         prj.always_build = 1;
@@ -665,6 +894,14 @@ int main(int argc, char *argv[]) {
         usage();
         return 1;
         
+      case 'j':
+        prj.jobs = atoi(optarg);
+        if (prj.jobs < 1 || prj.jobs > MAX_JOBS) {
+          fprintf(stderr, "Number of jobs must be between 1 and %d\n", MAX_JOBS);
+          return 1;
+        }
+        break;
+
       case 'n':
         prj.dry_run = 1;
         break;
@@ -673,6 +910,10 @@ int main(int argc, char *argv[]) {
         prj.silent = 1;
         break;
 
+      case 't':
+        prj.timing = 1;
+        break;
+
       default:
         fprintf(stderr, "use -h for help\n");
         return 1;
@@ -727,12 +968,24 @@ int main(int argc, char *argv[]) {
   }
 
   // Build targets
-  rc = build_targets(&prj);
+  gettimeofday(&start, NULL);
+  if (prj.jobs > 1 && !prj.dry_run) {
+    rc = build_parallel(&prj);
+  } else {
+    rc = build_targets(&prj);
+  }
   if (rc < 0) {
     project_free(&prj);
     return 1;
   }
 
+  if (prj.timing) {
+    gettimeofday(&end, NULL);
+    printf("Build time %.2f seconds with %d job%s\n",
+           (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0,
+           prj.jobs, prj.jobs == 1 ? "" : "s");
+  }
+
   project_free(&prj);
   return 0;
 }
@@ -12,6 +12,12 @@
 
 #define DFS_MAXFNAME               255
 
+#define DFS_JOURNAL_MAGIC          0x4C4A4644
+#define DFS_JOURNAL_HEADER         1
+#define DFS_JOURNAL_DESCRIPTOR     2
+#define DFS_JOURNAL_COMMIT         3
+#define DFS_JOURNAL_MAXTRANS       64
+
 struct superblock
 {
   unsigned int signature;
@@ -29,6 +35,10 @@ struct superblock
   vfs_blkno_t first_reserved_block;
   unsigned int reserved_blocks;
   unsigned int cache_buffers;
+  unsigned int compress_offset;
+  unsigned int compress_size;
+  vfs_blkno_t journal_block;
+  unsigned int journal_size;
 };
 
 struct groupdesc
@@ -59,6 +69,32 @@ struct inodedesc
   vfs_blkno_t blockdir[DFS_TOPBLOCKDIR_SIZE];
 };
 
+struct journalheader
+{
+  unsigned int magic;
+  unsigned int type;
+  unsigned int seq;
+  unsigned int size;
+};
+
+struct journaldesc
+{
+  unsigned int magic;
+  unsigned int type;
+  unsigned int seq;
+  unsigned int count;
+  unsigned int revoked;
+  vfs_blkno_t blocks[0];
+};
+
+struct journalcommit
+{
+  unsigned int magic;
+  unsigned int type;
+  unsigned int seq;
+  unsigned int checksum;
+};
+
 struct dentry
 {
   vfs_ino_t ino;
@@ -110,6 +146,9 @@ struct filsys *create_filesystem(vfs_devno_t devno, int blocksize, int inode_rat
 struct filsys *open_filesystem(vfs_devno_t devno);
 void close_filesystem(struct filsys *fs);
 
+// journal.c
+int check_journal(vfs_devno_t devno);
+
 // group.c
 vfs_blkno_t new_block(struct filsys *fs, vfs_blkno_t goal);
 void free_blocks(struct filsys *fs, vfs_blkno_t *blocks, int count);
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "vfs.h"
+#include "buf.h"
+#include "dfs.h"
+
+#define SECTORSIZE   512
+
+void panic(char *reason);
+int dev_read(vfs_devno_t devno, void *buffer, size_t count, vfs_blkno_t blkno);
+
+static unsigned int checksum(void *data, int size)
+{
+  unsigned int *p = (unsigned int *) data;
+  unsigned int sum = 0;
+  int n = size / sizeof(unsigned int);
+
+  while (n-- > 0) sum = ((sum << 1) | (sum >> 31)) + *p++;
+  return sum;
+}
+
+//
+// Check the journal on a device. All transactions after the journal header
+// must have a valid descriptor and commit block and a matching checksum.
+// Returns the number of transactions that would be replayed on mount, or -1
+// if the super block or journal header is invalid.
+//
+
+int check_journal(vfs_devno_t devno)
+{
+  struct superblock *super;
+  struct journalheader *hdr;
+  struct journaldesc *desc;
+  struct journalcommit *commit;
+  unsigned int blocksize;
+  unsigned int spb;
+  unsigned int maxdesc;
+  unsigned int pos;
+  unsigned int next;
+  char *buffer;
+  int txns;
+  int blocks;
+  int revoked;
+
+  // Read super block
+  super = (struct superblock *) malloc(SECTORSIZE);
+  if (!super) panic("out of memory");
+  dev_read(devno, super, SECTORSIZE, 1);
+  if (super->signature != DFS_SIGNATURE) 
+  {
+    printf("Invalid DFS signature\n");
+    free(super);
+    return -1;
+  }
+
+  if (super->journal_size == 0)
+  {
+    printf("File system has no journal\n");
+    free(super);
+    return 0;
+  }
+
+  blocksize = 1 << super->log_block_size;
+  spb = blocksize / SECTORSIZE;
+  maxdesc = (blocksize - sizeof(struct journaldesc)) / sizeof(vfs_blkno_t);
+  buffer = (char *) malloc((DFS_JOURNAL_MAXTRANS + 2) * blocksize);
+  if (!buffer) panic("out of memory");
+
+  // Check journal header
+  dev_read(devno, buffer, blocksize, super->journal_block * spb);
+  hdr = (struct journalheader *) buffer;
+  if (hdr->magic != DFS_JOURNAL_MAGIC || hdr->type != DFS_JOURNAL_HEADER || hdr->size != super->journal_size)
+  {
+    printf("Invalid journal header at block %d\n", super->journal_block);
+    free(buffer);
+    free(super);
+    return -1;
+  }
+
+  printf("Journal at block %d, %d blocks, sequence %u\n", super->journal_block, super->journal_size, hdr->seq);
+
+  // Scan transactions
+  txns = blocks = revoked = 0;
+  next = hdr->seq;
+  pos = 1;
+  desc = (struct journaldesc *) buffer;
+  while (pos + 2 <= super->journal_size)
+  {
+    dev_read(devno, buffer, blocksize, (super->journal_block + pos) * spb);
+    if (desc->magic != DFS_JOURNAL_MAGIC || desc->type != DFS_JOURNAL_DESCRIPTOR) break;
+    if ((int) (desc->seq - next) < 0) break;
+
+    if (desc->count > DFS_JOURNAL_MAXTRANS || desc->revoked > maxdesc - desc->count || pos + desc->count + 2 > super->journal_size)
+    {
+      printf("Transaction %u at block %d: invalid descriptor\n", desc->seq, pos);
+      break;
+    }
+
+    dev_read(devno, buffer + blocksize, (desc->count + 1) * blocksize, (super->journal_block + pos + 1) * spb);
+    commit = (struct journalcommit *) (buffer + (desc->count + 1) * blocksize);
+    if (commit->magic != DFS_JOURNAL_MAGIC || commit->type != DFS_JOURNAL_COMMIT || commit->seq != desc->seq)
+    {
+      printf("Transaction %u at block %d: no commit record\n", desc->seq, pos);
+      break;
+    }
+
+    if (commit->checksum != checksum(buffer, (desc->count + 1) * blocksize))
+    {
+      printf("Transaction %u at block %d: checksum mismatch\n", desc->seq, pos);
+      break;
+    }
+
+    txns++;
+    blocks += desc->count;
+    revoked += desc->revoked;
+    next = desc->seq + 1;
+    pos += desc->count + 2;
+  }
+
+  if (txns == 0)
+    printf("Journal is clean\n");
+  else
+    printf("%d transactions to replay (%d blocks, %d revoked) ending at block %d\n", txns, blocks, revoked, pos);
+
+  free(buffer);
+  free(super);
+  return txns;
+}
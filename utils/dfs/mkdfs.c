@@ -67,6 +67,7 @@ int doinit = 0;
 int dowipe = 0;
 int doformat = 0;
 int quick = 0;
+int checkjournal = 0;
 char *source = NULL;
 char *target = "";
 int part = -1;
@@ -449,6 +450,7 @@ void usage()
   fprintf(stderr, "  -C <device capacity> (capacity in kilobytes)\n");
   fprintf(stderr, "  -F <file list file>\n");
   fprintf(stderr, "  -I <inode ratio> (default 1 inode per 4K)\n");
+  fprintf(stderr, "  -J (check journal)\n");
   fprintf(stderr, "  -K <kernel options>\n");
   fprintf(stderr, "  -S <source directory or file>\n");
   fprintf(stderr, "  -T <target directory or file>\n");
@@ -478,7 +480,7 @@ int main(int argc, char **argv)
   int c;
 
   // Parse command line options
-  while ((c = getopt(argc, argv, "ad:b:c:ifk:l:t:vwp:qB:C:F:I:K:P:S:T:?")) != EOF)
+  while ((c = getopt(argc, argv, "ad:b:c:ifk:l:t:vwp:qB:C:F:I:JK:P:S:T:?")) != EOF)
   {
     switch (c)
     {
@@ -550,6 +552,10 @@ int main(int argc, char **argv)
         inoderatio = atoi(optarg);
         break;
 
+      case 'J':
+        checkjournal = 1;
+        break;
+
       case 'K':
         krnlopts = optarg;
         break;
@@ -592,6 +598,17 @@ int main(int argc, char **argv)
     read_mbr(&blkdev);
   }
 
+  // Check journal
+  if (checkjournal)
+  {
+    int rc;
+
+    printf("Checking journal on device %s\n", devname);
+    rc = check_journal((vfs_devno_t) &blkdev);
+    bdrv_close(&blkdev);
+    return rc < 0 ? 1 : 0;
+  }
+
   // Clear device
   if (dowipe) 
   {